@@ -0,0 +1,112 @@
+#!/usr/bin/env bash
+# Copyright (c) 2024 Dorjoy Chowdhury
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Benchmarks dsync on a synthetic tree made by bench/gen_tree. For every -j
+# value, every cache state and every run, the tree is copied to an empty
+# directory (full) and synced again without changes (noop). Every run prints
+# a line of JSON with the counters from dsync --stats and the wall clock time,
+# CPU time and peak RSS from bench/measure, so that results of different
+# builds and machines can be compared with jq or a spreadsheet.
+#
+# Settings come from the environment:
+#   DSYNC        dsync binary (default ./dsync)
+#   BENCH_DIR    directory for the tree and its copies, preferably on the
+#                filesystem to benchmark (default a new directory in $TMPDIR)
+#   BENCH_TREE   options of bench/gen_tree (default -n 5000)
+#   BENCH_JOBS   -j values (default "1 2 4 8")
+#   BENCH_CACHE  cache states, warm and/or cold (default "warm cold"); cold
+#                drops the page cache before every run, which needs root and
+#                is skipped otherwise
+#   BENCH_RUNS   runs per combination (default 3)
+#   BENCH_OUT    file the lines are appended to (default stdout)
+set -euo pipefail
+
+DSYNC="${DSYNC:-./dsync}"
+GEN_TREE="$(dirname "$0")/gen_tree"
+MEASURE="$(dirname "$0")/measure"
+BENCH_TREE="${BENCH_TREE:--n 5000}"
+BENCH_JOBS="${BENCH_JOBS:-1 2 4 8}"
+BENCH_CACHE="${BENCH_CACHE:-warm cold}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_OUT="${BENCH_OUT:-/dev/stdout}"
+
+work="${BENCH_DIR:-}"
+if [ -z "$work" ]; then
+    work=$(mktemp -d)
+    trap 'rm -rf "$work"' EXIT
+fi
+mkdir -p "$work"
+
+drop_caches() {
+    sync
+    (echo 3 > /proc/sys/vm/drop_caches) 2>/dev/null
+}
+
+# Prints the value of top level member $2 of the dsync --stats summary in $1.
+stat_value() {
+    grep -o "\"$2\":[0-9]*" "$1" | head -n 1 | cut -d : -f 2
+}
+
+# Runs dsync with -j $1 and prints a line of JSON for scenario $2 with cache
+# state $3 and run number $4.
+run_dsync() {
+    local jobs="$1"
+    local scenario="$2"
+    local cache="$3"
+    local run="$4"
+
+    if [ "$cache" = cold ]; then
+        drop_caches
+    fi
+    local measured
+    measured=$("$MEASURE" "$DSYNC" -j "$jobs" --stats="$work/stats.json" \
+        "$work/src" "$work/dst") || {
+        echo "dsync failed in $scenario run $run with -j $jobs" >&2
+        exit 1
+    }
+
+    local wall copied skipped bytes
+    wall=$(echo "$measured" | grep -o '"wall_s":[0-9.]*' | cut -d : -f 2)
+    copied=$(stat_value "$work/stats.json" files_copied)
+    skipped=$(stat_value "$work/stats.json" files_skipped)
+    bytes=$(stat_value "$work/stats.json" bytes_copied)
+    local files_per_s mb_per_s
+    read -r files_per_s mb_per_s < <(awk -v wall="$wall" \
+        -v files=$((copied + skipped)) -v bytes="$bytes" \
+        'BEGIN { if (wall <= 0) wall = 0.001;
+                 printf "%.1f %.1f\n", files / wall, bytes / 1048576 / wall }')
+
+    printf '{"commit":"%s","tree":%s,"scenario":"%s","cache":"%s","jobs":%s,' \
+        "$commit" "$tree" "$scenario" "$cache" "$jobs" >> "$BENCH_OUT"
+    printf '"run":%s,"files_scanned":%s,"files_copied":%s,"files_skipped":%s,' \
+        "$run" "$(stat_value "$work/stats.json" files_scanned)" "$copied" \
+        "$skipped" >> "$BENCH_OUT"
+    printf '"bytes_copied":%s,%s,"files_per_s":%s,"mb_per_s":%s}\n' \
+        "$bytes" "$measured" "$files_per_s" "$mb_per_s" >> "$BENCH_OUT"
+}
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+echo "Generating tree in $work/src..." >&2
+rm -rf "$work/src"
+# shellcheck disable=SC2086
+tree=$("$GEN_TREE" $BENCH_TREE "$work/src")
+
+for cache in $BENCH_CACHE; do
+    if [ "$cache" = cold ] && ! drop_caches; then
+        echo "Can't drop the page cache, skipping cold cache runs" >&2
+        continue
+    fi
+    for jobs in $BENCH_JOBS; do
+        for run in $(seq 1 "$BENCH_RUNS"); do
+            echo "Running $cache cache, -j $jobs, run $run..." >&2
+            rm -rf "$work/dst"
+            mkdir "$work/dst"
+            run_dsync "$jobs" full "$cache" "$run"
+            run_dsync "$jobs" noop "$cache" "$run"
+        done
+    done
+done
+
+rm -rf "$work/src" "$work/dst" "$work/stats.json"
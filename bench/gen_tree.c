@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Generates a synthetic source tree for benchmarking dsync. Directories are
+ * created ${fanout} per directory down to ${depth} levels and the files are
+ * spread over all of them round robin. File sizes are drawn from a weighted
+ * distribution of size classes, each file getting a random size between half
+ * its class's size and the size. Some of the files are symbolic links to the
+ * previous file of their directory or hard links to the previous regular file
+ * of the tree. The contents are pseudo-random and the same for the same seed.
+ * A line of JSON describing the tree is printed at the end.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SIZE_CLASSES 16
+#define WRITE_SIZE (64 * 1024)
+
+struct size_class {
+	uint64_t size;
+	unsigned long long weight;
+};
+
+struct tree {
+	char **dirs;
+	size_t dir_cnt;
+	size_t dir_cap;
+};
+
+static uint64_t rng_state;
+
+/*
+ * xorshift64* which is more than good enough for picking sizes and filling
+ * files with incompressible data.
+ */
+static uint64_t
+next_random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * UINT64_C(2685821657736338717);
+}
+
+static void
+usage(FILE *stream)
+{
+	char *usage =
+		"Usage: gen_tree [OPTION]... DIRECTORY\n"
+		"\n"
+		"Options:\n"
+		"  -d DEPTH     Levels of subdirectories (default 3)\n"
+		"  -f FANOUT    Subdirectories per directory (default 4)\n"
+		"  -h           Print this help message\n"
+		"  -L PERCENT   Percentage of files that are hard links (default 2)\n"
+		"  -l PERCENT   Percentage of files that are symbolic links (default 2)\n"
+		"  -n FILES     Number of files (default 5000)\n"
+		"  -S SEED      Seed of the sizes and contents (default 1)\n"
+		"  -s DIST      Comma separated SIZE:WEIGHT size classes, SIZE with an\n"
+		"               optional K, M or G suffix\n"
+		"               (default 512:30,4K:40,64K:25,1M:4,8M:1)\n";
+	fprintf(stream, "%s", usage);
+	return;
+}
+
+static int
+parse_count(char *arg, unsigned long long max, unsigned long long *value)
+{
+	char *endptr;
+
+	errno = 0;
+	*value = strtoull(arg, &endptr, 10);
+	if (errno != 0 || *endptr != '\0' || *value > max)
+		return -1;
+	return 0;
+}
+
+/*
+ * Parses "SIZE:WEIGHT[,SIZE:WEIGHT]..." into ${classes}.
+ *
+ * Returns the number of classes on success, -1 if ${arg} is invalid.
+ */
+static int
+parse_distribution(char *arg, struct size_class *classes)
+{
+	int cnt = 0;
+	char *str = arg;
+	while (*str != '\0') {
+		if (cnt == MAX_SIZE_CLASSES)
+			return -1;
+		char *endptr;
+		errno = 0;
+		unsigned long long size = strtoull(str, &endptr, 10);
+		if (errno != 0 || endptr == str)
+			return -1;
+		unsigned int shift = 0;
+		if (*endptr == 'K')
+			shift = 10;
+		else if (*endptr == 'M')
+			shift = 20;
+		else if (*endptr == 'G')
+			shift = 30;
+		if (shift != 0)
+			++endptr;
+		if (*endptr != ':' || size > (UINT64_MAX >> shift))
+			return -1;
+		classes[cnt].size = (uint64_t) size << shift;
+
+		str = endptr + 1;
+		errno = 0;
+		classes[cnt].weight = strtoull(str, &endptr, 10);
+		if (errno != 0 || endptr == str || (*endptr != ',' && *endptr != '\0'))
+			return -1;
+		++cnt;
+		str = *endptr == ',' ? endptr + 1 : endptr;
+	}
+	return cnt;
+}
+
+static int
+add_dir(struct tree *T, char *path)
+{
+	if (T->dir_cnt == T->dir_cap) {
+		size_t cap = T->dir_cap == 0 ? 64 : T->dir_cap * 2;
+		char **dirs = realloc(T->dirs, cap * sizeof(char *));
+		if (dirs == NULL)
+			return -1;
+		T->dirs = dirs;
+		T->dir_cap = cap;
+	}
+	T->dirs[T->dir_cnt++] = path;
+	return 0;
+}
+
+/*
+ * Creates ${fanout} subdirectories of ${path} and theirs down to ${depth}
+ * levels, adding all of them to ${T}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+create_dirs(struct tree *T, const char *path, unsigned long long fanout,
+            unsigned long long depth)
+{
+	if (depth == 0)
+		return 0;
+
+	for (unsigned long long i = 0; i < fanout; ++i) {
+		size_t len = strlen(path) + 32;
+		char *sub = malloc(len);
+		if (sub == NULL)
+			return -1;
+		snprintf(sub, len, "%s/d%llu", path, i);
+		if (mkdir(sub, 0755) != 0 && errno != EEXIST) {
+			free(sub);
+			return -1;
+		}
+		if (add_dir(T, sub) != 0) {
+			free(sub);
+			return -1;
+		}
+		if (create_dirs(T, sub, fanout, depth - 1) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Creates regular file ${path} of ${size} pseudo-random bytes.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+write_file(const char *path, uint64_t size, uint64_t *buf)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	while (size > 0) {
+		size_t n = size < WRITE_SIZE ? (size_t) size : WRITE_SIZE;
+		for (size_t i = 0; i < (n + 7) / 8; ++i)
+			buf[i] = next_random();
+		ssize_t ret = write(fd, buf, n);
+		if (ret == -1) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		size -= (uint64_t) ret;
+	}
+	return close(fd);
+}
+
+static uint64_t
+pick_size(const struct size_class *classes, unsigned long long total_weight)
+{
+	unsigned long long r = next_random() % total_weight;
+	int c = 0;
+	while (r >= classes[c].weight) {
+		r -= classes[c].weight;
+		++c;
+	}
+	uint64_t max = classes[c].size;
+	uint64_t min = max / 2;
+	return min + (max > min ? next_random() % (max - min + 1) : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long depth = 3;
+	unsigned long long fanout = 4;
+	unsigned long long hardlink_pct = 2;
+	unsigned long long symlink_pct = 2;
+	unsigned long long file_cnt = 5000;
+	unsigned long long seed = 1;
+	char default_dist[] = "512:30,4K:40,64K:25,1M:4,8M:1";
+	struct size_class classes[MAX_SIZE_CLASSES];
+	int class_cnt = parse_distribution(default_dist, classes);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:f:hL:l:n:S:s:")) != -1) {
+		int ret = 0;
+		switch (opt) {
+		case 'd':
+			ret = parse_count(optarg, 16, &depth);
+			break;
+		case 'f':
+			ret = parse_count(optarg, 1024, &fanout);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 'L':
+			ret = parse_count(optarg, 100, &hardlink_pct);
+			break;
+		case 'l':
+			ret = parse_count(optarg, 100, &symlink_pct);
+			break;
+		case 'n':
+			ret = parse_count(optarg, UINT32_MAX, &file_cnt);
+			break;
+		case 'S':
+			ret = parse_count(optarg, UINT64_MAX, &seed);
+			break;
+		case 's':
+			class_cnt = parse_distribution(optarg, classes);
+			ret = class_cnt > 0 ? 0 : -1;
+			break;
+		default:
+			usage(stderr);
+			return 1;
+		}
+		if (ret != 0) {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || hardlink_pct + symlink_pct > 100) {
+		usage(stderr);
+		return 1;
+	}
+
+	unsigned long long total_weight = 0;
+	for (int c = 0; c < class_cnt; ++c)
+		total_weight += classes[c].weight;
+	if (total_weight == 0) {
+		fprintf(stderr, "Size classes must have some weight\n");
+		return 1;
+	}
+	/* xorshift must not start from 0. */
+	rng_state = seed * UINT64_C(0x9e3779b97f4a7c15) | 1;
+
+	struct tree T = {NULL, 0, 0};
+	char *root = strdup(argv[optind]);
+	if (root == NULL || (mkdir(root, 0755) != 0 && errno != EEXIST) ||
+	    add_dir(&T, root) != 0 || create_dirs(&T, root, fanout, depth) != 0) {
+		perror("Failed to create directories");
+		return 1;
+	}
+
+	uint64_t *buf = malloc(WRITE_SIZE + 8);
+	size_t path_cap = 0;
+	for (size_t i = 0; i < T.dir_cnt; ++i) {
+		if (strlen(T.dirs[i]) > path_cap)
+			path_cap = strlen(T.dirs[i]);
+	}
+	path_cap += 32;
+	char *path = malloc(path_cap);
+	char *last_regular = calloc(path_cap, 1);
+	if (buf == NULL || path == NULL || last_regular == NULL) {
+		perror("Failed to allocate buffers");
+		return 1;
+	}
+
+	uint64_t bytes = 0;
+	uint64_t regular_cnt = 0, symlink_cnt = 0, hardlink_cnt = 0;
+	for (unsigned long long i = 0; i < file_cnt; ++i) {
+		size_t d = i % T.dir_cnt;
+		unsigned long long n = i / T.dir_cnt;
+		snprintf(path, path_cap, "%s/f%llu", T.dirs[d], n);
+		unsigned long long kind = next_random() % 100;
+
+		if (kind < symlink_pct && n > 0) {
+			char target[32];
+			snprintf(target, sizeof(target), "f%llu", n - 1);
+			if (symlink(target, path) != 0 && errno != EEXIST) {
+				perror("Failed to create symbolic link");
+				return 1;
+			}
+			++symlink_cnt;
+		} else if (kind < symlink_pct + hardlink_pct && regular_cnt > 0) {
+			if (link(last_regular, path) != 0 && errno != EEXIST) {
+				perror("Failed to create hard link");
+				return 1;
+			}
+			++hardlink_cnt;
+		} else {
+			uint64_t size = pick_size(classes, total_weight);
+			if (write_file(path, size, buf) != 0) {
+				fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+				return 1;
+			}
+			memcpy(last_regular, path, path_cap);
+			bytes += size;
+			++regular_cnt;
+		}
+	}
+
+	printf("{\"dirs\":%zu,\"files\":%" PRIu64 ",\"symlinks\":%" PRIu64
+	       ",\"hardlinks\":%" PRIu64 ",\"bytes\":%" PRIu64 "}\n", T.dir_cnt,
+	       regular_cnt, symlink_cnt, hardlink_cnt, bytes);
+
+	for (size_t i = 0; i < T.dir_cnt; ++i)
+		free(T.dirs[i]);
+	free(T.dirs);
+	free(last_regular);
+	free(path);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Runs a command and prints its wall clock time, CPU time and peak resident
+ * set size as JSON members (without the braces) to stdout, like a minimal
+ * /usr/bin/time -v that doesn't need to be installed. Exits with the
+ * command's exit status.
+ */
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+timeval_secs(struct timeval tv)
+{
+	return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: measure COMMAND [ARG]...\n");
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("Failed to fork");
+		return 1;
+	}
+	if (pid == 0) {
+		execvp(argv[1], &argv[1]);
+		perror("Failed to run command");
+		_exit(127);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			perror("Failed to wait for command");
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* The command is the only child, so the children's usage is its own. */
+	struct rusage usage;
+	if (getrusage(RUSAGE_CHILDREN, &usage) != 0) {
+		perror("Failed to get resource usage");
+		return 1;
+	}
+
+	double wall = (double) (end.tv_sec - start.tv_sec) +
+		(double) (end.tv_nsec - start.tv_nsec) / 1e9;
+	/* ru_maxrss is in kilobytes on linux and FreeBSD. */
+	printf("\"wall_s\":%.3f,\"user_s\":%.3f,\"sys_s\":%.3f,\"max_rss_kb\":%ld\n",
+	       wall, timeval_secs(usage.ru_utime), timeval_secs(usage.ru_stime),
+	       usage.ru_maxrss);
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 128 + WTERMSIG(status);
+}
@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Micro-benchmark of the generic MPMC queue. Producer threads enqueue items and
+ * a pool of consumer threads dequeue them like the sync threads do, ${batch}
+ * items per claim on the queue's shared positions (1 means the single item
+ * enqueue/dequeue functions are used). Items of different payload sizes can be
+ * moved through queues of different lengths, with every thread pinned to a cpu
+ * of its own (linux only). The throughput, the number of claims on the shared
+ * positions per item (which is what causes the cross-core traffic), the
+ * percentiles of the time items spend between being enqueued and dequeued and
+ * the time the consumers take to wake up and exit after the queue is closed
+ * are reported.
+ */
+
+#define _GNU_SOURCE /* for pthread_setaffinity_np */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpmc_queue_generic.h"
+
+#define QUEUE_SIZE 512
+#define MAX_QUEUE_SIZE (1 << 20)
+#define MAX_BATCH_SIZE 256
+#define MAX_THREAD_CNT 255
+/* Latencies below 16ns get a bucket each, the ones above 8 buckets per power
+   of two, which is precise to 12.5%. */
+#define HIST_SIZE (16 + 60 * 8)
+
+/*
+ * Operations on the queue of items of one payload size, which are declared by
+ * BENCH_DECLARE for every size in ${bench_queues}. Items are handled as arrays
+ * of ${item_size} bytes whose first two words are the item's value and the
+ * time it was enqueued at.
+ */
+struct bench_queue_ops {
+	size_t item_size;
+	void *(*init)(size_t queue_length);
+	void (*free)(void *Q);
+	void (*enqueue_wait)(void *Q, void *item);
+	size_t (*enqueue_bulk)(void *Q, void *items, size_t n);
+	void (*enqueue_bulk_wait)(void *Q, void *items, size_t n);
+	size_t (*dequeue_bulk_wait)(void *Q, void *items, size_t n);
+	void (*close)(void *Q);
+};
+
+#define BENCH_DECLARE(size)                                                       \
+                                                                                  \
+struct bench##size##_item {                                                       \
+    uint64_t words[(size) / 8];                                                   \
+};                                                                                \
+                                                                                  \
+static inline __attribute__((always_inline)) void                                 \
+copy_bench##size##_item(struct bench##size##_item *src,                           \
+                        struct bench##size##_item *dst)                           \
+{                                                                                 \
+    *dst = *src;                                                                  \
+}                                                                                 \
+                                                                                  \
+MPMC_QUEUE_DECLARE(bench##size, struct bench##size##_item,                        \
+                   copy_bench##size##_item)                                       \
+                                                                                  \
+static void *                                                                     \
+bench##size##_init(size_t queue_length)                                           \
+{                                                                                 \
+    return bench##size##_mpmc_queue_init(queue_length);                           \
+}                                                                                 \
+                                                                                  \
+static void                                                                       \
+bench##size##_free(void *Q)                                                       \
+{                                                                                 \
+    bench##size##_mpmc_queue_free(Q);                                             \
+}                                                                                 \
+                                                                                  \
+static void                                                                       \
+bench##size##_enqueue_wait(void *Q, void *item)                                   \
+{                                                                                 \
+    bench##size##_mpmc_queue_enqueue_wait(Q, item);                               \
+}                                                                                 \
+                                                                                  \
+static size_t                                                                     \
+bench##size##_enqueue_bulk(void *Q, void *items, size_t n)                        \
+{                                                                                 \
+    return bench##size##_mpmc_queue_enqueue_bulk(Q, items, n);                    \
+}                                                                                 \
+                                                                                  \
+static void                                                                       \
+bench##size##_enqueue_bulk_wait(void *Q, void *items, size_t n)                   \
+{                                                                                 \
+    bench##size##_mpmc_queue_enqueue_bulk_wait(Q, items, n);                      \
+}                                                                                 \
+                                                                                  \
+static size_t                                                                     \
+bench##size##_dequeue_bulk_wait(void *Q, void *items, size_t n)                   \
+{                                                                                 \
+    return bench##size##_mpmc_queue_dequeue_bulk_wait(Q, items, n);               \
+}                                                                                 \
+                                                                                  \
+static void                                                                       \
+bench##size##_close(void *Q)                                                      \
+{                                                                                 \
+    bench##size##_mpmc_queue_close(Q);                                            \
+}                                                                                 \
+                                                                                  \
+static const struct bench_queue_ops bench##size##_ops = {                         \
+    sizeof(struct bench##size##_item),                                            \
+    bench##size##_init,                                                           \
+    bench##size##_free,                                                           \
+    bench##size##_enqueue_wait,                                                   \
+    bench##size##_enqueue_bulk,                                                   \
+    bench##size##_enqueue_bulk_wait,                                              \
+    bench##size##_dequeue_bulk_wait,                                              \
+    bench##size##_close                                                           \
+};
+
+/* 96 bytes is the size of the sync_data entries queued by dsync on 64-bit
+   linux, three pointers and the members of the source's stat it reads. */
+BENCH_DECLARE(16)
+BENCH_DECLARE(64)
+BENCH_DECLARE(96)
+BENCH_DECLARE(256)
+BENCH_DECLARE(1024)
+BENCH_DECLARE(8192)
+
+static const struct bench_queue_ops *bench_queues[] = {
+	&bench16_ops,
+	&bench64_ops,
+	&bench96_ops,
+	&bench256_ops,
+	&bench1024_ops,
+	&bench8192_ops
+};
+
+struct bench_thread_data {
+	uint8_t pad0[CACHELINE_SIZE];
+	const struct bench_queue_ops *ops;
+	void *Q;
+	size_t batch;
+	int cpu;
+	uint64_t first;
+	uint64_t cnt;
+	uint64_t sum;
+	uint64_t claims;
+	uint64_t hist[HIST_SIZE];
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned int
+hist_bucket(uint64_t ns)
+{
+	if (ns < 16)
+		return (unsigned int) ns;
+	unsigned int exp = 63 - (unsigned int) __builtin_clzll(ns);
+	unsigned int bucket = 16 + (exp - 4) * 8 + (unsigned int) ((ns >> (exp - 3)) & 7);
+	return bucket < HIST_SIZE ? bucket : HIST_SIZE - 1;
+}
+
+/*
+ * Returns the upper bound in nanoseconds of ${bucket}.
+ */
+static uint64_t
+hist_bound(unsigned int bucket)
+{
+	if (bucket < 16)
+		return bucket + 1;
+	unsigned int exp = (bucket - 16) / 8 + 4;
+	uint64_t sub = (bucket - 16) % 8;
+	return ((8 + sub + 1) << (exp - 3)) - 1;
+}
+
+static uint64_t
+percentile(const uint64_t *hist, uint64_t cnt, double percent)
+{
+	uint64_t target = (uint64_t) ((double) cnt * percent / 100.0);
+	if (target == 0)
+		target = 1;
+	uint64_t seen = 0;
+	for (unsigned int b = 0; b < HIST_SIZE; ++b) {
+		seen += hist[b];
+		if (seen >= target)
+			return hist_bound(b);
+	}
+	return hist_bound(HIST_SIZE - 1);
+}
+
+static void
+item_set(const struct bench_queue_ops *ops, uint8_t *items, size_t i,
+         uint64_t value, uint64_t time)
+{
+	uint64_t words[2] = {value, time};
+	memcpy(items + i * ops->item_size, words, sizeof(words));
+	return;
+}
+
+static void
+item_get(const struct bench_queue_ops *ops, const uint8_t *items, size_t i,
+         uint64_t *value, uint64_t *time)
+{
+	uint64_t words[2];
+	memcpy(words, items + i * ops->item_size, sizeof(words));
+	*value = words[0];
+	*time = words[1];
+	return;
+}
+
+/*
+ * Pins the calling thread to ${cpu} unless it is -1.
+ *
+ * Returns 0 on success, an error number on failure.
+ */
+static int
+pin_thread(int cpu)
+{
+	if (cpu == -1)
+		return 0;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	return ENOTSUP;
+#endif
+}
+
+static void *
+producer_func(void *data)
+{
+	struct bench_thread_data *td = data;
+	const struct bench_queue_ops *ops = td->ops;
+	uint8_t *items = malloc(MAX_BATCH_SIZE * ops->item_size);
+	if (items == NULL) {
+		perror("Failed to allocate items");
+		exit(1);
+	}
+	uint64_t value = td->first;
+	uint64_t end = td->first + td->cnt;
+
+	int ret = pin_thread(td->cpu);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to pin thread to cpu %d: %s\n", td->cpu, strerror(ret));
+		exit(1);
+	}
+
+	while (value < end) {
+		size_t n = 0;
+		uint64_t time = now_ns();
+		while (n < td->batch && value < end)
+			item_set(ops, items, n++, value++, time);
+		if (td->batch == 1) {
+			ops->enqueue_wait(td->Q, items);
+			++td->claims;
+			continue;
+		}
+		/* Waits for space for a single item when the queue is full so that
+		   every claim gets counted. */
+		size_t done = 0;
+		while (done < n) {
+			uint8_t *next = items + done * ops->item_size;
+			size_t cnt = ops->enqueue_bulk(td->Q, next, n - done);
+			if (cnt == 0) {
+				ops->enqueue_bulk_wait(td->Q, next, 1);
+				cnt = 1;
+			}
+			done += cnt;
+			++td->claims;
+		}
+	}
+
+	free(items);
+	return NULL;
+}
+
+static void *
+consumer_func(void *data)
+{
+	struct bench_thread_data *td = data;
+	const struct bench_queue_ops *ops = td->ops;
+	uint8_t *items = malloc(MAX_BATCH_SIZE * ops->item_size);
+	if (items == NULL) {
+		perror("Failed to allocate items");
+		exit(1);
+	}
+	size_t cnt;
+
+	int ret = pin_thread(td->cpu);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to pin thread to cpu %d: %s\n", td->cpu, strerror(ret));
+		exit(1);
+	}
+
+	while ((cnt = ops->dequeue_bulk_wait(td->Q, items, td->batch)) > 0) {
+		uint64_t now = now_ns();
+		for (size_t i = 0; i < cnt; ++i) {
+			uint64_t value, time;
+			item_get(ops, items, i, &value, &time);
+			td->sum += value;
+			++td->hist[hist_bucket(now > time ? now - time : 0)];
+		}
+		td->cnt += cnt;
+		++td->claims;
+	}
+
+	free(items);
+	return NULL;
+}
+
+static void
+usage(FILE *stream)
+{
+	char *usage =
+		"Usage: queue_bench [-a] [-b BATCH] [-c CONSUMERS] [-n ITEMS] [-p PRODUCERS]\n"
+		"                   [-q LENGTH] [-s SIZE]\n"
+		"\n"
+		"Options:\n"
+		"  -a            Pin every thread to a cpu of its own, round robin (linux only)\n"
+		"  -b BATCH      Items per enqueue/dequeue claim (1-256, default 1)\n"
+		"  -c CONSUMERS  Number of consumer threads (1-255, default 4)\n"
+		"  -h            Print this help message\n"
+		"  -n ITEMS      Number of items to move through the queue (default 4194304)\n"
+		"  -p PRODUCERS  Number of producer threads (1-255, default 1)\n"
+		"  -q LENGTH     Queue length, a power of two (2-1048576, default 512)\n"
+		"  -s SIZE       Item size in bytes, 16, 64, 96, 256, 1024 or 8192\n"
+		"                (default 96)\n";
+	fprintf(stream, "%s", usage);
+	return;
+}
+
+static int
+parse_count(char *arg, unsigned long long max, unsigned long long *value)
+{
+	char *endptr;
+
+	errno = 0;
+	*value = strtoull(arg, &endptr, 10);
+	if (errno != 0 || *endptr != '\0' || *value == 0 || *value > max)
+		return -1;
+	return 0;
+}
+
+static const struct bench_queue_ops *
+find_queue_ops(unsigned long long size)
+{
+	for (size_t i = 0; i < sizeof(bench_queues) / sizeof(bench_queues[0]); ++i) {
+		if (bench_queues[i]->item_size == size)
+			return bench_queues[i];
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long batch = 1;
+	unsigned long long consumer_cnt = 4;
+	unsigned long long item_cnt = 1 << 22;
+	unsigned long long producer_cnt = 1;
+	unsigned long long queue_length = QUEUE_SIZE;
+	unsigned long long item_size = 96;
+	bool pin = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ab:c:hn:p:q:s:")) != -1) {
+		int ret = 0;
+		switch (opt) {
+		case 'a':
+			pin = true;
+			break;
+		case 'b':
+			ret = parse_count(optarg, MAX_BATCH_SIZE, &batch);
+			break;
+		case 'c':
+			ret = parse_count(optarg, MAX_THREAD_CNT, &consumer_cnt);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 'n':
+			ret = parse_count(optarg, UINT64_MAX / 2, &item_cnt);
+			break;
+		case 'p':
+			ret = parse_count(optarg, MAX_THREAD_CNT, &producer_cnt);
+			break;
+		case 'q':
+			ret = parse_count(optarg, MAX_QUEUE_SIZE, &queue_length);
+			if (ret == 0 && (queue_length < 2 ||
+			                 (queue_length & (queue_length - 1)) != 0))
+				ret = -1;
+			break;
+		case 's':
+			ret = parse_count(optarg, 8192, &item_size);
+			if (ret == 0 && find_queue_ops(item_size) == NULL)
+				ret = -1;
+			break;
+		default:
+			usage(stderr);
+			return 1;
+		}
+		if (ret != 0) {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+			return 1;
+		}
+	}
+
+	const struct bench_queue_ops *ops = find_queue_ops(item_size);
+	void *Q = ops->init(queue_length);
+	if (Q == NULL) {
+		perror("Failed to initialize queue");
+		return 1;
+	}
+
+	long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_cnt < 1)
+		cpu_cnt = 1;
+
+	size_t thread_cnt = producer_cnt + consumer_cnt;
+	struct bench_thread_data *tds = calloc(thread_cnt, sizeof(*tds));
+	pthread_t *threads = calloc(thread_cnt, sizeof(*threads));
+	if (tds == NULL || threads == NULL) {
+		perror("Failed to allocate thread data");
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint64_t first = 0;
+	for (size_t i = 0; i < thread_cnt; ++i) {
+		tds[i].ops = ops;
+		tds[i].Q = Q;
+		tds[i].batch = batch;
+		tds[i].cpu = pin ? (int) (i % (size_t) cpu_cnt) : -1;
+		void *(*func)(void *) = consumer_func;
+		if (i < producer_cnt) {
+			tds[i].first = first;
+			tds[i].cnt = item_cnt / producer_cnt +
+				(i < item_cnt % producer_cnt ? 1 : 0);
+			first += tds[i].cnt;
+			func = producer_func;
+		}
+		int ret = pthread_create(&threads[i], NULL, func, &tds[i]);
+		if (ret != 0) {
+			errno = ret;
+			perror("Failed to create thread");
+			return 1;
+		}
+	}
+
+	/* Like dsync, the queue is closed once everything has been enqueued
+	   and the consumers exit once they have dequeued everything. */
+	uint64_t close_time = 0;
+	for (size_t i = 0; i < thread_cnt; ++i) {
+		pthread_join(threads[i], NULL);
+		if (i == producer_cnt - 1) {
+			close_time = now_ns();
+			ops->close(Q);
+		}
+	}
+	uint64_t shutdown_ns = now_ns() - close_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t received = 0, sum = 0, enqueue_claims = 0, dequeue_claims = 0;
+	uint64_t hist[HIST_SIZE] = {0};
+	for (size_t i = 0; i < thread_cnt; ++i) {
+		if (i < producer_cnt) {
+			enqueue_claims += tds[i].claims;
+		} else {
+			received += tds[i].cnt;
+			sum += tds[i].sum;
+			dequeue_claims += tds[i].claims;
+			for (unsigned int b = 0; b < HIST_SIZE; ++b)
+				hist[b] += tds[i].hist[b];
+		}
+	}
+
+	uint64_t n = item_cnt;
+	if (received != n || sum != n * (n - 1) / 2) {
+		fprintf(stderr, "Items were lost or duplicated\n");
+		return 1;
+	}
+
+	double secs = (double) (end.tv_sec - start.tv_sec) +
+		(double) (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("producers %llu consumers %llu batch %llu size %llu queue %llu%s: "
+	       "%.2f Mitems/s, %.3f enqueue claims/item, %.3f dequeue claims/item, "
+	       "latency p50 %llu ns p90 %llu ns p99 %llu ns p99.9 %llu ns, "
+	       "shutdown %.1f us\n",
+	       producer_cnt, consumer_cnt, batch, item_size, queue_length,
+	       pin ? " pinned" : "", (double) n / secs / 1e6,
+	       (double) enqueue_claims / (double) n,
+	       (double) dequeue_claims / (double) n,
+	       (unsigned long long) percentile(hist, n, 50),
+	       (unsigned long long) percentile(hist, n, 90),
+	       (unsigned long long) percentile(hist, n, 99),
+	       (unsigned long long) percentile(hist, n, 99.9),
+	       (double) shutdown_ns / 1e3);
+
+	free(threads);
+	free(tds);
+	ops->free(Q);
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGNMENT sizeof(void *)
+
+/*
+ * ${refcnt} is the number of live allocations in the chunk plus one while the
+ * chunk is the current chunk of an arena.
+ */
+struct arena_chunk {
+	size_t refcnt;
+	size_t size;
+	size_t used;
+	uint8_t *data;
+};
+
+/*
+ * Every allocation is preceded by a header pointing to its chunk so that
+ * arena_free doesn't need the arena.
+ */
+struct alloc_header {
+	struct arena_chunk *chunk;
+};
+
+static inline void
+chunk_unref(struct arena_chunk *chunk)
+{
+	if (__atomic_sub_fetch(&chunk->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(chunk);
+	return;
+}
+
+/*
+ * Allocates a chunk that can hold at least ${size} bytes of allocations.
+ *
+ * Returns the chunk on success, NULL on failure. Sets errno on failure.
+ */
+static struct arena_chunk *
+chunk_new(size_t size)
+{
+	size_t header_size = (sizeof(struct arena_chunk) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	if (size < CHUNK_SIZE)
+		size = CHUNK_SIZE;
+	if (size > SIZE_MAX - header_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct arena_chunk *chunk = malloc(header_size + size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->refcnt = 1;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->data = (uint8_t *) chunk + header_size;
+
+	return chunk;
+}
+
+/*
+ * Initialize an empty arena ${A}.
+ */
+void
+arena_init(struct arena *A)
+{
+	A->chunk = NULL;
+	return;
+}
+
+/*
+ * Allocate ${size} bytes from ${A}. The returned memory is aligned for any
+ * pointer sized type.
+ *
+ * Returns the allocated memory on success, NULL on failure. Sets errno on
+ * failure.
+ */
+void *
+arena_alloc(struct arena *A, size_t size)
+{
+	if (size > SIZE_MAX - sizeof(struct alloc_header) - ALIGNMENT) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t total = (sizeof(struct alloc_header) + size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+	struct arena_chunk *chunk = A->chunk;
+	if (total > CHUNK_SIZE / 4) {
+		/* Big allocations get a chunk of their own so that the current chunk
+		   is not given up early. The allocation is the only reference. */
+		chunk = chunk_new(total);
+		if (chunk == NULL)
+			return NULL;
+		struct alloc_header *header = (struct alloc_header *) chunk->data;
+		header->chunk = chunk;
+		chunk->used = total;
+		return header + 1;
+	}
+
+	if (chunk == NULL || chunk->size - chunk->used < total) {
+		chunk = chunk_new(total);
+		if (chunk == NULL)
+			return NULL;
+		if (A->chunk != NULL)
+			chunk_unref(A->chunk);
+		A->chunk = chunk;
+	}
+
+	struct alloc_header *header = (struct alloc_header *) (chunk->data + chunk->used);
+	header->chunk = chunk;
+	chunk->used += total;
+	__atomic_add_fetch(&chunk->refcnt, 1, __ATOMIC_RELAXED);
+
+	return header + 1;
+}
+
+/*
+ * Free ${ptr} which must have been returned by arena_alloc. Can be called from
+ * any thread, even after the arena has been destroyed.
+ */
+void
+arena_free(void *ptr)
+{
+	if (ptr != NULL)
+		chunk_unref(((struct alloc_header *) ptr - 1)->chunk);
+	return;
+}
+
+/*
+ * Destroy ${A}. Chunks with live allocations are freed when their last
+ * allocation is freed.
+ */
+void
+arena_destroy(struct arena *A)
+{
+	if (A->chunk != NULL)
+		chunk_unref(A->chunk);
+	A->chunk = NULL;
+	return;
+}
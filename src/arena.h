@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Opaque type */
+struct arena_chunk;
+
+/*
+ * Bump allocator where every chunk keeps a count of its live allocations and
+ * is freed when the last allocation in it is freed and the arena has moved on
+ * to a newer chunk. Allocating must be done by one thread (the owner of the
+ * arena) but freeing can be done by any thread.
+ */
+struct arena {
+	struct arena_chunk *chunk;
+};
+
+void arena_init(struct arena *A);
+void *arena_alloc(struct arena *A, size_t size);
+void arena_free(void *ptr);
+void arena_destroy(struct arena *A);
+
+#endif /* ARENA_H */
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _DEFAULT_SOURCE /* for major and minor */
+
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "autotune.h"
+#include "metrics.h"
+
+/* Threads for a rotational device, whose throughput drops with every extra
+   seek. */
+#define HDD_THREAD_CNT 2
+/* Threads per cpu when nothing is known about a device (e.g., tmpfs, network
+   filesystems). */
+#define UNKNOWN_THREADS_PER_CPU 2
+/* Interval in milliseconds between two measurements of the controller. */
+#define AUTOTUNE_INTERVAL 1000
+/* Relative change of throughput below which it is considered the same. */
+#define AUTOTUNE_THRESHOLD 0.05
+/* Intervals the controller keeps the same count for while the throughput
+   doesn't change before trying another count. */
+#define AUTOTUNE_HOLD_CNT 5
+
+/*
+ * Reads the number in /sys/dev/block/MAJOR:MINOR/${attr}, falling back to the
+ * parent device as partitions don't have a queue of their own.
+ *
+ * Returns 0 on success, -1 if there is no such attribute.
+ */
+static int
+read_block_attr(dev_t dev, const char *attr, unsigned long *value)
+{
+#ifdef __linux__
+	const char *fmts[] = {"/sys/dev/block/%u:%u/queue/%s",
+	                      "/sys/dev/block/%u:%u/../queue/%s"};
+	for (size_t i = 0; i < sizeof(fmts) / sizeof(fmts[0]); ++i) {
+		char path[128];
+		snprintf(path, sizeof(path), fmts[i], major(dev), minor(dev), attr);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		char buf[32];
+		ssize_t len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+		char *endptr;
+		*value = strtoul(buf, &endptr, 10);
+		if (endptr != buf)
+			return 0;
+	}
+#else
+	(void) dev;
+	(void) attr;
+	(void) value;
+#endif
+	errno = 0;
+	return -1;
+}
+
+/*
+ * Returns the number of sync threads that suits block device ${dev} best by
+ * what the kernel tells about it: few for rotational devices, more the more
+ * requests the device's queue takes otherwise.
+ */
+static unsigned long
+device_thread_cnt(dev_t dev)
+{
+	long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long unknown_cnt = (unsigned long) (cpu_cnt > 0 ? cpu_cnt : 1) *
+		UNKNOWN_THREADS_PER_CPU;
+
+	unsigned long rotational;
+	if (read_block_attr(dev, "rotational", &rotational) != 0)
+		return unknown_cnt;
+	if (rotational != 0)
+		return HDD_THREAD_CNT;
+
+	/* About a request per thread would be in flight for small files, a few
+	   per thread for large files that are written back in the background. */
+	unsigned long nr_requests;
+	if (read_block_attr(dev, "nr_requests", &nr_requests) != 0)
+		return unknown_cnt;
+	return nr_requests / 4;
+}
+
+/*
+ * Returns the initial number of active sync threads for -j auto of the pool
+ * syncing from device ${src_dev} to device ${dst_dev}, which is the number that
+ * suits the slower of the two within [${min_cnt}, ${max_cnt}].
+ */
+uint8_t
+autotune_initial_cnt(dev_t src_dev, dev_t dst_dev, uint8_t min_cnt,
+                     uint8_t max_cnt)
+{
+	unsigned long cnt = device_thread_cnt(dst_dev);
+	unsigned long src_cnt = device_thread_cnt(src_dev);
+	if (src_cnt < cnt)
+		cnt = src_cnt;
+	if (cnt < min_cnt)
+		cnt = min_cnt;
+	if (cnt > max_cnt)
+		cnt = max_cnt;
+	return (uint8_t) cnt;
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the ratio of ${cur} to ${prev}, 1 if there is nothing to compare.
+ */
+static double
+rate_ratio(double cur, double prev)
+{
+	return prev > 0 ? cur / prev : 1;
+}
+
+/*
+ * Every AUTOTUNE_INTERVAL milliseconds, compares the rates of files and bytes
+ * synced by the pool with the previous interval's. If they went up, the count
+ * keeps moving in the same direction, if they went down it moves back the
+ * other way and if they stayed the same it stays for AUTOTUNE_HOLD_CNT
+ * intervals before trying the next count. Intervals in which nothing is synced
+ * (e.g., --watch waiting for changes) are skipped.
+ *
+ * Returns NULL.
+ */
+static void *
+controller_func(void *data)
+{
+	struct autotune *A = data;
+	uint64_t last_time = now_ms();
+	uint64_t last_files = 0;
+	uint64_t last_bytes = 0;
+	double prev_files_rate = 0;
+	double prev_bytes_rate = 0;
+	int direction = 1;
+	unsigned int hold = 0;
+
+	pthread_mutex_lock(&A->lock);
+	while (!A->stopped) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += AUTOTUNE_INTERVAL / 1000;
+		deadline.tv_nsec += (long) (AUTOTUNE_INTERVAL % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&A->unparked, &A->lock, &deadline);
+		if (A->stopped)
+			break;
+
+		uint64_t time = now_ms();
+		uint64_t files =
+			metrics_sync_total(METRICS_FILES_COPIED, A->first_id, A->thread_cnt) +
+			metrics_sync_total(METRICS_FILES_SKIPPED, A->first_id, A->thread_cnt);
+		uint64_t bytes = metrics_sync_total(METRICS_BYTES_COPIED, A->first_id,
+		                                    A->thread_cnt);
+		double secs = (double) (time - last_time) / 1000;
+		if (secs <= 0 || (files == last_files && bytes == last_bytes))
+			continue;
+		double files_rate = (double) (files - last_files) / secs;
+		double bytes_rate = (double) (bytes - last_bytes) / secs;
+		last_time = time;
+		last_files = files;
+		last_bytes = bytes;
+
+		/* Both rates count the same, whichever the files' sizes. */
+		double ratio = (rate_ratio(files_rate, prev_files_rate) +
+		                rate_ratio(bytes_rate, prev_bytes_rate)) / 2;
+		bool first = prev_files_rate == 0 && prev_bytes_rate == 0;
+		prev_files_rate = files_rate;
+		prev_bytes_rate = bytes_rate;
+		if (first)
+			continue;
+
+		if (ratio < 1 - AUTOTUNE_THRESHOLD) {
+			direction = -direction;
+		} else if (ratio <= 1 + AUTOTUNE_THRESHOLD) {
+			if (++hold < AUTOTUNE_HOLD_CNT)
+				continue;
+		}
+		hold = 0;
+
+		/* Steps of a quarter of the count so that large pools converge in
+		   a few intervals. */
+		int cnt = A->active_cnt;
+		int step = cnt / 4 > 1 ? cnt / 4 : 1;
+		cnt += direction * step;
+		if (cnt <= A->min_cnt) {
+			cnt = A->min_cnt;
+			direction = 1;
+		} else if (cnt >= A->thread_cnt) {
+			cnt = A->thread_cnt;
+			direction = -1;
+		}
+		__atomic_store_n(&A->active_cnt, (uint8_t) cnt, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&A->unparked);
+	}
+	pthread_mutex_unlock(&A->lock);
+
+	return NULL;
+}
+
+/*
+ * Starts tuning a pool of ${thread_cnt} sync threads, starting at sync thread
+ * ${first_id}, ${active_cnt} of which are active at first and at least
+ * ${min_cnt} of which are active at any time.
+ *
+ * Returns the tuning on success, NULL on failure. Sets errno on failure.
+ */
+struct autotune *
+autotune_start(uint8_t first_id, uint8_t thread_cnt, uint8_t active_cnt,
+               uint8_t min_cnt)
+{
+	int ret;
+
+	struct autotune *A = malloc(sizeof(struct autotune));
+	if (A == NULL)
+		goto err0;
+	ret = pthread_mutex_init(&A->lock, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto err1;
+	}
+	ret = pthread_cond_init(&A->unparked, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto err2;
+	}
+	A->active_cnt = active_cnt;
+	A->min_cnt = min_cnt;
+	A->thread_cnt = thread_cnt;
+	A->first_id = first_id;
+	A->stopped = false;
+	ret = pthread_create(&A->controller, NULL, controller_func, A);
+	if (ret != 0) {
+		errno = ret;
+		goto err3;
+	}
+	return A;
+
+ err3:
+	pthread_cond_destroy(&A->unparked);
+ err2:
+	pthread_mutex_destroy(&A->lock);
+ err1:
+	free(A);
+ err0:
+	return NULL;
+}
+
+/*
+ * Stops the controller and makes the parked threads exit, once there is no
+ * more work to queue.
+ */
+void
+autotune_stop(struct autotune *A)
+{
+	if (A == NULL)
+		return;
+
+	pthread_mutex_lock(&A->lock);
+	A->stopped = true;
+	pthread_cond_broadcast(&A->unparked);
+	pthread_mutex_unlock(&A->lock);
+	pthread_join(A->controller, NULL);
+	return;
+}
+
+/*
+ * Frees the tuning after the sync threads have exited.
+ */
+void
+autotune_free(struct autotune *A)
+{
+	if (A == NULL)
+		return;
+
+	pthread_cond_destroy(&A->unparked);
+	pthread_mutex_destroy(&A->lock);
+	free(A);
+	return;
+}
+
+/*
+ * Slow path of autotune_park, waiting while sync thread ${id} is parked.
+ *
+ * Returns true if the thread has been unparked, false if it is to exit.
+ */
+bool
+autotune_wait(struct autotune *A, uint8_t id)
+{
+	pthread_mutex_lock(&A->lock);
+	while (!A->stopped && id >= A->active_cnt)
+		pthread_cond_wait(&A->unparked, &A->lock);
+	bool active = id < A->active_cnt;
+	pthread_mutex_unlock(&A->lock);
+	return active;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Number of active sync threads for -j auto. All the sync threads of the pool
+ * are created, but only the ones whose id is below ${active_cnt} take work, the
+ * others are parked. A controller thread measures the throughput every second
+ * and moves ${active_cnt} between ${min_cnt} and ${thread_cnt} by hill
+ * climbing. The throughput is that of the pool's own threads, which start at
+ * sync thread ${first_id}.
+ */
+struct autotune {
+	uint8_t active_cnt;
+	uint8_t min_cnt;
+	uint8_t thread_cnt;
+	uint8_t first_id;
+	bool stopped;
+	pthread_mutex_t lock;
+	pthread_cond_t unparked;
+	pthread_t controller;
+};
+
+uint8_t autotune_initial_cnt(dev_t src_dev, dev_t dst_dev, uint8_t min_cnt,
+                             uint8_t max_cnt);
+struct autotune *autotune_start(uint8_t first_id, uint8_t thread_cnt,
+                                uint8_t active_cnt, uint8_t min_cnt);
+void autotune_stop(struct autotune *A);
+void autotune_free(struct autotune *A);
+bool autotune_wait(struct autotune *A, uint8_t id);
+
+/*
+ * Parks sync thread ${id} while it isn't one of the active threads.
+ *
+ * Returns true if the thread can take work, false if it is to exit.
+ */
+static inline bool
+autotune_park(struct autotune *A, uint8_t id)
+{
+	if (A == NULL || id < __atomic_load_n(&A->active_cnt, __ATOMIC_RELAXED))
+		return true;
+	return autotune_wait(A, id);
+}
+
+#endif /* AUTOTUNE_H */
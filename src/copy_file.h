@@ -6,12 +6,17 @@
 #ifndef COPY_FILE_H
 #define COPY_FILE_H
 
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <stdint.h>
 
+#include "dir_node.h"
+#include "sync_options.h"
+
 /*
- * Copy ${src} to ${dst} with ${mode}.
+ * Copy ${name} in ${dir}'s source directory to ${name} in ${dir}'s destination
+ * directory with ${mode}, cloning it if ${opts->reflink} says so.
  *
  * Currently, this is implemented by the linux specific copy_file_linux.c which
  * tries to use linux specific api and the portable copy_file_portable.c file.
@@ -19,6 +24,64 @@
  * provide similar implementation of this api for other systems and update the
  * Makefile to use system specific implementation file during compilation.
  */
-int copy_file(char *src, char *dst, uintmax_t size, mode_t mode);
+int copy_file(const struct sync_options *opts, struct dir_node *dir, char *name,
+              uintmax_t size, mode_t mode);
+
+/*
+ * Copy ${name} in ${dir}'s source directory with ${src_statbuf} to ${dir}'s
+ * destination directory through a temporary file that replaces ${name} once it
+ * is complete, with the mode and timestamps of the source already set.
+ * Implemented by copy_file_atomic.c for all systems on top of copy_file_data.
+ */
+int copy_file_atomic(const struct sync_options *opts, struct dir_node *dir,
+                     char *name, const struct stat *src_statbuf);
+
+/*
+ * Copy ${size} bytes from already opened ${src_fd} to ${dst_fd} which are files
+ * in ${dir}, flushing ${dst_fd} if ${opts->durable} is DURABLE_FSYNC. This is
+ * what copy_file uses after opening the files and is provided by the same
+ * implementation file.
+ */
+int copy_file_data(const struct sync_options *opts, struct dir_node *dir,
+                   int src_fd, int dst_fd, uintmax_t size);
+
+/*
+ * Copy ${len} bytes at offset ${off} of ${src_fd} to the same offset of
+ * ${dst_fd} without using or changing the file offsets, so that ranges of a
+ * file can be copied by multiple threads at once. ${dst_fd} must already be at
+ * least ${off} + ${len} bytes long and have no data in the range. Provided by
+ * the same implementation file as copy_file.
+ */
+int copy_file_data_range(int src_fd, int dst_fd, uintmax_t off, uintmax_t len);
+
+/*
+ * Start writing back ${len} bytes at offset ${off} of ${dst_fd} that have just
+ * been copied, so that the data of files copied with --durable doesn't pile up
+ * until the final flush. Provided by the same implementation file as
+ * copy_file, as a no-op where it is not supported.
+ */
+void copy_file_write_behind(int dst_fd, uintmax_t off, uintmax_t len);
+
+#ifdef HAVE_IO_URING
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sync_thread.h"
+
+/* Opaque type */
+struct copy_file_uring;
+
+/*
+ * io_uring based execution of the syncing syscalls of a batch of files which
+ * is implemented by the linux specific copy_file_uring.c on top of
+ * copy_file_data. The Makefile only compiles it (and defines HAVE_IO_URING)
+ * when the system headers provide io_uring. copy_file_uring_init fails if the
+ * running kernel doesn't support it, so callers must fall back to sync_file.
+ */
+struct copy_file_uring *copy_file_uring_init(unsigned int batch_size);
+void copy_file_uring_free(struct copy_file_uring *U);
+int copy_file_uring_sync(struct copy_file_uring *U, const struct sync_options *opts,
+                         struct sync_data *sds, size_t cnt, size_t *left);
+#endif
 
 #endif /* COPY_FILE_H */
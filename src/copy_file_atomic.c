@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE /* for O_TMPFILE */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "copy_file.h"
+#include "dir_node.h"
+#include "sync_options.h"
+#include "utils.h"
+
+/* "." followed by this, the pid and a counter is the name of temporary files
+   that are renamed over their destination. */
+#define TMP_PREFIX "dsync-tmp"
+#define TMP_NAME_SIZE 64
+
+static size_t tmp_counter;
+
+/*
+ * Writes a hidden name for a temporary file in ${buf}, which is unique among
+ * the ones any dsync process makes.
+ */
+static void
+make_tmp_name(char *buf)
+{
+	size_t cnt = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+	snprintf(buf, TMP_NAME_SIZE, "." TMP_PREFIX ".%ld.%zu", (long) getpid(), cnt);
+	return;
+}
+
+#ifdef O_TMPFILE
+/*
+ * Opens an anonymous file in ${dir}'s destination directory with O_TMPFILE
+ * unless its filesystem has been found not to support it.
+ *
+ * Returns the file descriptor on success, -1 on failure. Sets errno on failure.
+ */
+static int
+open_anonymous(struct dir_node *dir)
+{
+	if (__atomic_load_n(&dir->no_tmpfile, __ATOMIC_RELAXED)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	int fd = openat(dir->dst_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+	/* Filesystems without O_TMPFILE support fail with EOPNOTSUPP, kernels
+	   without it with EISDIR or EINVAL. */
+	if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+		__atomic_store_n(&dir->no_tmpfile, true, __ATOMIC_RELAXED);
+	return fd;
+}
+
+/*
+ * Gives anonymous file ${fd} the name ${name} in ${dir}'s destination
+ * directory. A new name is linked directly, an existing one is replaced by
+ * linking a temporary name and renaming it.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+link_anonymous(struct dir_node *dir, int fd, char *name)
+{
+	/* linkat with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, the /proc link of
+	   the file descriptor doesn't. */
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, path, dir->dst_fd, name, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+	if (errno != EEXIST)
+		return -1;
+
+	char tmp_name[TMP_NAME_SIZE];
+	make_tmp_name(tmp_name);
+	if (linkat(AT_FDCWD, path, dir->dst_fd, tmp_name, AT_SYMLINK_FOLLOW) != 0)
+		return -1;
+	if (renameat(dir->dst_fd, tmp_name, dir->dst_fd, name) != 0) {
+		int err = errno;
+		unlinkat(dir->dst_fd, tmp_name, 0);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Copy regular file ${name} in ${dir}'s source directory to ${dir}'s
+ * destination directory so that ${name} there is replaced at once: the data is
+ * copied with copy_file_data to an anonymous O_TMPFILE file (where supported)
+ * or to a temporary hidden name, the mode and timestamps of ${src_statbuf} are
+ * set on the file descriptor and only then is the file linked or renamed over
+ * ${name}. An interrupted or failed copy leaves the previous version of the
+ * destination as it was. The destination directory's file descriptor is used
+ * for everything, so this costs no more per directory setup than copy_file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+copy_file_atomic(const struct sync_options *opts, struct dir_node *dir,
+                 char *name, const struct stat *src_statbuf)
+{
+	int ret;
+	char *err;
+	uintmax_t size = (uintmax_t) src_statbuf->st_size;
+	char tmp_name[TMP_NAME_SIZE];
+	bool anonymous = false;
+
+	int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd == -1) {
+		err = "Failed to open source %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		goto err0;
+	}
+
+	int dst_fd = -1;
+#ifdef O_TMPFILE
+	dst_fd = open_anonymous(dir);
+	anonymous = dst_fd != -1;
+#endif
+	if (dst_fd == -1) {
+		make_tmp_name(tmp_name);
+		dst_fd = openat(dir->dst_fd, tmp_name,
+		                O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+	}
+	if (dst_fd == -1) {
+		err = "Failed to open temporary file in destination %s for %s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		goto err1;
+	}
+
+	ret = copy_file_data(opts, dir, src_fd, dst_fd, size);
+	if (ret == -1) {
+		err = "Failed to copy %s/%s to %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name, dir->dst, name);
+		goto err2;
+	}
+
+	/* The mode is set explicitly as the file was created with 0600 (and the
+	   umask applies to the mode given to open anyway). */
+	struct timespec times[2] = {
+		{src_statbuf->st_atim.tv_sec, src_statbuf->st_atim.tv_nsec},
+		{src_statbuf->st_mtim.tv_sec, src_statbuf->st_mtim.tv_nsec}
+	};
+	if (fchmod(dst_fd, src_statbuf->st_mode & 07777) != 0 ||
+	    futimens(dst_fd, times) != 0) {
+		err = "Failed to update mode or timestamps for %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		goto err2;
+	}
+
+#ifdef O_TMPFILE
+	if (anonymous)
+		ret = link_anonymous(dir, dst_fd, name);
+	else
+#endif
+		ret = renameat(dir->dst_fd, tmp_name, dir->dst_fd, name);
+	if (ret != 0) {
+		err = "Failed to replace destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		goto err2;
+	}
+
+	ret = close(dst_fd);
+	if (ret != 0) {
+		err = "Failed to close file descriptor for destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		goto err1;
+	}
+	/* Ignore return value from close on src_fd as src is opened for reading only. */
+	close(src_fd);
+	/* Let's reset errno in case close failed. */
+	errno = 0;
+	return 0;
+
+ err2:
+	close(dst_fd);
+	/* A named temporary file that didn't make it is removed. */
+	if (!anonymous)
+		unlinkat(dir->dst_fd, tmp_name, 0);
+ err1:
+	close(src_fd);
+ err0:
+	errno = 0;
+	return -1;
+}
@@ -5,79 +5,391 @@
 
 #define _GNU_SOURCE /* for copy_file_range */
 
+#include <sys/ioctl.h>
 #include <sys/types.h>
 
+#ifdef __linux__
+#include <linux/fs.h> /* for FICLONE */
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
 #include "copy_file.h"
 #include "copy_read_write.h"
+#include "dir_node.h"
+#include "file_job.h"
+#include "sync_options.h"
 #include "utils.h"
 
+/* Smaller files are not checked for holes. */
+#define SPARSE_MIN_SIZE (64 * 1024)
+
+/* With --durable, data is written back in windows of this size while it is
+   copied rather than all at once when the filesystem is flushed. */
+#define WRITE_BEHIND_SIZE ((uintmax_t) 8 * 1024 * 1024)
+
+#ifdef FICLONE
+#define CLONE_CACHE_SIZE 64
+
+enum clone_state {
+	CLONE_UNKNOWN,
+	CLONE_SUPPORTED,
+	CLONE_UNSUPPORTED
+};
+
 /*
- * Copy regular file ${src} to ${dst} with ${mode}. This implementation uses
- * linux specific copy_file_range api for copying falling back to copy via
- * read write loop.
- *
- * Returns 0 on success, -1 on failure.
+ * Whether cloning from filesystem ${src_dev} to filesystem ${dst_dev} works.
+ * Entries are only ever added (under clone_cache_lock) and ${state} is updated
+ * atomically, so looking up is lock free.
  */
-int
-copy_file(char *src, char *dst, uintmax_t size, mode_t mode)
+struct clone_support {
+	dev_t src_dev;
+	dev_t dst_dev;
+	int state;
+};
+
+static struct clone_support clone_cache[CLONE_CACHE_SIZE];
+static size_t clone_cache_cnt;
+static pthread_mutex_t clone_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct clone_support *
+find_clone_support(dev_t src_dev, dev_t dst_dev, size_t cnt)
 {
-	int ret;
-	char *err;
+	for (size_t i = 0; i < cnt; ++i) {
+		if (clone_cache[i].src_dev == src_dev && clone_cache[i].dst_dev == dst_dev)
+			return &clone_cache[i];
+	}
+	return NULL;
+}
 
-	int src_fd = open(src, O_RDONLY);
-	if (src_fd == -1) {
-		print_error_and_reset_errno(errno, "Failed to open source %s", src);
-		goto err0;
+/*
+ * Returns the clone_support entry of the ${src_dev} and ${dst_dev} pair adding
+ * it if there is none, or NULL if the cache is full.
+ */
+static struct clone_support *
+get_clone_support(dev_t src_dev, dev_t dst_dev)
+{
+	size_t cnt = __atomic_load_n(&clone_cache_cnt, __ATOMIC_ACQUIRE);
+	struct clone_support *cs = find_clone_support(src_dev, dst_dev, cnt);
+	if (cs != NULL)
+		return cs;
+
+	pthread_mutex_lock(&clone_cache_lock);
+	cnt = __atomic_load_n(&clone_cache_cnt, __ATOMIC_RELAXED);
+	cs = find_clone_support(src_dev, dst_dev, cnt);
+	if (cs == NULL && cnt < CLONE_CACHE_SIZE) {
+		cs = &clone_cache[cnt];
+		cs->src_dev = src_dev;
+		cs->dst_dev = dst_dev;
+		__atomic_store_n(&cs->state, CLONE_UNKNOWN, __ATOMIC_RELAXED);
+		__atomic_store_n(&clone_cache_cnt, cnt + 1, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&clone_cache_lock);
 
-	int dst_fd = open(dst, O_CREAT | O_TRUNC | O_WRONLY, mode);
-	if (dst_fd == -1) {
-		print_error_and_reset_errno(errno, "Failed to open destination %s", dst);
-		goto err1;
+	return cs;
+}
+
+/*
+ * Clones ${src_fd} to ${dst_fd} with the FICLONE ioctl. Unless ${always} is
+ * set, cloning is not tried again between filesystems where it has failed for
+ * lack of support.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+clone_file(struct dir_node *dir, int src_fd, int dst_fd, bool always)
+{
+	struct clone_support *cs = get_clone_support(dir->src_dev, dir->dst_dev);
+	int state = cs != NULL ? __atomic_load_n(&cs->state, __ATOMIC_RELAXED)
+	                       : CLONE_UNKNOWN;
+	if (state == CLONE_UNSUPPORTED && always == false) {
+		errno = EOPNOTSUPP;
+		return -1;
 	}
 
-	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+		if (cs != NULL && state != CLONE_SUPPORTED)
+			__atomic_store_n(&cs->state, CLONE_SUPPORTED, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	/* EINVAL can also be about the particular files (e.g., btrfs files with
+	   different nodatacow flags), so it only counts if cloning never worked. */
+	bool unsupported = errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY ||
+		errno == ENOSYS || (errno == EINVAL && state == CLONE_UNKNOWN);
+	if (cs != NULL && unsupported)
+		__atomic_store_n(&cs->state, CLONE_UNSUPPORTED, __ATOMIC_RELAXED);
+	return -1;
+}
+#endif
+
+/*
+ * Starts writing back ${len} bytes at offset ${off} of ${dst_fd} and waits for
+ * the writeback of the ${len} bytes before it, so that a file being copied has
+ * at most two windows of dirty data. Failures are ignored as this only spreads
+ * the work of the final flush, which reports the errors.
+ */
+void
+copy_file_write_behind(int dst_fd, uintmax_t off, uintmax_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(dst_fd, (off_t) off, (off_t) len, SYNC_FILE_RANGE_WRITE);
+	if (off >= len) {
+		unsigned int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER;
+		sync_file_range(dst_fd, (off_t) (off - len), (off_t) len, flags);
+	}
+	errno = 0;
+#else
+	(void) dst_fd;
+	(void) off;
+	(void) len;
+#endif
+	return;
+}
 
+/*
+ * Copy ${size} bytes from the current offset of ${src_fd} to the current offset
+ * of ${dst_fd} using copy_file_range falling back to copy via read write loop.
+ * If ${write_behind} is set, the copied data is written back as it is copied.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+copy_range(int src_fd, int dst_fd, uintmax_t size, bool write_behind)
+{
+	off_t off = write_behind ? lseek(dst_fd, 0, SEEK_CUR) : -1;
 	errno = 0;
 	uintmax_t bytes_left = size;
 	while (bytes_left > 0) {
 		size_t copy_len = bytes_left > (uintmax_t) SSIZE_MAX
 			? SSIZE_MAX
 			: (size_t) bytes_left;
+		if (off != -1 && copy_len > WRITE_BEHIND_SIZE)
+			copy_len = WRITE_BEHIND_SIZE;
 		ssize_t copied = copy_file_range(src_fd, NULL, dst_fd, NULL, copy_len, 0);
-		if (copied == -1)
+		/* Source getting shorter after stat is not an error. */
+		if (copied == -1 || copied == 0)
 			break;
 
 		bytes_left -= (uintmax_t) copied;
+		if (off != -1) {
+			copy_file_write_behind(dst_fd, (uintmax_t) off, (uintmax_t) copied);
+			off += copied;
+		}
 	}
 
 	if (errno) {
 		/* If copy_file_range is not supported or cross-filesystem copy_file_range
 		   is not supported, let's fallback to copying using read write loop. */
 		if (bytes_left == size && (errno == EOPNOTSUPP || errno == EXDEV)) {
-			ret = copy_read_write(src_fd, dst_fd, size);
-			if (ret == -1) {
-				err = "Failed to copy %s to %s";
-				print_error_and_reset_errno(errno, err, src, dst);
-				goto err2;
-			}
-		} else {
-			err = "Failed to copy %s to %s";
-			print_error_and_reset_errno(errno, err, src, dst);
-			goto err2;
+			errno = 0;
+			return copy_read_write(src_fd, dst_fd, size);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy ${len} bytes at offset ${off} of ${src_fd} to the same offset of ${dst_fd}
+ * using copy_file_range with explicit offsets falling back to copy via pread
+ * pwrite loop.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+copy_file_data_range(int src_fd, int dst_fd, uintmax_t off, uintmax_t len)
+{
+	errno = 0;
+	off_t src_off = (off_t) off;
+	off_t dst_off = (off_t) off;
+	uintmax_t bytes_left = len;
+	while (bytes_left > 0) {
+		size_t copy_len = bytes_left > (uintmax_t) SSIZE_MAX
+			? SSIZE_MAX
+			: (size_t) bytes_left;
+		ssize_t copied = copy_file_range(src_fd, &src_off, dst_fd, &dst_off,
+		                                 copy_len, 0);
+		/* Source getting shorter after stat is not an error. */
+		if (copied == -1 || copied == 0)
+			break;
+
+		bytes_left -= (uintmax_t) copied;
+	}
+
+	if (errno) {
+		if (bytes_left == len && (errno == EOPNOTSUPP || errno == EXDEV)) {
+			errno = 0;
+			return copy_read_write_range(src_fd, dst_fd, off, len);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef SEEK_HOLE
+/*
+ * Copy the first ${size} bytes of ${src_fd} which has holes to the empty
+ * ${dst_fd}. Only the data regions found with SEEK_DATA and SEEK_HOLE are
+ * copied. The holes are recreated by seeking over them in ${dst_fd} and
+ * setting its size at the end, as nothing is allocated for the parts of a file
+ * that are never written. ${write_behind} is passed on to copy_range.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+copy_sparse(int src_fd, int dst_fd, uintmax_t size, bool write_behind)
+{
+	off_t end = (off_t) size;
+	off_t data = 0;
+	while (data < end) {
+		data = lseek(src_fd, data, SEEK_DATA);
+		if (data == -1) {
+			/* No more data after ${data}, the rest is a hole. */
+			if (errno != ENXIO)
+				return -1;
+			errno = 0;
+			break;
 		}
+		if (data >= end)
+			break;
+
+		off_t hole = lseek(src_fd, data, SEEK_HOLE);
+		if (hole == -1)
+			return -1;
+		if (hole > end)
+			hole = end;
+
+		if (lseek(src_fd, data, SEEK_SET) == -1 ||
+		    lseek(dst_fd, data, SEEK_SET) == -1)
+			return -1;
+		uintmax_t len = (uintmax_t) (hole - data);
+		if (copy_range(src_fd, dst_fd, len, write_behind) != 0)
+			return -1;
+		data = hole;
+	}
+
+	return ftruncate(dst_fd, end);
+}
+#endif
+
+/*
+ * Copy ${size} bytes of regular file ${src_fd} to ${dst_fd}. This implementation
+ * clones the file with the linux specific FICLONE ioctl if ${opts->reflink}
+ * allows, otherwise uses copy_file_range api for copying falling back to copy via
+ * read write loop. Holes of sparse files are preserved. Large files are copied
+ * in ranges by multiple sync threads with file_job_copy.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+copy_data(const struct sync_options *opts, struct dir_node *dir,
+          int src_fd, int dst_fd, uintmax_t size)
+{
+	if (opts->reflink != REFLINK_NEVER && size > 0) {
+#ifdef FICLONE
+		bool always = opts->reflink == REFLINK_ALWAYS;
+		if (clone_file(dir, src_fd, dst_fd, always) == 0)
+			return 0;
+		if (always)
+			return -1;
+		errno = 0;
+#else
+		(void) dir;
+		if (opts->reflink == REFLINK_ALWAYS) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+#endif
+	}
+
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	bool write_behind = opts->durable != DURABLE_NONE;
+
+#ifdef SEEK_HOLE
+	if (size >= SPARSE_MIN_SIZE) {
+		/* Files without holes have one at the end only. */
+		off_t hole = lseek(src_fd, 0, SEEK_HOLE);
+		if (hole != -1 && (uintmax_t) hole < size)
+			return copy_sparse(src_fd, dst_fd, size, write_behind);
+		/* SEEK_HOLE moved the offset (or failed if not supported). */
+		if (lseek(src_fd, 0, SEEK_SET) == -1)
+			return -1;
+		errno = 0;
+	}
+#endif
+
+	if (opts->Q != NULL && size >= FILE_JOB_MIN_SIZE)
+		return file_job_copy(opts, src_fd, dst_fd, size);
+
+	return copy_range(src_fd, dst_fd, size, write_behind);
+}
+
+/*
+ * Copy ${size} bytes of regular file ${src_fd} to ${dst_fd} with copy_data and
+ * flush ${dst_fd} to stable storage if ${opts->durable} is DURABLE_FSYNC.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+copy_file_data(const struct sync_options *opts, struct dir_node *dir,
+               int src_fd, int dst_fd, uintmax_t size)
+{
+	if (copy_data(opts, dir, src_fd, dst_fd, size) != 0)
+		return -1;
+	if (opts->durable == DURABLE_FSYNC)
+		return fsync(dst_fd);
+	return 0;
+}
+
+/*
+ * Copy regular file ${name} in ${dir}'s source directory to ${name} in ${dir}'s
+ * destination directory with ${mode} using copy_file_data.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+copy_file(const struct sync_options *opts, struct dir_node *dir, char *name,
+          uintmax_t size, mode_t mode)
+{
+	int ret;
+	char *err;
+
+	int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd == -1) {
+		err = "Failed to open source %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		goto err0;
+	}
+
+	int dst_fd = openat(dir->dst_fd, name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+	                    mode);
+	if (dst_fd == -1) {
+		err = "Failed to open destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		goto err1;
+	}
+
+	ret = copy_file_data(opts, dir, src_fd, dst_fd, size);
+	if (ret == -1) {
+		err = "Failed to copy %s/%s to %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name, dir->dst, name);
+		goto err2;
 	}
 
 	ret = close(dst_fd);
 	if (ret != 0) {
-		err = "Failed to close file descriptor for destination %s";
-		print_error_and_reset_errno(errno, err, dst);
+		err = "Failed to close file descriptor for destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
 		goto err1;
 	}
 	/* Ignore return value from close on src_fd as src is opened for reading only. */
@@ -12,46 +12,106 @@
 
 #include "copy_file.h"
 #include "copy_read_write.h"
+#include "dir_node.h"
+#include "file_job.h"
+#include "sync_options.h"
 #include "utils.h"
 
 /*
- * Copy regular file ${src} to ${dst} with ${mode}. This is the portable version
- * that should work in all the POSIX systems.
+ * Copy ${size} bytes of regular file ${src_fd} to ${dst_fd}. This is the portable
+ * version that should work in all the POSIX systems. Cloning is not supported,
+ * so it fails if ${opts->reflink} is REFLINK_ALWAYS. Large files are copied in
+ * ranges by multiple sync threads with file_job_copy. ${dst_fd} is flushed to
+ * stable storage if ${opts->durable} is DURABLE_FSYNC.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+copy_file_data(const struct sync_options *opts, struct dir_node *dir,
+               int src_fd, int dst_fd, uintmax_t size)
+{
+	(void) dir;
+	if (opts->reflink == REFLINK_ALWAYS && size > 0) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	/* We don't call posix_fadvise like the linux version as posix_fadvise
+	   may not be available in all systems. */
+	int ret;
+	if (opts->Q != NULL && size >= FILE_JOB_MIN_SIZE)
+		ret = file_job_copy(opts, src_fd, dst_fd, size);
+	else
+		ret = copy_read_write(src_fd, dst_fd, size);
+	if (ret == 0 && opts->durable == DURABLE_FSYNC)
+		ret = fsync(dst_fd);
+	return ret;
+}
+
+/*
+ * Writing back data while copying needs sync_file_range, which is linux
+ * specific, so the portable version leaves it all to the final flush.
+ */
+void
+copy_file_write_behind(int dst_fd, uintmax_t off, uintmax_t len)
+{
+	(void) dst_fd;
+	(void) off;
+	(void) len;
+	return;
+}
+
+/*
+ * Copy ${len} bytes at offset ${off} of ${src_fd} to the same offset of ${dst_fd}
+ * via pread pwrite loop.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+copy_file_data_range(int src_fd, int dst_fd, uintmax_t off, uintmax_t len)
+{
+	return copy_read_write_range(src_fd, dst_fd, off, len);
+}
+
+/*
+ * Copy regular file ${name} in ${dir}'s source directory to ${name} in ${dir}'s
+ * destination directory with ${mode} using copy_file_data.
  *
  * Returns 0 on success, -1 on failure.
  */
 int
-copy_file(char *src, char *dst, uintmax_t size, mode_t mode)
+copy_file(const struct sync_options *opts, struct dir_node *dir, char *name,
+          uintmax_t size, mode_t mode)
 {
 	int ret;
 	char *err;
 
-	int src_fd = open(src, O_RDONLY);
+	int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
 	if (src_fd == -1) {
-		print_error_and_reset_errno(errno, "Failed to open source %s", src);
+		err = "Failed to open source %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
 		goto err0;
 	}
 
-	int dst_fd = open(dst, O_CREAT | O_TRUNC | O_WRONLY, mode);
+	int dst_fd = openat(dir->dst_fd, name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+	                    mode);
 	if (dst_fd == -1) {
-		print_error_and_reset_errno(errno, "Failed to open destination %s", dst);
+		err = "Failed to open destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
 		goto err1;
 	}
 
-	/* We don't call posix_fadvise like the linux version as posix_fadvise
-	   may not be available in all systems. */
-
-	ret = copy_read_write(src_fd, dst_fd, size);
+	ret = copy_file_data(opts, dir, src_fd, dst_fd, size);
 	if (ret == -1) {
-		err = "Failed to copy %s to %s";
-		print_error_and_reset_errno(errno, err, dst);
+		err = "Failed to copy %s/%s to %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name, dir->dst, name);
 		goto err2;
 	}
 
 	ret = close(dst_fd);
 	if (ret != 0) {
-		err = "Failed to close file descriptor for destination %s";
-		print_error_and_reset_errno(errno, err, dst);
+		err = "Failed to close file descriptor for destination %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
 		goto err1;
 	}
 	/* Ignore return value from close on src_fd as src is opened for reading only. */
@@ -0,0 +1,647 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE /* for struct statx */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_file.h"
+#include "copy_symlink.h"
+#include "dir_node.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "sync_options.h"
+#include "sync_file.h"
+#include "sync_thread.h"
+#include "utils.h"
+
+/* Operation kinds encoded in the low bits of the user_data of an sqe, the
+   rest of the bits are the index of the file in the batch. */
+enum uring_op {
+	OP_DST_STATX,
+	OP_SRC_OPEN,
+	OP_DST_OPEN,
+	OP_SRC_CLOSE,
+	OP_DST_CLOSE,
+};
+#define OP_BITS 3
+
+/*
+ * State of a file in the batch. The result members hold the cqe results i.e.,
+ * the return value of the syscall or -errno. ${src_close_pos} and
+ * ${dst_close_pos} are the positions in the submission queue of the sqes that
+ * close ${src_fd} and ${dst_fd}.
+ */
+struct batch_entry {
+	struct statx dst_stx;
+	struct stat src_statbuf;
+	bool unchanged;
+	int dst_stat_res;
+	int src_fd;
+	int dst_fd;
+	int dst_close_res;
+	unsigned int src_close_pos;
+	unsigned int dst_close_pos;
+	bool copying;
+	bool copied;
+};
+
+/*
+ * A minimal io_uring instance used through the raw syscalls. Only one thread
+ * uses an instance, so there is no locking.
+ */
+struct copy_file_uring {
+	int ring_fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_pending;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	size_t batch_size;
+	struct batch_entry *batch;
+};
+
+static inline int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+               unsigned int flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+	                     NULL, 0);
+}
+
+static inline int
+io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Checks that the kernel supports all the io_uring operations that we use.
+ *
+ * Returns 0 if supported, -1 otherwise. Sets errno if not supported.
+ */
+static int
+probe_ops(int ring_fd)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL)
+		return -1;
+
+	int rc = 0;
+	if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != 0) {
+		rc = -1;
+		goto done;
+	}
+
+	uint8_t ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_CLOSE};
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			errno = EOPNOTSUPP;
+			rc = -1;
+			goto done;
+		}
+	}
+
+ done:
+	free(probe);
+	return rc;
+}
+
+/*
+ * Initialize an io_uring instance that can process batches of up to
+ * ${batch_size} files. Fails if io_uring is not available (e.g., old kernel or
+ * disabled by seccomp) so that the caller can fall back to regular syscalls.
+ *
+ * Returns the instance on success, NULL on failure. Sets errno on failure.
+ */
+struct copy_file_uring *
+copy_file_uring_init(unsigned int batch_size)
+{
+	struct copy_file_uring *U = calloc(1, sizeof(struct copy_file_uring));
+	if (U == NULL)
+		goto err0;
+
+	U->batch_size = batch_size;
+	U->batch = calloc(batch_size, sizeof(struct batch_entry));
+	if (U->batch == NULL)
+		goto err1;
+
+	/* Every file needs at most two sqes in every phase of a batch. */
+	unsigned int entries = 1;
+	while (entries < 2 * batch_size)
+		entries *= 2;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	U->ring_fd = io_uring_setup(entries, &params);
+	if (U->ring_fd < 0)
+		goto err2;
+
+	if (probe_ops(U->ring_fd) != 0)
+		goto err3;
+
+	U->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	U->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (U->cq_ring_size > U->sq_ring_size)
+			U->sq_ring_size = U->cq_ring_size;
+		U->cq_ring_size = U->sq_ring_size;
+	}
+
+	U->sq_ring = mmap(NULL, U->sq_ring_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, U->ring_fd, IORING_OFF_SQ_RING);
+	if (U->sq_ring == MAP_FAILED)
+		goto err3;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		U->cq_ring = U->sq_ring;
+	} else {
+		U->cq_ring = mmap(NULL, U->cq_ring_size, PROT_READ | PROT_WRITE,
+		                  MAP_SHARED | MAP_POPULATE, U->ring_fd, IORING_OFF_CQ_RING);
+		if (U->cq_ring == MAP_FAILED)
+			goto err4;
+	}
+
+	U->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	U->sqes = mmap(NULL, U->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, U->ring_fd, IORING_OFF_SQES);
+	if (U->sqes == MAP_FAILED)
+		goto err5;
+
+	uint8_t *sq = U->sq_ring;
+	U->sq_entries = params.sq_entries;
+	U->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	U->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	U->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	U->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	U->sq_pending = 0;
+
+	uint8_t *cq = U->cq_ring;
+	U->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	U->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	U->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	U->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return U;
+
+ err5:
+	if (U->cq_ring != U->sq_ring)
+		munmap(U->cq_ring, U->cq_ring_size);
+ err4:
+	munmap(U->sq_ring, U->sq_ring_size);
+ err3:
+	close(U->ring_fd);
+ err2:
+	free(U->batch);
+ err1:
+	free(U);
+ err0:
+	return NULL;
+}
+
+/*
+ * Free ${U}.
+ */
+void
+copy_file_uring_free(struct copy_file_uring *U)
+{
+	if (U != NULL) {
+		munmap(U->sqes, U->sqes_size);
+		if (U->cq_ring != U->sq_ring)
+			munmap(U->cq_ring, U->cq_ring_size);
+		munmap(U->sq_ring, U->sq_ring_size);
+		close(U->ring_fd);
+		free(U->batch);
+		free(U);
+	}
+	return;
+}
+
+/*
+ * Returns the next free sqe of ${U}, cleared and tagged with ${op} on the file
+ * at ${index} of the batch. There is always room as a batch phase never
+ * prepares more sqes than the ring has.
+ */
+static inline struct io_uring_sqe *
+get_sqe(struct copy_file_uring *U, size_t index, enum uring_op op)
+{
+	unsigned int tail = *U->sq_tail + U->sq_pending;
+	unsigned int idx = tail & *U->sq_mask;
+	struct io_uring_sqe *sqe = &U->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = ((uint64_t) index << OP_BITS) | op;
+	U->sq_array[idx] = idx;
+	++U->sq_pending;
+
+	return sqe;
+}
+
+static inline void
+prep_statx(struct copy_file_uring *U, size_t index, enum uring_op op, int dirfd,
+           const char *name, struct statx *stx)
+{
+	struct io_uring_sqe *sqe = get_sqe(U, index, op);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uint64_t) (uintptr_t) name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uint64_t) (uintptr_t) stx;
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	return;
+}
+
+static inline void
+prep_openat(struct copy_file_uring *U, size_t index, enum uring_op op, int dirfd,
+            const char *name, int flags, mode_t mode)
+{
+	struct io_uring_sqe *sqe = get_sqe(U, index, op);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uint64_t) (uintptr_t) name;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	return;
+}
+
+/*
+ * Returns the position of the prepared sqe in the submission queue.
+ */
+static inline unsigned int
+prep_close(struct copy_file_uring *U, size_t index, enum uring_op op, int fd)
+{
+	unsigned int pos = *U->sq_tail + U->sq_pending;
+	struct io_uring_sqe *sqe = get_sqe(U, index, op);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	return pos;
+}
+
+/*
+ * Returns true if the kernel has taken the sqe at position ${pos} of the
+ * submission queue, in which case it will run even if waiting for it failed.
+ */
+static inline bool
+sqe_submitted(struct copy_file_uring *U, unsigned int pos)
+{
+	unsigned int head = __atomic_load_n(U->sq_head, __ATOMIC_ACQUIRE);
+	return (int) (pos - head) < 0;
+}
+
+/*
+ * Stores the result of ${cqe} in the batch entry it belongs to.
+ */
+static inline void
+complete(struct copy_file_uring *U, struct io_uring_cqe *cqe)
+{
+	struct batch_entry *entry = &U->batch[cqe->user_data >> OP_BITS];
+
+	switch ((enum uring_op) (cqe->user_data & ((1 << OP_BITS) - 1))) {
+	case OP_DST_STATX:
+		entry->dst_stat_res = cqe->res;
+		break;
+	case OP_SRC_OPEN:
+		entry->src_fd = cqe->res;
+		break;
+	case OP_DST_OPEN:
+		entry->dst_fd = cqe->res;
+		break;
+	case OP_SRC_CLOSE:
+		entry->src_fd = -1;
+		break;
+	case OP_DST_CLOSE:
+		entry->dst_fd = -1;
+		entry->dst_close_res = cqe->res;
+		break;
+	}
+	return;
+}
+
+/*
+ * Submits all the prepared sqes with one syscall and waits for all of them to
+ * complete.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+submit_and_wait(struct copy_file_uring *U)
+{
+	unsigned int to_submit = U->sq_pending;
+	unsigned int remaining = to_submit;
+	if (to_submit == 0)
+		return 0;
+
+	__atomic_store_n(U->sq_tail, *U->sq_tail + to_submit, __ATOMIC_RELEASE);
+	U->sq_pending = 0;
+
+	while (remaining > 0) {
+		int ret = io_uring_enter(U->ring_fd, to_submit, remaining,
+		                         IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		to_submit -= (unsigned int) ret < to_submit ? (unsigned int) ret : to_submit;
+
+		unsigned int head = *U->cq_head;
+		unsigned int tail = __atomic_load_n(U->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail && remaining > 0; ++head, --remaining)
+			complete(U, &U->cqes[head & *U->cq_mask]);
+		__atomic_store_n(U->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/*
+ * Fills the members of ${statbuf} that syncing uses from ${stx}.
+ */
+static inline void
+statx_to_stat(struct statx *stx, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	statbuf->st_ino = stx->stx_ino;
+	statbuf->st_mode = stx->stx_mode;
+	statbuf->st_nlink = stx->stx_nlink;
+	statbuf->st_uid = stx->stx_uid;
+	statbuf->st_gid = stx->stx_gid;
+	statbuf->st_size = (off_t) stx->stx_size;
+	statbuf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	statbuf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	statbuf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	statbuf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	return;
+}
+
+/*
+ * Sets the times of the copied file of ${entry}, ${name} in ${dir}, once its
+ * destination has been closed and records it in the manifest.
+ */
+static void
+finish_copy(const struct sync_options *opts, struct dir_node *dir, char *name,
+            struct batch_entry *entry)
+{
+	if (entry->dst_close_res < 0) {
+		char *err = "Failed to close file descriptor for destination %s/%s";
+		print_error_and_reset_errno(-entry->dst_close_res, err, dir->dst, name);
+		return;
+	}
+	if (sync_file_set_times(dir, name, &entry->src_statbuf) == 0 &&
+	    opts->manifest != NULL)
+		manifest_add_file(opts->manifest, dir, name, &entry->src_statbuf);
+	return;
+}
+
+/*
+ * Moves the entries of ${sds} whose files are being copied to the front,
+ * closing the file descriptors that have been opened for them.
+ *
+ * Returns the number of entries moved.
+ */
+static size_t
+move_copying_to_front(struct copy_file_uring *U, struct sync_data *sds,
+                      size_t cnt)
+{
+	size_t left = 0;
+	for (size_t i = 0; i < cnt; ++i) {
+		struct batch_entry *entry = &U->batch[i];
+		if (entry->copying == false)
+			continue;
+		if (entry->src_fd >= 0)
+			close(entry->src_fd);
+		if (entry->dst_fd >= 0)
+			close(entry->dst_fd);
+		struct sync_data sd = sds[left];
+		sds[left] = sds[i];
+		sds[i] = sd;
+		++left;
+	}
+	return left;
+}
+
+/*
+ * Syncs the ${cnt} files of ${sds} like sync_file_with_stat does for one file
+ * (with the source's stat of the entries), but the destination statx, the
+ * openat and the close syscalls of all the files are each submitted to
+ * io_uring at once. The data copy itself is done
+ * with copy_file_data and the timestamps are set with utimensat as io_uring
+ * doesn't have operations for them. ${cnt} must not be more than the batch
+ * size ${U} was initialized with. Files with multiple hard links are synced
+ * with sync_file_with_stat.
+ *
+ * Returns 0 on success. Failures of individual files are reported like
+ * sync_file does. Returns -1 if io_uring itself failed, in which case ${U}
+ * must not be used anymore and the ${*left} files that haven't been synced
+ * are moved to the front of ${sds} for the caller to sync some other way.
+ */
+int
+copy_file_uring_sync(struct copy_file_uring *U, const struct sync_options *opts,
+                     struct sync_data *sds, size_t cnt, size_t *left)
+{
+	bool force_copy = opts->force_copy;
+	int ret;
+	char *err;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		struct batch_entry *entry = &U->batch[i];
+		entry->copying = false;
+		entry->copied = false;
+		entry->src_fd = -1;
+		entry->dst_fd = -1;
+		entry->dst_stat_res = 0;
+		entry->dst_close_res = 0;
+		sync_stat_to_stat(&sds[i].stat, &entry->src_statbuf);
+		entry->unchanged = opts->manifest != NULL && force_copy == false &&
+			manifest_file_unchanged(opts->manifest, sds[i].dir, sds[i].name,
+			                        &entry->src_statbuf);
+		if (force_copy == false && entry->unchanged == false)
+			prep_statx(U, i, OP_DST_STATX, sds[i].dir->dst_fd, sds[i].name,
+			           &entry->dst_stx);
+	}
+	if (submit_and_wait(U) != 0) {
+		/* Nothing has been synced yet. */
+		*left = cnt;
+		errno = 0;
+		return -1;
+	}
+
+	for (size_t i = 0; i < cnt; ++i) {
+		struct batch_entry *entry = &U->batch[i];
+		struct dir_node *dir = sds[i].dir;
+		char *name = sds[i].name;
+
+		struct stat dst_statbuf;
+
+		/* Files with multiple hard links may have to wait for another
+		   thread syncing the same inode, so they are synced on their own. */
+		if (opts->links != NULL && S_ISREG(entry->src_statbuf.st_mode) &&
+		    entry->src_statbuf.st_nlink > 1) {
+			sync_file_with_stat(opts, dir, name, &entry->src_statbuf);
+			continue;
+		}
+
+		if (entry->unchanged) {
+			manifest_add_file(opts->manifest, dir, name, &entry->src_statbuf);
+			metrics_add(METRICS_FILES_SKIPPED, 1);
+			continue;
+		}
+
+		if (entry->dst_stat_res == 0 && force_copy == false)
+			statx_to_stat(&entry->dst_stx, &dst_statbuf);
+
+		ret = sync_file_compare(opts, dir, name, &entry->src_statbuf,
+		                        &dst_statbuf, -entry->dst_stat_res);
+		if (ret == 0 && opts->manifest != NULL)
+			manifest_add_file(opts->manifest, dir, name, &entry->src_statbuf);
+		if (ret == 0)
+			metrics_add(METRICS_FILES_SKIPPED, 1);
+		if (ret != 1)
+			continue;
+
+		switch (entry->src_statbuf.st_mode & S_IFMT) {
+		case S_IFLNK:
+			ret = copy_symlink(dir, name, entry->src_statbuf.st_size);
+			if (ret == 0) {
+				metrics_add(METRICS_FILES_COPIED, 1);
+				ret = sync_file_set_times(dir, name, &entry->src_statbuf);
+			}
+			if (ret == 0 && opts->manifest != NULL)
+				manifest_add_file(opts->manifest, dir, name, &entry->src_statbuf);
+			break;
+
+		case S_IFREG:
+			/* The temporary file is opened, linked and renamed relative to the
+			   destination directory, which io_uring is not used for. */
+			if (opts->atomic) {
+				uint64_t start = metrics_now();
+				ret = copy_file_atomic(opts, dir, name, &entry->src_statbuf);
+				metrics_record(METRICS_COPY, start);
+				if (ret != 0)
+					break;
+				metrics_add(METRICS_FILES_COPIED, 1);
+				metrics_add(METRICS_BYTES_COPIED,
+				            (uintmax_t) entry->src_statbuf.st_size);
+				if (opts->manifest != NULL)
+					manifest_add_file(opts->manifest, dir, name,
+					                  &entry->src_statbuf);
+				break;
+			}
+			entry->copying = true;
+			prep_openat(U, i, OP_SRC_OPEN, dir->src_fd, name,
+			            O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+			prep_openat(U, i, OP_DST_OPEN, dir->dst_fd, name,
+			            O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+			            entry->src_statbuf.st_mode);
+			break;
+
+		default:
+			err = "Failed to sync %s/%s. Source must be a regular file or symbolic link";
+			print_error_and_reset_errno(0, err, dir->src, name);
+			break;
+		}
+	}
+	if (submit_and_wait(U) != 0) {
+		/* Only the files being copied are left, and they are copied again
+		   from scratch. */
+		*left = move_copying_to_front(U, sds, cnt);
+		errno = 0;
+		return -1;
+	}
+
+	for (size_t i = 0; i < cnt; ++i) {
+		struct batch_entry *entry = &U->batch[i];
+		struct dir_node *dir = sds[i].dir;
+		char *name = sds[i].name;
+		if (entry->copying == false)
+			continue;
+
+		if (entry->src_fd < 0) {
+			err = "Failed to open source %s/%s";
+			print_error_and_reset_errno(-entry->src_fd, err, dir->src, name);
+		} else if (entry->dst_fd < 0) {
+			err = "Failed to open destination %s/%s";
+			print_error_and_reset_errno(-entry->dst_fd, err, dir->dst, name);
+		} else {
+			uintmax_t size = (uintmax_t) entry->src_statbuf.st_size;
+			uint64_t start = metrics_now();
+			ret = copy_file_data(opts, dir, entry->src_fd, entry->dst_fd, size);
+			metrics_record(METRICS_COPY, start);
+			if (ret == -1) {
+				err = "Failed to copy %s/%s to %s/%s";
+				print_error_and_reset_errno(errno, err, dir->src, name, dir->dst,
+				                            name);
+			} else {
+				entry->copied = true;
+				metrics_add(METRICS_FILES_COPIED, 1);
+				metrics_add(METRICS_BYTES_COPIED, size);
+			}
+		}
+
+		if (entry->src_fd >= 0)
+			entry->src_close_pos = prep_close(U, i, OP_SRC_CLOSE, entry->src_fd);
+		if (entry->dst_fd >= 0)
+			entry->dst_close_pos = prep_close(U, i, OP_DST_CLOSE, entry->dst_fd);
+	}
+	bool failed = submit_and_wait(U) != 0;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		struct batch_entry *entry = &U->batch[i];
+		if (failed && entry->copying) {
+			/* Every file has been copied, only the files whose close hasn't
+			   been taken by the kernel are closed here. A close that has been
+			   taken runs anyway and its result is unknown. */
+			if (entry->src_fd >= 0 && !sqe_submitted(U, entry->src_close_pos))
+				close(entry->src_fd);
+			if (entry->dst_fd >= 0 && !sqe_submitted(U, entry->dst_close_pos))
+				entry->dst_close_res = close(entry->dst_fd) == 0 ? 0 : -errno;
+		}
+		if (entry->copied)
+			finish_copy(opts, sds[i].dir, sds[i].name, entry);
+	}
+
+	if (failed) {
+		*left = 0;
+		errno = 0;
+		return -1;
+	}
+	return 0;
+}
@@ -3,17 +3,93 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/types.h>
+
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "copy_read_write.h"
 
+/* Zero blocks are detected and skipped at this granularity which is the block
+   size of most filesystems. */
+#define ZERO_BLOCK_SIZE 4096
+
+/*
+ * Checks ${len} bytes of ${buf} 64 bytes at a time. The 8 word loads of each
+ * stride are or-ed together without branches, which compilers turn into vector
+ * instructions, and only the result of the stride is branched on.
+ *
+ * Returns true if all the bytes are zero, false otherwise.
+ */
+static inline bool
+is_zero(const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		uint64_t w[8];
+		memcpy(w, buf + i, sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return false;
+	}
+	for (; i < len; ++i) {
+		if (buf[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Writes ${len} bytes of ${buf} to ${dst} at the current offset, skipping over
+ * ZERO_BLOCK_SIZE blocks that are all zero instead of writing them. As ${dst} is
+ * written from scratch, the skipped blocks become holes in the destination.
+ * ${*skipped} is set to whether the last block was skipped.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+write_skipping_zeros(int dst, const uint8_t *buf, size_t len, bool *skipped)
+{
+	size_t off = 0;
+	while (off < len) {
+		size_t block = len - off > ZERO_BLOCK_SIZE ? ZERO_BLOCK_SIZE : len - off;
+		if (is_zero(buf + off, block)) {
+			if (lseek(dst, (off_t) block, SEEK_CUR) == -1)
+				return -1;
+			off += block;
+			*skipped = true;
+			continue;
+		}
+
+		/* Write the whole run of non zero blocks at once. */
+		size_t end = off + block;
+		while (end < len) {
+			size_t next = len - end > ZERO_BLOCK_SIZE ? ZERO_BLOCK_SIZE : len - end;
+			if (is_zero(buf + end, next))
+				break;
+			end += next;
+		}
+		while (off < end) {
+			ssize_t bytes_written = write(dst, buf + off, end - off);
+			if (bytes_written == -1)
+				return -1;
+			off += (size_t) bytes_written;
+		}
+		*skipped = false;
+	}
+
+	return 0;
+}
+
 /*
- * Copy source file descriptor ${src} to destination file descriptor ${dst}
- * using a read write loop. This should be used for systems where we can't
- * utilize better system specific apis for copying.
+ * Copy ${size} bytes from source file descriptor ${src} to destination file
+ * descriptor ${dst} using a read write loop starting at their current offsets.
+ * This should be used for systems where we can't utilize better system specific
+ * apis for copying. ${dst} must not have any data from its current offset
+ * onwards as blocks of zeros are not written but skipped over, leaving holes.
  *
  * Returns 0 on success, -1 on failure. Sets errno on failure.
  */
@@ -28,24 +104,86 @@ copy_read_write(int src, int dst, uintmax_t size)
 	if (buf == NULL)
 		goto err0;
 
+	bool skipped = false;
 	uintmax_t bytes_left = size;
 	while (bytes_left > 0) {
 		size_t len = bytes_left > buf_size ? buf_size : (size_t) bytes_left;
 		ssize_t bytes_read = read(src, buf, len);
 		if (bytes_read == -1)
 			goto err1;
+		/* Source getting shorter after stat is not an error. */
+		if (bytes_read == 0)
+			break;
+
+		if (write_skipping_zeros(dst, buf, (size_t) bytes_read, &skipped) != 0)
+			goto err1;
+
+		bytes_left -= (uintmax_t) bytes_read;
+	}
+
+	/* Skipping over trailing zeros doesn't extend the file by itself. */
+	if (skipped) {
+		off_t end = lseek(dst, 0, SEEK_CUR);
+		if (end == -1 || ftruncate(dst, end) != 0)
+			goto err1;
+	}
+
+	free(buf);
+	return 0;
+
+ err1:
+	free(buf);
+ err0:
+	return -1;
+}
+
+/*
+ * Copy ${len} bytes at offset ${off} of source file descriptor ${src} to the same
+ * offset of destination file descriptor ${dst} using a pread pwrite loop, which
+ * leaves the file offsets alone so that different ranges of the same files can
+ * be copied concurrently. ${dst} must not have any data in the range as blocks
+ * of zeros are not written, and must already be at least ${off} + ${len} bytes
+ * long for them to read back as zeros.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+copy_read_write_range(int src, int dst, uintmax_t off, uintmax_t len)
+{
+	size_t buf_size = (uintmax_t) (256 * 1024) < (uintmax_t) SSIZE_MAX
+		? (256 * 1024)
+		: SSIZE_MAX;
+	uint8_t *buf = malloc(buf_size);
+	if (buf == NULL)
+		goto err0;
+
+	uintmax_t bytes_left = len;
+	while (bytes_left > 0) {
+		size_t n = bytes_left > buf_size ? buf_size : (size_t) bytes_left;
+		ssize_t bytes_read = pread(src, buf, n, (off_t) off);
+		if (bytes_read == -1)
+			goto err1;
+		/* Source getting shorter after stat is not an error. */
+		if (bytes_read == 0)
+			break;
 
-		uintmax_t copied = bytes_read;
-		uint8_t *buf_ptr =  buf;
-		while (bytes_read > 0) {
-			ssize_t bytes_written = write(dst, buf_ptr, bytes_read);
+		size_t i = 0;
+		while (i < (size_t) bytes_read) {
+			size_t block = (size_t) bytes_read - i > ZERO_BLOCK_SIZE
+				? ZERO_BLOCK_SIZE
+				: (size_t) bytes_read - i;
+			if (is_zero(buf + i, block)) {
+				i += block;
+				continue;
+			}
+			ssize_t bytes_written = pwrite(dst, buf + i, block, (off_t) (off + i));
 			if (bytes_written == -1)
 				goto err1;
-			bytes_read -= bytes_written;
-			buf_ptr += bytes_written;
+			i += (size_t) bytes_written;
 		}
 
-		bytes_left -= (uintmax_t) copied;
+		off += (uintmax_t) bytes_read;
+		bytes_left -= (uintmax_t) bytes_read;
 	}
 
 	free(buf);
@@ -56,3 +194,60 @@ copy_read_write(int src, int dst, uintmax_t size)
  err0:
 	return -1;
 }
+
+/*
+ * Compares ${size} bytes of ${src} and ${dst} from offset 0 with a pread loop
+ * of large reads, which leaves the file offsets alone. memcmp of libc compares
+ * the buffers with vector instructions and comparing stops at the first
+ * difference, so files that differ early are hardly read.
+ *
+ * Returns 1 if the bytes are the same, 0 if not, -1 on failure. Sets errno on
+ * failure.
+ */
+int
+copy_read_write_equal(int src, int dst, uintmax_t size)
+{
+	int rc = 1;
+	size_t buf_size = (uintmax_t) (1024 * 1024) < (uintmax_t) SSIZE_MAX
+		? (1024 * 1024)
+		: SSIZE_MAX;
+	uint8_t *buf = malloc(2 * buf_size);
+	if (buf == NULL)
+		return -1;
+	uint8_t *dst_buf = buf + buf_size;
+
+	uintmax_t off = 0;
+	while (off < size) {
+		size_t n = size - off > buf_size ? buf_size : (size_t) (size - off);
+		ssize_t src_read = pread(src, buf, n, (off_t) off);
+		if (src_read == -1) {
+			rc = -1;
+			break;
+		}
+		/* Files that change size while being compared differ. */
+		if (src_read == 0) {
+			rc = 0;
+			break;
+		}
+		size_t dst_len = 0;
+		ssize_t dst_read = 1;
+		while (dst_len < (size_t) src_read && dst_read > 0) {
+			dst_read = pread(dst, dst_buf + dst_len, (size_t) src_read - dst_len,
+			                 (off_t) (off + dst_len));
+			if (dst_read > 0)
+				dst_len += (size_t) dst_read;
+		}
+		if (dst_read == -1 || dst_len < (size_t) src_read) {
+			rc = dst_read == -1 ? -1 : 0;
+			break;
+		}
+		if (memcmp(buf, dst_buf, (size_t) src_read) != 0) {
+			rc = 0;
+			break;
+		}
+		off += (uintmax_t) src_read;
+	}
+
+	free(buf);
+	return rc;
+}
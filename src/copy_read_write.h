@@ -9,5 +9,7 @@
 #include <stdint.h>
 
 int copy_read_write(int src, int dst, uintmax_t size);
+int copy_read_write_range(int src, int dst, uintmax_t off, uintmax_t len);
+int copy_read_write_equal(int src, int dst, uintmax_t size);
 
 #endif /* COPY_READ_WRITE_H */
@@ -13,16 +13,18 @@
 #include <unistd.h>
 
 #include "copy_symlink.h"
+#include "dir_node.h"
 #include "utils.h"
 
 /*
- * Copy symbolic link ${src} itself (i.e., not what it points to) to ${dst}.
- * ${size} is symbolic link ${src}'s size.
+ * Copy symbolic link ${name} in ${dir}'s source directory itself (i.e., not what
+ * it points to) to ${name} in ${dir}'s destination directory. ${size} is the
+ * source symbolic link's size.
  *
  * Returns 0 on success, -1 on failure.
  */
 int
-copy_symlink(char *src, char *dst, uintmax_t size)
+copy_symlink(struct dir_node *dir, char *name, uintmax_t size)
 {
 	int ret;
 	char *err;
@@ -31,47 +33,48 @@ copy_symlink(char *src, char *dst, uintmax_t size)
 	   readlinkat ssize_t. */
 	if (size > (uintmax_t) (SSIZE_MAX - 1)) {
 		errno = ENOMEM;
-		err = "Skipping copy of symbolic link %s";
-		print_error_and_reset_errno(errno, err, src);
+		err = "Skipping copy of symbolic link %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
 		goto err0;
 	}
 	char *buf = malloc(size + 1);
 	if (buf == NULL) {
-		err = "Skipping copy of symbolic link %s";
-		print_error_and_reset_errno(errno, err, src);
+		err = "Skipping copy of symbolic link %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
 		goto err0;
 	}
-	ssize_t link_ret = readlinkat(AT_FDCWD, src, buf, size);
+	ssize_t link_ret = readlinkat(dir->src_fd, name, buf, size);
 	if (link_ret == -1) {
-		err = "Skipping copy of symbolic link %s. Failed to read contents";
-		print_error_and_reset_errno(errno, err, src);
+		err = "Skipping copy of symbolic link %s/%s. Failed to read contents";
+		print_error_and_reset_errno(errno, err, dir->src, name);
 		goto err1;
 	} else if ((uintmax_t) link_ret != size) {
-		err = "Skipping copy of symbolic link %s. "
-			"Stat size and read size did not match\n";
-		fprintf(stderr, err, src);
+		err = "Skipping copy of symbolic link %s/%s. "
+			"Stat size and read size did not match";
+		print_error_and_reset_errno(0, err, dir->src, name);
 		goto err1;
 	}
 	buf[link_ret] = '\0';
-	ret = symlinkat(buf, AT_FDCWD, dst);
+	ret = symlinkat(buf, dir->dst_fd, name);
 	if (ret != 0) {
 		if (errno == EEXIST) {
-			ret = unlinkat(AT_FDCWD, dst, 0);
+			ret = unlinkat(dir->dst_fd, name, 0);
 			if (ret != 0) {
-				err = "Skipping copy of symbolic link %s. Failed to unlink "
-					"existing symbolic link %s";
-				print_error_and_reset_errno(errno, err, src, dst);
+				err = "Skipping copy of symbolic link %s/%s. Failed to unlink "
+					"existing symbolic link %s/%s";
+				print_error_and_reset_errno(errno, err, dir->src, name, dir->dst,
+				                            name);
 				goto err1;
 			}
-			ret = symlinkat(buf, AT_FDCWD, dst);
+			ret = symlinkat(buf, dir->dst_fd, name);
 			if (ret != 0) {
-				err = "Failed to create symbolic link %s";
-				print_error_and_reset_errno(errno, err, dst);
+				err = "Failed to create symbolic link %s/%s";
+				print_error_and_reset_errno(errno, err, dir->dst, name);
 				goto err1;
 			}
 		} else {
-			err = "Failed to create symbolic link %s";
-			print_error_and_reset_errno(errno, err, dst);
+			err = "Failed to create symbolic link %s/%s";
+			print_error_and_reset_errno(errno, err, dir->dst, name);
 			goto err1;
 		}
 	}
@@ -6,9 +6,11 @@
 #ifndef COPY_SYMLINK_H
 #define COPY_SYMLINK_H
 
-#include <stddef.h>
+#include <stdint.h>
 
-int copy_symlink(char *src, char *dst, size_t size);
+#include "dir_node.h"
+
+int copy_symlink(struct dir_node *dir, char *name, uintmax_t size);
 
 #endif /* COPY_SYMLINK_H */
 
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delete_extras.h"
+#include "dir_node.h"
+#include "manifest.h"
+#include "utils.h"
+
+/*
+ * Initialize empty name list ${L}.
+ */
+void
+name_list_init(struct name_list *L)
+{
+	L->buf = NULL;
+	L->buf_len = 0;
+	L->buf_cap = 0;
+	L->offs = NULL;
+	L->cnt = 0;
+	L->cap = 0;
+	return;
+}
+
+/*
+ * Adds "${name}" to ${L}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+name_list_add(struct name_list *L, const char *name, size_t name_len)
+{
+	if (L->cnt == L->cap) {
+		size_t cap = L->cap > 0 ? L->cap * 2 : 64;
+		size_t *offs = realloc(L->offs, cap * sizeof(size_t));
+		if (offs == NULL)
+			return -1;
+		L->offs = offs;
+		L->cap = cap;
+	}
+	if (name_len + 1 > L->buf_cap - L->buf_len) {
+		size_t cap = L->buf_cap > 0 ? L->buf_cap : 1024;
+		while (name_len + 1 > cap - L->buf_len)
+			cap *= 2;
+		char *buf = realloc(L->buf, cap);
+		if (buf == NULL)
+			return -1;
+		L->buf = buf;
+		L->buf_cap = cap;
+	}
+
+	memcpy(L->buf + L->buf_len, name, name_len);
+	L->buf[L->buf_len + name_len] = '\0';
+	L->offs[L->cnt++] = L->buf_len;
+	L->buf_len += name_len + 1;
+	return 0;
+}
+
+/*
+ * Frees the names of ${L}, leaving it empty.
+ */
+void
+name_list_free(struct name_list *L)
+{
+	free(L->buf);
+	free(L->offs);
+	name_list_init(L);
+	return;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Returns the names of ${L} sorted or NULL on failure. Sets errno on failure.
+ */
+static char **
+sorted_names(struct name_list *L)
+{
+	char **names = malloc((L->cnt > 0 ? L->cnt : 1) * sizeof(char *));
+	if (names == NULL)
+		return NULL;
+	for (size_t i = 0; i < L->cnt; ++i)
+		names[i] = L->buf + L->offs[i];
+	qsort(names, L->cnt, sizeof(char *), compare_names);
+	return names;
+}
+
+/*
+ * Reads the names of the entries of the directory with file descriptor ${fd}
+ * into ${L}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+read_names(int fd, struct name_list *L)
+{
+	/* The directory stream gets its own file descriptor as closedir closes
+	   it. */
+	int dir_fd = dup(fd);
+	DIR *dir = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+	if (dir == NULL) {
+		if (dir_fd != -1)
+			close(dir_fd);
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent *dent;
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL) {
+		char *name = dent->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (name_list_add(L, name, strlen(name)) != 0)
+			break;
+		errno = 0;
+	}
+	if (errno != 0)
+		ret = -1;
+
+	int err = errno;
+	/* Ignore return value from closedir. */
+	closedir(dir);
+	errno = err;
+	return ret;
+}
+
+/*
+ * Deletes ${name} in the directory with file descriptor ${dir_fd} (whose path
+ * is ${dir}), with everything in it if it is a directory. Errors are reported
+ * and the rest is deleted still.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+remove_entry(int dir_fd, const char *dir, const char *name)
+{
+	int rc = 0;
+	char *err;
+
+	/* Entries deleted meanwhile are no longer extra. */
+	if (unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT) {
+		errno = 0;
+		return 0;
+	}
+	/* unlink fails with EISDIR on linux and EPERM elsewhere for directories */
+	if (errno != EISDIR && errno != EPERM)
+		goto err0;
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		goto err0;
+
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path = malloc(joined_path_len(dir, dir_len, name_len) + 1);
+	if (path == NULL) {
+		close(fd);
+		goto err0;
+	}
+	join_path(path, dir, dir_len, name, name_len);
+
+	/* Read the whole listing first as removing entries while reading the
+	   directory may make readdir skip entries. */
+	struct name_list L;
+	name_list_init(&L);
+	if (read_names(fd, &L) != 0) {
+		err = "Failed to read directory %s";
+		print_error_and_reset_errno(errno, err, path);
+		rc = -1;
+	}
+	for (size_t i = 0; i < L.cnt; ++i) {
+		if (remove_entry(fd, path, L.buf + L.offs[i]) != 0)
+			rc = -1;
+	}
+	name_list_free(&L);
+	close(fd);
+
+	if (rc == 0 && unlinkat(dir_fd, name, AT_REMOVEDIR) != 0) {
+		err = "Failed to delete directory %s";
+		print_error_and_reset_errno(errno, err, path);
+		rc = -1;
+	}
+	free(path);
+	return rc;
+
+ err0:
+	err = "Failed to delete %s/%s";
+	print_error_and_reset_errno(errno, err, dir, name);
+	return -1;
+}
+
+/*
+ * Deletes ${name} in directory ${dir}, with everything in it if it is a
+ * directory.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+delete_entry(const char *dir, const char *name)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return 0;
+		}
+		print_error_and_reset_errno(errno, "Failed to delete %s/%s", dir, name);
+		return -1;
+	}
+	int rc = remove_entry(fd, dir, name);
+	/* Ignore return value from close as the directory is opened for reading
+	   only. */
+	close(fd);
+	return rc;
+}
+
+/*
+ * Deletes the entries of ${dir}'s destination directory which are not among
+ * ${src_names}, the complete listing of the source directory. Both listings
+ * are sorted and merged, so it takes O(n log n) time and O(n) memory for a
+ * directory of n entries. The manifest directory of the destination directory
+ * itself is kept.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+delete_extras(struct dir_node *dir, struct name_list *src_names)
+{
+	int rc = 0;
+	char *err;
+
+	struct name_list dst_names;
+	name_list_init(&dst_names);
+	if (read_names(dir->dst_fd, &dst_names) != 0) {
+		err = "Failed to read directory %s. Skipping deleting extra entries";
+		print_error_and_reset_errno(errno, err, dir->dst);
+		rc = -1;
+		goto out0;
+	}
+
+	char **src = sorted_names(src_names);
+	if (src == NULL)
+		goto err0;
+	char **dst = sorted_names(&dst_names);
+	if (dst == NULL)
+		goto err1;
+
+	size_t i = 0;
+	for (size_t j = 0; j < dst_names.cnt; ++j) {
+		int cmp = 1;
+		while (i < src_names->cnt && (cmp = strcmp(src[i], dst[j])) < 0)
+			++i;
+		if (i < src_names->cnt && cmp == 0)
+			continue;
+		if (dir->is_dst_root && dir->parent == NULL &&
+		    strcmp(dst[j], MANIFEST_DIR) == 0)
+			continue;
+		if (remove_entry(dir->dst_fd, dir->dst, dst[j]) != 0)
+			rc = -1;
+	}
+
+	free(dst);
+	free(src);
+ out0:
+	name_list_free(&dst_names);
+	return rc;
+
+ err1:
+	free(src);
+ err0:
+	err = "Failed to delete extra entries of directory %s";
+	print_error_and_reset_errno(errno, err, dir->dst);
+	name_list_free(&dst_names);
+	return -1;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef DELETE_EXTRAS_H
+#define DELETE_EXTRAS_H
+
+#include <stddef.h>
+
+#include "dir_node.h"
+
+/*
+ * Whether entries of destination directories which are not in the source
+ * directories are deleted. With DELETE_BEFORE, a directory's extra entries are
+ * deleted before its files are queued for syncing and with DELETE_AFTER, once
+ * all of its files have been synced.
+ */
+enum delete_mode {
+	DELETE_NONE,
+	DELETE_BEFORE,
+	DELETE_AFTER
+};
+
+/*
+ * Names of the entries of a directory. The names are kept one after another
+ * in ${buf} so that a listing takes two allocations no matter how many
+ * entries it has.
+ */
+struct name_list {
+	char *buf;
+	size_t buf_len;
+	size_t buf_cap;
+	size_t *offs;
+	size_t cnt;
+	size_t cap;
+};
+
+void name_list_init(struct name_list *L);
+int name_list_add(struct name_list *L, const char *name, size_t name_len);
+void name_list_free(struct name_list *L);
+int delete_entry(const char *dir, const char *name);
+int delete_extras(struct dir_node *dir, struct name_list *src_names);
+
+#endif /* DELETE_EXTRAS_H */
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dir_deque.h"
+
+#define INITIAL_CAPACITY 64
+
+/*
+ * Initialize an empty deque ${D}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+dir_deque_init(struct dir_deque *D)
+{
+	int ret = pthread_mutex_init(&D->lock, NULL);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	D->items = NULL;
+	D->cap = 0;
+	D->head = 0;
+	__atomic_store_n(&D->cnt, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Free the resources held by ${D}. Entries that are still in the deque are not
+ * freed.
+ */
+void
+dir_deque_destroy(struct dir_deque *D)
+{
+	pthread_mutex_destroy(&D->lock);
+	free(D->items);
+	return;
+}
+
+/*
+ * Grow the ring buffer of ${D}, keeping the entries in order. Must be called
+ * with ${D->lock} held.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+grow(struct dir_deque *D)
+{
+	size_t cap = D->cap == 0 ? INITIAL_CAPACITY : D->cap;
+	if (D->cap != 0) {
+		if (cap > SIZE_MAX / 2 / sizeof(struct dir_node *)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		cap *= 2;
+	}
+
+	struct dir_node **items = malloc(cap * sizeof(struct dir_node *));
+	if (items == NULL)
+		return -1;
+
+	for (size_t i = 0; i < D->cnt; ++i)
+		items[i] = D->items[(D->head + i) % D->cap];
+
+	free(D->items);
+	D->items = items;
+	D->cap = cap;
+	D->head = 0;
+
+	return 0;
+}
+
+/*
+ * Push ${node} at the back of ${D}. Only the owner of ${D} should call this.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+dir_deque_push(struct dir_deque *D, struct dir_node *node)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&D->lock);
+	if (D->cnt == D->cap && grow(D) != 0) {
+		rc = -1;
+		goto done;
+	}
+
+	D->items[(D->head + D->cnt) % D->cap] = node;
+	__atomic_store_n(&D->cnt, D->cnt + 1, __ATOMIC_RELAXED);
+
+ done:
+	pthread_mutex_unlock(&D->lock);
+	return rc;
+}
+
+/*
+ * Pop the entry at the back of ${D} i.e., the most recently pushed one. Only the
+ * owner of ${D} should call this.
+ *
+ * Returns the entry or NULL if ${D} is empty.
+ */
+struct dir_node *
+dir_deque_pop(struct dir_deque *D)
+{
+	struct dir_node *node = NULL;
+
+	pthread_mutex_lock(&D->lock);
+	if (D->cnt > 0) {
+		node = D->items[(D->head + D->cnt - 1) % D->cap];
+		__atomic_store_n(&D->cnt, D->cnt - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&D->lock);
+
+	return node;
+}
+
+/*
+ * Steal the entry at the front of ${D} i.e., the least recently pushed one.
+ * Can be called by any thread.
+ *
+ * Returns the entry or NULL if ${D} is empty.
+ */
+struct dir_node *
+dir_deque_steal(struct dir_deque *D)
+{
+	struct dir_node *node = NULL;
+
+	/* Avoid taking the lock of deques that look empty. */
+	if (dir_deque_size(D) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&D->lock);
+	if (D->cnt > 0) {
+		node = D->items[D->head];
+		D->head = (D->head + 1) % D->cap;
+		__atomic_store_n(&D->cnt, D->cnt - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&D->lock);
+
+	return node;
+}
+
+/*
+ * Returns a snapshot of the number of entries in ${D} without taking the lock.
+ */
+size_t
+dir_deque_size(struct dir_deque *D)
+{
+	return __atomic_load_n(&D->cnt, __ATOMIC_RELAXED);
+}
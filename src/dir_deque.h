@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef DIR_DEQUE_H
+#define DIR_DEQUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dir_node.h"
+
+#define CACHELINE_SIZE 64
+
+/*
+ * Per traversal thread double ended queue of directories that are yet to be
+ * scanned. The owning thread pushes and pops at the back (so that it traverses
+ * depth first like fts would) while idle threads steal from the front, which
+ * tends to hold directories closer to the root i.e., bigger units of work.
+ *
+ * The paddings keep the deques of different threads on separate cachelines.
+ */
+struct dir_deque {
+	uint8_t pad0[CACHELINE_SIZE];
+	pthread_mutex_t lock;
+	struct dir_node **items;
+	size_t cap;
+	size_t head;
+	size_t cnt;
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+int dir_deque_init(struct dir_deque *D);
+void dir_deque_destroy(struct dir_deque *D);
+int dir_deque_push(struct dir_deque *D, struct dir_node *node);
+struct dir_node *dir_deque_pop(struct dir_deque *D);
+struct dir_node *dir_deque_steal(struct dir_deque *D);
+size_t dir_deque_size(struct dir_deque *D);
+
+#endif /* DIR_DEQUE_H */
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "delete_extras.h"
+#include "dir_node.h"
+#include "utils.h"
+
+/*
+ * Allocates a dir_node from ${A} with room for ${src_len} and ${dst_len} long
+ * paths (and their terminating null bytes) right after the struct.
+ *
+ * Returns the dir_node with one reference on success, NULL on failure. Sets
+ * errno on failure.
+ */
+static struct dir_node *
+dir_node_alloc(struct arena *A, size_t src_len, size_t dst_len)
+{
+	if (src_len > SIZE_MAX - sizeof(struct dir_node) - 2 ||
+	    dst_len > SIZE_MAX - sizeof(struct dir_node) - 2 - src_len) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct dir_node *node = arena_alloc(A, sizeof(struct dir_node) + src_len +
+	                                    dst_len + 2);
+	if (node == NULL)
+		return NULL;
+
+	node->refcnt = 1;
+	node->parent = NULL;
+	node->src_fd = -1;
+	node->dst_fd = -1;
+	node->src_dev = 0;
+	node->dst_dev = 0;
+	node->dst_ctime.tv_sec = 0;
+	node->dst_ctime.tv_nsec = 0;
+	node->src_ctime.tv_sec = 0;
+	node->src_ctime.tv_nsec = 0;
+	node->manifest_ok = false;
+	node->no_tmpfile = false;
+	node->src_names = NULL;
+	node->name = NULL;
+	node->src = (char *) (node + 1);
+	node->src_len = src_len;
+	node->dst = node->src + src_len + 1;
+	node->dst_len = dst_len;
+	node->is_dst_root = false;
+
+	return node;
+}
+
+/*
+ * Allocates a dir_node from ${A} for syncing ${src} directory to ${dst}.
+ *
+ * Returns the dir_node with one reference on success, NULL on failure. Sets
+ * errno on failure.
+ */
+struct dir_node *
+dir_node_new(struct arena *A, const char *src, size_t src_len, const char *dst,
+             size_t dst_len, bool is_dst_root)
+{
+	struct dir_node *node = dir_node_alloc(A, src_len, dst_len);
+	if (node == NULL)
+		return NULL;
+
+	memcpy(node->src, src, src_len);
+	node->src[src_len] = '\0';
+	memcpy(node->dst, dst, dst_len);
+	node->dst[dst_len] = '\0';
+	node->is_dst_root = is_dst_root;
+
+	return node;
+}
+
+/*
+ * Allocates a dir_node from ${A} for the ${name} subdirectory of ${parent}. The
+ * new dir_node holds a reference to ${parent}.
+ *
+ * Returns the dir_node with one reference on success, NULL on failure. Sets
+ * errno on failure.
+ */
+struct dir_node *
+dir_node_new_child(struct arena *A, struct dir_node *parent, const char *name,
+                   size_t name_len)
+{
+	size_t src_len = joined_path_len(parent->src, parent->src_len, name_len);
+	size_t dst_len = joined_path_len(parent->dst, parent->dst_len, name_len);
+	if (src_len < name_len || dst_len < name_len) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct dir_node *node = dir_node_alloc(A, src_len, dst_len);
+	if (node == NULL)
+		return NULL;
+
+	join_path(node->src, parent->src, parent->src_len, name, name_len);
+	join_path(node->dst, parent->dst, parent->dst_len, name, name_len);
+	node->name = node->src + src_len - name_len;
+	dir_node_ref(parent);
+	node->parent = parent;
+
+	return node;
+}
+
+/*
+ * Drops the reference to the parent of ${node} as it is not needed anymore.
+ */
+void
+dir_node_release_parent(struct dir_node *node)
+{
+	if (node->parent != NULL) {
+		dir_node_unref(node->parent);
+		node->parent = NULL;
+	}
+	return;
+}
+
+/*
+ * Drops a reference to ${node}, freeing it (and closing its file descriptors)
+ * if that was the last one. The extra entries of the destination directory
+ * are deleted then if ${node->src_names} is set.
+ */
+void
+dir_node_unref(struct dir_node *node)
+{
+	while (node != NULL &&
+	       __atomic_sub_fetch(&node->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct dir_node *parent = node->parent;
+		/* All the files of the directory have been synced by now. */
+		if (node->src_names != NULL) {
+			if (node->dst_fd != -1)
+				delete_extras(node, node->src_names);
+			name_list_free(node->src_names);
+			free(node->src_names);
+		}
+		/* Ignore return value from close as directories are opened for
+		   reading only. */
+		if (node->src_fd != -1)
+			close(node->src_fd);
+		if (node->dst_fd != -1)
+			close(node->dst_fd);
+		arena_free(node);
+		node = parent;
+	}
+	return;
+}
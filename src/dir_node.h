@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef DIR_NODE_H
+#define DIR_NODE_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "arena.h"
+
+struct name_list;
+
+/*
+ * A source directory and its corresponding destination directory. There is one
+ * dir_node per directory which is shared by all the files queued from that
+ * directory, so the directory paths are written once no matter how many files
+ * it has. The dir_node is freed when the last reference is dropped.
+ *
+ * Once the directory has been synced, ${src_fd} and ${dst_fd} are open file
+ * descriptors of the source and destination directories and all the per file
+ * syscalls are done relative to them. The file descriptors are closed when the
+ * dir_node is freed. ${src_dev}, ${dst_dev}, ${src_ctime} and ${dst_ctime} are
+ * set then too.
+ * ${parent} is only held until the directory has been opened relative to the
+ * parent's file descriptors.
+ */
+struct dir_node {
+	size_t refcnt;
+	struct dir_node *parent;
+	int src_fd;
+	int dst_fd;
+	/* devices (filesystems) of the source and destination directories */
+	dev_t src_dev;
+	dev_t dst_dev;
+	/* status change times of the source directory and of the destination
+	   directory before syncing, zero if it was created */
+	struct timespec src_ctime;
+	struct timespec dst_ctime;
+	/* whether the manifest's records of the directory's files can be used */
+	bool manifest_ok;
+	/* whether O_TMPFILE has failed in the destination directory */
+	bool no_tmpfile;
+	/* listing of the source directory whose extra entries in the destination
+	   directory are deleted when the dir_node is freed, NULL if none */
+	struct name_list *src_names;
+	size_t src_len;
+	char *src;
+	size_t dst_len;
+	char *dst;
+	/* last component of ${src} (and ${dst}) for nodes with a parent */
+	char *name;
+	/* true for nodes whose ${dst} is given i.e., not created by dsync like the
+	   destination directory itself for source '/' */
+	bool is_dst_root;
+};
+
+struct dir_node *dir_node_new(struct arena *A, const char *src, size_t src_len,
+                              const char *dst, size_t dst_len, bool is_dst_root);
+struct dir_node *dir_node_new_child(struct arena *A, struct dir_node *parent,
+                                    const char *name, size_t name_len);
+void dir_node_release_parent(struct dir_node *node);
+void dir_node_unref(struct dir_node *node);
+
+static inline void
+dir_node_ref(struct dir_node *node)
+{
+	__atomic_add_fetch(&node->refcnt, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+#endif /* DIR_NODE_H */
@@ -5,26 +5,110 @@
 
 #define _DEFAULT_SOURCE /* for realpath */
 
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "autotune.h"
+#include "copy_file.h"
+#include "delete_extras.h"
+#include "durable.h"
+#include "eventcount.h"
+#include "link_table.h"
+#include "log_sink.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "sync_data_heap.h"
 #include "sync_data_mpmc_queue.h"
+#include "sync_options.h"
 #include "sync_thread.h"
 #include "traverse.h"
 #include "utils.h"
+#include "verify.h"
+#include "watch.h"
 
 #define QUEUE_SIZE 512
+#define HEAP_SIZE 512
 #define MAX_SYNC_THREAD_CNT 255
+#define MAX_TRAVERSE_THREAD_CNT 255
+/* Sources on more devices than this share the pool of the first source. */
+#define MAX_POOL_CNT 16
+/* Smaller files are rewritten rather than compared with --compare as opening
+   and reading the destination costs about as much as writing them. */
+#define COMPARE_MIN_SIZE ((uintmax_t) 64 * 1024)
+/* With -j auto, a pool of 4 sync threads per cpu, within these bounds, is
+   created for the tuning to choose from. Threads waiting for I/O don't take a
+   cpu, so even rotational devices with few cpus can use more than one per
+   cpu. */
+#define AUTO_THREADS_PER_CPU 4
+#define AUTO_MIN_POOL_SIZE 16
+#define AUTO_MAX_POOL_SIZE 64
+/* Active sync threads with -j auto, one for each lane at least. */
+#define AUTO_MIN_ACTIVE_CNT 2
 
 struct dsync_flags {
 	bool force_copy;
+	bool use_io_uring;
 	uint8_t sync_thread_cnt;
+	bool auto_threads;
+	uint8_t traverse_thread_cnt;
+	enum reflink_mode reflink;
+	bool use_manifest;
+	bool prune;
+	bool watch;
+	enum watch_backend watch_backend;
+	enum delete_mode delete_mode;
+	enum durable_mode durable;
+	bool atomic;
+	bool verify;
+	char *hash_path;
+	bool compare;
+	uintmax_t compare_min_size;
+	bool progress;
+	bool stats;
+	char *stats_path;
+	enum log_format log_format;
+};
+
+/* Values returned by getopt_long for options without a short version. */
+enum long_only_option {
+	OPT_REFLINK = 256,
+	OPT_MANIFEST,
+	OPT_PRUNE,
+	OPT_WATCH,
+	OPT_DELETE,
+	OPT_DURABLE,
+	OPT_ATOMIC,
+	OPT_VERIFY,
+	OPT_COMPARE,
+	OPT_PROGRESS,
+	OPT_STATS,
+	OPT_LOG_FORMAT
+};
+
+static struct option long_options[] = {
+	{"reflink", required_argument, NULL, OPT_REFLINK},
+	{"manifest", no_argument, NULL, OPT_MANIFEST},
+	{"prune", no_argument, NULL, OPT_PRUNE},
+	{"watch", optional_argument, NULL, OPT_WATCH},
+	{"delete", optional_argument, NULL, OPT_DELETE},
+	{"durable", optional_argument, NULL, OPT_DURABLE},
+	{"atomic", no_argument, NULL, OPT_ATOMIC},
+	{"verify", optional_argument, NULL, OPT_VERIFY},
+	{"compare", optional_argument, NULL, OPT_COMPARE},
+	{"progress", no_argument, NULL, OPT_PROGRESS},
+	{"stats", optional_argument, NULL, OPT_STATS},
+	{"log-format", required_argument, NULL, OPT_LOG_FORMAT},
+	{NULL, 0, NULL, 0}
 };
 
 /*
@@ -37,21 +121,286 @@ usage(FILE *stream)
 		"Usage: dsync [OPTION]... SOURCE... DIRECTORY\n"
 		"Sync/copy SOURCE(s) to DIRECTORY.\n\n"
 		"  -f       force copy SOURCE(s) to DIRECTORY even if they are in sync\n"
-		"  -j [N]   run N (max 255) threads that sync/copy source files\n\n"
+		"  -j [N]   run N (max 255) threads that sync/copy source files per device of\n"
+		"           SOURCE(s), or pick and adjust the number of threads as it goes with\n"
+		"           -j auto\n"
+		"  -t [N]   run N (max 255) threads that traverse SOURCE(s) directories\n"
+		"  -u       use io_uring to batch the syscalls of syncing files if available\n"
+		"  --reflink=WHEN\n"
+		"           clone regular files instead of copying them, WHEN is auto (default),\n"
+		"           always or never\n"
+		"  --manifest\n"
+		"           skip unchanged files using DIRECTORY/.dsync/manifest without checking\n"
+		"           them in DIRECTORY and rewrite it at the end\n"
+		"  --prune  like --manifest, but also skip reading source directories that\n"
+		"           have not changed since the last run\n"
+		"  --watch[=BACKEND]\n"
+		"           keep running after syncing and sync changes to SOURCE(s) as they\n"
+		"           happen until interrupted, BACKEND is auto (default), fanotify or\n"
+		"           inotify\n"
+		"  --delete[=WHEN]\n"
+		"           delete files and directories in DIRECTORY that are not in\n"
+		"           SOURCE(s), WHEN is after (default) or before syncing\n"
+		"  --durable[=LEVEL]\n"
+		"           make sure what is synced is on disk before exiting, LEVEL is syncfs\n"
+		"           (default) or fsync\n"
+		"  --atomic copy files to a temporary file first and replace the destination\n"
+		"           files with it when complete\n"
+		"  --verify[=FILE]\n"
+		"           compare SOURCE(s) with DIRECTORY without syncing, reporting the\n"
+		"           files that differ, and write the hashes of SOURCE(s) files to FILE\n"
+		"  --compare[=SIZE]\n"
+		"           compare the contents of files of at least SIZE bytes (K, M or G\n"
+		"           suffix allowed, 64K by default) whose modification time differs\n"
+		"           and only set their timestamps if they are the same\n"
+		"  --progress\n"
+		"           print files scanned, copied and skipped, throughput and queue\n"
+		"           depth to stderr every second\n"
+		"  --stats[=FILE]\n"
+		"           write a JSON summary of the counters and syscall latencies to FILE\n"
+		"           (stdout by default) at the end\n"
+		"  --log-format=FORMAT\n"
+		"           print errors and messages to stderr as text (default) or json, one\n"
+		"           per line\n\n"
 		"By default (without the -f option), dsync will copy SOURCE(s) to DIRECTORY only\n"
 		"if the files' size and modification time don't match (even if file in destination\n"
 		"is newer than the corresponding source file). If SOURCE(s) themselves are symbolic\n"
 		"links they will be resolved to their actual paths. dsync always preserves mode and\n"
 		"timestamps. Multiple threads can be used to sync/copy using the -j option which\n"
 		"can reduce total time in case of source directories with a lot of directories\n"
-		"and a lot of small files in them. dsync always recursively syncs/copies all the\n"
-		"contents of the given sources. Symbolic links inside SOURCE(s) are not followed\n"
-		"but copied themselves. Extra directories or files in destination directory are\n"
-		"not detected or deleted. dsync doesn't make sure data is written to disk.\n";
+		"and a lot of small files in them. Large files are synced largest first by a\n"
+		"quarter of the threads and copied in ranges by multiple threads. dsync always\n"
+		"recursively syncs/copies all the contents of the given sources. Symbolic links\n"
+		"inside SOURCE(s) are not followed but copied themselves. Files with multiple\n"
+		"hard links inside SOURCE(s) are copied once and hard linked in destination.\n"
+		"Holes in sparse files are preserved. Extra directories or files in destination\n"
+		"directory are not deleted unless --delete is given. dsync doesn't make sure data\n"
+		"is written to disk unless --durable is given.\n"
+		"SOURCE(s) on different devices are synced by separate threads with queues\n"
+		"of their own, -j of them for every device (fewer if they don't all fit in\n"
+		"255), so that a slow device doesn't hold up the others. With -j auto, the\n"
+		"threads of every device are tuned separately.\n"
+		"Multiple threads can be used to traverse SOURCE(s) using the -t option which\n"
+		"can reduce total time in case of source trees with a lot of directories.\n"
+		"With the -u option, every sync/copy thread submits the stat, open and close\n"
+		"syscalls of many files at once using io_uring (linux only) falling back to\n"
+		"regular syscalls if io_uring is not available.\n"
+		"Cloned files share their data with the source in filesystems that support it\n"
+		"(e.g., btrfs, xfs) which takes no time and space for the data. With\n"
+		"--reflink=auto, files are copied if cloning is not supported (which is\n"
+		"remembered per pair of filesystems). With --reflink=always, failing to clone\n"
+		"a file is an error.\n"
+		"With --manifest, a file whose size, modification time and mode are the same\n"
+		"as recorded by the last run is not looked up in DIRECTORY, as long as its\n"
+		"directory in DIRECTORY has not had entries added, removed or renamed since.\n"
+		"Changes made to the contents of files in DIRECTORY by other programs are\n"
+		"not detected then, use -f or remove DIRECTORY/.dsync in that case.\n"
+		"With --prune, a source directory which has not had entries added, removed\n"
+		"or renamed since the last run (its status change time is the same) is not\n"
+		"read and its files are not looked at, only its subdirectories are checked.\n"
+		"Files that have been modified in place in such a directory (e.g., appended\n"
+		"to or truncated) are not synced then, so --prune is only safe for sources\n"
+		"whose files are replaced rather than edited. -f disables pruning.\n"
+		"With --watch (linux only), dsync syncs SOURCE(s) and then waits for changes\n"
+		"to them, which are synced shortly after they stop coming in. fanotify needs\n"
+		"CAP_SYS_ADMIN, --watch=auto falls back to inotify which watches every\n"
+		"directory separately. If changes are missed (too many at once), fanotify\n"
+		"tells the filesystem and the SOURCE(s) on it are synced again as a whole.\n"
+		"inotify doesn't tell where, so only the directories of the changes that\n"
+		"were not missed are synced again (all of SOURCE(s) if there are none), and\n"
+		"a missed change elsewhere is only synced once its directory changes again.\n"
+		"Files removed from SOURCE(s) are removed from DIRECTORY only with --delete.\n"
+		"--watch can't be used with --manifest or --prune.\n"
+		"With --delete, every directory of SOURCE(s) that is read is compared with its\n"
+		"copy in DIRECTORY and the entries only in the copy are deleted, with\n"
+		"--delete=after once the directory's files have been synced and with\n"
+		"--delete=before before they are. DIRECTORY itself is not compared as it\n"
+		"may have other entries than SOURCE(s), unless SOURCE is /. Nothing is\n"
+		"deleted from directories that couldn't be read completely or that --prune\n"
+		"skips.\n"
+		"With --durable, the data of copied files is written back while they are\n"
+		"copied and every filesystem dsync wrote to is flushed once at the end\n"
+		"(linux only, elsewhere all filesystems are flushed). --durable=fsync also\n"
+		"flushes every copied file before closing it, which is slower.\n"
+		"With --atomic, a file in DIRECTORY is either its old or its new version\n"
+		"while it is synced, even if dsync is interrupted or copying fails. The\n"
+		"new version is written to an anonymous file (O_TMPFILE, linux only) or a\n"
+		"hidden .dsync-tmp file in the same directory which is renamed over it.\n"
+		"With --verify, nothing is synced. Every file of SOURCE(s) is compared with\n"
+		"its copy in DIRECTORY by size and XXH64 hash (symbolic links by target)\n"
+		"and the ones that are missing or differ are printed, in which case dsync\n"
+		"exits with status 1. Large files are hashed in ranges by multiple threads\n"
+		"like they are copied. Extra entries in DIRECTORY are not reported. FILE\n"
+		"gets a line per regular file like xxhsum's, in no particular order. Files\n"
+		"of more than 16MiB are hashed as the XXH64 of the hashes of their 16MiB\n"
+		"ranges. -u has no effect with --verify, which can't be used with\n"
+		"--manifest, --prune, --watch or --delete.\n"
+		"With --compare, a file whose size is the same but whose modification time\n"
+		"is not (e.g., after touch or git checkout) is read in both places first and\n"
+		"isn't written again if its contents are the same, which saves slow writes\n"
+		"and wear on flash drives at the cost of reading the destination.\n"
+		"Every thread counts what it does (directories, files and bytes, errors\n"
+		"and the latencies of stat, directory, copy and timestamp syscalls) at\n"
+		"the cost of a few plain increments. Sending SIGUSR1 to dsync writes a\n"
+		"snapshot of the counters as a line of JSON to stderr at any time.\n"
+		"Errors are buffered by every thread and printed by a single thread a few\n"
+		"times a second, so they don't interleave. After 20 errors of the same\n"
+		"kind and cause (e.g., files failing to open for a full disk) in 10\n"
+		"seconds, the rest are only counted and printed once with their count and\n"
+		"the last of them at the end of the 10 seconds. With --log-format=json,\n"
+		"every line is a JSON object with the time, level, thread, message and\n"
+		"error.\n";
 	fprintf(stream, "%s", usage);
 	return;
 }
 
+/*
+ * Parses ${str} as a number of bytes with an optional K, M or G suffix (powers
+ * of 1024) into ${size}.
+ *
+ * Returns 0 on success, -1 if ${str} is not a valid size.
+ */
+static int
+parse_size(const char *str, uintmax_t *size)
+{
+	char *endptr = NULL;
+	errno = 0;
+	uintmax_t value = strtoumax(str, &endptr, 10);
+	if (errno != 0 || endptr == str) {
+		errno = 0;
+		return -1;
+	}
+
+	unsigned int shift = 0;
+	if (*endptr == 'K')
+		shift = 10;
+	else if (*endptr == 'M')
+		shift = 20;
+	else if (*endptr == 'G')
+		shift = 30;
+	if (shift != 0)
+		++endptr;
+	if (*endptr != '\0' || value > (UINTMAX_MAX >> shift))
+		return -1;
+
+	*size = value << shift;
+	return 0;
+}
+
+/*
+ * Raises the soft limit of open file descriptors to the hard limit as every
+ * directory with files waiting in the queue keeps its source and destination
+ * directories open. Failure is not fatal.
+ */
+static void
+raise_open_file_limit(void)
+{
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+	return;
+}
+
+/*
+ * Fills ${devs} with the distinct devices of ${src_paths}, in the order they
+ * first appear, up to MAX_POOL_CNT. Sources that can't be stat-ed are left to
+ * traversal to report.
+ *
+ * Returns the number of devices, at least 1.
+ */
+static uint8_t
+source_devices(char **src_paths, dev_t *devs)
+{
+	uint8_t cnt = 0;
+	for (size_t i = 0; src_paths[i] != NULL && cnt < MAX_POOL_CNT; ++i) {
+		struct stat statbuf;
+		if (fstatat(AT_FDCWD, src_paths[i], &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+			errno = 0;
+			continue;
+		}
+		uint8_t j = 0;
+		while (j < cnt && devs[j] != statbuf.st_dev)
+			++j;
+		if (j == cnt)
+			devs[cnt++] = statbuf.st_dev;
+	}
+	if (cnt == 0)
+		devs[cnt++] = 0;
+	return cnt;
+}
+
+/*
+ * Initializes the queue of ${pool} and, if it has more than one of its
+ * ${thread_cnt} sync threads, its heap, along with the count of the files
+ * queued to them.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+init_lanes(struct sync_thread_data *pool, uint8_t thread_cnt)
+{
+	pool->Q = sync_data_mpmc_queue_init(QUEUE_SIZE);
+	if (pool->Q == NULL) {
+		print_error_and_reset_errno(errno, "Failed to initialize queue");
+		return -1;
+	}
+
+	/* With a single sync thread, the order of the files doesn't matter. */
+	pool->H = NULL;
+	if (thread_cnt > 1) {
+		pool->H = sync_data_heap_init(HEAP_SIZE);
+		if (pool->H == NULL) {
+			print_error_and_reset_errno(errno, "Failed to initialize heap");
+			sync_data_mpmc_queue_free(pool->Q);
+			return -1;
+		}
+	}
+
+	pool->queued_cnt = 0;
+	if (eventcount_init(&pool->idle) != 0) {
+		print_error_and_reset_errno(errno, "Failed to initialize queue");
+		sync_data_heap_free(pool->H);
+		sync_data_mpmc_queue_free(pool->Q);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+free_lanes(struct sync_thread_data *pool)
+{
+	eventcount_destroy(&pool->idle);
+	sync_data_heap_free(pool->H);
+	sync_data_mpmc_queue_free(pool->Q);
+	return;
+}
+
+/*
+ * Checks whether the io_uring backend can be used, telling the user why not
+ * if it can't. Sync threads fall back to regular syscalls in that case.
+ *
+ * Returns true if io_uring can be used, false otherwise.
+ */
+static bool
+io_uring_available(void)
+{
+#ifdef HAVE_IO_URING
+	struct copy_file_uring *U = copy_file_uring_init(1);
+	if (U == NULL) {
+		char *err = "io_uring is not available, using regular syscalls";
+		print_error_and_reset_errno(errno, err);
+		return false;
+	}
+	copy_file_uring_free(U);
+	return true;
+#else
+	print_message("io_uring is not supported by this build, using regular syscalls");
+	return false;
+#endif
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -59,10 +408,15 @@ main(int argc, char *argv[])
 	int ret;
 	char *err;
 
-	struct dsync_flags flags = {false, 1};
+	struct dsync_flags flags = {false, false, 1, false, 1, REFLINK_AUTO, false, false, false,
+	                           WATCH_AUTO, DELETE_NONE, DURABLE_NONE, false, false,
+	                           NULL, false, COMPARE_MIN_SIZE, false, false,
+	                           NULL, LOG_FORMAT_TEXT};
 	int c;
+	char *endptr;
+	unsigned long value;
 	opterr = 0;
-	while ((c = getopt(argc, argv, "fhj:")) != -1) {
+	while ((c = getopt_long(argc, argv, "fhj:t:u", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'f':
 			flags.force_copy = true;
@@ -72,8 +426,13 @@ main(int argc, char *argv[])
 			rc = 0;
 			goto done;
 		case 'j':
-			char *endptr = NULL;
-			unsigned long value = strtoul(optarg, &endptr, 10);
+			if (strcmp(optarg, "auto") == 0) {
+				flags.auto_threads = true;
+				break;
+			}
+			flags.auto_threads = false;
+			endptr = NULL;
+			value = strtoul(optarg, &endptr, 10);
 			if (*endptr != '\0') {
 				err = "Option -j should be provided with a value in range [1, %d].\n\n";
 				fprintf(stderr, err, MAX_SYNC_THREAD_CNT);
@@ -89,8 +448,132 @@ main(int argc, char *argv[])
 				goto err0;
 			}
 			break;
+		case 't':
+			endptr = NULL;
+			value = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0') {
+				err = "Option -t should be provided with a value in range [1, %d].\n\n";
+				fprintf(stderr, err, MAX_TRAVERSE_THREAD_CNT);
+				usage(stderr);
+				goto err0;
+			}
+			if (value > 0 && value <= MAX_TRAVERSE_THREAD_CNT) {
+				flags.traverse_thread_cnt = value;
+			} else {
+				err = "Number of traversal threads must be in range [1, %d].\n\n";
+				fprintf(stderr, err, MAX_TRAVERSE_THREAD_CNT);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+		case 'u':
+			flags.use_io_uring = true;
+			break;
+		case OPT_REFLINK:
+			if (strcmp(optarg, "auto") == 0) {
+				flags.reflink = REFLINK_AUTO;
+			} else if (strcmp(optarg, "always") == 0) {
+				flags.reflink = REFLINK_ALWAYS;
+			} else if (strcmp(optarg, "never") == 0) {
+				flags.reflink = REFLINK_NEVER;
+			} else {
+				err = "Option --reflink should be provided with auto, always or never.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+		case OPT_MANIFEST:
+			flags.use_manifest = true;
+			break;
+		case OPT_PRUNE:
+			flags.use_manifest = true;
+			flags.prune = true;
+			break;
+		case OPT_WATCH:
+#ifdef HAVE_WATCH
+			flags.watch = true;
+			if (optarg == NULL || strcmp(optarg, "auto") == 0) {
+				flags.watch_backend = WATCH_AUTO;
+			} else if (strcmp(optarg, "fanotify") == 0) {
+				flags.watch_backend = WATCH_FANOTIFY;
+			} else if (strcmp(optarg, "inotify") == 0) {
+				flags.watch_backend = WATCH_INOTIFY;
+			} else {
+				err = "Option --watch should be provided with auto, fanotify or inotify.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+#else
+			fprintf(stderr, "Option --watch is not supported by this build.\n");
+			goto err0;
+#endif
+		case OPT_DELETE:
+			if (optarg == NULL || strcmp(optarg, "after") == 0) {
+				flags.delete_mode = DELETE_AFTER;
+			} else if (strcmp(optarg, "before") == 0) {
+				flags.delete_mode = DELETE_BEFORE;
+			} else {
+				err = "Option --delete should be provided with after or before.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+		case OPT_ATOMIC:
+			flags.atomic = true;
+			break;
+		case OPT_VERIFY:
+			flags.verify = true;
+			flags.hash_path = optarg;
+			break;
+		case OPT_COMPARE:
+			flags.compare = true;
+			if (optarg != NULL && parse_size(optarg, &flags.compare_min_size) != 0) {
+				err = "Option --compare should be provided with a size in bytes.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+		case OPT_PROGRESS:
+			flags.progress = true;
+			break;
+		case OPT_STATS:
+			flags.stats = true;
+			flags.stats_path = optarg;
+			break;
+		case OPT_LOG_FORMAT:
+			if (strcmp(optarg, "text") == 0) {
+				flags.log_format = LOG_FORMAT_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				flags.log_format = LOG_FORMAT_JSON;
+			} else {
+				err = "Option --log-format should be provided with text or json.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
+		case OPT_DURABLE:
+			if (optarg == NULL || strcmp(optarg, "syncfs") == 0) {
+				flags.durable = DURABLE_SYNCFS;
+			} else if (strcmp(optarg, "fsync") == 0) {
+				flags.durable = DURABLE_FSYNC;
+			} else {
+				err = "Option --durable should be provided with syncfs or fsync.\n\n";
+				fprintf(stderr, "%s", err);
+				usage(stderr);
+				goto err0;
+			}
+			break;
 		case '?':
-			fprintf(stderr, "Unkown option -%c.\n\n", optopt);
+			if (optopt != 0)
+				fprintf(stderr, "Unkown option -%c.\n\n", optopt);
+			else
+				fprintf(stderr, "Unkown option %s.\n\n", argv[optind - 1]);
 			usage(stderr);
 			goto err0;
 		default:
@@ -99,6 +582,33 @@ main(int argc, char *argv[])
 		}
 	}
 
+	log_sink_set_format(flags.log_format);
+
+	if (flags.auto_threads) {
+		long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+		long pool_size = (cpu_cnt > 0 ? cpu_cnt : 1) * AUTO_THREADS_PER_CPU;
+		if (pool_size < AUTO_MIN_POOL_SIZE)
+			pool_size = AUTO_MIN_POOL_SIZE;
+		if (pool_size > AUTO_MAX_POOL_SIZE)
+			pool_size = AUTO_MAX_POOL_SIZE;
+		flags.sync_thread_cnt = (uint8_t) pool_size;
+	}
+
+	if (flags.watch && flags.use_manifest) {
+		fprintf(stderr, "Option --watch can't be used with --manifest or --prune.\n\n");
+		usage(stderr);
+		goto err0;
+	}
+
+	if (flags.verify && (flags.use_manifest || flags.watch ||
+	                     flags.delete_mode != DELETE_NONE)) {
+		err = "Option --verify can't be used with --manifest, --prune, --watch or "
+			"--delete.\n\n";
+		fprintf(stderr, "%s", err);
+		usage(stderr);
+		goto err0;
+	}
+
 	if (argc - optind < 2) {
 		err = "At least one source and a destination directory must be provided.\n\n";
 		fprintf(stderr, "%s", err);
@@ -143,38 +653,166 @@ main(int argc, char *argv[])
 		}
 	}
 
-	struct sync_data_mpmc_queue *Q = sync_data_mpmc_queue_init(QUEUE_SIZE);
-	if (Q == NULL) {
-		print_error_and_reset_errno(errno, "Failed to initialize queue");
+	raise_open_file_limit();
+
+	dev_t pool_devs[MAX_POOL_CNT];
+	uint8_t pool_cnt = source_devices(src_paths, pool_devs);
+	/* -j is the number of sync threads of every pool, as long as they all
+	   fit. */
+	uint8_t pool_thread_cnt = flags.sync_thread_cnt;
+	if (pool_thread_cnt > MAX_SYNC_THREAD_CNT / pool_cnt)
+		pool_thread_cnt = MAX_SYNC_THREAD_CNT / pool_cnt;
+	uint8_t sync_thread_cnt = pool_cnt * pool_thread_cnt;
+
+	struct sync_thread_data *pools = malloc(pool_cnt *
+	                                        sizeof(struct sync_thread_data));
+	if (pools == NULL) {
+		print_error_and_reset_errno(errno, "Failed to allocate sync thread pools");
 		goto err1;
 	}
 
-	struct sync_thread_data *thread_data = malloc(sizeof(struct sync_thread_data));
-	if (thread_data == NULL) {
-		print_error_and_reset_errno(errno, "Failed to allocate thread_data");
+	struct sync_data_mpmc_queue *queues[MAX_POOL_CNT];
+	uint8_t lanes_cnt = 0;
+	for (; lanes_cnt < pool_cnt; ++lanes_cnt) {
+		if (init_lanes(&pools[lanes_cnt], pool_thread_cnt) != 0)
+			goto err2;
+		pools[lanes_cnt].dev = pool_devs[lanes_cnt];
+		queues[lanes_cnt] = pools[lanes_cnt].Q;
+	}
+
+	struct sync_options opts;
+	opts.links = link_table_init();
+	if (opts.links == NULL) {
+		print_error_and_reset_errno(errno, "Failed to initialize hard link table");
 		goto err2;
 	}
 
-	thread_data->Q = Q;
-	thread_data->force_copy = flags.force_copy;
-	__atomic_store_n(&thread_data->traverse_done, 0, __ATOMIC_RELEASE);
+	opts.manifest = NULL;
+	if (flags.use_manifest) {
+		opts.manifest = manifest_open(dst_path, flags.prune && !flags.force_copy);
+		if (opts.manifest == NULL) {
+			print_error_and_reset_errno(errno, "Failed to initialize manifest");
+			goto err3;
+		}
+	}
+
+	struct durable *D = NULL;
+	if (flags.durable != DURABLE_NONE) {
+		D = durable_init();
+		if (D == NULL) {
+			print_error_and_reset_errno(errno, "Failed to initialize durability");
+			goto err4;
+		}
+	}
+
+	struct verify *V = NULL;
+	if (flags.verify) {
+		V = verify_init(flags.hash_path);
+		if (V == NULL) {
+			print_error_and_reset_errno(errno, "Failed to initialize verification");
+			goto err5;
+		}
+	}
+
+	if (metrics_init(sync_thread_cnt, flags.traverse_thread_cnt) != 0) {
+		print_error_and_reset_errno(errno, "Failed to initialize metrics");
+		goto err6;
+	}
+
+	/* Watching starts before the first sync so that no change is missed and
+	   before the threads are created as it blocks signals for them too. */
+#ifdef HAVE_WATCH
+	struct watch *W = NULL;
+	if (flags.watch) {
+		W = watch_init(src_paths, flags.watch_backend);
+		if (W == NULL) {
+			print_error_and_reset_errno(errno, "Failed to watch sources");
+			goto err7;
+		}
+	}
+#endif
+
+	/* The reporter thread is started after watching, which blocks signals
+	   for it too, and before the other threads so that they all block
+	   SIGUSR1 for it. */
+	if (metrics_start_reporter(flags.progress, queues, pool_cnt) != 0) {
+		print_error_and_reset_errno(errno, "Failed to start reporting metrics");
+		goto err8;
+	}
+
+	/* The writer is started after the reporter so that it blocks the same
+	   signals. */
+	if (log_sink_start(sync_thread_cnt, flags.traverse_thread_cnt) != 0) {
+		print_error_and_reset_errno(errno, "Failed to start logging");
+		goto err9;
+	}
+
+	opts.force_copy = flags.force_copy;
+	opts.reflink = flags.reflink;
+	opts.Q = NULL;
+	opts.helper_cnt = pool_thread_cnt - 1;
+	opts.durable = flags.durable;
+	opts.atomic = flags.atomic;
+	opts.verify = V;
+	opts.compare = flags.compare;
+	opts.compare_min_size = flags.compare_min_size;
+	/* Verifying doesn't go through the io_uring backend. */
+	bool use_io_uring = flags.use_io_uring && !flags.verify && io_uring_available();
 
 	pthread_t threads[MAX_SYNC_THREAD_CNT];
-	for (int i = 0; i < flags.sync_thread_cnt; ++i) {
-		ret = pthread_create(&threads[i], NULL, sync_thread_func, thread_data);
+	int started_cnt = 0;
+	uint8_t tuned_cnt = 0;
+	for (; tuned_cnt < pool_cnt; ++tuned_cnt) {
+		struct sync_thread_data *pool = &pools[tuned_cnt];
+		pool->first_id = tuned_cnt * pool_thread_cnt;
+		pool->A = NULL;
+		if (flags.auto_threads) {
+			uint8_t active_cnt = autotune_initial_cnt(pool->dev,
+			                                          dst_dir_statbuf.st_dev,
+			                                          AUTO_MIN_ACTIVE_CNT,
+			                                          pool_thread_cnt);
+			pool->A = autotune_start(pool->first_id, pool_thread_cnt, active_cnt,
+			                         AUTO_MIN_ACTIVE_CNT);
+			if (pool->A == NULL) {
+				print_error_and_reset_errno(errno, "Failed to start tuning threads");
+				goto err10;
+			}
+		}
+		pool->started_cnt = 0;
+		pool->opts = opts;
+		/* Large files are copied in ranges by the threads of their pool. */
+		pool->opts.Q = pool_thread_cnt > 1 ? pool->Q : NULL;
+		pool->use_io_uring = use_io_uring;
+	}
+
+	for (; started_cnt < sync_thread_cnt; ++started_cnt) {
+		ret = pthread_create(&threads[started_cnt], NULL, sync_thread_func,
+		                     &pools[started_cnt / pool_thread_cnt]);
 		if (ret != 0) {
 			print_error_and_reset_errno(ret, "Failed to create all threads");
-			goto err3;
+			goto err10;
 		}
 	}
 
-	ret = traverse_and_queue(src_paths, dst_path, Q);
+	ret = traverse_and_queue(src_paths, dst_path, pools, pool_cnt, opts.manifest,
+	                         D, V, flags.delete_mode, flags.traverse_thread_cnt);
 	if (ret != 0)
 		rc = 1;
 
-	__atomic_store_n(&thread_data->traverse_done, 1, __ATOMIC_RELEASE);
+#ifdef HAVE_WATCH
+	if (W != NULL && watch_run(W, dst_path, pools, pool_cnt, D, flags.delete_mode,
+	                           flags.traverse_thread_cnt) != 0)
+		rc = 1;
+#endif
+
+	for (uint8_t i = 0; i < pool_cnt; ++i) {
+		sync_data_mpmc_queue_close(pools[i].Q);
+		if (pools[i].H != NULL)
+			sync_data_heap_close(pools[i].H);
+		autotune_stop(pools[i].A);
+	}
 
-	for (int i = 0; i < flags.sync_thread_cnt; ++i) {
+	for (int i = 0; i < sync_thread_cnt; ++i) {
 		ret = pthread_join(threads[i], NULL);
 		if (ret != 0) {
 			rc = 1;
@@ -182,9 +820,65 @@ main(int argc, char *argv[])
 			print_error_and_reset_errno(ret, err, i);
 		}
 	}
+	for (uint8_t i = 0; i < pool_cnt; ++i)
+		sync_thread_drain(&pools[i]);
+	/* Releases the destination directories held for hard links. */
+	link_table_clear(opts.links);
+
+	if (opts.manifest != NULL && manifest_write(opts.manifest) != 0) {
+		rc = 1;
+		print_error_and_reset_errno(errno, "Failed to write manifest");
+	}
 
-	free(thread_data);
-	sync_data_mpmc_queue_free(Q);
+	if (V != NULL) {
+		if (verify_finish(V) != 0) {
+			rc = 1;
+			print_error_and_reset_errno(errno, "Failed to write hash file %s",
+			                            flags.hash_path);
+		}
+		size_t mismatch_cnt = verify_mismatch_cnt(V);
+		if (mismatch_cnt > 0) {
+			rc = 1;
+			print_message("%zu mismatches found", mismatch_cnt);
+		}
+	}
+
+	/* The manifest is flushed along with the files. */
+	if (D != NULL && durable_sync(D) != 0)
+		rc = 1;
+
+	for (uint8_t i = 0; i < pool_cnt; ++i)
+		autotune_free(pools[i].A);
+	log_sink_stop();
+	metrics_stop_reporter();
+#ifdef HAVE_WATCH
+	watch_free(W);
+#endif
+	if (flags.stats) {
+		FILE *stream = stdout;
+		if (flags.stats_path != NULL)
+			stream = fopen(flags.stats_path, "w");
+		if (stream == NULL) {
+			rc = 1;
+			err = "Failed to open %s for writing the summary";
+			print_error_and_reset_errno(errno, err, flags.stats_path);
+		} else {
+			metrics_write_json(stream, "summary");
+			if (stream != stdout && fclose(stream) != 0) {
+				rc = 1;
+				err = "Failed to write the summary to %s";
+				print_error_and_reset_errno(errno, err, flags.stats_path);
+			}
+		}
+	}
+	metrics_free();
+	verify_free(V);
+	durable_free(D);
+	manifest_free(opts.manifest);
+	link_table_free(opts.links);
+	for (uint8_t i = 0; i < pool_cnt; ++i)
+		free_lanes(&pools[i]);
+	free(pools);
 	for (int i = 0; i < src_paths_len; ++i)
 		free(src_paths[i]);
 	free(src_paths);
@@ -193,10 +887,42 @@ main(int argc, char *argv[])
  done:
 	return rc;
 
+ err10:
+	/* The sync threads that have been started exit once the lanes are closed
+	   and their tuning is stopped. */
+	for (uint8_t i = 0; i < pool_cnt; ++i) {
+		sync_data_mpmc_queue_close(pools[i].Q);
+		if (pools[i].H != NULL)
+			sync_data_heap_close(pools[i].H);
+	}
+	for (uint8_t i = 0; i < tuned_cnt; ++i)
+		autotune_stop(pools[i].A);
+	for (int i = 0; i < started_cnt; ++i)
+		pthread_join(threads[i], NULL);
+	link_table_clear(opts.links);
+	for (uint8_t i = 0; i < tuned_cnt; ++i)
+		autotune_free(pools[i].A);
+	log_sink_stop();
+ err9:
+	metrics_stop_reporter();
+ err8:
+#ifdef HAVE_WATCH
+	watch_free(W);
+#endif
+ err7:
+	metrics_free();
+ err6:
+	verify_free(V);
+ err5:
+	durable_free(D);
+ err4:
+	manifest_free(opts.manifest);
  err3:
-	free(thread_data);
+	link_table_free(opts.links);
  err2:
-	sync_data_mpmc_queue_free(Q);
+	for (uint8_t i = 0; i < lanes_cnt; ++i)
+		free_lanes(&pools[i]);
+	free(pools);
  err1:
 	for (int i = 0; i < src_paths_len; ++i)
 		free(src_paths[i]);
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE /* for syncfs */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "durable.h"
+#include "utils.h"
+
+/*
+ * The filesystems are few (usually one) and only added when a traversal thread
+ * crosses into another one, so they are kept in an array under one lock.
+ */
+struct durable {
+	pthread_mutex_t lock;
+	dev_t *devs;
+	int *fds;
+	size_t cnt;
+	size_t cap;
+};
+
+/*
+ * Initialize empty set.
+ *
+ * Returns the set on success, NULL on failure. Sets errno on failure.
+ */
+struct durable *
+durable_init(void)
+{
+	int ret;
+
+	struct durable *D = malloc(sizeof(struct durable));
+	if (D == NULL)
+		return NULL;
+	ret = pthread_mutex_init(&D->lock, NULL);
+	if (ret != 0) {
+		free(D);
+		errno = ret;
+		return NULL;
+	}
+	D->devs = NULL;
+	D->fds = NULL;
+	D->cnt = 0;
+	D->cap = 0;
+	return D;
+}
+
+/*
+ * Free set, closing the file descriptors in it.
+ */
+void
+durable_free(struct durable *D)
+{
+	if (D == NULL)
+		return;
+
+	/* Ignore return value from close as directories are opened for reading
+	   only. */
+	for (size_t i = 0; i < D->cnt; ++i)
+		close(D->fds[i]);
+	free(D->fds);
+	free(D->devs);
+	pthread_mutex_destroy(&D->lock);
+	free(D);
+	return;
+}
+
+/*
+ * Adds the filesystem ${dev} of destination directory ${dir_fd} to ${D}
+ * unless it is there already. ${dir_fd} is duplicated, so the caller may close
+ * it.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+durable_add(struct durable *D, int dir_fd, dev_t dev)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&D->lock);
+	for (size_t i = 0; i < D->cnt; ++i) {
+		if (D->devs[i] == dev)
+			goto out;
+	}
+
+	if (D->cnt == D->cap) {
+		size_t cap = D->cap > 0 ? D->cap * 2 : 4;
+		dev_t *devs = realloc(D->devs, cap * sizeof(dev_t));
+		if (devs == NULL)
+			goto err;
+		D->devs = devs;
+		int *fds = realloc(D->fds, cap * sizeof(int));
+		if (fds == NULL)
+			goto err;
+		D->fds = fds;
+		D->cap = cap;
+	}
+
+	int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		goto err;
+	D->devs[D->cnt] = dev;
+	D->fds[D->cnt] = fd;
+	++D->cnt;
+
+ out:
+	pthread_mutex_unlock(&D->lock);
+	return rc;
+
+ err:
+	rc = -1;
+	goto out;
+}
+
+/*
+ * Flushes the data and metadata of the filesystems of ${D} to stable storage.
+ * Systems without syncfs fall back to sync, which flushes all filesystems and
+ * doesn't report errors.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+durable_sync(struct durable *D)
+{
+	int rc = 0;
+
+#ifdef __linux__
+	for (size_t i = 0; i < D->cnt; ++i) {
+		/* syncfs reports writeback errors of the filesystem since linux
+		   5.8. */
+		if (syncfs(D->fds[i]) != 0) {
+			print_error_and_reset_errno(errno, "Failed to flush destination "
+			                            "filesystem to disk");
+			rc = -1;
+		}
+	}
+#else
+	if (D->cnt > 0)
+		sync();
+#endif
+
+	return rc;
+}
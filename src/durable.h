@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <sys/types.h>
+
+/* Opaque type */
+struct durable;
+
+/*
+ * Set of the destination filesystems that dsync wrote to, which are flushed to
+ * stable storage once at the end with one syncfs per filesystem instead of an
+ * fsync per file. Traversal threads add the destination directories they sync
+ * and only the first directory of every filesystem is kept.
+ */
+struct durable *durable_init(void);
+void durable_free(struct durable *D);
+int durable_add(struct durable *D, int dir_fd, dev_t dev);
+int durable_sync(struct durable *D);
+
+#endif /* DURABLE_H */
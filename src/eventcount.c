@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _DEFAULT_SOURCE /* for syscall */
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "eventcount.h"
+
+/*
+ * Initialize ${ec}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+eventcount_init(struct eventcount *ec)
+{
+	__atomic_store_n(&ec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ec->waiters, 0, __ATOMIC_RELAXED);
+#ifndef __linux__
+	int ret = pthread_mutex_init(&ec->lock, NULL);
+	if (ret != 0)
+		goto err0;
+	ret = pthread_cond_init(&ec->cond, NULL);
+	if (ret != 0)
+		goto err1;
+#endif
+	return 0;
+
+#ifndef __linux__
+ err1:
+	pthread_mutex_destroy(&ec->lock);
+ err0:
+	errno = ret;
+	return -1;
+#endif
+}
+
+/*
+ * Destroy ${ec}. There must not be any waiters.
+ */
+void
+eventcount_destroy(struct eventcount *ec)
+{
+#ifndef __linux__
+	pthread_cond_destroy(&ec->cond);
+	pthread_mutex_destroy(&ec->lock);
+#else
+	(void) ec;
+#endif
+	return;
+}
+
+/*
+ * Registers the caller as a waiter of ${ec}. The caller must check its
+ * condition after this call and then call either eventcount_cancel_wait or
+ * eventcount_wait with the returned key.
+ *
+ * Returns the key to be passed to eventcount_wait.
+ */
+uint32_t
+eventcount_prepare_wait(struct eventcount *ec)
+{
+	uint32_t key = __atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE);
+	__atomic_fetch_add(&ec->waiters, 1, __ATOMIC_RELAXED);
+	/* Pairs with the fence in eventcount_notify. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return key;
+}
+
+/*
+ * Unregisters the caller as a waiter of ${ec}.
+ */
+void
+eventcount_cancel_wait(struct eventcount *ec)
+{
+	__atomic_fetch_sub(&ec->waiters, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Sleeps until ${ec} is notified after the eventcount_prepare_wait call that
+ * returned ${key} and unregisters the caller as a waiter. Returns immediately if
+ * it has already been notified. Spurious wakeups are possible so the caller
+ * must check its condition again.
+ */
+void
+eventcount_wait(struct eventcount *ec, uint32_t key)
+{
+#ifdef __linux__
+	if (__atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE) == key)
+		syscall(SYS_futex, &ec->seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+	/* EAGAIN or EINTR only mean that the caller should check again. */
+	errno = 0;
+#else
+	pthread_mutex_lock(&ec->lock);
+	while (__atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE) == key)
+		pthread_cond_wait(&ec->cond, &ec->lock);
+	pthread_mutex_unlock(&ec->lock);
+#endif
+	__atomic_fetch_sub(&ec->waiters, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Wakes up the waiters of ${ec}. Callers should use eventcount_notify which
+ * only calls this when there are waiters.
+ */
+void
+eventcount_wake(struct eventcount *ec, uint32_t cnt)
+{
+#ifdef __linux__
+	__atomic_fetch_add(&ec->seq, 1, __ATOMIC_RELEASE);
+	int wake_cnt = cnt > INT_MAX ? INT_MAX : (int) cnt;
+	syscall(SYS_futex, &ec->seq, FUTEX_WAKE_PRIVATE, wake_cnt, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&ec->lock);
+	__atomic_fetch_add(&ec->seq, 1, __ATOMIC_RELEASE);
+	if (cnt > 1)
+		pthread_cond_broadcast(&ec->cond);
+	else
+		pthread_cond_signal(&ec->cond);
+	pthread_mutex_unlock(&ec->lock);
+#endif
+	return;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef EVENTCOUNT_H
+#define EVENTCOUNT_H
+
+#include <stdint.h>
+
+#ifndef __linux__
+#include <pthread.h>
+#endif
+
+/*
+ * Eventcount i.e., a way for threads to sleep until some condition that is
+ * checked without locks (e.g., "the queue is not empty") may have become true.
+ * A waiter calls eventcount_prepare_wait, checks the condition once more and
+ * then either calls eventcount_cancel_wait if the condition is true or
+ * eventcount_wait with the key returned from eventcount_prepare_wait. A thread
+ * that makes the condition true calls eventcount_notify afterwards, which is
+ * cheap when nobody is waiting. On linux, waiting is done with futex, otherwise
+ * with a mutex and condition variable.
+ */
+struct eventcount {
+	uint32_t seq;
+	uint32_t waiters;
+#ifndef __linux__
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+int eventcount_init(struct eventcount *ec);
+void eventcount_destroy(struct eventcount *ec);
+uint32_t eventcount_prepare_wait(struct eventcount *ec);
+void eventcount_cancel_wait(struct eventcount *ec);
+void eventcount_wait(struct eventcount *ec, uint32_t key);
+void eventcount_wake(struct eventcount *ec, uint32_t cnt);
+
+/*
+ * Wakes up ${cnt} of the threads waiting on ${ec}, or all of them if there are
+ * fewer waiters. The waiters count is read after a full fence so that either
+ * the waiter sees the condition the caller made true before this call or the
+ * caller sees the waiter.
+ */
+static inline void
+eventcount_notify(struct eventcount *ec, uint32_t cnt)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ec->waiters, __ATOMIC_RELAXED) != 0)
+		eventcount_wake(ec, cnt);
+	return;
+}
+
+/*
+ * Hint to the cpu that the caller is spin waiting.
+ */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+	return;
+}
+
+#endif /* EVENTCOUNT_H */
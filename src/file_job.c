@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "copy_file.h"
+#include "eventcount.h"
+#include "file_job.h"
+#include "hash.h"
+#include "sync_data_mpmc_queue.h"
+#include "sync_options.h"
+#include "sync_thread.h"
+
+/* Size of the ranges a large file is split into. */
+#define RANGE_SIZE ((uintmax_t) 16 * 1024 * 1024)
+
+/*
+ * A large file being copied (or hashed) in ranges. The sync thread that syncs
+ * the file (the owner) adds entries referring to the job to the queue so that
+ * idle sync threads help by claiming ranges too. Every entry in the queue holds
+ * a reference. ${src_fd} and ${dst_fd} belong to the owner, who waits for all
+ * the claimed ranges to complete before closing them, so helpers that find no
+ * ranges left never touch them. If ${hashes} is not NULL, the ranges are
+ * hashed instead of copied, the source's hash of range i into ${hashes}[2i]
+ * and the destination's (unless ${dst_fd} is -1) into ${hashes}[2i + 1].
+ */
+struct file_job {
+	size_t refcnt;
+	int src_fd;
+	int dst_fd;
+	uintmax_t size;
+	size_t range_cnt;
+	bool write_behind;
+	uint64_t *hashes;
+	uint8_t pad0[CACHELINE_SIZE];
+	size_t next_range;
+	uint8_t pad1[CACHELINE_SIZE];
+	size_t done_cnt;
+	int err;
+	struct eventcount done;
+	uint8_t pad2[CACHELINE_SIZE];
+};
+
+/*
+ * Copies or hashes range ${i} of ${job}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+do_range(struct file_job *job, size_t i)
+{
+	uintmax_t off = (uintmax_t) i * RANGE_SIZE;
+	uintmax_t len = job->size - off < RANGE_SIZE ? job->size - off : RANGE_SIZE;
+
+	if (job->hashes != NULL) {
+		if (hash64_fd_range(job->src_fd, off, len, 0, &job->hashes[2 * i]) != 0)
+			return -1;
+		if (job->dst_fd != -1 &&
+		    hash64_fd_range(job->dst_fd, off, len, 0, &job->hashes[2 * i + 1]) != 0)
+			return -1;
+		return 0;
+	}
+
+	if (copy_file_data_range(job->src_fd, job->dst_fd, off, len) != 0)
+		return -1;
+	if (job->write_behind)
+		copy_file_write_behind(job->dst_fd, off, len);
+	return 0;
+}
+
+/*
+ * Claims and does ranges of ${job} until there are none left. Once a range
+ * fails, the remaining ranges are only claimed, not done.
+ */
+static void
+do_ranges(struct file_job *job)
+{
+	while (true) {
+		size_t i = __atomic_fetch_add(&job->next_range, 1, __ATOMIC_RELAXED);
+		if (i >= job->range_cnt)
+			break;
+
+		if (__atomic_load_n(&job->err, __ATOMIC_RELAXED) == 0 &&
+		    do_range(job, i) != 0) {
+			int expected = 0;
+			int err = errno != 0 ? errno : EIO;
+			__atomic_compare_exchange_n(&job->err, &expected, err, false,
+			                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			errno = 0;
+		}
+
+		size_t done = __atomic_add_fetch(&job->done_cnt, 1, __ATOMIC_ACQ_REL);
+		if (done == job->range_cnt)
+			eventcount_notify(&job->done, 1);
+	}
+
+	return;
+}
+
+/*
+ * Allocates a job for the ${size} bytes of ${src_fd} and ${dst_fd}.
+ *
+ * Returns the job on success, NULL on failure. Sets errno on failure.
+ */
+static struct file_job *
+new_job(const struct sync_options *opts, int src_fd, int dst_fd, uintmax_t size,
+        uint64_t *hashes)
+{
+	struct file_job *job = malloc(sizeof(struct file_job));
+	if (job == NULL)
+		return NULL;
+	if (eventcount_init(&job->done) != 0) {
+		free(job);
+		return NULL;
+	}
+
+	job->refcnt = 1;
+	job->src_fd = src_fd;
+	job->dst_fd = dst_fd;
+	job->size = size;
+	job->range_cnt = size > 0 ? (size_t) ((size + RANGE_SIZE - 1) / RANGE_SIZE) : 1;
+	job->write_behind = opts->durable != DURABLE_NONE;
+	job->hashes = hashes;
+	job->next_range = 0;
+	job->done_cnt = 0;
+	job->err = 0;
+	return job;
+}
+
+/*
+ * Does the ranges of ${job} asking up to ${opts->helper_cnt} idle sync threads
+ * for help and waits until all of them are done. Helpers are only asked if
+ * there is space in the queue, the caller never waits for it. Requests that no
+ * sync thread takes before they all exit are dropped by sync_thread_drain. The
+ * caller's reference to ${job} is dropped.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+run_job(const struct sync_options *opts, struct file_job *job)
+{
+	size_t ticket_cnt = opts->helper_cnt < job->range_cnt - 1
+		? opts->helper_cnt
+		: job->range_cnt - 1;
+	/* Without memory for the requests, the caller does all the ranges. */
+	struct sync_data *tickets = NULL;
+	if (ticket_cnt > 0)
+		tickets = calloc(ticket_cnt, sizeof(struct sync_data));
+	if (tickets == NULL) {
+		errno = 0;
+		ticket_cnt = 0;
+	}
+	for (size_t i = 0; i < ticket_cnt; ++i)
+		tickets[i].job = job;
+	job->refcnt += ticket_cnt;
+	size_t queued = 0;
+	if (ticket_cnt > 0)
+		queued = sync_data_mpmc_queue_enqueue_bulk(opts->Q, tickets, ticket_cnt);
+	if (queued < ticket_cnt)
+		__atomic_sub_fetch(&job->refcnt, ticket_cnt - queued, __ATOMIC_RELAXED);
+	free(tickets);
+
+	do_ranges(job);
+
+	while (__atomic_load_n(&job->done_cnt, __ATOMIC_ACQUIRE) != job->range_cnt) {
+		uint32_t key = eventcount_prepare_wait(&job->done);
+		if (__atomic_load_n(&job->done_cnt, __ATOMIC_ACQUIRE) == job->range_cnt) {
+			eventcount_cancel_wait(&job->done);
+			break;
+		}
+		eventcount_wait(&job->done, key);
+	}
+
+	int err = __atomic_load_n(&job->err, __ATOMIC_RELAXED);
+	file_job_unref(job);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy ${size} bytes of ${src_fd} to ${dst_fd} splitting it in ranges that up
+ * to ${opts->helper_cnt} idle sync threads copy concurrently with the caller.
+ * Returns only after all the ranges have been copied, so the caller can set
+ * the destination's metadata afterwards like for any other file. With
+ * --durable, every range is written back as soon as it is copied.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+file_job_copy(const struct sync_options *opts, int src_fd, int dst_fd,
+              uintmax_t size)
+{
+	/* Ranges are written in any order and zero blocks are skipped, so the
+	   destination gets its final size first. */
+	if (ftruncate(dst_fd, (off_t) size) != 0)
+		return -1;
+
+	struct file_job *job = new_job(opts, src_fd, dst_fd, size, NULL);
+	if (job != NULL)
+		return run_job(opts, job);
+
+	errno = 0;
+	if (opts->durable == DURABLE_NONE)
+		return copy_file_data_range(src_fd, dst_fd, 0, size);
+	for (uintmax_t off = 0; off < size; off += RANGE_SIZE) {
+		uintmax_t len = size - off < RANGE_SIZE ? size - off : RANGE_SIZE;
+		if (copy_file_data_range(src_fd, dst_fd, off, len) != 0)
+			return -1;
+		copy_file_write_behind(dst_fd, off, len);
+	}
+	return 0;
+}
+
+/*
+ * Returns the hash of a file of ${size} bytes from the hashes of its
+ * ${range_cnt} ranges, every other one of ${hashes}. A file of a single range
+ * hashes to the range's hash, i.e., its plain XXH64.
+ */
+static uint64_t
+combine_hashes(const uint64_t *hashes, size_t range_cnt, uintmax_t size)
+{
+	if (range_cnt == 1)
+		return hashes[0];
+
+	struct hash64 h;
+	hash64_init(&h, (uint64_t) size);
+	for (size_t i = 0; i < range_cnt; ++i) {
+		uint8_t bytes[8];
+		for (int j = 0; j < 8; ++j)
+			bytes[j] = (uint8_t) (hashes[2 * i] >> (8 * j));
+		hash64_update(&h, bytes, sizeof(bytes));
+	}
+	return hash64_final(&h);
+}
+
+/*
+ * Hashes the ${size} bytes of ${src_fd} into ${src_hash} and, unless ${dst_fd}
+ * is -1, of ${dst_fd} into ${dst_hash}. Files are hashed in ranges of 16MB and
+ * the ranges of files of at least FILE_JOB_MIN_SIZE are hashed by idle sync
+ * threads too like file_job_copy does, so a file's hash is the same no matter
+ * how many threads hashed it.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+file_job_hash(const struct sync_options *opts, int src_fd, int dst_fd,
+              uintmax_t size, uint64_t *src_hash, uint64_t *dst_hash)
+{
+	int rc = 0;
+	size_t range_cnt = size > 0 ? (size_t) ((size + RANGE_SIZE - 1) / RANGE_SIZE) : 1;
+	uint64_t one_range[2];
+	uint64_t *hashes = one_range;
+	if (range_cnt > 1) {
+		hashes = malloc(2 * range_cnt * sizeof(uint64_t));
+		if (hashes == NULL)
+			return -1;
+	}
+
+	struct file_job *job = NULL;
+	if (opts->Q != NULL && size >= FILE_JOB_MIN_SIZE)
+		job = new_job(opts, src_fd, dst_fd, size, hashes);
+	if (job != NULL) {
+		rc = run_job(opts, job);
+	} else {
+		struct file_job serial = {
+			.src_fd = src_fd, .dst_fd = dst_fd, .size = size, .hashes = hashes
+		};
+		errno = 0;
+		for (size_t i = 0; i < range_cnt && rc == 0; ++i)
+			rc = do_range(&serial, i);
+	}
+
+	if (rc == 0) {
+		*src_hash = combine_hashes(hashes, range_cnt, size);
+		if (dst_fd != -1)
+			*dst_hash = combine_hashes(hashes + 1, range_cnt, size);
+	}
+	if (hashes != one_range)
+		free(hashes);
+	return rc;
+}
+
+/*
+ * Helps with the ranges of ${job} that have not been claimed yet.
+ */
+void
+file_job_help(struct file_job *job)
+{
+	do_ranges(job);
+	return;
+}
+
+/*
+ * Drops a reference to ${job}, freeing it if it was the last one.
+ */
+void
+file_job_unref(struct file_job *job)
+{
+	if (__atomic_sub_fetch(&job->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		eventcount_destroy(&job->done);
+		free(job);
+	}
+	return;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef FILE_JOB_H
+#define FILE_JOB_H
+
+#include <stdint.h>
+
+#include "sync_options.h"
+
+/* Files of at least this size are copied (or hashed) in ranges by multiple
+   threads. */
+#define FILE_JOB_MIN_SIZE ((uintmax_t) 64 * 1024 * 1024)
+
+/* Opaque type */
+struct file_job;
+
+int file_job_copy(const struct sync_options *opts, int src_fd, int dst_fd,
+                  uintmax_t size);
+int file_job_hash(const struct sync_options *opts, int src_fd, int dst_fd,
+                  uintmax_t size, uint64_t *src_hash, uint64_t *dst_hash);
+void file_job_help(struct file_job *job);
+void file_job_unref(struct file_job *job);
+
+#endif /* FILE_JOB_H */
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+#define PRIME5 0x27d4eb2f165667c5ULL
+
+/* Files are read in blocks of this size for hashing. */
+#define READ_BUF_SIZE (128 * 1024)
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t
+merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+/*
+ * Consumes the 32 byte stripes of ${p} (${len} must be a multiple of 32).
+ */
+static inline void
+consume_stripes(uint64_t acc[4], const uint8_t *p, size_t len)
+{
+	uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+	for (const uint8_t *end = p + len; p < end; p += 32) {
+		a0 = round64(a0, read64(p));
+		a1 = round64(a1, read64(p + 8));
+		a2 = round64(a2, read64(p + 16));
+		a3 = round64(a3, read64(p + 24));
+	}
+	acc[0] = a0;
+	acc[1] = a1;
+	acc[2] = a2;
+	acc[3] = a3;
+	return;
+}
+
+/*
+ * Starts hashing with ${seed}.
+ */
+void
+hash64_init(struct hash64 *h, uint64_t seed)
+{
+	h->acc[0] = seed + PRIME1 + PRIME2;
+	h->acc[1] = seed + PRIME2;
+	h->acc[2] = seed;
+	h->acc[3] = seed - PRIME1;
+	h->seed = seed;
+	h->total_len = 0;
+	h->buf_len = 0;
+	return;
+}
+
+/*
+ * Hashes the ${len} bytes of ${data}.
+ */
+void
+hash64_update(struct hash64 *h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	h->total_len += len;
+
+	if (h->buf_len > 0) {
+		size_t n = 32 - h->buf_len < len ? 32 - h->buf_len : len;
+		memcpy(h->buf + h->buf_len, p, n);
+		h->buf_len += n;
+		p += n;
+		len -= n;
+		if (h->buf_len < 32)
+			return;
+		consume_stripes(h->acc, h->buf, 32);
+		h->buf_len = 0;
+	}
+
+	size_t stripes_len = len & ~(size_t) 31;
+	consume_stripes(h->acc, p, stripes_len);
+	memcpy(h->buf, p + stripes_len, len - stripes_len);
+	h->buf_len = len - stripes_len;
+	return;
+}
+
+/*
+ * Returns the hash of everything given to hash64_update so far. ${h} is not
+ * changed, so more can be hashed afterwards.
+ */
+uint64_t
+hash64_final(const struct hash64 *h)
+{
+	uint64_t r;
+	if (h->total_len >= 32) {
+		r = rotl64(h->acc[0], 1) + rotl64(h->acc[1], 7) + rotl64(h->acc[2], 12) +
+			rotl64(h->acc[3], 18);
+		for (int i = 0; i < 4; ++i)
+			r = merge_round(r, h->acc[i]);
+	} else {
+		r = h->seed + PRIME5;
+	}
+	r += h->total_len;
+
+	const uint8_t *p = h->buf;
+	const uint8_t *end = h->buf + h->buf_len;
+	for (; p + 8 <= end; p += 8) {
+		r ^= round64(0, read64(p));
+		r = rotl64(r, 27) * PRIME1 + PRIME4;
+	}
+	if (p + 4 <= end) {
+		r ^= (uint64_t) read32(p) * PRIME1;
+		r = rotl64(r, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		r ^= *p * PRIME5;
+		r = rotl64(r, 11) * PRIME1;
+	}
+
+	r ^= r >> 33;
+	r *= PRIME2;
+	r ^= r >> 29;
+	r *= PRIME3;
+	r ^= r >> 32;
+	return r;
+}
+
+/*
+ * Hashes ${len} bytes at offset ${off} of ${fd} with ${seed} into ${hash}
+ * without using or changing the file offset. If the file is shorter, only the
+ * bytes up to its end are hashed.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+hash64_fd_range(int fd, uintmax_t off, uintmax_t len, uint64_t seed,
+                uint64_t *hash)
+{
+	uint8_t buf[READ_BUF_SIZE];
+	struct hash64 h;
+	hash64_init(&h, seed);
+
+	while (len > 0) {
+		size_t n = len < READ_BUF_SIZE ? (size_t) len : READ_BUF_SIZE;
+		ssize_t got = pread(fd, buf, n, (off_t) off);
+		if (got == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (got == 0)
+			break;
+		hash64_update(&h, buf, (size_t) got);
+		off += (uintmax_t) got;
+		len -= (uintmax_t) got;
+	}
+
+	*hash = hash64_final(&h);
+	return 0;
+}
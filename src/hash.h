@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * State of an XXH64 hash being computed incrementally. XXH64 keeps four
+ * independent accumulators that consume 32 bytes per step, so the multiplies
+ * of the lanes overlap in the cpu and hashing runs at memory speed.
+ */
+struct hash64 {
+	uint64_t acc[4];
+	uint64_t seed;
+	uint64_t total_len;
+	uint8_t buf[32];
+	size_t buf_len;
+};
+
+void hash64_init(struct hash64 *h, uint64_t seed);
+void hash64_update(struct hash64 *h, const void *data, size_t len);
+uint64_t hash64_final(const struct hash64 *h);
+int hash64_fd_range(int fd, uintmax_t off, uintmax_t len, uint64_t seed,
+                    uint64_t *hash);
+
+#endif /* HASH_H */
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_table.h"
+
+#define CACHELINE_SIZE 64
+#define SHARD_CNT 64
+#define MIN_BUCKET_CNT 16
+
+/*
+ * A chained hash table protected by ${lock}. Threads waiting for a pending
+ * entry of the shard wait on ${cond}. The paddings keep the shards on separate
+ * cachelines.
+ */
+struct link_shard {
+	uint8_t pad0[CACHELINE_SIZE];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct link_entry **buckets;
+	size_t bucket_cnt;
+	size_t entry_cnt;
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+struct link_table {
+	struct link_shard shards[SHARD_CNT];
+};
+
+static inline uint64_t
+hash_inode(dev_t dev, ino_t ino)
+{
+	/* splitmix64 finalizer */
+	uint64_t h = (uint64_t) ino ^ ((uint64_t) dev * 0x9e3779b97f4a7c15ULL);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/*
+ * Doubles the buckets of ${S} when it holds more entries than buckets. A
+ * failed allocation only makes the chains longer.
+ */
+static void
+grow_shard(struct link_shard *S)
+{
+	if (S->entry_cnt <= S->bucket_cnt)
+		return;
+
+	size_t bucket_cnt = S->bucket_cnt * 2;
+	struct link_entry **buckets = calloc(bucket_cnt, sizeof(*buckets));
+	if (buckets == NULL) {
+		errno = 0;
+		return;
+	}
+
+	for (size_t i = 0; i < S->bucket_cnt; ++i) {
+		struct link_entry *entry = S->buckets[i];
+		while (entry != NULL) {
+			struct link_entry *next = entry->next;
+			/* The low bits of the hash select the shard. */
+			size_t b = (hash_inode(entry->dev, entry->ino) / SHARD_CNT) &
+				(bucket_cnt - 1);
+			entry->next = buckets[b];
+			buckets[b] = entry;
+			entry = next;
+		}
+	}
+	free(S->buckets);
+	S->buckets = buckets;
+	S->bucket_cnt = bucket_cnt;
+	return;
+}
+
+/*
+ * Frees ${entry} and releases its destination directory.
+ */
+static void
+free_entry(struct link_entry *entry)
+{
+	dir_node_unref(entry->dst_dir);
+	free(entry->dst_name);
+	free(entry);
+	return;
+}
+
+/*
+ * Initialize table.
+ *
+ * Returns the table on success, NULL on failure. Sets errno on failure.
+ */
+struct link_table *
+link_table_init(void)
+{
+	int ret;
+	size_t i = 0;
+
+	struct link_table *T = malloc(sizeof(struct link_table));
+	if (T == NULL)
+		goto err0;
+
+	for (; i < SHARD_CNT; ++i) {
+		struct link_shard *S = &T->shards[i];
+		S->buckets = calloc(MIN_BUCKET_CNT, sizeof(*S->buckets));
+		if (S->buckets == NULL)
+			goto err1;
+		ret = pthread_mutex_init(&S->lock, NULL);
+		if (ret != 0)
+			goto err2;
+		ret = pthread_cond_init(&S->cond, NULL);
+		if (ret != 0)
+			goto err3;
+		S->bucket_cnt = MIN_BUCKET_CNT;
+		S->entry_cnt = 0;
+	}
+
+	return T;
+
+ err3:
+	pthread_mutex_destroy(&T->shards[i].lock);
+ err2:
+	free(T->shards[i].buckets);
+	errno = ret;
+ err1:
+	while (i-- > 0) {
+		pthread_cond_destroy(&T->shards[i].cond);
+		pthread_mutex_destroy(&T->shards[i].lock);
+		free(T->shards[i].buckets);
+	}
+	free(T);
+ err0:
+	return NULL;
+}
+
+/*
+ * Free table and the entries that are left in it.
+ */
+void
+link_table_free(struct link_table *T)
+{
+	if (T == NULL)
+		return;
+
+	for (size_t i = 0; i < SHARD_CNT; ++i) {
+		struct link_shard *S = &T->shards[i];
+		for (size_t b = 0; b < S->bucket_cnt; ++b) {
+			struct link_entry *entry = S->buckets[b];
+			while (entry != NULL) {
+				struct link_entry *next = entry->next;
+				free_entry(entry);
+				entry = next;
+			}
+		}
+		pthread_cond_destroy(&S->cond);
+		pthread_mutex_destroy(&S->lock);
+		free(S->buckets);
+	}
+	free(T);
+	return;
+}
+
+/*
+ * Claims the inode ${ino} of device ${dev} that has ${nlink} hard links. If the
+ * caller is the first to claim it, a pending entry is added and the caller
+ * must sync the file and call link_table_publish. Otherwise, waits until the
+ * first claimer has published the entry. In both cases, the caller must call
+ * link_table_release once done with ${*entry}.
+ *
+ * Returns 1 if the caller is the first claimer, 0 if the entry was already
+ * published, -1 on failure. Sets errno on failure.
+ */
+int
+link_table_claim(struct link_table *T, dev_t dev, ino_t ino, nlink_t nlink,
+                 struct link_entry **entry)
+{
+	uint64_t h = hash_inode(dev, ino);
+	struct link_shard *S = &T->shards[h % SHARD_CNT];
+
+	pthread_mutex_lock(&S->lock);
+	size_t b = (h / SHARD_CNT) & (S->bucket_cnt - 1);
+	struct link_entry *e = S->buckets[b];
+	while (e != NULL && (e->dev != dev || e->ino != ino))
+		e = e->next;
+
+	if (e != NULL) {
+		if (e->unvisited > 0)
+			--e->unvisited;
+		++e->users;
+		while (e->pending)
+			pthread_cond_wait(&S->cond, &S->lock);
+		pthread_mutex_unlock(&S->lock);
+		*entry = e;
+		return 0;
+	}
+
+	e = malloc(sizeof(struct link_entry));
+	if (e == NULL) {
+		pthread_mutex_unlock(&S->lock);
+		return -1;
+	}
+	e->dev = dev;
+	e->ino = ino;
+	e->unvisited = nlink - 1;
+	e->users = 1;
+	e->pending = 1;
+	e->detached = 0;
+	e->dst_dir = NULL;
+	e->dst_name = NULL;
+	e->next = S->buckets[b];
+	S->buckets[b] = e;
+	++S->entry_cnt;
+	grow_shard(S);
+	pthread_mutex_unlock(&S->lock);
+
+	*entry = e;
+	return 1;
+}
+
+/*
+ * Publishes ${name} in ${dir}'s destination directory as the destination of
+ * ${entry} and wakes up the threads waiting for it. The entry takes a
+ * reference to ${dir} and a copy of ${name}. NULL ${dir} means that syncing the
+ * file failed, as does failing to copy ${name}.
+ */
+void
+link_table_publish(struct link_table *T, struct link_entry *entry,
+                   struct dir_node *dir, const char *name)
+{
+	uint64_t h = hash_inode(entry->dev, entry->ino);
+	struct link_shard *S = &T->shards[h % SHARD_CNT];
+
+	char *dst_name = NULL;
+	if (dir != NULL) {
+		size_t name_len = strlen(name);
+		dst_name = malloc(name_len + 1);
+		if (dst_name != NULL) {
+			memcpy(dst_name, name, name_len + 1);
+			dir_node_ref(dir);
+		} else {
+			dir = NULL;
+			errno = 0;
+		}
+	}
+
+	pthread_mutex_lock(&S->lock);
+	entry->dst_dir = dir;
+	entry->dst_name = dst_name;
+	entry->pending = 0;
+	pthread_cond_broadcast(&S->cond);
+	pthread_mutex_unlock(&S->lock);
+	return;
+}
+
+/*
+ * Releases the caller's claim of ${entry}. Once all the hard links of the
+ * inode have been claimed and released, the entry is removed as there is
+ * nothing left to link to it.
+ */
+void
+link_table_release(struct link_table *T, struct link_entry *entry)
+{
+	uint64_t h = hash_inode(entry->dev, entry->ino);
+	struct link_shard *S = &T->shards[h % SHARD_CNT];
+
+	pthread_mutex_lock(&S->lock);
+	if (entry->detached) {
+		bool last = --entry->users == 0;
+		pthread_mutex_unlock(&S->lock);
+		if (last)
+			free_entry(entry);
+		return;
+	}
+	if (--entry->users > 0 || entry->unvisited > 0) {
+		pthread_mutex_unlock(&S->lock);
+		return;
+	}
+
+	size_t b = (h / SHARD_CNT) & (S->bucket_cnt - 1);
+	struct link_entry **p = &S->buckets[b];
+	while (*p != entry)
+		p = &(*p)->next;
+	*p = entry->next;
+	--S->entry_cnt;
+	pthread_mutex_unlock(&S->lock);
+
+	free_entry(entry);
+	return;
+}
+
+/*
+ * Removes all the entries from the table so that the next claims start over,
+ * e.g., for another pass of --watch in which the files synced before may have
+ * changed. Entries whose hard links were not all visited (because only some
+ * of them changed or the others are outside the sources) would otherwise make
+ * later claims link to the previous destination instead of syncing. Entries
+ * that are still claimed are only detached and freed by their last release.
+ * Clearing also releases the destination directories held by the entries,
+ * which must be done once syncing is over and before the log sink and the
+ * metrics are stopped as the last release of a directory deletes the extras in
+ * it.
+ */
+void
+link_table_clear(struct link_table *T)
+{
+	for (size_t i = 0; i < SHARD_CNT; ++i) {
+		struct link_shard *S = &T->shards[i];
+		pthread_mutex_lock(&S->lock);
+		for (size_t b = 0; b < S->bucket_cnt; ++b) {
+			struct link_entry *entry = S->buckets[b];
+			while (entry != NULL) {
+				struct link_entry *next = entry->next;
+				if (entry->users > 0) {
+					entry->detached = 1;
+				} else {
+					free_entry(entry);
+				}
+				entry = next;
+			}
+			S->buckets[b] = NULL;
+		}
+		S->entry_cnt = 0;
+		pthread_mutex_unlock(&S->lock);
+	}
+	return;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef LINK_TABLE_H
+#define LINK_TABLE_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include "dir_node.h"
+
+/*
+ * A source file with more than one hard link. ${dst_name} in ${dst_dir}'s
+ * destination directory is where the first visitor synced the file to, both
+ * NULL if syncing it failed, and the entry holds a reference to ${dst_dir} so
+ * that the others link relative to its file descriptor. They are only valid
+ * after link_table_claim returned 0. ${unvisited} is the number of
+ * hard links that have not been claimed yet and ${users} is the number of
+ * claims that have not been released yet. ${detached} is set once the entry
+ * has been cleared from the table while still claimed.
+ */
+struct link_entry {
+	struct link_entry *next;
+	dev_t dev;
+	ino_t ino;
+	nlink_t unvisited;
+	size_t users;
+	int pending;
+	int detached;
+	struct dir_node *dst_dir;
+	char *dst_name;
+};
+
+/* Opaque type */
+struct link_table;
+
+/*
+ * Concurrent table of source files with multiple hard links keyed by their
+ * (st_dev, st_ino). The first sync thread to claim an inode syncs it and
+ * publishes its destination. Other threads claiming the same inode wait for
+ * that and then hard link to the published destination. The table is split in
+ * shards with their own lock so that threads rarely contend.
+ */
+struct link_table *link_table_init(void);
+void link_table_free(struct link_table *T);
+int link_table_claim(struct link_table *T, dev_t dev, ino_t ino, nlink_t nlink,
+                     struct link_entry **entry);
+void link_table_publish(struct link_table *T, struct link_entry *entry,
+                        struct dir_node *dir, const char *name);
+void link_table_release(struct link_table *T, struct link_entry *entry);
+void link_table_clear(struct link_table *T);
+
+#endif /* LINK_TABLE_H */
@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log_sink.h"
+
+/* Size of the buffer of every thread and of the batches the writer writes. */
+#define LOG_BUFFER_SIZE (64 * 1024)
+/* Longer messages are truncated. */
+#define LOG_MESSAGE_MAX 4096
+/* Interval in milliseconds at which the writer flushes the buffers. */
+#define LOG_FLUSH_INTERVAL 100
+/* Number of records with the same format, error and level that are written in
+   every LOG_SUMMARY_INTERVAL before the rest are only counted. */
+#define LOG_BURST 20
+/* Interval in milliseconds at which the counts of suppressed records are
+   written and the counts start over. */
+#define LOG_SUMMARY_INTERVAL 10000
+/* Number of distinct formats, errors and levels that can be rate limited in an
+   interval, records of any more are always written. Must be a power of 2. */
+#define LOG_KEY_CNT 256
+
+/*
+ * Header of a record in a thread's buffer, which is followed by the formatted
+ * message (without the description of ${err}). Headers are copied in and out
+ * with memcpy as they aren't aligned.
+ */
+struct log_record {
+	const char *format;
+	struct timespec time;
+	int err;
+	enum log_level level;
+	size_t len;
+};
+
+/*
+ * Buffer of one thread, which appends records to ${data} under ${lock} and
+ * waits on ${space} while it is full. The writer takes the records by swapping
+ * ${data} with an empty buffer of its own.
+ */
+struct log_buffer {
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	char *data;
+	size_t len;
+};
+
+/*
+ * Records with the same format, error and level in the current interval, e.g.,
+ * every file failing to be copied to a full disk, only the first LOG_BURST of
+ * which are written. ${sample} is the last message suppressed, which tells one
+ * of the paths and is written with the count of suppressed records.
+ */
+struct log_key {
+	const char *format;
+	int err;
+	enum log_level level;
+	uint64_t cnt;
+	char *sample;
+};
+
+/* Output written to stderr when it is full and when it is flushed. */
+struct log_out {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+static enum log_format log_format = LOG_FORMAT_TEXT;
+
+/*
+ * As with the metrics, the buffers of the sync threads come first, followed by
+ * the buffers of the traversal threads, and threads are bound to them by their
+ * ids.
+ */
+static struct log_buffer *buffers;
+static size_t sync_buffer_cnt;
+static size_t buffer_cnt;
+
+/*
+ * The writer is the only thread that uses ${keys}, ${spare} and ${out}.
+ * Threads whose buffer is full wake it up with ${writer_wake}.
+ */
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static bool stop_writer;
+static char *spare;
+static struct log_out out;
+static struct log_key keys[LOG_KEY_CNT];
+
+static __thread struct log_buffer *log_buffer;
+
+/*
+ * Sets the format of the records written from now on, before any thread other
+ * than the calling one logs.
+ */
+void
+log_sink_set_format(enum log_format format)
+{
+	log_format = format;
+	return;
+}
+
+/*
+ * Writes what is in ${O} to stderr. Errors are ignored as there is nowhere
+ * left to report them.
+ */
+static void
+out_flush(struct log_out *O)
+{
+	size_t written = 0;
+	while (written < O->len) {
+		ssize_t ret = write(STDERR_FILENO, O->buf + written, O->len - written);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += (size_t) ret;
+	}
+	O->len = 0;
+	return;
+}
+
+static void
+out_append(struct log_out *O, const char *str, size_t len)
+{
+	while (len > 0) {
+		if (O->len == O->cap)
+			out_flush(O);
+		size_t n = len < O->cap - O->len ? len : O->cap - O->len;
+		memcpy(O->buf + O->len, str, n);
+		O->len += n;
+		str += n;
+		len -= n;
+	}
+	return;
+}
+
+static void
+out_append_str(struct log_out *O, const char *str)
+{
+	out_append(O, str, strlen(str));
+	return;
+}
+
+/*
+ * Appends ${len} bytes of ${str} as a JSON string, escaping quotes,
+ * backslashes and control characters.
+ */
+static void
+out_append_json_string(struct log_out *O, const char *str, size_t len)
+{
+	out_append(O, "\"", 1);
+	size_t run = 0;
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char) str[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		out_append(O, str + run, i - run);
+		run = i + 1;
+		char esc[8];
+		if (c == '"' || c == '\\')
+			snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c == '\n')
+			snprintf(esc, sizeof(esc), "\\n");
+		else if (c == '\t')
+			snprintf(esc, sizeof(esc), "\\t");
+		else
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+		out_append_str(O, esc);
+	}
+	out_append(O, str + run, len - run);
+	out_append(O, "\"", 1);
+	return;
+}
+
+/*
+ * Appends ${message} of record ${R} as a line of text or JSON. ${role} and
+ * ${id} tell the thread that logged it, unless ${role} is NULL. If
+ * ${suppressed} is not 0, the record is the last of that many that have been
+ * suppressed.
+ */
+static void
+format_record(struct log_out *O, const struct log_record *R,
+              const char *message, const char *role, size_t id,
+              uint64_t suppressed)
+{
+	char err_buf[1024];
+	if (R->err != 0)
+		strerror_r(R->err, err_buf, sizeof(err_buf));
+
+	char buf[128];
+	if (log_format == LOG_FORMAT_TEXT) {
+		out_append(O, message, R->len);
+		if (R->err != 0) {
+			out_append_str(O, " : ");
+			out_append_str(O, err_buf);
+		}
+		if (suppressed != 0) {
+			snprintf(buf, sizeof(buf), " (%" PRIu64 " similar messages suppressed)",
+			         suppressed);
+			out_append_str(O, buf);
+		}
+		out_append(O, "\n", 1);
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "{\"time\":%jd.%06ld,\"level\":\"%s\"",
+	         (intmax_t) R->time.tv_sec, R->time.tv_nsec / 1000,
+	         R->level == LOG_ERROR ? "error" : "info");
+	out_append_str(O, buf);
+	if (role != NULL) {
+		snprintf(buf, sizeof(buf), ",\"thread\":\"%s\",\"id\":%zu", role, id);
+		out_append_str(O, buf);
+	}
+	out_append_str(O, ",\"message\":");
+	out_append_json_string(O, message, R->len);
+	if (R->err != 0) {
+		snprintf(buf, sizeof(buf), ",\"errno\":%d,\"error\":", R->err);
+		out_append_str(O, buf);
+		out_append_json_string(O, err_buf, strlen(err_buf));
+	}
+	if (suppressed != 0) {
+		snprintf(buf, sizeof(buf), ",\"suppressed\":%" PRIu64, suppressed);
+		out_append_str(O, buf);
+	}
+	out_append_str(O, "}\n");
+	return;
+}
+
+/*
+ * Returns the key of records with ${format}, ${err} and ${level}, NULL if there
+ * is no room left for it.
+ */
+static struct log_key *
+find_key(const char *format, int err, enum log_level level)
+{
+	size_t hash = (size_t) (((uintptr_t) format >> 3) ^
+	                        ((uintptr_t) err * 0x9e3779b9u) ^ (uintptr_t) level);
+	for (size_t i = 0; i < LOG_KEY_CNT; ++i) {
+		struct log_key *K = &keys[(hash + i) & (LOG_KEY_CNT - 1)];
+		if (K->format == NULL) {
+			K->format = format;
+			K->err = err;
+			K->level = level;
+			return K;
+		}
+		if (K->format == format && K->err == err && K->level == level)
+			return K;
+	}
+	return NULL;
+}
+
+/*
+ * Writes the sample and the count of suppressed records of every key that has
+ * any and starts counting over.
+ */
+static void
+write_summaries(void)
+{
+	for (size_t i = 0; i < LOG_KEY_CNT; ++i) {
+		struct log_key *K = &keys[i];
+		if (K->cnt > LOG_BURST) {
+			const char *message = K->sample != NULL ? K->sample : K->format;
+			struct log_record R;
+			R.format = K->format;
+			clock_gettime(CLOCK_REALTIME, &R.time);
+			R.err = K->err;
+			R.level = K->level;
+			R.len = strlen(message);
+			format_record(&out, &R, message, NULL, 0, K->cnt - LOG_BURST);
+		}
+		free(K->sample);
+	}
+	memset(keys, 0, sizeof(keys));
+	return;
+}
+
+/*
+ * Takes the records out of every thread's buffer and writes them in batches,
+ * counting rather than writing the ones over the limit of their key.
+ */
+static void
+flush_buffers(void)
+{
+	for (size_t i = 0; i < buffer_cnt; ++i) {
+		struct log_buffer *B = &buffers[i];
+		pthread_mutex_lock(&B->lock);
+		size_t len = B->len;
+		if (len == 0) {
+			pthread_mutex_unlock(&B->lock);
+			continue;
+		}
+		char *data = B->data;
+		B->data = spare;
+		B->len = 0;
+		pthread_cond_broadcast(&B->space);
+		pthread_mutex_unlock(&B->lock);
+		spare = data;
+
+		bool sync = i < sync_buffer_cnt;
+		size_t pos = 0;
+		while (pos < len) {
+			struct log_record R;
+			memcpy(&R, data + pos, sizeof(R));
+			const char *message = data + pos + sizeof(R);
+			pos += sizeof(R) + R.len;
+
+			struct log_key *K = find_key(R.format, R.err, R.level);
+			if (K != NULL && ++K->cnt > LOG_BURST) {
+				char *sample = realloc(K->sample, R.len + 1);
+				if (sample != NULL) {
+					memcpy(sample, message, R.len);
+					sample[R.len] = '\0';
+					K->sample = sample;
+				}
+				continue;
+			}
+			format_record(&out, &R, message, sync ? "sync" : "traverse",
+			              sync ? i : i - sync_buffer_cnt, 0);
+		}
+	}
+	out_flush(&out);
+	return;
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/*
+ * Flushes the buffers every LOG_FLUSH_INTERVAL milliseconds or when a thread's
+ * buffer is full, and writes the counts of suppressed records every
+ * LOG_SUMMARY_INTERVAL milliseconds, after which similar records are written
+ * LOG_BURST more times, and when stopped.
+ *
+ * Returns NULL.
+ */
+static void *
+writer_func(void *data)
+{
+	(void) data;
+	uint64_t next_summary = now_ms() + LOG_SUMMARY_INTERVAL;
+
+	pthread_mutex_lock(&writer_lock);
+	while (!stop_writer) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long) LOG_FLUSH_INTERVAL * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+		pthread_mutex_unlock(&writer_lock);
+
+		flush_buffers();
+		if (now_ms() >= next_summary) {
+			write_summaries();
+			out_flush(&out);
+			next_summary = now_ms() + LOG_SUMMARY_INTERVAL;
+		}
+
+		pthread_mutex_lock(&writer_lock);
+	}
+	pthread_mutex_unlock(&writer_lock);
+
+	flush_buffers();
+	write_summaries();
+	out_flush(&out);
+	return NULL;
+}
+
+/*
+ * Allocates the buffers of ${sync_thread_cnt} sync threads and
+ * ${traverse_thread_cnt} traversal threads and starts the writer thread. Until
+ * then, and for threads that aren't bound to a buffer, every record is written
+ * with a single write.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+log_sink_start(uint8_t sync_thread_cnt, uint8_t traverse_thread_cnt)
+{
+	int ret;
+	size_t cnt = (size_t) sync_thread_cnt + traverse_thread_cnt;
+
+	struct log_buffer *B = calloc(cnt, sizeof(struct log_buffer));
+	if (B == NULL)
+		goto err0;
+	size_t init_cnt;
+	for (init_cnt = 0; init_cnt < cnt; ++init_cnt) {
+		ret = pthread_mutex_init(&B[init_cnt].lock, NULL);
+		if (ret != 0) {
+			errno = ret;
+			goto err1;
+		}
+		ret = pthread_cond_init(&B[init_cnt].space, NULL);
+		if (ret != 0) {
+			pthread_mutex_destroy(&B[init_cnt].lock);
+			errno = ret;
+			goto err1;
+		}
+	}
+	spare = malloc(LOG_BUFFER_SIZE);
+	if (spare == NULL)
+		goto err1;
+	out.buf = malloc(LOG_BUFFER_SIZE);
+	if (out.buf == NULL)
+		goto err2;
+	out.len = 0;
+	out.cap = LOG_BUFFER_SIZE;
+
+	buffers = B;
+	sync_buffer_cnt = sync_thread_cnt;
+	buffer_cnt = cnt;
+	stop_writer = false;
+	ret = pthread_create(&writer, NULL, writer_func, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto err3;
+	}
+	return 0;
+
+ err3:
+	buffers = NULL;
+	buffer_cnt = 0;
+	free(out.buf);
+	out.buf = NULL;
+ err2:
+	free(spare);
+	spare = NULL;
+ err1:
+	ret = errno;
+	for (size_t i = 0; i < init_cnt; ++i) {
+		pthread_cond_destroy(&B[i].space);
+		pthread_mutex_destroy(&B[i].lock);
+	}
+	free(B);
+	errno = ret;
+ err0:
+	return -1;
+}
+
+/*
+ * Stops the writer thread after it has written every record left and the
+ * counts of suppressed records, and frees the buffers. The other threads
+ * bound to a buffer must not log anymore.
+ */
+void
+log_sink_stop(void)
+{
+	if (buffers == NULL)
+		return;
+
+	pthread_mutex_lock(&writer_lock);
+	stop_writer = true;
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_lock);
+	pthread_join(writer, NULL);
+
+	log_buffer = NULL;
+	for (size_t i = 0; i < buffer_cnt; ++i) {
+		pthread_cond_destroy(&buffers[i].space);
+		pthread_mutex_destroy(&buffers[i].lock);
+		free(buffers[i].data);
+	}
+	free(buffers);
+	buffers = NULL;
+	buffer_cnt = 0;
+	free(spare);
+	spare = NULL;
+	free(out.buf);
+	out.buf = NULL;
+	return;
+}
+
+/*
+ * Makes the calling thread log to the buffer of sync thread ${id}.
+ */
+void
+log_sink_bind_sync_thread(uint8_t id)
+{
+	if (buffers != NULL && id < sync_buffer_cnt)
+		log_buffer = &buffers[id];
+	return;
+}
+
+/*
+ * Makes the calling thread log to the buffer of traversal thread ${id}.
+ */
+void
+log_sink_bind_traverse_thread(uint8_t id)
+{
+	if (buffers != NULL && sync_buffer_cnt + id < buffer_cnt)
+		log_buffer = &buffers[sync_buffer_cnt + id];
+	return;
+}
+
+/*
+ * Logs ${format} with ${args} and the description of the ${err} error code
+ * (unless it is 0) at ${level}. The record goes to the calling thread's buffer
+ * if it has one, waiting for the writer if it is full, or is written to stderr
+ * at once otherwise.
+ */
+void
+log_sink_vwrite(enum log_level level, int err, const char *format,
+                va_list args)
+{
+	char message[LOG_MESSAGE_MAX];
+	int ret = vsnprintf(message, sizeof(message), format, args);
+	struct log_record R;
+	R.format = format;
+	clock_gettime(CLOCK_REALTIME, &R.time);
+	R.err = err;
+	R.level = level;
+	R.len = ret < 0 ? 0 : (size_t) ret >= sizeof(message)
+		? sizeof(message) - 1
+		: (size_t) ret;
+
+	struct log_buffer *B = log_buffer;
+	if (B != NULL) {
+		pthread_mutex_lock(&B->lock);
+		if (B->data == NULL)
+			B->data = malloc(LOG_BUFFER_SIZE);
+		if (B->data != NULL) {
+			size_t size = sizeof(R) + R.len;
+			while (B->len + size > LOG_BUFFER_SIZE) {
+				pthread_mutex_lock(&writer_lock);
+				pthread_cond_signal(&writer_wake);
+				pthread_mutex_unlock(&writer_lock);
+				pthread_cond_wait(&B->space, &B->lock);
+			}
+			memcpy(B->data + B->len, &R, sizeof(R));
+			memcpy(B->data + B->len + sizeof(R), message, R.len);
+			B->len += size;
+			pthread_mutex_unlock(&B->lock);
+			return;
+		}
+		pthread_mutex_unlock(&B->lock);
+	}
+
+	/* Large enough for any text record and most JSON ones to be written with
+	   a single write, which keeps them from interleaving with other
+	   records. */
+	char buf[4 * LOG_MESSAGE_MAX];
+	struct log_out O = {buf, 0, sizeof(buf)};
+	format_record(&O, &R, message, NULL, 0, 0);
+	out_flush(&O);
+	return;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+enum log_format {
+	LOG_FORMAT_TEXT,
+	LOG_FORMAT_JSON
+};
+
+enum log_level {
+	LOG_ERROR,
+	LOG_INFO
+};
+
+void log_sink_set_format(enum log_format format);
+int log_sink_start(uint8_t sync_thread_cnt, uint8_t traverse_thread_cnt);
+void log_sink_stop(void);
+void log_sink_bind_sync_thread(uint8_t id);
+void log_sink_bind_traverse_thread(uint8_t id);
+void log_sink_vwrite(enum log_level level, int err, const char *format,
+                     va_list args);
+
+#endif /* LOG_SINK_H */
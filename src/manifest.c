@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dir_node.h"
+#include "manifest.h"
+
+#define CACHELINE_SIZE 64
+#define SHARD_CNT 64
+
+/* The manifest is "${dst}/.dsync/manifest". It is kept in a directory of its
+   own so that replacing it doesn't change the destination directory itself. */
+#define MANIFEST_NAME "manifest"
+#define MANIFEST_TMP_NAME "manifest.tmp"
+
+#define MANIFEST_MAGIC "DSYNCMAN"
+#define MANIFEST_VERSION 2
+
+/*
+ * The manifest file is a header followed by ${record_cnt} records sorted by
+ * the hash of their path, the indexes of the records sorted by the hash of
+ * their parent directory's path (to find the entries of a directory) and then
+ * the paths the records point to. It is only a cache for the machine that
+ * wrote it, so native byte order is used and a manifest written with a
+ * different layout is ignored.
+ */
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t dst_dev;
+	uint64_t dst_ino;
+	uint64_t record_cnt;
+	uint64_t strings_size;
+};
+
+/*
+ * State of a file or directory (${mode} tells which) in the destination as of
+ * the last sync. ${path} is relative to the destination directory. For files,
+ * ${size} and the modification time ${sec} and ${nsec} are the ones of the
+ * source which the destination was synced to. For directories, ${sec} and
+ * ${nsec} are the destination directory's status change time, which changes
+ * whenever an entry of the directory is added, removed or renamed, ${src_sec}
+ * and ${src_nsec} are the same for the source directory and ${size} is the
+ * number of entries the directory had (0 if it was not read).
+ */
+struct manifest_record {
+	uint64_t hash;
+	uint64_t parent_hash;
+	uint64_t path_off;
+	uint32_t path_len;
+	uint32_t mode;
+	int64_t size;
+	int64_t sec;
+	int64_t nsec;
+	int64_t src_sec;
+	int64_t src_nsec;
+};
+
+/*
+ * Records of the files and directories synced during this run, sharded by the
+ * hash of their path so that the sync threads don't contend on a single lock.
+ * ${path_off} of the records are offsets into ${strings} of the shard.
+ */
+struct manifest_shard {
+	uint8_t pad0[CACHELINE_SIZE];
+	pthread_mutex_t lock;
+	struct manifest_record *records;
+	size_t record_cnt;
+	size_t record_cap;
+	char *strings;
+	size_t strings_size;
+	size_t strings_cap;
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+/*
+ * The manifest of the last run mapped read only (${old_cnt} is 0 if there is
+ * none or it is stale) and the records of this run which replace it. With
+ * ${prune}, unchanged directories are not read again.
+ */
+struct manifest {
+	const char *dst_path;
+	size_t dst_len;
+	dev_t dst_dev;
+	ino_t dst_ino;
+	bool prune;
+	void *map;
+	size_t map_size;
+	const struct manifest_record *old_records;
+	size_t old_cnt;
+	const uint64_t *old_children;
+	const char *old_strings;
+	size_t old_strings_size;
+	struct manifest_shard shards[SHARD_CNT];
+};
+
+/*
+ * FNV-1a hash of ${len} bytes of ${s} continuing from ${h}.
+ */
+static inline uint64_t
+hash_bytes(uint64_t h, const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (uint8_t) s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * Hash of the path "${dir}/${name}", or of ${dir} itself if ${name_len} is 0,
+ * where ${dir} is "" for the destination directory itself.
+ */
+static inline uint64_t
+hash_path(const char *dir, size_t dir_len, const char *name, size_t name_len)
+{
+	uint64_t h = hash_bytes(0xcbf29ce484222325ULL, dir, dir_len);
+	if (dir_len > 0 && name_len > 0)
+		h = hash_bytes(h, "/", 1);
+	return hash_bytes(h, name, name_len);
+}
+
+static inline bool
+path_equals(const char *path, size_t path_len, const char *dir, size_t dir_len,
+            const char *name, size_t name_len)
+{
+	size_t sep = dir_len > 0 && name_len > 0 ? 1 : 0;
+	return path_len == dir_len + sep + name_len &&
+		memcmp(path, dir, dir_len) == 0 &&
+		(sep == 0 || path[dir_len] == '/') &&
+		memcmp(path + dir_len + sep, name, name_len) == 0;
+}
+
+/*
+ * Returns the path of ${dir}'s destination relative to the destination
+ * directory and sets ${*len} to its length.
+ */
+static inline const char *
+relative_dir(struct manifest *M, struct dir_node *dir, size_t *len)
+{
+	const char *rel = dir->dst + M->dst_len;
+	if (*rel == '/')
+		++rel;
+	*len = dir->dst_len - (size_t) (rel - dir->dst);
+	return rel;
+}
+
+/*
+ * Returns the hash of the parent directory of the relative path ${rel}, 0 for
+ * the destination directory itself which has no parent.
+ */
+static inline uint64_t
+hash_parent(const char *rel, size_t rel_len)
+{
+	if (rel_len == 0)
+		return 0;
+	size_t len = rel_len;
+	while (len > 0 && rel[len - 1] != '/')
+		--len;
+	return hash_path(rel, len > 0 ? len - 1 : 0, "", 0);
+}
+
+/*
+ * Returns whether the path of ${rec} of the last run's manifest is within the
+ * mapped strings.
+ */
+static inline bool
+valid_path(struct manifest *M, const struct manifest_record *rec)
+{
+	return rec->path_off <= M->old_strings_size &&
+		rec->path_len <= M->old_strings_size - rec->path_off;
+}
+
+/*
+ * Finds the record of "${dir}/${name}" in the manifest of the last run.
+ *
+ * Returns the record or NULL if there is none.
+ */
+static const struct manifest_record *
+lookup(struct manifest *M, uint64_t h, const char *dir, size_t dir_len,
+       const char *name, size_t name_len)
+{
+	size_t lo = 0;
+	size_t hi = M->old_cnt;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (M->old_records[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < M->old_cnt && M->old_records[lo].hash == h; ++lo) {
+		const struct manifest_record *rec = &M->old_records[lo];
+		if (!valid_path(M, rec))
+			return NULL;
+		if (path_equals(M->old_strings + rec->path_off, rec->path_len, dir, dir_len,
+		                name, name_len))
+			return rec;
+	}
+	return NULL;
+}
+
+/*
+ * Adds a copy of ${rec} with the path "${dir}/${name}" for this run. Failing
+ * to allocate only means that the entry is checked in full by the next run.
+ */
+static void
+add_record(struct manifest *M, const struct manifest_record *rec,
+           const char *dir, size_t dir_len, const char *name, size_t name_len)
+{
+	struct manifest_shard *S = &M->shards[rec->hash % SHARD_CNT];
+	size_t sep = dir_len > 0 && name_len > 0 ? 1 : 0;
+	size_t path_len = dir_len + sep + name_len;
+	if (path_len > UINT32_MAX)
+		return;
+
+	pthread_mutex_lock(&S->lock);
+	if (S->record_cnt == S->record_cap) {
+		size_t cap = S->record_cap == 0 ? 64 : S->record_cap * 2;
+		struct manifest_record *records = realloc(S->records,
+		                                          cap * sizeof(*records));
+		if (records == NULL)
+			goto err;
+		S->records = records;
+		S->record_cap = cap;
+	}
+	if (S->strings == NULL || S->strings_cap - S->strings_size < path_len) {
+		size_t cap = S->strings_cap == 0 ? 4096 : S->strings_cap;
+		while (cap - S->strings_size < path_len)
+			cap *= 2;
+		char *strings = realloc(S->strings, cap);
+		if (strings == NULL)
+			goto err;
+		S->strings = strings;
+		S->strings_cap = cap;
+	}
+
+	char *path = S->strings + S->strings_size;
+	memcpy(path, dir, dir_len);
+	if (sep)
+		path[dir_len] = '/';
+	memcpy(path + dir_len + sep, name, name_len);
+
+	struct manifest_record *new_rec = &S->records[S->record_cnt++];
+	*new_rec = *rec;
+	new_rec->path_off = S->strings_size;
+	new_rec->path_len = (uint32_t) path_len;
+	S->strings_size += path_len;
+	pthread_mutex_unlock(&S->lock);
+	return;
+
+ err:
+	pthread_mutex_unlock(&S->lock);
+	errno = 0;
+	return;
+}
+
+/*
+ * Maps the manifest of the last run if there is a valid one for the
+ * destination directory. A manifest that can't be read, has a different
+ * layout or was written for another directory (e.g., the destination was
+ * copied somewhere else with it) is ignored.
+ */
+static void
+load(struct manifest *M)
+{
+	char *path = malloc(M->dst_len + sizeof("/" MANIFEST_DIR "/" MANIFEST_NAME));
+	if (path == NULL)
+		goto err0;
+	sprintf(path, "%s/%s/%s", M->dst_path, MANIFEST_DIR, MANIFEST_NAME);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		goto err0;
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) ||
+	    (uintmax_t) statbuf.st_size < sizeof(struct manifest_header) ||
+	    (uintmax_t) statbuf.st_size > SIZE_MAX)
+		goto err1;
+
+	size_t size = (size_t) statbuf.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto err1;
+
+	/* Every record comes with an index in the children's section. */
+	size_t entry_size = sizeof(struct manifest_record) + sizeof(uint64_t);
+	const struct manifest_header *hdr = map;
+	size_t entries_size = size - sizeof(struct manifest_header);
+	if (memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != MANIFEST_VERSION ||
+	    hdr->record_size != sizeof(struct manifest_record) ||
+	    hdr->dst_dev != (uint64_t) M->dst_dev ||
+	    hdr->dst_ino != (uint64_t) M->dst_ino ||
+	    hdr->strings_size > entries_size ||
+	    hdr->record_cnt != (entries_size - hdr->strings_size) / entry_size ||
+	    (entries_size - hdr->strings_size) % entry_size != 0)
+		goto err2;
+
+	M->map = map;
+	M->map_size = size;
+	M->old_records = (const struct manifest_record *) (hdr + 1);
+	M->old_cnt = (size_t) hdr->record_cnt;
+	M->old_children = (const uint64_t *) (M->old_records + M->old_cnt);
+	M->old_strings = (const char *) (M->old_children + M->old_cnt);
+	M->old_strings_size = (size_t) hdr->strings_size;
+	close(fd);
+	return;
+
+ err2:
+	munmap(map, size);
+ err1:
+	close(fd);
+ err0:
+	errno = 0;
+	return;
+}
+
+/*
+ * Initialize manifest of the canonicalized absolute ${dst_path} directory,
+ * loading the manifest left by the last run if it is valid. If ${prune} is
+ * true, manifest_prune_dir prunes unchanged directories.
+ *
+ * Returns the manifest on success, NULL on failure. Sets errno on failure.
+ */
+struct manifest *
+manifest_open(const char *dst_path, bool prune)
+{
+	int ret;
+	size_t i = 0;
+
+	struct manifest *M = calloc(1, sizeof(struct manifest));
+	if (M == NULL)
+		goto err0;
+
+	struct stat statbuf;
+	if (stat(dst_path, &statbuf) != 0)
+		goto err1;
+
+	M->dst_path = dst_path;
+	M->dst_len = strlen(dst_path);
+	M->dst_dev = statbuf.st_dev;
+	M->dst_ino = statbuf.st_ino;
+	M->prune = prune;
+
+	for (; i < SHARD_CNT; ++i) {
+		ret = pthread_mutex_init(&M->shards[i].lock, NULL);
+		if (ret != 0) {
+			errno = ret;
+			goto err1;
+		}
+	}
+
+	load(M);
+	return M;
+
+ err1:
+	while (i-- > 0)
+		pthread_mutex_destroy(&M->shards[i].lock);
+	free(M);
+ err0:
+	return NULL;
+}
+
+/*
+ * Free manifest.
+ */
+void
+manifest_free(struct manifest *M)
+{
+	if (M == NULL)
+		return;
+
+	if (M->map != NULL)
+		munmap(M->map, M->map_size);
+	for (size_t i = 0; i < SHARD_CNT; ++i) {
+		pthread_mutex_destroy(&M->shards[i].lock);
+		free(M->shards[i].records);
+		free(M->shards[i].strings);
+	}
+	free(M);
+	return;
+}
+
+/*
+ * Finds the record of directory ${dir}, which has been synced, in the manifest
+ * of the last run if its destination hasn't changed since. Directories created
+ * by this run have ${dir->dst_ctime} zeroed and never match.
+ *
+ * Returns the record or NULL if there is none.
+ */
+static const struct manifest_record *
+lookup_dir(struct manifest *M, struct dir_node *dir, const char *rel,
+           size_t rel_len, uint64_t h)
+{
+	if (dir->dst_ctime.tv_sec == 0 && dir->dst_ctime.tv_nsec == 0)
+		return NULL;
+
+	const struct manifest_record *rec = lookup(M, h, rel, rel_len, "", 0);
+	if (rec == NULL || !S_ISDIR(rec->mode) ||
+	    rec->sec != (int64_t) dir->dst_ctime.tv_sec ||
+	    rec->nsec != (int64_t) dir->dst_ctime.tv_nsec)
+		return NULL;
+	return rec;
+}
+
+/*
+ * Checks whether the destination directory of ${dir}, which has been synced,
+ * is unchanged since the last run, in which case the records of its files can
+ * be trusted.
+ */
+void
+manifest_check_dir(struct manifest *M, struct dir_node *dir)
+{
+	size_t rel_len;
+	const char *rel = relative_dir(M, dir, &rel_len);
+	uint64_t h = hash_path(rel, rel_len, "", 0);
+
+	dir->manifest_ok = lookup_dir(M, dir, rel, rel_len, h) != NULL;
+	return;
+}
+
+/*
+ * Records the state of directory ${dir} that has been read completely and had
+ * ${entry_cnt} files and directories for the next run. Directories created by
+ * this run are not recorded as their status change time is not known.
+ */
+void
+manifest_add_dir(struct manifest *M, struct dir_node *dir, size_t entry_cnt)
+{
+	if (dir->dst_ctime.tv_sec == 0 && dir->dst_ctime.tv_nsec == 0)
+		return;
+
+	size_t rel_len;
+	const char *rel = relative_dir(M, dir, &rel_len);
+
+	struct manifest_record rec;
+	rec.hash = hash_path(rel, rel_len, "", 0);
+	rec.parent_hash = hash_parent(rel, rel_len);
+	rec.mode = S_IFDIR;
+	rec.size = (int64_t) entry_cnt;
+	rec.sec = (int64_t) dir->dst_ctime.tv_sec;
+	rec.nsec = (int64_t) dir->dst_ctime.tv_nsec;
+	rec.src_sec = (int64_t) dir->src_ctime.tv_sec;
+	rec.src_nsec = (int64_t) dir->src_ctime.tv_nsec;
+	add_record(M, &rec, rel, rel_len, "", 0);
+	return;
+}
+
+/*
+ * Returns the index of the first entry in the children's section of the last
+ * run's manifest whose record's parent has hash ${h}.
+ */
+static size_t
+first_child(struct manifest *M, uint64_t h)
+{
+	size_t lo = 0;
+	size_t hi = M->old_cnt;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint64_t i = M->old_children[mid];
+		if (i < M->old_cnt && M->old_records[i].parent_hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Returns the record of the ${c}th entry of the children's section of the last
+ * run's manifest if it is an entry of directory ${rel} with hash ${h} and sets
+ * ${*name} and ${*name_len} to its name, NULL otherwise.
+ */
+static const struct manifest_record *
+child_record(struct manifest *M, size_t c, uint64_t h, const char *rel,
+             size_t rel_len, const char **name, size_t *name_len)
+{
+	uint64_t i = M->old_children[c];
+	if (i >= M->old_cnt)
+		return NULL;
+	const struct manifest_record *rec = &M->old_records[i];
+	if (rec->parent_hash != h || !valid_path(M, rec))
+		return NULL;
+
+	const char *path = M->old_strings + rec->path_off;
+	size_t sep = rel_len > 0 ? 1 : 0;
+	if (rec->path_len <= rel_len + sep || memcmp(path, rel, rel_len) != 0 ||
+	    (sep && path[rel_len] != '/') ||
+	    memchr(path + rel_len + sep, '/', rec->path_len - rel_len - sep) != NULL)
+		return NULL;
+
+	*name = path + rel_len + sep;
+	*name_len = rec->path_len - rel_len - sep;
+	return rec;
+}
+
+/*
+ * Prunes directory ${dir}, which has been synced and checked with
+ * manifest_check_dir, if neither its source nor its destination have had
+ * entries added, removed or renamed since the last run and all of its entries
+ * were synced by the last run. The directory is then not read: the records of
+ * its files are carried over to this run and ${push_dir} is called with
+ * ${arg} for each of its subdirectories, which have to be checked themselves.
+ * Files that have been modified in place in the source are not synced then.
+ *
+ * Returns true if ${dir} has been pruned, false if it has to be read.
+ */
+bool
+manifest_prune_dir(struct manifest *M, struct dir_node *dir,
+                   int (*push_dir)(void *arg, struct dir_node *dir,
+                                   const char *name, size_t name_len),
+                   void *arg)
+{
+	if (!M->prune || !dir->manifest_ok)
+		return false;
+
+	size_t rel_len;
+	const char *rel = relative_dir(M, dir, &rel_len);
+	uint64_t h = hash_path(rel, rel_len, "", 0);
+
+	const struct manifest_record *dir_rec = lookup_dir(M, dir, rel, rel_len, h);
+	if (dir_rec == NULL || dir_rec->size <= 0 ||
+	    dir_rec->src_sec != (int64_t) dir->src_ctime.tv_sec ||
+	    dir_rec->src_nsec != (int64_t) dir->src_ctime.tv_nsec)
+		return false;
+
+	/* Entries that failed to sync have no record, which is noticed here. */
+	size_t first = first_child(M, h);
+	size_t cnt = 0;
+	const char *name;
+	size_t name_len;
+	for (size_t c = first; c < M->old_cnt; ++c) {
+		uint64_t i = M->old_children[c];
+		if (i >= M->old_cnt || M->old_records[i].parent_hash != h)
+			break;
+		if (child_record(M, c, h, rel, rel_len, &name, &name_len) != NULL)
+			++cnt;
+	}
+	if (cnt != (uint64_t) dir_rec->size)
+		return false;
+
+	for (size_t c = first; c < M->old_cnt; ++c) {
+		uint64_t i = M->old_children[c];
+		if (i >= M->old_cnt || M->old_records[i].parent_hash != h)
+			break;
+		const struct manifest_record *rec = child_record(M, c, h, rel, rel_len,
+		                                                 &name, &name_len);
+		if (rec == NULL)
+			continue;
+		if (S_ISDIR(rec->mode))
+			push_dir(arg, dir, name, name_len);
+		else
+			add_record(M, rec, rel, rel_len, name, name_len);
+	}
+
+	add_record(M, dir_rec, rel, rel_len, "", 0);
+	return true;
+}
+
+/*
+ * Checks whether the source of ${name} in ${dir} with ${src_statbuf} is still
+ * what its destination was synced to by the last run, so that the destination
+ * doesn't need to be stat-ed.
+ *
+ * Returns true if the file is unchanged, false if it has to be checked.
+ */
+bool
+manifest_file_unchanged(struct manifest *M, struct dir_node *dir,
+                        const char *name, const struct stat *src_statbuf)
+{
+	if (!dir->manifest_ok)
+		return false;
+
+	size_t rel_len;
+	const char *rel = relative_dir(M, dir, &rel_len);
+	size_t name_len = strlen(name);
+	uint64_t h = hash_path(rel, rel_len, name, name_len);
+
+	const struct manifest_record *rec = lookup(M, h, rel, rel_len, name, name_len);
+	return rec != NULL && !S_ISDIR(rec->mode) &&
+		rec->mode == (uint32_t) src_statbuf->st_mode &&
+		rec->size == (int64_t) src_statbuf->st_size &&
+		rec->sec == (int64_t) src_statbuf->st_mtim.tv_sec &&
+		rec->nsec == (int64_t) src_statbuf->st_mtim.tv_nsec;
+}
+
+/*
+ * Records that ${name} in ${dir} has been synced to the source's
+ * ${src_statbuf}.
+ */
+void
+manifest_add_file(struct manifest *M, struct dir_node *dir, const char *name,
+                  const struct stat *src_statbuf)
+{
+	size_t rel_len;
+	const char *rel = relative_dir(M, dir, &rel_len);
+	size_t name_len = strlen(name);
+
+	struct manifest_record rec;
+	rec.hash = hash_path(rel, rel_len, name, name_len);
+	rec.parent_hash = hash_path(rel, rel_len, "", 0);
+	rec.mode = (uint32_t) src_statbuf->st_mode;
+	rec.size = (int64_t) src_statbuf->st_size;
+	rec.sec = (int64_t) src_statbuf->st_mtim.tv_sec;
+	rec.nsec = (int64_t) src_statbuf->st_mtim.tv_nsec;
+	rec.src_sec = 0;
+	rec.src_nsec = 0;
+	add_record(M, &rec, rel, rel_len, name, name_len);
+	return;
+}
+
+static int
+compare_records(const void *a, const void *b)
+{
+	uint64_t ha = ((const struct manifest_record *) a)->hash;
+	uint64_t hb = ((const struct manifest_record *) b)->hash;
+	return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+/* Entry of the children's section paired with the key it is sorted by. */
+struct manifest_child {
+	uint64_t parent_hash;
+	uint64_t index;
+};
+
+static int
+compare_children(const void *a, const void *b)
+{
+	const struct manifest_child *ca = a;
+	const struct manifest_child *cb = b;
+	if (ca->parent_hash != cb->parent_hash)
+		return ca->parent_hash < cb->parent_hash ? -1 : 1;
+	return ca->index < cb->index ? -1 : ca->index > cb->index ? 1 : 0;
+}
+
+/*
+ * Writes ${len} bytes of ${buf} to ${fd}.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t written = write(fd, p, len);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += written;
+		len -= (size_t) written;
+	}
+	return 0;
+}
+
+/*
+ * Replaces the manifest of the destination directory with the records of this
+ * run. The new manifest is written to a temporary file which is renamed over
+ * the old one once it is on disk, so a manifest is either the old or the new
+ * one as a whole.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+manifest_write(struct manifest *M)
+{
+	int ret;
+	size_t record_cnt = 0;
+	size_t strings_size = 0;
+	for (size_t i = 0; i < SHARD_CNT; ++i) {
+		record_cnt += M->shards[i].record_cnt;
+		strings_size += M->shards[i].strings_size;
+	}
+
+	struct manifest_record *records = malloc((record_cnt > 0 ? record_cnt : 1) *
+	                                         sizeof(*records));
+	if (records == NULL)
+		goto err0;
+	char *strings = malloc(strings_size > 0 ? strings_size : 1);
+	if (strings == NULL)
+		goto err1;
+
+	size_t cnt = 0;
+	size_t off = 0;
+	for (size_t i = 0; i < SHARD_CNT; ++i) {
+		struct manifest_shard *S = &M->shards[i];
+		for (size_t j = 0; j < S->record_cnt; ++j) {
+			records[cnt] = S->records[j];
+			records[cnt++].path_off += off;
+		}
+		if (S->strings_size > 0)
+			memcpy(strings + off, S->strings, S->strings_size);
+		off += S->strings_size;
+	}
+	qsort(records, record_cnt, sizeof(*records), compare_records);
+
+	/* The same path may have been recorded more than once, e.g., the
+	   destination directory for multiple sources. */
+	cnt = 0;
+	size_t run = 0;
+	for (size_t i = 0; i < record_cnt; ++i) {
+		if (cnt > 0 && records[cnt - 1].hash != records[i].hash)
+			run = cnt;
+		bool dup = false;
+		for (size_t j = run; j < cnt && !dup; ++j) {
+			dup = records[j].path_len == records[i].path_len &&
+				memcmp(strings + records[j].path_off,
+				       strings + records[i].path_off, records[i].path_len) == 0;
+		}
+		if (!dup)
+			records[cnt++] = records[i];
+	}
+
+	/* The pairs are turned into the indexes in place once sorted. */
+	struct manifest_child *children = malloc((cnt > 0 ? cnt : 1) * sizeof(*children));
+	if (children == NULL)
+		goto err2;
+	for (size_t i = 0; i < cnt; ++i) {
+		children[i].parent_hash = records[i].parent_hash;
+		children[i].index = i;
+	}
+	qsort(children, cnt, sizeof(*children), compare_children);
+	uint64_t *child_indexes = (uint64_t *) children;
+	for (size_t i = 0; i < cnt; ++i)
+		child_indexes[i] = children[i].index;
+
+	struct manifest_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.version = MANIFEST_VERSION;
+	hdr.record_size = sizeof(struct manifest_record);
+	hdr.dst_dev = (uint64_t) M->dst_dev;
+	hdr.dst_ino = (uint64_t) M->dst_ino;
+	hdr.record_cnt = cnt;
+	hdr.strings_size = strings_size;
+
+	int dst_fd = open(M->dst_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dst_fd == -1)
+		goto err3;
+	if (mkdirat(dst_fd, MANIFEST_DIR, 0755) != 0 && errno != EEXIST)
+		goto err4;
+	int dir_fd = openat(dst_fd, MANIFEST_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+	                    O_CLOEXEC);
+	if (dir_fd == -1)
+		goto err4;
+	int fd = openat(dir_fd, MANIFEST_TMP_NAME, O_CREAT | O_TRUNC | O_WRONLY |
+	                O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1)
+		goto err5;
+
+	if (write_all(fd, &hdr, sizeof(hdr)) != 0 ||
+	    write_all(fd, records, cnt * sizeof(*records)) != 0 ||
+	    write_all(fd, child_indexes, cnt * sizeof(*child_indexes)) != 0 ||
+	    write_all(fd, strings, strings_size) != 0 ||
+	    fsync(fd) != 0)
+		goto err6;
+	if (close(fd) != 0) {
+		fd = -1;
+		goto err6;
+	}
+	if (renameat(dir_fd, MANIFEST_TMP_NAME, dir_fd, MANIFEST_NAME) != 0)
+		goto err5;
+	/* Ignore return value from fsync of the directory, the manifest is only a
+	   cache. */
+	fsync(dir_fd);
+
+	close(dir_fd);
+	close(dst_fd);
+	free(children);
+	free(strings);
+	free(records);
+	errno = 0;
+	return 0;
+
+ err6:
+	ret = errno;
+	if (fd != -1)
+		close(fd);
+	unlinkat(dir_fd, MANIFEST_TMP_NAME, 0);
+	errno = ret;
+ err5:
+	close(dir_fd);
+ err4:
+	close(dst_fd);
+ err3:
+	free(children);
+ err2:
+	free(strings);
+ err1:
+	free(records);
+ err0:
+	return -1;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dir_node.h"
+
+/* Directory of the manifest in the destination directory */
+#define MANIFEST_DIR ".dsync"
+
+/* Opaque type */
+struct manifest;
+
+struct manifest *manifest_open(const char *dst_path, bool prune);
+void manifest_free(struct manifest *M);
+void manifest_check_dir(struct manifest *M, struct dir_node *dir);
+void manifest_add_dir(struct manifest *M, struct dir_node *dir, size_t entry_cnt);
+bool manifest_prune_dir(struct manifest *M, struct dir_node *dir,
+                        int (*push_dir)(void *arg, struct dir_node *dir,
+                                        const char *name, size_t name_len),
+                        void *arg);
+bool manifest_file_unchanged(struct manifest *M, struct dir_node *dir,
+                             const char *name, const struct stat *src_statbuf);
+void manifest_add_file(struct manifest *M, struct dir_node *dir, const char *name,
+                       const struct stat *src_statbuf);
+int manifest_write(struct manifest *M);
+
+#endif /* MANIFEST_H */
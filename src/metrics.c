@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "sync_data_mpmc_queue.h"
+
+/* Interval of the progress line in milliseconds. */
+#define PROGRESS_INTERVAL 1000
+
+static const char *counter_names[METRICS_COUNTER_CNT] = {
+	"dirs_scanned",
+	"files_scanned",
+	"files_copied",
+	"files_skipped",
+	"bytes_copied",
+	"errors"
+};
+
+static const char *class_names[METRICS_CLASS_CNT] = {
+	"stat",
+	"dir",
+	"copy",
+	"set_times"
+};
+
+/*
+ * The slots of the sync threads come first, followed by the slots of the
+ * traversal threads. Threads are bound to slots by their ids, so traversal
+ * threads started again by --watch keep counting in the same slots.
+ */
+static struct metrics_slot *slots;
+static size_t sync_slot_cnt;
+static size_t slot_cnt;
+static uint64_t start_time;
+
+/*
+ * The reporter thread prints the progress line and the snapshots requested
+ * with SIGUSR1. The signal handler and metrics_stop_reporter wake it up by
+ * writing to ${wake_pipe}.
+ */
+static pthread_t reporter;
+static bool reporter_started;
+static bool progress_line;
+static int stop_reporter;
+static struct sync_data_mpmc_queue *const *queues;
+static size_t queue_cnt;
+static int wake_pipe[2] = {-1, -1};
+static volatile sig_atomic_t snapshot_requested;
+static sigset_t old_mask;
+
+__thread struct metrics_slot *metrics_slot;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Allocates the slots of ${sync_thread_cnt} sync threads and
+ * ${traverse_thread_cnt} traversal threads.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+metrics_init(uint8_t sync_thread_cnt, uint8_t traverse_thread_cnt)
+{
+	slot_cnt = (size_t) sync_thread_cnt + traverse_thread_cnt;
+	slots = calloc(slot_cnt, sizeof(struct metrics_slot));
+	if (slots == NULL)
+		return -1;
+	sync_slot_cnt = sync_thread_cnt;
+	start_time = now_ns();
+	return 0;
+}
+
+/*
+ * Frees the slots. Threads must not count anymore.
+ */
+void
+metrics_free(void)
+{
+	metrics_slot = NULL;
+	free(slots);
+	slots = NULL;
+	slot_cnt = 0;
+	return;
+}
+
+/*
+ * Makes the calling thread count in the slot of sync thread ${id}.
+ */
+void
+metrics_bind_sync_thread(uint8_t id)
+{
+	if (slots != NULL && id < sync_slot_cnt)
+		metrics_slot = &slots[id];
+	return;
+}
+
+/*
+ * Makes the calling thread count in the slot of traversal thread ${id}.
+ */
+void
+metrics_bind_traverse_thread(uint8_t id)
+{
+	if (slots != NULL && sync_slot_cnt + id < slot_cnt)
+		metrics_slot = &slots[sync_slot_cnt + id];
+	return;
+}
+
+/*
+ * Sums up ${counter} of all the slots.
+ */
+static uint64_t
+total(enum metrics_counter counter)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < slot_cnt; ++i)
+		sum += __atomic_load_n(&slots[i].counters[counter], __ATOMIC_RELAXED);
+	return sum;
+}
+
+/*
+ * Returns ${counter} summed up over the ${cnt} sync threads starting at sync
+ * thread ${first_id}.
+ */
+uint64_t
+metrics_sync_total(enum metrics_counter counter, uint8_t first_id, uint8_t cnt)
+{
+	uint64_t sum = 0;
+	for (size_t i = first_id; i < (size_t) first_id + cnt && i < sync_slot_cnt; ++i)
+		sum += __atomic_load_n(&slots[i].counters[counter], __ATOMIC_RELAXED);
+	return sum;
+}
+
+/*
+ * Returns the upper bound in nanoseconds of the bucket of ${hist} below which
+ * ${percent} percent of the ${cnt} latencies are.
+ */
+static uint64_t
+percentile(const uint64_t *hist, uint64_t cnt, unsigned int percent)
+{
+	uint64_t target = (cnt * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (unsigned int b = 0; b < METRICS_HIST_SIZE; ++b) {
+		seen += hist[b];
+		if (seen >= target)
+			return (uint64_t) 1 << b;
+	}
+	return (uint64_t) 1 << (METRICS_HIST_SIZE - 1);
+}
+
+/*
+ * Returns the number of entries in all the queues.
+ */
+static size_t
+queue_depth(void)
+{
+	size_t depth = 0;
+	for (size_t i = 0; i < queue_cnt; ++i)
+		depth += sync_data_mpmc_queue_depth(queues[i]);
+	return depth;
+}
+
+/*
+ * Writes a JSON object with the totals, rates, latency percentiles and per
+ * thread counters on one line to ${stream}. ${event} tells what it is, e.g.,
+ * "summary" or "snapshot".
+ */
+void
+metrics_write_json(FILE *stream, const char *event)
+{
+	if (slots == NULL)
+		return;
+
+	double elapsed = (double) (now_ns() - start_time) / 1e9;
+	flockfile(stream);
+	fprintf(stream, "{\"event\":\"%s\",\"elapsed_s\":%.3f", event, elapsed);
+	for (int c = 0; c < METRICS_COUNTER_CNT; ++c)
+		fprintf(stream, ",\"%s\":%" PRIu64, counter_names[c], total(c));
+	if (elapsed > 0) {
+		fprintf(stream, ",\"files_per_s\":%.1f,\"bytes_per_s\":%.0f",
+		        (double) (total(METRICS_FILES_COPIED) + total(METRICS_FILES_SKIPPED)) /
+		        elapsed, (double) total(METRICS_BYTES_COPIED) / elapsed);
+	}
+	if (queue_cnt > 0)
+		fprintf(stream, ",\"queue_depth\":%zu", queue_depth());
+
+	fprintf(stream, ",\"latency_ns\":{");
+	for (int c = 0; c < METRICS_CLASS_CNT; ++c) {
+		uint64_t hist[METRICS_HIST_SIZE] = {0};
+		uint64_t cnt = 0;
+		uint64_t sum = 0;
+		for (size_t i = 0; i < slot_cnt; ++i) {
+			for (int b = 0; b < METRICS_HIST_SIZE; ++b) {
+				uint64_t n = __atomic_load_n(&slots[i].latency_hist[c][b],
+				                             __ATOMIC_RELAXED);
+				hist[b] += n;
+				cnt += n;
+			}
+			sum += __atomic_load_n(&slots[i].latency_sum[c], __ATOMIC_RELAXED);
+		}
+		fprintf(stream, "%s\"%s\":{\"count\":%" PRIu64 ",\"mean\":%" PRIu64
+		        ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 "}",
+		        c == 0 ? "" : ",", class_names[c], cnt, cnt > 0 ? sum / cnt : 0,
+		        cnt > 0 ? percentile(hist, cnt, 50) : 0,
+		        cnt > 0 ? percentile(hist, cnt, 90) : 0,
+		        cnt > 0 ? percentile(hist, cnt, 99) : 0);
+	}
+	fprintf(stream, "}");
+
+	fprintf(stream, ",\"threads\":[");
+	for (size_t i = 0; i < slot_cnt; ++i) {
+		bool sync = i < sync_slot_cnt;
+		fprintf(stream, "%s{\"role\":\"%s\",\"id\":%zu", i == 0 ? "" : ",",
+		        sync ? "sync" : "traverse", sync ? i : i - sync_slot_cnt);
+		for (int c = 0; c < METRICS_COUNTER_CNT; ++c) {
+			uint64_t n = __atomic_load_n(&slots[i].counters[c], __ATOMIC_RELAXED);
+			if (n != 0)
+				fprintf(stream, ",\"%s\":%" PRIu64, counter_names[c], n);
+		}
+		fprintf(stream, "}");
+	}
+	fprintf(stream, "]}\n");
+	fflush(stream);
+	funlockfile(stream);
+	return;
+}
+
+/*
+ * Prints the progress line to stderr, overwriting the previous one if stderr
+ * is a terminal. ${last_*} are the totals of the previous line for the rates,
+ * which are updated.
+ */
+static void
+print_progress(uint64_t *last_time, uint64_t *last_files, uint64_t *last_bytes)
+{
+	uint64_t time = now_ns();
+	uint64_t files = total(METRICS_FILES_COPIED) + total(METRICS_FILES_SKIPPED);
+	uint64_t bytes = total(METRICS_BYTES_COPIED);
+	double interval = (double) (time - *last_time) / 1e9;
+	if (interval <= 0)
+		interval = 1;
+
+	fprintf(stderr, "%s%" PRIu64 " files scanned, %" PRIu64 " copied, %" PRIu64
+	        " skipped, %.1f MiB copied, %.0f files/s, %.1f MiB/s, queue %zu, %"
+	        PRIu64 " errors%s", isatty(STDERR_FILENO) ? "\r" : "",
+	        total(METRICS_FILES_SCANNED), total(METRICS_FILES_COPIED),
+	        total(METRICS_FILES_SKIPPED), (double) bytes / (1024 * 1024),
+	        (double) (files - *last_files) / interval,
+	        (double) (bytes - *last_bytes) / (1024 * 1024) / interval,
+	        queue_depth(),
+	        total(METRICS_ERRORS), isatty(STDERR_FILENO) ? "\033[K" : "\n");
+	fflush(stderr);
+
+	*last_time = time;
+	*last_files = files;
+	*last_bytes = bytes;
+	return;
+}
+
+static void
+handle_sigusr1(int sig)
+{
+	(void) sig;
+	int err = errno;
+	snapshot_requested = 1;
+	/* Nothing to do if the pipe is full, the reporter is waking up anyway. */
+	ssize_t ret = write(wake_pipe[1], "", 1);
+	(void) ret;
+	errno = err;
+	return;
+}
+
+/*
+ * Waits for SIGUSR1, which is only unblocked in this thread, and writes a
+ * snapshot to stderr every time it comes, printing the progress line every
+ * PROGRESS_INTERVAL milliseconds in between if asked to.
+ *
+ * Returns NULL.
+ */
+static void *
+reporter_func(void *data)
+{
+	(void) data;
+	uint64_t last_time = start_time;
+	uint64_t last_files = 0;
+	uint64_t last_bytes = 0;
+	uint64_t next_progress = start_time + (uint64_t) PROGRESS_INTERVAL * 1000000;
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	while (__atomic_load_n(&stop_reporter, __ATOMIC_ACQUIRE) == 0) {
+		int timeout = -1;
+		if (progress_line) {
+			uint64_t time = now_ns();
+			timeout = next_progress > time
+				? (int) ((next_progress - time) / 1000000) + 1
+				: 0;
+		}
+		struct pollfd pfd = {wake_pipe[0], POLLIN, 0};
+		if (poll(&pfd, 1, timeout) > 0) {
+			char buf[64];
+			ssize_t ret = read(wake_pipe[0], buf, sizeof(buf));
+			(void) ret;
+		}
+
+		if (snapshot_requested) {
+			snapshot_requested = 0;
+			metrics_write_json(stderr, "snapshot");
+		}
+		if (progress_line && now_ns() >= next_progress) {
+			print_progress(&last_time, &last_files, &last_bytes);
+			next_progress += (uint64_t) PROGRESS_INTERVAL * 1000000;
+		}
+	}
+
+	if (progress_line) {
+		print_progress(&last_time, &last_files, &last_bytes);
+		if (isatty(STDERR_FILENO))
+			fprintf(stderr, "\n");
+	}
+	return NULL;
+}
+
+/*
+ * Starts the reporter thread, which prints the progress line if ${progress}
+ * is set and a snapshot on SIGUSR1. The summed up depth of the ${Q_cnt} queues
+ * of ${Qs}, which must be kept until the reporter is stopped, is reported.
+ * SIGUSR1 is blocked in the calling thread, so this must be called before the
+ * other threads are created for them to block it too.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+metrics_start_reporter(bool progress, struct sync_data_mpmc_queue *const *Qs,
+                       size_t Q_cnt)
+{
+	int ret;
+
+	progress_line = progress;
+	queues = Qs;
+	queue_cnt = Q_cnt;
+	if (pipe(wake_pipe) != 0)
+		goto err0;
+	if (fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	    fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC) != 0)
+		goto err1;
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	ret = pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	if (ret != 0) {
+		errno = ret;
+		goto err1;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigusr1;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL) != 0)
+		goto err2;
+
+	ret = pthread_create(&reporter, NULL, reporter_func, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto err2;
+	}
+	reporter_started = true;
+	return 0;
+
+ err2:
+	ret = errno;
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	errno = ret;
+ err1:
+	ret = errno;
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+	errno = ret;
+ err0:
+	return -1;
+}
+
+/*
+ * Stops the reporter thread, which prints the last progress line, and
+ * restores the signal mask of the calling thread.
+ */
+void
+metrics_stop_reporter(void)
+{
+	if (!reporter_started)
+		return;
+
+	__atomic_store_n(&stop_reporter, 1, __ATOMIC_RELEASE);
+	ssize_t ret = write(wake_pipe[1], "", 1);
+	(void) ret;
+	pthread_join(reporter, NULL);
+	reporter_started = false;
+
+	/* SIGUSR1 stays blocked until it is ignored, so one sent now is
+	   dropped rather than killing dsync. */
+	signal(SIGUSR1, SIG_IGN);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+	return;
+}
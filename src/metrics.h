@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sync_thread.h"
+
+/* Latencies are counted in buckets of powers of two nanoseconds, the last one
+   taking everything from about 9 minutes on. */
+#define METRICS_HIST_SIZE 40
+
+enum metrics_counter {
+	METRICS_DIRS_SCANNED,
+	METRICS_FILES_SCANNED,
+	METRICS_FILES_COPIED,
+	METRICS_FILES_SKIPPED,
+	METRICS_BYTES_COPIED,
+	METRICS_ERRORS,
+	METRICS_COUNTER_CNT
+};
+
+/* Classes of syscalls whose latencies are measured. */
+enum metrics_class {
+	/* fstatat of files by traversal and sync threads */
+	METRICS_STAT,
+	/* opening (and creating) directories by traversal threads */
+	METRICS_DIR,
+	/* copying a file's data, including opening and closing it where that
+	   isn't batched with io_uring */
+	METRICS_COPY,
+	/* setting the timestamps of a synced file */
+	METRICS_SET_TIMES,
+	METRICS_CLASS_CNT
+};
+
+struct sync_data_mpmc_queue;
+
+/*
+ * Counters of one thread, which only that thread writes. They are updated with
+ * relaxed atomic stores rather than read-modify-writes, so counting costs as
+ * much as a plain increment, and other threads sum them up with relaxed loads
+ * without any lock. The paddings keep the slots of different threads on
+ * separate cachelines.
+ */
+struct metrics_slot {
+	uint8_t pad0[CACHELINE_SIZE];
+	uint64_t counters[METRICS_COUNTER_CNT];
+	uint64_t latency_sum[METRICS_CLASS_CNT];
+	uint64_t latency_hist[METRICS_CLASS_CNT][METRICS_HIST_SIZE];
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+/* Slot of the calling thread, NULL for threads without one in which case
+   nothing is counted. It is thread local so that it doesn't have to be passed
+   down to everything that counts. */
+extern __thread struct metrics_slot *metrics_slot;
+
+int metrics_init(uint8_t sync_thread_cnt, uint8_t traverse_thread_cnt);
+void metrics_free(void);
+void metrics_bind_sync_thread(uint8_t id);
+void metrics_bind_traverse_thread(uint8_t id);
+int metrics_start_reporter(bool progress, struct sync_data_mpmc_queue *const *Qs,
+                           size_t Q_cnt);
+void metrics_stop_reporter(void);
+void metrics_write_json(FILE *stream, const char *event);
+uint64_t metrics_sync_total(enum metrics_counter counter, uint8_t first_id,
+                            uint8_t cnt);
+
+/*
+ * Adds ${n} to ${counter} of the calling thread.
+ */
+static inline void
+metrics_add(enum metrics_counter counter, uint64_t n)
+{
+	struct metrics_slot *slot = metrics_slot;
+	if (slot != NULL)
+		__atomic_store_n(&slot->counters[counter], slot->counters[counter] + n,
+		                 __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Returns the current time in nanoseconds for metrics_record, 0 if the calling
+ * thread doesn't count.
+ */
+static inline uint64_t
+metrics_now(void)
+{
+	if (metrics_slot == NULL)
+		return 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Records the latency of a syscall of ${class} that started at ${start} (from
+ * metrics_now) for the calling thread.
+ */
+static inline void
+metrics_record(enum metrics_class class, uint64_t start)
+{
+	struct metrics_slot *slot = metrics_slot;
+	if (slot == NULL)
+		return;
+
+	uint64_t ns = metrics_now() - start;
+	/* Bucket b holds latencies in [2^(b - 1), 2^b). */
+	unsigned int bucket = ns == 0 ? 0 : 64 - (unsigned int) __builtin_clzll(ns);
+	if (bucket >= METRICS_HIST_SIZE)
+		bucket = METRICS_HIST_SIZE - 1;
+	__atomic_store_n(&slot->latency_hist[class][bucket],
+	                 slot->latency_hist[class][bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->latency_sum[class], slot->latency_sum[class] + ns,
+	                 __ATOMIC_RELAXED);
+	return;
+}
+
+#endif /* METRICS_H */
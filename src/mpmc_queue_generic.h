@@ -16,12 +16,19 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include "eventcount.h"
 
 #define CACHELINE_SIZE 64
 
-#define MPMC_QUEUE_DECLARE(prefix, type, copy_fn)                                          \
+/* Bounds of the adaptive spin before sleeping in enqueue_wait/dequeue_wait. */
+#define MPMC_QUEUE_SPIN_MIN 16
+#define MPMC_QUEUE_SPIN_MAX 4096
+
+#define MPMC_QUEUE_DECLARE(prefix, type, copy_fn)                                 \
                                                                                   \
-struct queue_entry {                                                              \
+struct prefix##_queue_entry {                                                     \
     size_t seq;                                                                   \
     type data;                                                                    \
 };                                                                                \
@@ -32,13 +39,21 @@ struct queue_entry {
  */                                                                               \
 struct prefix##_mpmc_queue {                                                      \
     uint8_t pad0[CACHELINE_SIZE];                                                 \
-    struct queue_entry *queue;                                                    \
+    struct prefix##_queue_entry *queue;                                           \
     size_t queue_mask;                                                            \
+    size_t spin_max;                                                              \
+    int closed;                                                                   \
     uint8_t pad1[CACHELINE_SIZE];                                                 \
     size_t enqueue_pos;                                                           \
+    size_t enqueue_spin;                                                          \
     uint8_t pad2[CACHELINE_SIZE];                                                 \
     size_t dequeue_pos;                                                           \
+    size_t dequeue_spin;                                                          \
     uint8_t pad3[CACHELINE_SIZE];                                                 \
+    struct eventcount not_empty;                                                  \
+    uint8_t pad4[CACHELINE_SIZE];                                                 \
+    struct eventcount not_full;                                                   \
+    uint8_t pad5[CACHELINE_SIZE];                                                 \
 };                                                                                \
                                                                                   \
 /*                                                                                \
@@ -52,19 +67,33 @@ struct prefix##_mpmc_queue *
 prefix##_mpmc_queue_init(size_t queue_length)                                     \
 {                                                                                 \
     assert(queue_length >= 2 && (queue_length & (queue_length - 1)) == 0);        \
-    assert(queue_length <= SIZE_MAX / sizeof(struct queue_entry));                \
+    assert(queue_length <= SIZE_MAX / sizeof(struct prefix##_queue_entry));       \
                                                                                   \
     struct prefix##_mpmc_queue *Q = malloc(sizeof(struct prefix##_mpmc_queue));   \
     if (Q == NULL)                                                                \
         goto err0;                                                                \
                                                                                   \
-    size_t size = queue_length * sizeof(struct queue_entry);                      \
-    struct queue_entry *queue = malloc(size);                                     \
+    size_t size = queue_length * sizeof(struct prefix##_queue_entry);             \
+    struct prefix##_queue_entry *queue = malloc(size);                            \
     if (queue == NULL)                                                            \
         goto err1;                                                                \
                                                                                   \
+    if (eventcount_init(&Q->not_empty) != 0)                                      \
+        goto err2;                                                                \
+    if (eventcount_init(&Q->not_full) != 0)                                       \
+        goto err3;                                                                \
+                                                                                  \
     Q->queue = queue;                                                             \
     Q->queue_mask = queue_length - 1;                                             \
+    /* Spinning before sleeping only makes sense if there is some other cpu       \
+       that can make progress meanwhile. */                                       \
+    long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);                                 \
+    Q->spin_max = cpu_cnt > 1 ? MPMC_QUEUE_SPIN_MAX : 0;                          \
+    size_t spin = Q->spin_max < MPMC_QUEUE_SPIN_MIN ? Q->spin_max                 \
+                                                    : MPMC_QUEUE_SPIN_MIN;        \
+    __atomic_store_n(&Q->enqueue_spin, spin, __ATOMIC_RELAXED);                   \
+    __atomic_store_n(&Q->dequeue_spin, spin, __ATOMIC_RELAXED);                   \
+    __atomic_store_n(&Q->closed, 0, __ATOMIC_RELAXED);                            \
                                                                                   \
     for (size_t i = 0; i < queue_length; ++i) {                                   \
         __atomic_store_n(&Q->queue[i].seq, i, __ATOMIC_RELAXED);                  \
@@ -74,6 +103,10 @@ prefix##_mpmc_queue_init(size_t queue_length)
                                                                                   \
     return Q;                                                                     \
                                                                                   \
+ err3:                                                                            \
+    eventcount_destroy(&Q->not_empty);                                            \
+ err2:                                                                            \
+    free(queue);                                                                  \
  err1:                                                                            \
     free(Q);                                                                      \
                                                                                   \
@@ -88,6 +121,8 @@ void
 prefix##_mpmc_queue_free(struct prefix##_mpmc_queue *Q)                           \
 {                                                                                 \
     if (Q != NULL) {                                                              \
+        eventcount_destroy(&Q->not_full);                                         \
+        eventcount_destroy(&Q->not_empty);                                        \
         free(Q->queue);                                                           \
         free(Q);                                                                  \
     }                                                                             \
@@ -101,9 +136,9 @@ prefix##_mpmc_queue_free(struct prefix##_mpmc_queue *Q)
  * is full.                                                                       \
  */                                                                               \
 int                                                                               \
-prefix##_mpmc_queue_enqueue(struct prefix##_mpmc_queue *Q, type *data)             \
+prefix##_mpmc_queue_enqueue(struct prefix##_mpmc_queue *Q, type *data)            \
 {                                                                                 \
-    struct queue_entry *entry;                                                    \
+    struct prefix##_queue_entry *entry;                                           \
     size_t mask = Q->queue_mask;                                                  \
     size_t pos = __atomic_load_n(&Q->enqueue_pos, __ATOMIC_RELAXED);              \
                                                                                   \
@@ -122,8 +157,9 @@ prefix##_mpmc_queue_enqueue(struct prefix##_mpmc_queue *Q, type *data)
         }                                                                         \
     }                                                                             \
                                                                                   \
-    copy_fn(data, &(entry->data));                                                           \
+    copy_fn(data, &(entry->data));                                                \
     __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);                     \
+    eventcount_notify(&Q->not_empty, 1);                                          \
                                                                                   \
     return 0;                                                                     \
  }                                                                                \
@@ -137,7 +173,7 @@ prefix##_mpmc_queue_enqueue(struct prefix##_mpmc_queue *Q, type *data)
 int                                                                               \
 prefix##_mpmc_queue_dequeue(struct prefix##_mpmc_queue *Q, type *data)            \
 {                                                                                 \
-    struct queue_entry *entry;                                                    \
+    struct prefix##_queue_entry *entry;                                           \
     size_t mask = Q->queue_mask;                                                  \
     size_t pos = __atomic_load_n(&Q->dequeue_pos, __ATOMIC_RELAXED);              \
                                                                                   \
@@ -156,10 +192,253 @@ prefix##_mpmc_queue_dequeue(struct prefix##_mpmc_queue *Q, type *data)
         }                                                                         \
     }                                                                             \
                                                                                   \
-    copy_fn(&(entry->data), data);                                                          \
+    copy_fn(&(entry->data), data);                                                \
     __atomic_store_n(&entry->seq, pos + mask + 1, __ATOMIC_RELEASE);              \
+    eventcount_notify(&Q->not_full, 1);                                           \
+                                                                                  \
+    return 0;                                                                     \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Enqueue up to ${n} entries from ${data} claiming contiguous slots with a       \
+ * single CAS on enqueue_pos.                                                     \
+ *                                                                                \
+ * Returns the number of entries enqueued which is 0 when queue is full.          \
+ */                                                                               \
+size_t                                                                            \
+prefix##_mpmc_queue_enqueue_bulk(struct prefix##_mpmc_queue *Q, type *data,       \
+                                 size_t n)                                        \
+{                                                                                 \
+    struct prefix##_queue_entry *entry;                                           \
+    size_t mask = Q->queue_mask;                                                  \
+    size_t pos = __atomic_load_n(&Q->enqueue_pos, __ATOMIC_RELAXED);              \
+    size_t cnt;                                                                   \
+                                                                                  \
+    while(true) {                                                                 \
+        entry = &Q->queue[pos & mask];                                            \
+        size_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);              \
+                                                                                  \
+        if (seq == pos) {                                                         \
+            cnt = 1;                                                              \
+            while (cnt < n) {                                                     \
+                entry = &Q->queue[(pos + cnt) & mask];                            \
+                seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);             \
+                if (seq != (size_t)(pos + cnt))                                   \
+                    break;                                                        \
+                ++cnt;                                                            \
+            }                                                                     \
+            if (__atomic_compare_exchange_n(&Q->enqueue_pos, &pos, pos + cnt,     \
+                                            true, __ATOMIC_RELAXED,               \
+                                            __ATOMIC_RELAXED))                    \
+                break;                                                            \
+        } else if (seq < pos) {                                                   \
+            return 0;                                                             \
+        } else {                                                                  \
+            pos = __atomic_load_n(&Q->enqueue_pos, __ATOMIC_RELAXED);             \
+        }                                                                         \
+    }                                                                             \
+                                                                                  \
+    for (size_t i = 0; i < cnt; ++i) {                                            \
+        entry = &Q->queue[(pos + i) & mask];                                      \
+        copy_fn(&data[i], &(entry->data));                                        \
+        __atomic_store_n(&entry->seq, pos + i + 1, __ATOMIC_RELEASE);             \
+    }                                                                             \
+    eventcount_notify(&Q->not_empty, cnt);                                        \
+                                                                                  \
+    return cnt;                                                                   \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Dequeue up to ${n} next queue entries into ${data} claiming contiguous slots   \
+ * with a single CAS on dequeue_pos.                                              \
+ *                                                                                \
+ * Returns the number of entries dequeued which is 0 when queue is empty.         \
+ */                                                                               \
+size_t                                                                            \
+prefix##_mpmc_queue_dequeue_bulk(struct prefix##_mpmc_queue *Q, type *data,       \
+                                 size_t n)                                        \
+{                                                                                 \
+    struct prefix##_queue_entry *entry;                                           \
+    size_t mask = Q->queue_mask;                                                  \
+    size_t pos = __atomic_load_n(&Q->dequeue_pos, __ATOMIC_RELAXED);              \
+    size_t cnt;                                                                   \
+                                                                                  \
+    while(true) {                                                                 \
+        entry = &Q->queue[pos & mask];                                            \
+        size_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);              \
+                                                                                  \
+        if (seq == (size_t)(pos + 1)) {                                           \
+            cnt = 1;                                                              \
+            while (cnt < n) {                                                     \
+                entry = &Q->queue[(pos + cnt) & mask];                            \
+                seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);             \
+                if (seq != (size_t)(pos + cnt + 1))                               \
+                    break;                                                        \
+                ++cnt;                                                            \
+            }                                                                     \
+            if (__atomic_compare_exchange_n(&Q->dequeue_pos, &pos, pos + cnt,     \
+                                            true, __ATOMIC_RELAXED,               \
+                                            __ATOMIC_RELAXED))                    \
+                break;                                                            \
+        } else if (seq < (size_t)(pos + 1)) {                                     \
+            return 0;                                                             \
+        } else {                                                                  \
+            pos = __atomic_load_n(&Q->dequeue_pos, __ATOMIC_RELAXED);             \
+        }                                                                         \
+    }                                                                             \
+                                                                                  \
+    for (size_t i = 0; i < cnt; ++i) {                                            \
+        entry = &Q->queue[(pos + i) & mask];                                      \
+        copy_fn(&(entry->data), &data[i]);                                        \
+        __atomic_store_n(&entry->seq, pos + i + mask + 1, __ATOMIC_RELEASE);      \
+    }                                                                             \
+    eventcount_notify(&Q->not_full, cnt);                                         \
+                                                                                  \
+    return cnt;                                                                   \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Spins up to ${*spin} times trying ${try_fn}. ${*spin} is adapted so that       \
+ * threads keep spinning for as long as spinning tends to pay off.                \
+ *                                                                                \
+ * Returns the number of entries ${try_fn} moved, 0 if it never succeeded.        \
+ */                                                                               \
+static inline size_t                                                              \
+prefix##_mpmc_queue_spin(struct prefix##_mpmc_queue *Q, size_t *spin,             \
+                         size_t (*try_fn)(struct prefix##_mpmc_queue *, type *,   \
+                                          size_t),                                \
+                         type *data, size_t n)                                    \
+{                                                                                 \
+    size_t limit = __atomic_load_n(spin, __ATOMIC_RELAXED);                       \
+    for (size_t i = 0; i < limit; ++i) {                                          \
+        size_t cnt = try_fn(Q, data, n);                                          \
+        if (cnt > 0) {                                                            \
+            if (limit < Q->spin_max)                                              \
+                __atomic_store_n(spin, limit * 2, __ATOMIC_RELAXED);              \
+            return cnt;                                                           \
+        }                                                                         \
+        cpu_relax();                                                              \
+    }                                                                             \
+    if (limit > MPMC_QUEUE_SPIN_MIN)                                              \
+        __atomic_store_n(spin, limit / 2, __ATOMIC_RELAXED);                      \
                                                                                   \
     return 0;                                                                     \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Enqueue all ${n} entries from ${data}, waiting for space if the queue is       \
+ * full. After a short spin, the caller sleeps until some entry is dequeued.      \
+ */                                                                               \
+void                                                                              \
+prefix##_mpmc_queue_enqueue_bulk_wait(struct prefix##_mpmc_queue *Q, type *data,  \
+                                      size_t n)                                   \
+{                                                                                 \
+    while (n > 0) {                                                               \
+        size_t cnt = prefix##_mpmc_queue_spin(Q, &Q->enqueue_spin,                \
+                                              prefix##_mpmc_queue_enqueue_bulk,   \
+                                              data, n);                           \
+        while (cnt == 0 &&                                                        \
+               (cnt = prefix##_mpmc_queue_enqueue_bulk(Q, data, n)) == 0) {       \
+            uint32_t key = eventcount_prepare_wait(&Q->not_full);                 \
+            cnt = prefix##_mpmc_queue_enqueue_bulk(Q, data, n);                   \
+            if (cnt > 0) {                                                        \
+                eventcount_cancel_wait(&Q->not_full);                             \
+                break;                                                            \
+            }                                                                     \
+            eventcount_wait(&Q->not_full, key);                                   \
+        }                                                                         \
+        data += cnt;                                                              \
+        n -= cnt;                                                                 \
+    }                                                                             \
+                                                                                  \
+    return;                                                                       \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Dequeue up to ${n} next queue entries into ${data}, waiting for entries if     \
+ * the queue is empty. After a short spin, the caller sleeps until some entry is  \
+ * enqueued or the queue is closed.                                               \
+ *                                                                                \
+ * Returns the number of entries dequeued which is 0 only when the queue is       \
+ * closed and empty.                                                              \
+ */                                                                               \
+size_t                                                                            \
+prefix##_mpmc_queue_dequeue_bulk_wait(struct prefix##_mpmc_queue *Q, type *data,  \
+                                      size_t n)                                   \
+{                                                                                 \
+    size_t cnt = prefix##_mpmc_queue_spin(Q, &Q->dequeue_spin,                    \
+                                          prefix##_mpmc_queue_dequeue_bulk,       \
+                                          data, n);                               \
+    if (cnt > 0)                                                                  \
+        return cnt;                                                               \
+                                                                                  \
+    while ((cnt = prefix##_mpmc_queue_dequeue_bulk(Q, data, n)) == 0) {           \
+        uint32_t key = eventcount_prepare_wait(&Q->not_empty);                    \
+        cnt = prefix##_mpmc_queue_dequeue_bulk(Q, data, n);                       \
+        if (cnt > 0) {                                                            \
+            eventcount_cancel_wait(&Q->not_empty);                                \
+            break;                                                                \
+        }                                                                         \
+        if (__atomic_load_n(&Q->closed, __ATOMIC_ACQUIRE) == 1) {                 \
+            eventcount_cancel_wait(&Q->not_empty);                                \
+            /* Everything enqueued before closing is visible now. */              \
+            return prefix##_mpmc_queue_dequeue_bulk(Q, data, n);                  \
+        }                                                                         \
+        eventcount_wait(&Q->not_empty, key);                                      \
+    }                                                                             \
+                                                                                  \
+    return cnt;                                                                   \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Enqueue ${data}, waiting for space if the queue is full.                       \
+ */                                                                               \
+void                                                                              \
+prefix##_mpmc_queue_enqueue_wait(struct prefix##_mpmc_queue *Q, type *data)       \
+{                                                                                 \
+    prefix##_mpmc_queue_enqueue_bulk_wait(Q, data, 1);                            \
+    return;                                                                       \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Dequeue next queue entry into ${*data}, waiting for an entry if the queue is   \
+ * empty.                                                                         \
+ *                                                                                \
+ * Returns 0 when an entry is successfully dequeued. Otherwise, returns -1 when   \
+ * the queue is closed and empty.                                                 \
+ */                                                                               \
+int                                                                               \
+prefix##_mpmc_queue_dequeue_wait(struct prefix##_mpmc_queue *Q, type *data)       \
+{                                                                                 \
+    return prefix##_mpmc_queue_dequeue_bulk_wait(Q, data, 1) == 1 ? 0 : -1;       \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Returns the number of entries in the queue. Entries being enqueued or          \
+ * dequeued concurrently may or may not be counted, so this is only an estimate   \
+ * for monitoring.                                                                \
+ */                                                                               \
+size_t                                                                            \
+prefix##_mpmc_queue_depth(struct prefix##_mpmc_queue *Q)                          \
+{                                                                                 \
+    size_t dequeue_pos = __atomic_load_n(&Q->dequeue_pos, __ATOMIC_RELAXED);      \
+    size_t enqueue_pos = __atomic_load_n(&Q->enqueue_pos, __ATOMIC_RELAXED);      \
+    size_t depth = enqueue_pos - dequeue_pos;                                     \
+    /* The positions are loaded one after the other, so they may be off. */       \
+    return depth > Q->queue_mask + 1 ? 0 : depth;                                 \
+}                                                                                 \
+                                                                                  \
+/*                                                                                \
+ * Close queue i.e., tell consumers waiting in dequeue_wait that nothing more     \
+ * will be enqueued. Must be called after all the enqueues are done, except for   \
+ * ones that the caller drains itself once the consumers are gone.                \
+ */                                                                               \
+void                                                                              \
+prefix##_mpmc_queue_close(struct prefix##_mpmc_queue *Q)                          \
+{                                                                                 \
+    __atomic_store_n(&Q->closed, 1, __ATOMIC_RELEASE);                            \
+    eventcount_notify(&Q->not_empty, UINT32_MAX);                                 \
+    return;                                                                       \
 }
 
 #endif /* MPMC_QUEUE_GENERIC_H */
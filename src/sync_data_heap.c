@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sync_data_heap.h"
+#include "sync_thread.h"
+
+/*
+ * Bounded max-heap of files to be synced keyed by their size, so that the
+ * largest of the queued files is synced first. Only large files go through it
+ * which are few compared to the rest, so a lock is good enough. Like the queue,
+ * it is bounded as every entry keeps its directory open.
+ */
+struct sync_data_heap {
+	uint8_t pad0[CACHELINE_SIZE];
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct sync_data *entries;
+	size_t cnt;
+	size_t capacity;
+	bool closed;
+	uint8_t pad1[CACHELINE_SIZE];
+};
+
+static inline off_t
+key(struct sync_data *data)
+{
+	return data->stat.size;
+}
+
+/*
+ * Initialize heap that holds up to ${capacity} entries.
+ *
+ * Returns the heap on success, NULL on failure. Sets errno on failure.
+ */
+struct sync_data_heap *
+sync_data_heap_init(size_t capacity)
+{
+	int ret;
+
+	struct sync_data_heap *H = malloc(sizeof(struct sync_data_heap));
+	if (H == NULL)
+		goto err0;
+
+	H->entries = malloc(capacity * sizeof(struct sync_data));
+	if (H->entries == NULL)
+		goto err1;
+
+	ret = pthread_mutex_init(&H->lock, NULL);
+	if (ret != 0)
+		goto err2;
+	ret = pthread_cond_init(&H->not_empty, NULL);
+	if (ret != 0)
+		goto err3;
+	ret = pthread_cond_init(&H->not_full, NULL);
+	if (ret != 0)
+		goto err4;
+
+	H->cnt = 0;
+	H->capacity = capacity;
+	H->closed = false;
+	return H;
+
+ err4:
+	pthread_cond_destroy(&H->not_empty);
+ err3:
+	pthread_mutex_destroy(&H->lock);
+ err2:
+	free(H->entries);
+	errno = ret;
+ err1:
+	free(H);
+ err0:
+	return NULL;
+}
+
+/*
+ * Free heap. Entries that are still in the heap are not released.
+ */
+void
+sync_data_heap_free(struct sync_data_heap *H)
+{
+	if (H == NULL)
+		return;
+
+	pthread_cond_destroy(&H->not_full);
+	pthread_cond_destroy(&H->not_empty);
+	pthread_mutex_destroy(&H->lock);
+	free(H->entries);
+	free(H);
+	return;
+}
+
+/*
+ * Adds ${data} to the heap, waiting for space if the heap is full.
+ */
+void
+sync_data_heap_push_wait(struct sync_data_heap *H, struct sync_data *data)
+{
+	pthread_mutex_lock(&H->lock);
+	while (H->cnt == H->capacity)
+		pthread_cond_wait(&H->not_full, &H->lock);
+
+	size_t i = H->cnt++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (key(&H->entries[parent]) >= key(data))
+			break;
+		H->entries[i] = H->entries[parent];
+		i = parent;
+	}
+	H->entries[i] = *data;
+
+	pthread_cond_signal(&H->not_empty);
+	pthread_mutex_unlock(&H->lock);
+	return;
+}
+
+/*
+ * Removes the largest entry into ${data}. Must be called with ${H->lock} held
+ * and the heap not empty.
+ */
+static void
+pop_locked(struct sync_data_heap *H, struct sync_data *data)
+{
+	*data = H->entries[0];
+	struct sync_data *last = &H->entries[--H->cnt];
+
+	size_t i = 0;
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= H->cnt)
+			break;
+		if (child + 1 < H->cnt &&
+		    key(&H->entries[child + 1]) > key(&H->entries[child]))
+			++child;
+		if (key(last) >= key(&H->entries[child]))
+			break;
+		H->entries[i] = H->entries[child];
+		i = child;
+	}
+	H->entries[i] = *last;
+
+	pthread_cond_signal(&H->not_full);
+	return;
+}
+
+/*
+ * Removes the largest entry of the heap into ${data} if the heap is not empty.
+ *
+ * Returns 0 on success, -1 if the heap is empty.
+ */
+int
+sync_data_heap_pop(struct sync_data_heap *H, struct sync_data *data)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&H->lock);
+	if (H->cnt > 0) {
+		pop_locked(H, data);
+		rc = 0;
+	}
+	pthread_mutex_unlock(&H->lock);
+	return rc;
+}
+
+/*
+ * Removes the largest entry of the heap into ${data}, waiting while the heap
+ * is empty.
+ *
+ * Returns 0 on success, -1 if the heap has been closed and is empty.
+ */
+int
+sync_data_heap_pop_wait(struct sync_data_heap *H, struct sync_data *data)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&H->lock);
+	while (H->cnt == 0 && !H->closed)
+		pthread_cond_wait(&H->not_empty, &H->lock);
+	if (H->cnt > 0) {
+		pop_locked(H, data);
+		rc = 0;
+	}
+	pthread_mutex_unlock(&H->lock);
+	return rc;
+}
+
+/*
+ * Marks that no more entries will be added, waking up all the threads waiting
+ * for entries so that they return once the heap is empty.
+ */
+void
+sync_data_heap_close(struct sync_data_heap *H)
+{
+	pthread_mutex_lock(&H->lock);
+	H->closed = true;
+	pthread_cond_broadcast(&H->not_empty);
+	pthread_mutex_unlock(&H->lock);
+	return;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef SYNC_DATA_HEAP_H
+#define SYNC_DATA_HEAP_H
+
+#include <stddef.h>
+
+#include "sync_thread.h"
+
+/* Opaque type */
+struct sync_data_heap;
+
+struct sync_data_heap *sync_data_heap_init(size_t capacity);
+void sync_data_heap_free(struct sync_data_heap *H);
+void sync_data_heap_push_wait(struct sync_data_heap *H, struct sync_data *data);
+int sync_data_heap_pop(struct sync_data_heap *H, struct sync_data *data);
+int sync_data_heap_pop_wait(struct sync_data_heap *H, struct sync_data *data);
+void sync_data_heap_close(struct sync_data_heap *H);
+
+#endif /* SYNC_DATA_HEAP_H */
@@ -17,5 +17,19 @@ struct sync_data_mpmc_queue *sync_data_mpmc_queue_init(size_t queue_length);
 void sync_data_mpmc_queue_free(struct sync_data_mpmc_queue *Q);
 int sync_data_mpmc_queue_enqueue(struct sync_data_mpmc_queue *Q, struct sync_data *data);
 int sync_data_mpmc_queue_dequeue(struct sync_data_mpmc_queue *Q, struct sync_data *data);
+size_t sync_data_mpmc_queue_enqueue_bulk(struct sync_data_mpmc_queue *Q,
+                                        struct sync_data *data, size_t n);
+size_t sync_data_mpmc_queue_dequeue_bulk(struct sync_data_mpmc_queue *Q,
+                                        struct sync_data *data, size_t n);
+void sync_data_mpmc_queue_enqueue_bulk_wait(struct sync_data_mpmc_queue *Q,
+                                            struct sync_data *data, size_t n);
+size_t sync_data_mpmc_queue_dequeue_bulk_wait(struct sync_data_mpmc_queue *Q,
+                                              struct sync_data *data, size_t n);
+void sync_data_mpmc_queue_enqueue_wait(struct sync_data_mpmc_queue *Q,
+                                       struct sync_data *data);
+int sync_data_mpmc_queue_dequeue_wait(struct sync_data_mpmc_queue *Q,
+                                      struct sync_data *data);
+size_t sync_data_mpmc_queue_depth(struct sync_data_mpmc_queue *Q);
+void sync_data_mpmc_queue_close(struct sync_data_mpmc_queue *Q);
 
 #endif /* SYNC_DATA_MPMC_QUEUE_H */
@@ -3,54 +3,171 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#define _GNU_SOURCE /* for O_PATH */
+
 #include <sys/stat.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
+#include "dir_node.h"
+#include "sync_directory.h"
 #include "utils.h"
 
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+/* Directories that only need to be searched (i.e., used as the directory file
+   descriptor of *at syscalls) don't need read permission where O_PATH or
+   O_SEARCH is available. */
+#if defined(O_PATH)
+#define DIR_SEARCH_FLAGS (O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#elif defined(O_SEARCH)
+#define DIR_SEARCH_FLAGS (O_SEARCH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#else
+#define DIR_SEARCH_FLAGS DIR_OPEN_FLAGS
+#endif
+
+/*
+ * Opens the source directory of ${node}, relative to the parent's source
+ * directory if there is a parent.
+ *
+ * Returns the file descriptor on success, -1 on failure. Sets errno on failure.
+ */
+static int
+open_src_directory(struct dir_node *node)
+{
+	if (node->parent != NULL)
+		return openat(node->parent->src_fd, node->name, DIR_OPEN_FLAGS);
+
+	int fd = open(node->src, DIR_OPEN_FLAGS);
+	/* Parents of sources given on the command line may not be readable. */
+	if (fd == -1 && errno == EACCES && node->is_dst_root)
+		fd = open(node->src, DIR_SEARCH_FLAGS);
+	return fd;
+}
+
 /*
- * Syncs ${src} directory to ${dst} directory. If ${dst} doesn't exist, it is
- * created with ${src}'s mode. If ${dst} exists, it's mode is set to ${src}'s
- * mode if not already.
+ * Syncs ${node}'s source directory to its destination directory and opens the
+ * directory file descriptors of ${node}. If the destination directory doesn't
+ * exist, it is created with the source's mode. If it exists, it's mode is set to
+ * the source's mode if not already. Destination directories of nodes with
+ * ${is_dst_root} set are only opened.
  *
  * Returns 0 on success, -1 on fatal error which means that the caller should
  * not move forward with the directory, -2 on non fatal error.
  */
 int
-sync_directory(char *src, char *dst)
+sync_directory(struct dir_node *node)
 {
+	int rc = 0;
 	int ret;
 
+	int dst_dirfd = node->parent != NULL ? node->parent->dst_fd : AT_FDCWD;
+	char *dst_name = node->parent != NULL ? node->name : node->dst;
+
+	node->src_fd = open_src_directory(node);
+	if (node->src_fd == -1)
+		goto fatal_err;
+
 	struct stat src_statbuf;
-	ret = fstatat(AT_FDCWD, src, &src_statbuf,  AT_SYMLINK_NOFOLLOW);
+	ret = fstat(node->src_fd, &src_statbuf);
 	if (ret != 0)
 		goto fatal_err;
+	node->src_dev = src_statbuf.st_dev;
+	node->src_ctime = src_statbuf.st_ctim;
 
 	struct stat dst_statbuf;
-	ret = fstatat(AT_FDCWD, dst, &dst_statbuf, AT_SYMLINK_NOFOLLOW);
+	if (node->is_dst_root) {
+		node->dst_fd = openat(dst_dirfd, dst_name, DIR_OPEN_FLAGS);
+		if (node->dst_fd == -1)
+			goto fatal_err;
+		ret = fstat(node->dst_fd, &dst_statbuf);
+		if (ret != 0)
+			goto fatal_err;
+		node->dst_dev = dst_statbuf.st_dev;
+		node->dst_ctime = dst_statbuf.st_ctim;
+		goto done;
+	}
+
+	ret = fstatat(dst_dirfd, dst_name, &dst_statbuf, AT_SYMLINK_NOFOLLOW);
 	if (ret != 0) {
 		if (errno == ENOENT) {
-		 	ret = mkdir(dst, src_statbuf.st_mode);
+		 	ret = mkdirat(dst_dirfd, dst_name, src_statbuf.st_mode);
 			if (ret != 0)
 				goto fatal_err;
+			dst_statbuf.st_mode = src_statbuf.st_mode;
+			dst_statbuf.st_ctim.tv_sec = 0;
+			dst_statbuf.st_ctim.tv_nsec = 0;
+			/* A new directory is in the same filesystem as its parent. */
+			if (node->parent != NULL)
+				dst_statbuf.st_dev = node->parent->dst_dev;
+			else if (stat(node->dst, &dst_statbuf) != 0)
+				goto fatal_err;
 		} else
 			goto fatal_err;
-	} else if (src_statbuf.st_mode != dst_statbuf.st_mode) {
-		ret = fchmodat(AT_FDCWD, dst, src_statbuf.st_mode, AT_SYMLINK_NOFOLLOW);
+	}
+
+	node->dst_fd = openat(dst_dirfd, dst_name, DIR_OPEN_FLAGS);
+	if (node->dst_fd == -1)
+		goto fatal_err;
+	node->dst_dev = dst_statbuf.st_dev;
+	node->dst_ctime = dst_statbuf.st_ctim;
+
+	if (src_statbuf.st_mode != dst_statbuf.st_mode) {
+		ret = fchmod(node->dst_fd, src_statbuf.st_mode);
 		if (ret != 0) {
 			char *err = "Failed to update mode of directory %s";
-			print_error_and_reset_errno(errno, err, dst);
-			goto non_fatal_err;
+			print_error_and_reset_errno(errno, err, node->dst);
+			rc = -2;
 		}
 	}
 
-	return 0;
-
- non_fatal_err:
-	return -2;
+ done:
+	dir_node_release_parent(node);
+	return rc;
 
  fatal_err:
 	return -1;
 }
+
+/*
+ * Opens the directory file descriptors of ${node} like sync_directory does but
+ * without creating or changing its destination directory, which is what
+ * --verify needs.
+ *
+ * Returns 0 on success, -1 on failure, 1 if the destination directory doesn't
+ * exist or is not a directory. Sets errno on failure and to ENOENT or ENOTDIR
+ * respectively if 1 is returned.
+ */
+int
+open_directory(struct dir_node *node)
+{
+	int dst_dirfd = node->parent != NULL ? node->parent->dst_fd : AT_FDCWD;
+	char *dst_name = node->parent != NULL ? node->name : node->dst;
+
+	node->src_fd = open_src_directory(node);
+	if (node->src_fd == -1)
+		return -1;
+
+	struct stat statbuf;
+	if (fstat(node->src_fd, &statbuf) != 0)
+		return -1;
+	node->src_dev = statbuf.st_dev;
+	node->src_ctime = statbuf.st_ctim;
+
+	node->dst_fd = openat(dst_dirfd, dst_name, DIR_OPEN_FLAGS);
+	if (node->dst_fd == -1) {
+		/* O_NOFOLLOW fails with ELOOP for a symbolic link. */
+		if (errno == ELOOP)
+			errno = ENOTDIR;
+		return errno == ENOENT || errno == ENOTDIR ? 1 : -1;
+	}
+	if (fstat(node->dst_fd, &statbuf) != 0)
+		return -1;
+	node->dst_dev = statbuf.st_dev;
+	node->dst_ctime = statbuf.st_ctim;
+
+	dir_node_release_parent(node);
+	return 0;
+}
@@ -6,6 +6,9 @@
 #ifndef SYNC_DIRECTORY_H
 #define SYNC_DIRECTORY_H
 
-int sync_directory(char *src, char *dst);
+#include "dir_node.h"
+
+int sync_directory(struct dir_node *node);
+int open_directory(struct dir_node *node);
 
 #endif /* SYNC_DIRECTORY_H */
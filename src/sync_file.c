@@ -9,98 +9,359 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "copy_file.h"
+#include "copy_read_write.h"
 #include "copy_symlink.h"
+#include "dir_node.h"
+#include "link_table.h"
+#include "manifest.h"
+#include "metrics.h"
 #include "sync_file.h"
+#include "sync_options.h"
 #include "utils.h"
+#include "verify.h"
 
 /*
- * Syncs ${src} file to ${dst} file. If ${dst} doesn't exist or ${dst}'s size and
- * modification time don't match with ${src}, ${src} is copied to ${dst}. ${dst}'s
- * mode and timestamps are set equal to the ${src} if not already. Only regular
- * files or symbolic links are supported for syncing.
+ * Compares the contents of regular file ${name} of ${size} bytes in ${dir}'s
+ * source and destination directories.
  *
- * Returns 0 on success, -1 on failure.
+ * Returns true if they are the same, false if not or if they couldn't be
+ * compared.
+ */
+static bool
+same_contents(struct dir_node *dir, char *name, uintmax_t size)
+{
+	int ret = -1;
+
+	int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd == -1)
+		goto out;
+	int dst_fd = openat(dir->dst_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (dst_fd != -1) {
+		ret = copy_read_write_equal(src_fd, dst_fd, size);
+		close(dst_fd);
+	}
+	close(src_fd);
+
+ out:
+	/* A file that can't be compared is copied, which reports any real
+	   problem with it. */
+	errno = 0;
+	return ret == 1;
+}
+
+/*
+ * Decides whether ${name} needs to be copied given the source's ${src_statbuf}
+ * and the destination's ${dst_statbuf}. ${dst_err} is 0 if the destination was
+ * stat-ed successfully, otherwise the errno of the failed stat. If the file is
+ * in sync, the destination's mode is set to the source's if not already. With
+ * ${opts->compare}, regular files of at least ${opts->compare_min_size} bytes
+ * whose sizes match but modification times don't are compared and only their
+ * timestamps are set if their contents are the same, so that they are not
+ * written again.
+ *
+ * Returns 1 if the file needs to be copied, 0 if it is in sync, -1 on failure.
  */
 int
-sync_file(char *src, char *dst, bool force_copy)
+sync_file_compare(const struct sync_options *opts, struct dir_node *dir,
+                  char *name, struct stat *src_statbuf, struct stat *dst_statbuf,
+                  int dst_err)
 {
 	int ret;
 	char *err;
 
-	struct stat src_statbuf;
-	ret = fstatat(AT_FDCWD, src, &src_statbuf, AT_SYMLINK_NOFOLLOW);
+	if (src_statbuf->st_size < 0) {
+		err = "Skipping sync of file %s/%s. Got negative file size";
+		print_error_and_reset_errno(0, err, dir->src, name);
+		return -1;
+	}
+
+	if (opts->force_copy)
+		return 1;
+
+	if (dst_err != 0) {
+		if (dst_err != ENOENT) {
+			err = "Skipping sync of file %s/%s. Failed to stat destination %s/%s";
+			print_error_and_reset_errno(dst_err, err, dir->src, name, dir->dst, name);
+			return -1;
+		}
+		return 1;
+	}
+
+	if (src_statbuf->st_size != dst_statbuf->st_size)
+		return 1;
+
+	if (src_statbuf->st_mtim.tv_sec != dst_statbuf->st_mtim.tv_sec ||
+	    src_statbuf->st_mtim.tv_nsec != dst_statbuf->st_mtim.tv_nsec) {
+		uintmax_t size = (uintmax_t) src_statbuf->st_size;
+		if (!opts->compare || size < opts->compare_min_size ||
+		    !S_ISREG(src_statbuf->st_mode) || !S_ISREG(dst_statbuf->st_mode) ||
+		    !same_contents(dir, name, size))
+			return 1;
+		if (sync_file_set_times(dir, name, src_statbuf) != 0)
+			return -1;
+	}
+
+	if (src_statbuf->st_mode != dst_statbuf->st_mode) {
+		ret = fchmodat(dir->dst_fd, name, src_statbuf->st_mode,
+		               AT_SYMLINK_NOFOLLOW);
+		if (ret != 0) {
+			err = "Failed to update permissions for file %s/%s";
+			print_error_and_reset_errno(errno, err, dir->dst, name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sets the destination's timestamps of ${name} equal to the source's from
+ * ${src_statbuf}. This is the last step of syncing a copied file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+sync_file_set_times(struct dir_node *dir, char *name, struct stat *src_statbuf)
+{
+	struct timespec times[2] = {
+		{src_statbuf->st_atim.tv_sec, src_statbuf->st_atim.tv_nsec},
+		{src_statbuf->st_mtim.tv_sec, src_statbuf->st_mtim.tv_nsec}
+	};
+	uint64_t start = metrics_now();
+	int ret = utimensat(dir->dst_fd, name, times, AT_SYMLINK_NOFOLLOW);
+	metrics_record(METRICS_SET_TIMES, start);
 	if (ret != 0) {
-		err = "Skipping sync of file %s. Failed to stat";
-		print_error_and_reset_errno(errno, err, src);
-		goto err0;
+		char *err = "Failed to update timestamp for %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		return -1;
 	}
 
-	if (src_statbuf.st_size < 0) {
-		fprintf(stderr, "Skipping sync of file %s. Got negative file size\n", src);
-		goto err0;
+	return 0;
+}
+
+/*
+ * Syncs ${name} file whose source has been stat-ed into ${src_statbuf}. This is
+ * sync_file without the hard link handling. Files that the manifest says are
+ * unchanged since the last run are skipped without stat-ing the destination.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+sync_file_contents(const struct sync_options *opts, struct dir_node *dir,
+                   char *name, struct stat *src_statbuf)
+{
+	bool force_copy = opts->force_copy;
+	int ret;
+	char *err;
+
+	if (opts->manifest != NULL && force_copy == false &&
+	    manifest_file_unchanged(opts->manifest, dir, name, src_statbuf)) {
+		manifest_add_file(opts->manifest, dir, name, src_statbuf);
+		metrics_add(METRICS_FILES_SKIPPED, 1);
+		return 0;
 	}
 
+	struct stat dst_statbuf;
+	int dst_err = 0;
 	if (force_copy == false) {
-		struct stat dst_statbuf;
-		ret = fstatat(AT_FDCWD, dst, &dst_statbuf, AT_SYMLINK_NOFOLLOW);
+		uint64_t start = metrics_now();
+		ret = fstatat(dir->dst_fd, name, &dst_statbuf, AT_SYMLINK_NOFOLLOW);
+		metrics_record(METRICS_STAT, start);
 		if (ret != 0) {
-			if (errno != ENOENT) {
-				err = "Skipping sync of file %s. Failed to stat destination %s";
-				print_error_and_reset_errno(errno, err, src, dst);
-				goto err0;
-			}
-		} else if (src_statbuf.st_size == dst_statbuf.st_size &&
-		           src_statbuf.st_mtim.tv_sec == dst_statbuf.st_mtim.tv_sec &&
-		           src_statbuf.st_mtim.tv_nsec == dst_statbuf.st_mtim.tv_nsec) {
-			if (src_statbuf.st_mode != dst_statbuf.st_mode) {
-				ret = fchmodat(AT_FDCWD, dst, src_statbuf.st_mode, AT_SYMLINK_NOFOLLOW);
-				if (ret != 0) {
-					err = "Failed to update permissions for file %s";
-					print_error_and_reset_errno(errno, err, dst);
-					goto err0;
-				}
-			}
-			return 0;
+			dst_err = errno;
+			errno = 0;
 		}
 	}
 
-	switch (src_statbuf.st_mode & S_IFMT) {
+	ret = sync_file_compare(opts, dir, name, src_statbuf, &dst_statbuf, dst_err);
+	if (ret == 0 && opts->manifest != NULL)
+		manifest_add_file(opts->manifest, dir, name, src_statbuf);
+	if (ret == 0)
+		metrics_add(METRICS_FILES_SKIPPED, 1);
+	if (ret != 1)
+		return ret;
+
+	uint64_t start = metrics_now();
+	uintmax_t src_size = (uintmax_t) src_statbuf->st_size;
+	switch (src_statbuf->st_mode & S_IFMT) {
 	case S_IFLNK:
-		ret = copy_symlink(src, dst, src_statbuf.st_size);
+		ret = copy_symlink(dir, name, src_statbuf->st_size);
 		if (ret != 0)
 			goto err0;
 		break;
 
 	case S_IFREG:
-		uintmax_t src_size = (uintmax_t) src_statbuf.st_size;
-		ret = copy_file(src, dst, src_size, src_statbuf.st_mode);
+		/* The timestamps are set before the file is put in place. */
+		if (opts->atomic) {
+			ret = copy_file_atomic(opts, dir, name, src_statbuf);
+			metrics_record(METRICS_COPY, start);
+			if (ret != 0)
+				return ret;
+			metrics_add(METRICS_FILES_COPIED, 1);
+			metrics_add(METRICS_BYTES_COPIED, src_size);
+			if (opts->manifest != NULL)
+				manifest_add_file(opts->manifest, dir, name, src_statbuf);
+			return 0;
+		}
+		ret = copy_file(opts, dir, name, src_size, src_statbuf->st_mode);
+		metrics_record(METRICS_COPY, start);
 		if (ret != 0)
 			goto err0;
+		metrics_add(METRICS_BYTES_COPIED, src_size);
 		break;
 
 	default:
-		err = "Failed to sync %s. Source must be a regular file or symbolic link\n";
-		fprintf(stderr, err, src);
+		err = "Failed to sync %s/%s. Source must be a regular file or symbolic link";
+		print_error_and_reset_errno(0, err, dir->src, name);
 		goto err0;
 		break;
 	}
 
-	struct timespec times[2] = {
-		{src_statbuf.st_atim.tv_sec, src_statbuf.st_atim.tv_nsec},
-		{src_statbuf.st_mtim.tv_sec, src_statbuf.st_mtim.tv_nsec}
-	};
-	ret = utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
-	if (ret != 0) {
-		err = "Failed to update timestamp for %s";
-		print_error_and_reset_errno(errno, err, dst);
-		goto err0;
-	}
-
-	return 0;
+	metrics_add(METRICS_FILES_COPIED, 1);
+	ret = sync_file_set_times(dir, name, src_statbuf);
+	if (ret == 0 && opts->manifest != NULL)
+		manifest_add_file(opts->manifest, dir, name, src_statbuf);
+	return ret;
 
  err0:
 	return -1;
 }
+
+/*
+ * Makes ${name} in ${dir}'s destination directory a hard link to the
+ * destination published in ${entry} unless it already is one. The target is
+ * reached relative to its directory's file descriptor, so no path is built.
+ *
+ * Returns 1 if it already was a hard link to the target, 0 if it has been
+ * linked, -1 on failure. Sets errno on failure.
+ */
+static int
+link_file(struct dir_node *dir, char *name, struct link_entry *entry)
+{
+	int ret;
+	struct dir_node *target_dir = entry->dst_dir;
+	char *target = entry->dst_name;
+
+	struct stat dst_statbuf;
+	ret = fstatat(dir->dst_fd, name, &dst_statbuf, AT_SYMLINK_NOFOLLOW);
+	if (ret == 0) {
+		struct stat target_statbuf;
+		ret = fstatat(target_dir->dst_fd, target, &target_statbuf,
+		              AT_SYMLINK_NOFOLLOW);
+		if (ret != 0)
+			return -1;
+		if (dst_statbuf.st_dev == target_statbuf.st_dev &&
+		    dst_statbuf.st_ino == target_statbuf.st_ino)
+			return 1;
+		ret = unlinkat(dir->dst_fd, name, 0);
+		if (ret != 0)
+			return -1;
+	} else if (errno != ENOENT) {
+		return -1;
+	}
+
+	return linkat(target_dir->dst_fd, target, dir->dst_fd, name, 0);
+}
+
+/*
+ * Syncs ${name} regular file with multiple hard links. The first sync thread
+ * to get to the inode syncs it like any other file and the others hard link
+ * their destination to the first one's destination, which counts as skipping
+ * the file if it already was linked. If hard linking fails (e.g., the sources
+ * are synced to different filesystems), the file is synced like any other
+ * file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+sync_linked_file(const struct sync_options *opts, struct dir_node *dir,
+                 char *name, struct stat *src_statbuf)
+{
+	int ret;
+	char *err;
+	struct link_table *links = opts->links;
+	struct link_entry *entry;
+
+	ret = link_table_claim(links, src_statbuf->st_dev, src_statbuf->st_ino,
+	                       src_statbuf->st_nlink, &entry);
+	if (ret == -1) {
+		err = "Failed to track hard links of %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		return sync_file_contents(opts, dir, name, src_statbuf);
+	}
+
+	if (ret == 1) {
+		ret = sync_file_contents(opts, dir, name, src_statbuf);
+		link_table_publish(links, entry, ret == 0 ? dir : NULL, name);
+		link_table_release(links, entry);
+		return ret;
+	}
+
+	ret = entry->dst_dir != NULL ? link_file(dir, name, entry) : -1;
+	if (ret >= 0) {
+		metrics_add(ret == 1 ? METRICS_FILES_SKIPPED : METRICS_FILES_COPIED, 1);
+		ret = 0;
+		if (opts->manifest != NULL)
+			manifest_add_file(opts->manifest, dir, name, src_statbuf);
+	} else
+		ret = sync_file_contents(opts, dir, name, src_statbuf);
+	errno = 0;
+	link_table_release(links, entry);
+
+	return ret;
+}
+
+/*
+ * Syncs ${name} file whose source has been stat-ed into ${src_statbuf}. See
+ * sync_file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+sync_file_with_stat(const struct sync_options *opts, struct dir_node *dir,
+                    char *name, struct stat *src_statbuf)
+{
+	if (opts->verify != NULL)
+		return verify_file(opts->verify, opts, dir, name, src_statbuf);
+
+	if (opts->links != NULL && S_ISREG(src_statbuf->st_mode) &&
+	    src_statbuf->st_nlink > 1)
+		return sync_linked_file(opts, dir, name, src_statbuf);
+
+	return sync_file_contents(opts, dir, name, src_statbuf);
+}
+
+/*
+ * Syncs ${name} file in ${dir}'s source directory to ${name} file in ${dir}'s
+ * destination directory. If the destination doesn't exist or its size and
+ * modification time don't match with the source, the source is copied to the
+ * destination. The destination's mode and timestamps are set equal to the
+ * source's if not already. Only regular files or symbolic links are supported
+ * for syncing. All the syscalls are done relative to ${dir}'s directory file
+ * descriptors. If ${opts->links} is not NULL, regular files with multiple hard
+ * links are tracked in it so that the hard links are preserved in the
+ * destination.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+sync_file(const struct sync_options *opts, struct dir_node *dir, char *name)
+{
+	int ret;
+	char *err;
+
+	struct stat src_statbuf;
+	ret = fstatat(dir->src_fd, name, &src_statbuf, AT_SYMLINK_NOFOLLOW);
+	if (ret != 0) {
+		err = "Skipping sync of file %s/%s. Failed to stat";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		return -1;
+	}
+
+	return sync_file_with_stat(opts, dir, name, &src_statbuf);
+}
@@ -6,8 +6,19 @@
 #ifndef SYNC_FILE_H
 #define SYNC_FILE_H
 
+#include <sys/stat.h>
+
 #include <stdbool.h>
 
-int sync_file(char *src, char *dst, bool force_copy);
+#include "dir_node.h"
+#include "sync_options.h"
+
+int sync_file(const struct sync_options *opts, struct dir_node *dir, char *name);
+int sync_file_with_stat(const struct sync_options *opts, struct dir_node *dir,
+                        char *name, struct stat *src_statbuf);
+int sync_file_compare(const struct sync_options *opts, struct dir_node *dir,
+                      char *name, struct stat *src_statbuf,
+                      struct stat *dst_statbuf, int dst_err);
+int sync_file_set_times(struct dir_node *dir, char *name, struct stat *src_statbuf);
 
 #endif /* SYNC_FILE_H */
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef SYNC_OPTIONS_H
+#define SYNC_OPTIONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "link_table.h"
+
+/*
+ * Whether regular files are cloned (i.e., the destination shares the source's
+ * data extents) instead of copied. With REFLINK_AUTO, cloning is tried first
+ * falling back to copying. With REFLINK_ALWAYS, failing to clone is an error.
+ */
+enum reflink_mode {
+	REFLINK_AUTO,
+	REFLINK_ALWAYS,
+	REFLINK_NEVER
+};
+
+/*
+ * How the data dsync writes is made durable. With DURABLE_SYNCFS, the
+ * destination filesystems are flushed once at the end and with DURABLE_FSYNC,
+ * every copied file is also flushed before it is closed. Both start writing
+ * back the data of large files while they are being copied.
+ */
+enum durable_mode {
+	DURABLE_NONE,
+	DURABLE_SYNCFS,
+	DURABLE_FSYNC
+};
+
+struct manifest;
+struct sync_data_mpmc_queue;
+struct verify;
+
+/*
+ * Options of how files are synced which are set from the command line and
+ * shared (read only) by all the sync threads. ${links} is NULL if hard links
+ * are not to be preserved. Large files are copied in ranges by up to
+ * ${helper_cnt} other sync threads asked for help through ${Q}, which is NULL
+ * if there are no other sync threads. Unchanged files are looked up in
+ * ${manifest} and synced files are recorded in it, if it is not NULL.
+ * ${durable} says how copied data is written to stable storage. If ${atomic} is
+ * set, regular files are copied with copy_file_atomic. If ${verify} is not
+ * NULL, files are only compared with their destination and nothing is synced.
+ * If ${compare} is set, the contents of files of at least ${compare_min_size}
+ * bytes that only differ in modification time are compared before copying.
+ */
+struct sync_options {
+	bool force_copy;
+	enum reflink_mode reflink;
+	struct link_table *links;
+	struct sync_data_mpmc_queue *Q;
+	unsigned int helper_cnt;
+	struct manifest *manifest;
+	enum durable_mode durable;
+	bool atomic;
+	struct verify *verify;
+	bool compare;
+	uintmax_t compare_min_size;
+};
+
+#endif /* SYNC_OPTIONS_H */
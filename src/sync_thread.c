@@ -3,15 +3,258 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/stat.h>
+
 #include <stdbool.h>
+#include <string.h>
 
+#include "arena.h"
+#include "copy_file.h"
+#include "dir_node.h"
+#include "file_job.h"
+#include "log_sink.h"
+#include "metrics.h"
+#include "sync_data_heap.h"
 #include "sync_data_mpmc_queue.h"
 #include "sync_file.h"
 #include "sync_thread.h"
 
+/* Number of entries a sync thread dequeues at once. Bigger batches mean less
+   contention on the queue but worse balancing of the work among threads. */
+#define SYNC_BATCH_SIZE 8
+
+/*
+ * Keeps the members of ${statbuf} that syncing reads in ${stat}.
+ */
+void
+sync_stat_from_stat(struct sync_stat *stat, const struct stat *statbuf)
+{
+	stat->mtim = statbuf->st_mtim;
+	stat->atim = statbuf->st_atim;
+	stat->size = statbuf->st_size;
+	stat->dev = statbuf->st_dev;
+	stat->ino = statbuf->st_ino;
+	stat->nlink = statbuf->st_nlink;
+	stat->mode = statbuf->st_mode;
+	return;
+}
+
+/*
+ * Fills ${statbuf} back from ${stat} for the sync thread, the members that
+ * syncing doesn't read are 0.
+ */
+void
+sync_stat_to_stat(const struct sync_stat *stat, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_mtim = stat->mtim;
+	statbuf->st_atim = stat->atim;
+	statbuf->st_size = stat->size;
+	statbuf->st_dev = stat->dev;
+	statbuf->st_ino = stat->ino;
+	statbuf->st_nlink = stat->nlink;
+	statbuf->st_mode = stat->mode;
+	return;
+}
+
+/*
+ * Counts ${cnt} more files queued to ${pool}. Must be called before they are
+ * added to its lanes.
+ */
+void
+sync_thread_add_queued(struct sync_thread_data *pool, size_t cnt)
+{
+	__atomic_add_fetch(&pool->queued_cnt, cnt, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Counts ${cnt} of the files queued to ${pool} as synced, waking up the
+ * threads waiting for the pool to go idle if they were the last ones.
+ */
+static inline void
+finish_queued(struct sync_thread_data *pool, size_t cnt)
+{
+	if (__atomic_sub_fetch(&pool->queued_cnt, cnt, __ATOMIC_ACQ_REL) == 0)
+		eventcount_notify(&pool->idle, UINT32_MAX);
+	return;
+}
+
+/*
+ * Waits until all the files queued to ${pool} so far have been synced and
+ * their references released.
+ */
+void
+sync_thread_wait_idle(struct sync_thread_data *pool)
+{
+	while (__atomic_load_n(&pool->queued_cnt, __ATOMIC_ACQUIRE) != 0) {
+		uint32_t key = eventcount_prepare_wait(&pool->idle);
+		if (__atomic_load_n(&pool->queued_cnt, __ATOMIC_ACQUIRE) == 0) {
+			eventcount_cancel_wait(&pool->idle);
+			break;
+		}
+		eventcount_wait(&pool->idle, key);
+	}
+	return;
+}
+
+/*
+ * Drops the requests for help with large files left in the queue of ${pool}.
+ * Owners may add them after the queue has been closed, so some may not be
+ * taken by any sync thread before they exit. Must be called after all the
+ * sync threads of ${pool} have exited.
+ */
+void
+sync_thread_drain(struct sync_thread_data *pool)
+{
+	struct sync_data sds[SYNC_BATCH_SIZE];
+	size_t cnt;
+
+	while ((cnt = sync_data_mpmc_queue_dequeue_bulk(pool->Q, sds,
+	                                                SYNC_BATCH_SIZE)) > 0) {
+		for (size_t i = 0; i < cnt; ++i) {
+			if (sds[i].job != NULL)
+				file_job_unref(sds[i].job);
+		}
+	}
+	return;
+}
+
+/*
+ * Syncs the file of ${sd} and releases ${sd}'s references.
+ */
+static inline void
+sync_entry(struct sync_thread_data *thread_data, struct sync_data *sd)
+{
+	struct stat statbuf;
+	sync_stat_to_stat(&sd->stat, &statbuf);
+	sync_file_with_stat(&thread_data->opts, sd->dir, sd->name, &statbuf);
+	arena_free(sd->name);
+	dir_node_unref(sd->dir);
+	return;
+}
+
 /*
- * Dequeues sync_data entries from the queue and calls try_sync_file to do the
- * syncing. When threads are created for sync/copy work, this is the function
+ * Helps with the file jobs among the ${cnt} entries of ${sds} before syncing
+ * anything else, as their owners are waiting for them, and removes them.
+ *
+ * Returns the number of entries left in ${sds}.
+ */
+static size_t
+help_file_jobs(struct sync_data *sds, size_t cnt)
+{
+	size_t left = 0;
+	for (size_t i = 0; i < cnt; ++i) {
+		if (sds[i].job != NULL) {
+			file_job_help(sds[i].job);
+			file_job_unref(sds[i].job);
+		} else {
+			sds[left++] = sds[i];
+		}
+	}
+	return left;
+}
+
+/*
+ * Takes up to ${n} entries from lane ${large}, waiting while it is empty if
+ * ${wait} is true.
+ *
+ * Returns the number of entries taken.
+ */
+static inline size_t
+take_lane(struct sync_thread_data *thread_data, bool large, struct sync_data *sds,
+          size_t n, bool wait)
+{
+	if (large) {
+		if (wait)
+			return sync_data_heap_pop_wait(thread_data->H, sds) == 0 ? 1 : 0;
+		return sync_data_heap_pop(thread_data->H, sds) == 0 ? 1 : 0;
+	}
+	if (wait)
+		return sync_data_mpmc_queue_dequeue_bulk_wait(thread_data->Q, sds, n);
+	return sync_data_mpmc_queue_dequeue_bulk(thread_data->Q, sds, n);
+}
+
+/*
+ * Takes up to ${n} entries to sync for a sync thread of lane ${large}. Work is
+ * taken from the other lane if the thread's own lane is empty and the thread
+ * only waits on its own lane, which always has threads of its own, until
+ * traversal is done. Then it waits on the other lane so that all the threads
+ * work on whatever is left. Both lanes are checked on every call as file jobs
+ * may be added to the queue after it has been closed.
+ *
+ * Returns the number of entries taken, 0 once both lanes are closed and empty.
+ */
+static size_t
+take_work(struct sync_thread_data *thread_data, bool large, struct sync_data *sds,
+          size_t n)
+{
+	size_t cnt;
+
+	if (thread_data->H == NULL)
+		return sync_data_mpmc_queue_dequeue_bulk_wait(thread_data->Q, sds, n);
+
+	if ((cnt = take_lane(thread_data, large, sds, n, false)) > 0 ||
+	    (cnt = take_lane(thread_data, !large, sds, n, false)) > 0 ||
+	    (cnt = take_lane(thread_data, large, sds, n, true)) > 0)
+		return cnt;
+	return take_lane(thread_data, !large, sds, n, true);
+}
+
+#ifdef HAVE_IO_URING
+#define URING_BATCH_SIZE 64
+
+/*
+ * Like sync_thread_func, but dequeues up to URING_BATCH_SIZE entries at a time
+ * and syncs them as a batch with io_uring.
+ *
+ * Returns true once the lanes are done, false if io_uring failed, in which case
+ * the thread goes on with regular syscalls.
+ */
+static bool
+sync_thread_uring_func(struct sync_thread_data *thread_data, uint8_t id,
+                       bool large, struct copy_file_uring *U)
+{
+	struct sync_data sds[URING_BATCH_SIZE];
+
+	size_t cnt;
+
+	while (autotune_park(thread_data->A, id) &&
+	       (cnt = take_work(thread_data, large, sds, URING_BATCH_SIZE)) > 0) {
+		/* A batch ends at the first entry that is still being enqueued, so
+		   try once more to fill it up. */
+		if (cnt < URING_BATCH_SIZE)
+			cnt += sync_data_mpmc_queue_dequeue_bulk(thread_data->Q, &sds[cnt],
+			                                         URING_BATCH_SIZE - cnt);
+
+		cnt = help_file_jobs(sds, cnt);
+		if (cnt == 0)
+			continue;
+		size_t left = 0;
+		bool failed = copy_file_uring_sync(U, &thread_data->opts, sds, cnt,
+		                                   &left) != 0;
+		for (size_t i = 0; i < left; ++i) {
+			struct stat statbuf;
+			sync_stat_to_stat(&sds[i].stat, &statbuf);
+			sync_file_with_stat(&thread_data->opts, sds[i].dir, sds[i].name,
+			                    &statbuf);
+		}
+		for (size_t i = 0; i < cnt; ++i) {
+			arena_free(sds[i].name);
+			dir_node_unref(sds[i].dir);
+		}
+		finish_queued(thread_data, cnt);
+		if (failed)
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+/*
+ * Takes sync_data entries from the lanes and calls sync_file_with_stat to do
+ * the syncing. When threads are created for sync/copy work, this is the function
  * they will be running.
  *
  * Returns NULL.
@@ -20,39 +263,37 @@ void *
 sync_thread_func(void *data)
 {
 	struct sync_thread_data *thread_data = data;
-	struct sync_data sd;
+	struct sync_data sds[SYNC_BATCH_SIZE];
+	size_t cnt;
 
-	while(true) {
-		int ret = sync_data_mpmc_queue_dequeue(thread_data->Q, &sd);
-		if (ret == 0) {
-			sync_file(sd.src, sd.dst, thread_data->force_copy);
-		} else {
-			int traverse_done = __atomic_load_n(&thread_data->traverse_done,
-			                                    __ATOMIC_ACQUIRE);
-			if (traverse_done == 1) {
-				/* Even after we get traverse_done to be 1, we need to look for
-				   entries in the queue as the following turn of events could lead
-				   to the queue not being empty (the events are in order of time):
-				   1. producer thread gets descheduled
-				   2. consumer threads drain the queue and get ret == -1
-				   3. consumer threads get descheduled at the else block before
-				   reading traverse_done above
-				   4. producer thread gets scheduled and adds a bunch to the queue
-				   and sets traverse_done to 1
-				   5. consumer threads now get scheduled and enter the else block
-				   reading traverse_done to be 1 and the queue is not empty
-				*/
-				while (true) {
-					ret = sync_data_mpmc_queue_dequeue(thread_data->Q, &sd);
-					if (ret == 0)
-						sync_file(sd.src, sd.dst, thread_data->force_copy);
-					else
-						break;
-				}
-				break;
-			}
+	uint8_t id = __atomic_fetch_add(&thread_data->started_cnt, 1, __ATOMIC_RELAXED);
+	bool large = id % 4 == 0;
+	metrics_bind_sync_thread((uint8_t) (thread_data->first_id + id));
+	log_sink_bind_sync_thread((uint8_t) (thread_data->first_id + id));
+
+#ifdef HAVE_IO_URING
+	if (thread_data->use_io_uring) {
+		struct copy_file_uring *U = copy_file_uring_init(URING_BATCH_SIZE);
+		if (U != NULL) {
+			bool done = sync_thread_uring_func(thread_data, id, large, U);
+			copy_file_uring_free(U);
+			if (done)
+				return NULL;
 		}
 	}
+#endif
+
+	/* Waits while there is nothing to sync and returns 0 only once traversal
+	   is done and the lanes are drained. Parked threads exit once traversal
+	   is done and leave the rest to the active ones. */
+	while (autotune_park(thread_data->A, id) &&
+	       (cnt = take_work(thread_data, large, sds, SYNC_BATCH_SIZE)) > 0) {
+		cnt = help_file_jobs(sds, cnt);
+		for (size_t i = 0; i < cnt; ++i)
+			sync_entry(thread_data, &sds[i]);
+		if (cnt > 0)
+			finish_queued(thread_data, cnt);
+	}
 
 	return NULL;
 }
@@ -6,33 +6,98 @@
 #ifndef SYNC_THREAD_H
 #define SYNC_THREAD_H
 
+#include <sys/stat.h>
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define PATH_SIZE 4096
+#include "autotune.h"
+#include "dir_node.h"
+#include "eventcount.h"
+#include "sync_options.h"
+
 #define CACHELINE_SIZE 64
 
+/* Regular files of at least this size are synced through the large files'
+   lane. */
+#define LARGE_FILE_SIZE ((off_t) 8 * 1024 * 1024)
+
+struct file_job;
+
+/*
+ * The members of a file's stat that syncing reads, which is what a queued file
+ * carries instead of the whole struct stat to keep the lanes' entries small.
+ */
+struct sync_stat {
+	struct timespec mtim;
+	struct timespec atim;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	nlink_t nlink;
+	mode_t mode;
+};
+
+/*
+ * A file to be synced i.e., "${dir->src}/${name}" to "${dir->dst}/${name}".
+ * The entry holds a reference to ${dir} and ${name} is allocated from the arena
+ * of the traversal thread that queued it. Both are released by the sync thread
+ * once the file has been synced. ${stat} is the source's stat taken by the
+ * traversal thread, which tells the size of the file for scheduling and isn't
+ * taken again by the sync thread. If ${job} is not NULL, the entry is instead a
+ * request to help copying the ranges of a large file being synced by another
+ * sync thread and holds a reference to ${job} (${dir} and ${name} are NULL).
+ */
 struct sync_data {
-	uint16_t src_len;
-	char src[PATH_SIZE];
-	uint16_t dst_len;
-	char dst[PATH_SIZE];
+	struct dir_node *dir;
+	char *name;
+	struct file_job *job;
+	struct sync_stat stat;
 };
 
 /*
  * As sync_thread_data struct members are read by all the threads doing
  * sync/copy work, let's make sure they are on separate cachelines from
  * other potential malloc-ed memory to prevent false cacheline sharing.
+ *
+ * Files are synced in two lanes: large files from heap ${H} (largest first)
+ * and the rest from queue ${Q}. Every fourth sync thread to start, starting
+ * with the first, takes its work from ${H} and the others from ${Q}, taking
+ * work from the other lane instead of waiting when their own lane is empty.
+ * ${H} is NULL if there is only one lane. With -j auto, ${A} parks the threads
+ * that aren't active, which are the last ones to start, so that both lanes
+ * always have threads of their own.
+ *
+ * Every source device gets a pool of sync threads of its own, each with its
+ * own lanes and tuning, so that a slow device doesn't hold up the threads of
+ * the others. The pool syncs the files on device ${dev} and its threads'
+ * metrics and log slots start at sync thread ${first_id}.
+ *
+ * ${queued_cnt} is the number of files queued to the pool that haven't been
+ * synced yet (help requests for large files aren't counted as their owners
+ * wait for them) and ${idle} is notified when it drops to 0.
  */
 struct sync_thread_data {
 	uint8_t pad0[CACHELINE_SIZE];
 	struct sync_data_mpmc_queue *Q;
-	int traverse_done;
-	bool force_copy;
+	struct sync_data_heap *H;
+	struct sync_options opts;
+	struct autotune *A;
+	dev_t dev;
+	bool use_io_uring;
+	uint8_t first_id;
+	uint8_t started_cnt;
+	size_t queued_cnt;
+	struct eventcount idle;
 	uint8_t pad1[CACHELINE_SIZE];
 };
 
+void sync_stat_from_stat(struct sync_stat *stat, const struct stat *statbuf);
+void sync_stat_to_stat(const struct sync_stat *stat, struct stat *statbuf);
+void sync_thread_add_queued(struct sync_thread_data *pool, size_t cnt);
+void sync_thread_wait_idle(struct sync_thread_data *pool);
+void sync_thread_drain(struct sync_thread_data *pool);
 void *sync_thread_func(void *data);
 
 #endif /* SYNC_THREAD_H */
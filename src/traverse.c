@@ -3,271 +3,792 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
-#include <assert.h>
+#define _DEFAULT_SOURCE /* for d_type */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
 #include <errno.h>
-#include <fts.h>
-#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <unistd.h>
+
+#include "arena.h"
+#include "delete_extras.h"
+#include "dir_deque.h"
+#include "dir_node.h"
+#include "durable.h"
+#include "log_sink.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "sync_data_heap.h"
 #include "sync_data_mpmc_queue.h"
 #include "sync_directory.h"
 #include "sync_thread.h"
 #include "traverse.h"
 #include "utils.h"
+#include "verify.h"
 
-#define BUF_SIZE 1024
+/* Files are added to the queue in batches of this many entries at most. */
+#define QUEUE_BATCH_SIZE 64
 
 /*
- * Returns the path suffix that needs to be appended to the destination directory
- * path. For example, if the source path is "/home/user/some/thing" and level
- * is 1, that means "some/thing" needs to be appended to the directory.
+ * State shared by all the traversal threads. Files are queued to the one of
+ * the ${pool_cnt} ${pools} of sync threads that syncs their device, the first
+ * one if none does. ${pending} is the number of directories that have been
+ * pushed to some deque but have not been scanned completely yet. Traversal is
+ * done when it drops to 0.
+ */
+struct traverse_ctx {
+	struct sync_thread_data *pools;
+	uint8_t pool_cnt;
+	struct manifest *M;
+	struct durable *D;
+	struct verify *V;
+	enum delete_mode delete_mode;
+	struct dir_deque *deques;
+	uint8_t thread_cnt;
+	uint8_t pad0[CACHELINE_SIZE];
+	size_t pending;
+	uint8_t pad1[CACHELINE_SIZE];
+	unsigned int idle_cnt;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	int failed;
+};
+
+struct traverse_thread_data {
+	struct traverse_ctx *ctx;
+	uint8_t id;
+	/* filesystem of the last destination directory added to ${ctx->D} */
+	bool dst_dev_added;
+	dev_t dst_dev;
+	struct arena arena;
+	/* pool the batched files are for */
+	struct sync_thread_data *batch_pool;
+	size_t batch_cnt;
+	struct sync_data batch[QUEUE_BATCH_SIZE];
+};
+
+/*
+ * Allocates "${name}" with a terminating null byte from ${A}.
  *
- * Returns the (char *) in ${src} that is the desired suffix.
+ * Returns the allocated name on success, NULL on failure. Sets errno on failure.
  */
 static inline char *
-get_path_suffix_at_level(char *src, size_t src_len, int level)
+arena_strdup(struct arena *A, const char *name, size_t name_len)
 {
-	assert(level >= 0 && (uintmax_t) (level) < UINT_MAX);
-	assert(src_len > 0);
+	char *rc = arena_alloc(A, name_len + 1);
+	if (rc == NULL)
+		return NULL;
+	memcpy(rc, name, name_len);
+	rc[name_len] = '\0';
+	return rc;
+}
 
-	uintmax_t lv = level;
-	size_t ind = src_len - 1;
-	while (true) {
-		if (src[ind] != '/' || ind == 0)
-			break;
-		--ind;
+/*
+ * Returns the pool of sync threads that syncs the files on device ${dev}.
+ */
+static inline struct sync_thread_data *
+find_pool(struct traverse_ctx *ctx, dev_t dev)
+{
+	for (uint8_t i = 1; i < ctx->pool_cnt; ++i) {
+		if (ctx->pools[i].dev == dev)
+			return &ctx->pools[i];
 	}
+	return &ctx->pools[0];
+}
 
-	if (ind == 0)
-		return src;
-
-	uintmax_t cnt = 0;
-	char *rc = &src[ind];
-	bool was_previous_char_slash = false;
-	while (cnt < lv + 1) {
-		if (src[ind] == '/') {
-			if (was_previous_char_slash == false) {
-				++cnt;
-				was_previous_char_slash = true;
-			}
-		} else {
-			was_previous_char_slash = false;
-			rc = &src[ind];
-		}
-
-		if (ind == 0)
-			break;
-
-		--ind;
+/*
+ * Adds the batched files to the queue of their pool with as few claims on the
+ * queue as possible, waiting for space if the queue is full.
+ */
+static inline void
+flush_files(struct traverse_thread_data *thread_data)
+{
+	if (thread_data->batch_cnt > 0) {
+		sync_thread_add_queued(thread_data->batch_pool, thread_data->batch_cnt);
+		sync_data_mpmc_queue_enqueue_bulk_wait(thread_data->batch_pool->Q,
+		                                       thread_data->batch,
+		                                       thread_data->batch_cnt);
+		thread_data->batch_cnt = 0;
 	}
-
-	return rc;
+	return;
 }
 
 /*
- * Prepares ${sd} by assigning proper source and destination paths to ${sd->src}
- * and ${sd->dst} respectively.
+ * Adds "${dir}/${name}" file with stat ${statbuf} to the batch of files to be
+ * queued to the pool of its device, flushing the batch if it is full or for
+ * another pool. Large regular files are added to the heap of the pool's large
+ * files' lane instead, if there is one. The queued entry takes a reference to
+ * ${dir}.
  *
  * Returns 0 on success, -1 on failure. Sets errno on failure.
  */
 static inline int
-prepare_sync_data(char *src, size_t src_len, char *dst, size_t dst_len, int level,
-                  struct sync_data *sd)
+queue_file(struct traverse_thread_data *thread_data, struct dir_node *dir,
+           const char *name, size_t name_len, struct stat *statbuf)
 {
-	/* Make sure ${src_len + 1} will fit. */
-	if (src_len > PATH_SIZE - 1) {
-		errno = ENOMEM;
-		goto err;
+	struct sync_thread_data *pool = find_pool(thread_data->ctx, statbuf->st_dev);
+	if (pool != thread_data->batch_pool) {
+		flush_files(thread_data);
+		thread_data->batch_pool = pool;
 	}
 
-	sd->src_len = src_len + 1;
-	memcpy(sd->src, src, src_len);
-	sd->src[src_len] = '\0';
+	struct sync_data *sd = &thread_data->batch[thread_data->batch_cnt];
+	sd->name = arena_strdup(&thread_data->arena, name, name_len);
+	if (sd->name == NULL)
+		return -1;
+	dir_node_ref(dir);
+	sd->dir = dir;
+	sd->job = NULL;
+	sync_stat_from_stat(&sd->stat, statbuf);
+	metrics_add(METRICS_FILES_SCANNED, 1);
+
+	if (pool->H != NULL && S_ISREG(statbuf->st_mode) &&
+	    statbuf->st_size >= LARGE_FILE_SIZE) {
+		sync_thread_add_queued(pool, 1);
+		sync_data_heap_push_wait(pool->H, sd);
+		return 0;
+	}
 
-	char *suffix = get_path_suffix_at_level(src, src_len, level);
-	size_t suffix_len = strlen(suffix);
+	if (++thread_data->batch_cnt == QUEUE_BATCH_SIZE)
+		flush_files(thread_data);
+	return 0;
+}
 
-	/* Make sure ${dst_len + suffix_len + 2} will fit. */
-	if (dst_len > PATH_SIZE - suffix_len || dst_len + suffix_len > PATH_SIZE - 2) {
-		errno = ENOMEM;
-		goto err;
+/*
+ * Marks that traversal failed for at least one entry.
+ */
+static inline void
+set_failed(struct traverse_ctx *ctx)
+{
+	__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * Adds the filesystem of ${work}'s synced destination directory to the set
+ * flushed at the end, if there is one. Every thread remembers the last one it
+ * added, so the set is only locked when a thread crosses into another
+ * filesystem.
+ */
+static void
+add_filesystem(struct traverse_thread_data *thread_data, struct dir_node *work)
+{
+	struct traverse_ctx *ctx = thread_data->ctx;
+	if (ctx->D == NULL ||
+	    (thread_data->dst_dev_added && thread_data->dst_dev == work->dst_dev))
+		return;
+
+	if (durable_add(ctx->D, work->dst_fd, work->dst_dev) != 0) {
+		set_failed(ctx);
+		char *err = "Failed to add filesystem of %s for flushing";
+		print_error_and_reset_errno(errno, err, work->dst);
+		return;
+	}
+	thread_data->dst_dev_added = true;
+	thread_data->dst_dev = work->dst_dev;
+	return;
+}
+
+/*
+ * Pushes ${work} to the deque of traversal thread ${id} and wakes up one idle
+ * traversal thread, if any, to steal it.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+push_work(struct traverse_ctx *ctx, uint8_t id, struct dir_node *work)
+{
+	__atomic_add_fetch(&ctx->pending, 1, __ATOMIC_RELAXED);
+	if (dir_deque_push(&ctx->deques[id], work) != 0) {
+		__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_RELAXED);
+		return -1;
 	}
 
-	sd->dst_len = dst_len + suffix_len + 2;
-	memcpy(sd->dst, dst, dst_len);
-	sd->dst[dst_len] = '/';
-	memcpy(sd->dst + dst_len + 1, suffix, suffix_len);
-	sd->dst[sd->dst_len - 1] = '\0';
+	/* Pairs with the fence in wait_for_work so that either the idle thread
+	   sees the pushed entry or we see the idle thread. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->idle_cnt, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&ctx->idle_lock);
+		pthread_cond_signal(&ctx->idle_cond);
+		pthread_mutex_unlock(&ctx->idle_lock);
+	}
 
 	return 0;
+}
 
- err:
-	return -1;
+/*
+ * Tries to steal a directory from the other traversal threads' deques.
+ *
+ * Returns the stolen directory or NULL if all the deques looked empty.
+ */
+static struct dir_node *
+steal_work(struct traverse_ctx *ctx, uint8_t id)
+{
+	for (uint8_t i = 1; i < ctx->thread_cnt; ++i) {
+		uint8_t victim = (id + i) % ctx->thread_cnt;
+		struct dir_node *work = dir_deque_steal(&ctx->deques[victim]);
+		if (work != NULL)
+			return work;
+	}
+	return NULL;
 }
 
 /*
- * Skips the ${ftsent} directory entry that needs to be skipped from traversal.
+ * Blocks until there is a directory to steal or the traversal is done.
+ *
+ * Returns the stolen directory or NULL if the traversal is done.
  */
-static inline void
-try_skip_directory(FTS *fts, FTSENT *ftsent)
+static struct dir_node *
+wait_for_work(struct traverse_ctx *ctx, uint8_t id)
 {
-	if (fts_set(fts, ftsent, FTS_SKIP) != 0) {
-		char *err = "Failed to skip directory %s";
-		print_error_and_reset_errno(errno, err, ftsent->fts_path);
+	struct dir_node *work = NULL;
+
+	pthread_mutex_lock(&ctx->idle_lock);
+	__atomic_add_fetch(&ctx->idle_cnt, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) > 0) {
+		work = dir_deque_pop(&ctx->deques[id]);
+		if (work == NULL)
+			work = steal_work(ctx, id);
+		if (work != NULL)
+			break;
+		pthread_cond_wait(&ctx->idle_cond, &ctx->idle_lock);
+	}
+	__atomic_sub_fetch(&ctx->idle_cnt, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->idle_lock);
+
+	return work;
+}
+
+/*
+ * Marks ${work} as completely scanned and drops the reference to it. Wakes up
+ * all the idle traversal threads if this was the last directory.
+ */
+static void
+finish_work(struct traverse_ctx *ctx, struct dir_node *work)
+{
+	dir_node_unref(work);
+	if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&ctx->idle_lock);
+		pthread_cond_broadcast(&ctx->idle_cond);
+		pthread_mutex_unlock(&ctx->idle_lock);
 	}
 	return;
 }
 
 /*
- * Traverses the ${src_paths} and syncs sources to ${dst_path}. This function
- * handles the work of syncing directories itself. Files are added to the queue
- * for syncing which will be picked up by the sync threads. This function uses
- * the "fts" apis for traversing sources. Although not standardized by POSIX,
- * fts apis seem to be implemented by linux and the traditional bsd systems.
+ * Pushes subdirectory ${name} of ${dir} to the deque of traversal thread
+ * ${arg} like scan_directory does for the subdirectories it reads.
  *
- * ${src_paths} and ${dst_path} must be canonicalized absolute paths.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+push_subdirectory(void *arg, struct dir_node *dir, const char *name,
+                  size_t name_len)
+{
+	struct traverse_thread_data *thread_data = arg;
+	struct traverse_ctx *ctx = thread_data->ctx;
+
+	struct dir_node *child = dir_node_new_child(&thread_data->arena, dir, name,
+	                                            name_len);
+	if (child == NULL || push_work(ctx, thread_data->id, child) != 0) {
+		set_failed(ctx);
+		char *err = "Skipping sync of directory %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		if (child != NULL)
+			dir_node_unref(child);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+free_names(struct name_list *names)
+{
+	name_list_free(names);
+	free(names);
+	return;
+}
+
+/*
+ * Reads the names of all the entries of source directory ${dir} into ${names}
+ * and rewinds it.
  *
- * Returns 0 on success, -1 on any kind of failure during traversal.
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
  */
-int
-traverse_and_queue(char *src_paths[], char *dst_path, struct sync_data_mpmc_queue *Q)
+static int
+list_directory(DIR *dir, struct name_list *names)
+{
+	int ret = 0;
+	struct dirent *dent;
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL) {
+		char *name = dent->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (name_list_add(names, name, strlen(name)) != 0)
+			break;
+		errno = 0;
+	}
+	if (errno != 0)
+		ret = -1;
+	rewinddir(dir);
+	return ret;
+}
+
+/*
+ * Syncs ${work} directory and goes through its entries. Subdirectories are
+ * pushed to the deque of the traversal thread and files are added to the queue
+ * for syncing. Directories that the manifest prunes are not read, only their
+ * subdirectories are pushed. Extra entries in the destination directory are
+ * deleted before the files are queued or once they have been synced,
+ * depending on the delete mode.
+ */
+static void
+scan_directory(struct traverse_thread_data *thread_data, struct dir_node *work)
 {
-	int rc = 0;
 	int ret;
 	char *err;
+	struct traverse_ctx *ctx = thread_data->ctx;
+
+	uint64_t start = metrics_now();
+	ret = ctx->V != NULL ? open_directory(work) : sync_directory(work);
+	metrics_record(METRICS_DIR, start);
+	if (ret == 1) {
+		verify_mismatch(ctx->V, work->dst, NULL,
+		                errno == ENOENT ? "missing" : "not a directory");
+		errno = 0;
+		return;
+	}
+	if (ret == -1) {
+		set_failed(ctx);
+		err = "Skipping sync of directory %s";
+		print_error_and_reset_errno(errno, err, work->src);
+		return;
+	}
+	metrics_add(METRICS_DIRS_SCANNED, 1);
+	add_filesystem(thread_data, work);
+	if (ctx->M != NULL) {
+		manifest_check_dir(ctx->M, work);
+		if (manifest_prune_dir(ctx->M, work, push_subdirectory, thread_data))
+			return;
+	}
 
-	errno = 0;
- 	FTS *fts = fts_open(src_paths, FTS_NOCHDIR | FTS_NOSTAT | FTS_PHYSICAL, NULL);
-	if (fts == NULL) {
-		print_error_and_reset_errno(errno, "Failed to traverse all the sources");
-		rc = -1;
-		goto done;
+	/* The directory stream gets its own file descriptor as closedir closes
+	   it while ${work->src_fd} is used by the sync threads. */
+	int fd = dup(work->src_fd);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		set_failed(ctx);
+		err = "Skipping sync of directory %s. Directory cannot be read";
+		print_error_and_reset_errno(errno, err, work->src);
+		if (fd != -1)
+			close(fd);
+		return;
 	}
 
-	struct sync_data sd;
-	size_t dst_len = strlen(dst_path);
+	/* Deleting needs the complete listing of the source directory, which is
+	   read up front in DELETE_BEFORE mode and along the way otherwise. */
+	struct name_list *names = NULL;
+	if (ctx->delete_mode != DELETE_NONE) {
+		names = malloc(sizeof(struct name_list));
+		if (names == NULL) {
+			set_failed(ctx);
+			err = "Skipping deleting extra entries of directory %s";
+			print_error_and_reset_errno(errno, err, work->dst);
+		} else {
+			name_list_init(names);
+		}
+	}
+	if (names != NULL && ctx->delete_mode == DELETE_BEFORE) {
+		if (list_directory(dir, names) != 0) {
+			set_failed(ctx);
+			err = "Skipping deleting extra entries of directory %s";
+			print_error_and_reset_errno(errno, err, work->dst);
+		} else if (delete_extras(work, names) != 0) {
+			set_failed(ctx);
+		}
+		free_names(names);
+		names = NULL;
+	}
 
-	FTSENT *ftsent = NULL;
-	char *dst_dir_buf = NULL;
-	size_t dst_dir_buf_len = 0;
+	/* Entries that are synced (or given to the sync threads) for the
+	   manifest, which only records directories read without failures. */
+	size_t entry_cnt = 0;
+	bool complete = true;
+	struct dirent *dent;
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL) {
+		char *name = dent->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			errno = 0;
+			continue;
+		}
+		size_t name_len = strlen(name);
+		if (names != NULL && name_list_add(names, name, name_len) != 0) {
+			set_failed(ctx);
+			err = "Skipping deleting extra entries of directory %s";
+			print_error_and_reset_errno(errno, err, work->dst);
+			free_names(names);
+			names = NULL;
+		}
 
-	while ((ftsent = fts_read(fts)) != NULL) {
-		errno = 0;
-		switch (ftsent->fts_info) {
-		case FTS_D:
-			if (ftsent->fts_pathlen <= 0 || ftsent->fts_level < 0)
-				break;
-
-			char *suffix = get_path_suffix_at_level(ftsent->fts_path,
-			                                        ftsent->fts_pathlen,
-			                                        ftsent->fts_level);
-			size_t suffix_len = strlen(suffix);
-			/* For source path '/', we don't need to create '/' in destination. */
-			if (ftsent->fts_level == 0 && suffix[0] == '/')
-				break;
-
-			/* Make sure ${dst_len + suffix_len + 2} will not wrap around. */
-			if (dst_len > SIZE_MAX - suffix_len ||
-			    dst_len + suffix_len > SIZE_MAX - 2) {
-				rc = -1;
-				errno = ENOMEM;
-				err = "Skipping sync of directory %s";
-				print_error_and_reset_errno(errno, err, ftsent->fts_path);
-				try_skip_directory(fts, ftsent);
-				break;
+		/* Files are stat-ed here rather than by the sync threads so that they
+		   can be scheduled by size. */
+		unsigned char type = dent->d_type;
+		struct stat statbuf;
+		if (type == DT_UNKNOWN || type == DT_REG || type == DT_LNK) {
+			start = metrics_now();
+			ret = fstatat(work->src_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW);
+			metrics_record(METRICS_STAT, start);
+			if (ret != 0) {
+				set_failed(ctx);
+				complete = false;
+				err = "Failure during traversing for %s/%s";
+				print_error_and_reset_errno(errno, err, work->src, name);
+				continue;
 			}
+			type = DT_UNKNOWN;
+			if (S_ISDIR(statbuf.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(statbuf.st_mode))
+				type = DT_REG;
+			else if (S_ISLNK(statbuf.st_mode))
+				type = DT_LNK;
+		}
 
-			size_t total_len = dst_len + suffix_len + 2;
-			if (dst_dir_buf_len < total_len) {
-				size_t buf_size = total_len < BUF_SIZE ? BUF_SIZE : total_len;
-				char *tmp = realloc(dst_dir_buf, buf_size);
-				if (tmp == NULL) {
-					rc = -1;
-					err = "Skipping sync of directory %s";
-					print_error_and_reset_errno(errno, err, ftsent->fts_path);
-					try_skip_directory(fts, ftsent);
-					break;
-				}
-				dst_dir_buf = tmp;
-				dst_dir_buf_len = buf_size;
-			}
+		switch (type) {
+		case DT_DIR:
+			if (push_subdirectory(thread_data, work, name, name_len) == 0)
+				++entry_cnt;
+			else
+				complete = false;
+			break;
 
-			memcpy(dst_dir_buf, dst_path, dst_len);
-			dst_dir_buf[dst_len] = '/';
-			memcpy(dst_dir_buf + dst_len + 1, suffix, suffix_len);
-			dst_dir_buf[total_len - 1] = '\0';
-
-			ret = sync_directory(ftsent->fts_path, dst_dir_buf);
-			if (ret == -1) {
-				rc = -1;
-				err = "Skipping sync of directory %s";
-				print_error_and_reset_errno(errno, err, ftsent->fts_path);
-				try_skip_directory(fts, ftsent);
+		case DT_REG:
+		case DT_LNK:
+			ret = queue_file(thread_data, work, name, name_len, &statbuf);
+			if (ret != 0) {
+				set_failed(ctx);
+				complete = false;
+				err = "Skipping sync of file %s/%s";
+				print_error_and_reset_errno(errno, err, work->src, name);
+			} else {
+				++entry_cnt;
 			}
 			break;
 
-		case FTS_F:
-		case FTS_SL:
-		case FTS_SLNONE:
-		case FTS_NSOK:
-			if (ftsent->fts_pathlen <= 0 || ftsent->fts_level < 0)
-				break;
+		default:
+			print_message("Skipping %s/%s. Unknown file type", work->src, name);
+			complete = false;
+			break;
+		}
+		errno = 0;
+	}
 
-			ret = prepare_sync_data(ftsent->fts_path, ftsent->fts_pathlen,
-			                        dst_path, dst_len, ftsent->fts_level, &sd);
-			if (ret != 0) {
-				rc = -1;
-				err = "Skipping sync of file %s";
-				print_error_and_reset_errno(errno, err, ftsent->fts_path);
-				break;
-			}
+	if (errno) {
+		set_failed(ctx);
+		complete = false;
+		if (names != NULL) {
+			free_names(names);
+			names = NULL;
+		}
+		err = "Failure during traversing for %s";
+		print_error_and_reset_errno(errno, err, work->src);
+	}
+	if (ctx->M != NULL && complete)
+		manifest_add_dir(ctx->M, work, entry_cnt);
 
-			while ((ret = sync_data_mpmc_queue_enqueue(Q, &sd)) != 0)
-				;
+	/* The extra entries are deleted when the last reference to the directory
+	   is dropped, i.e., after its files have been synced. */
+	work->src_names = names;
 
-			break;
+	/* Don't hold back the files of this directory while scanning the next. */
+	flush_files(thread_data);
 
-		case FTS_DEFAULT:
-			fprintf(stderr, "Skipping %s. Unknown file type\n", ftsent->fts_path);
-			break;
+	/* Ignore return value from closedir. */
+	closedir(dir);
+	return;
+}
 
-		case FTS_DNR:
-			rc = -1;
-			err = "Skipping sync of directory %s. Directory cannot be read";
-			print_error_and_reset_errno(ftsent->fts_errno, err, ftsent->fts_path);
-			break;
+/*
+ * Scans directories from its own deque, stealing from the other traversal
+ * threads' deques when its own deque is empty, until all the directories have
+ * been scanned.
+ *
+ * Returns NULL.
+ */
+static void *
+traverse_thread_func(void *data)
+{
+	struct traverse_thread_data *thread_data = data;
+	struct traverse_ctx *ctx = thread_data->ctx;
+	uint8_t id = thread_data->id;
+	metrics_bind_traverse_thread(id);
+	log_sink_bind_traverse_thread(id);
 
-		case FTS_DC:
-			rc = -1;
-			err = "Skipping sync of directory %s. Directory causes cycle\n";
-			fprintf(stderr, err, ftsent->fts_path);
+	while (true) {
+		struct dir_node *work = dir_deque_pop(&ctx->deques[id]);
+		if (work == NULL)
+			work = steal_work(ctx, id);
+		if (work == NULL)
+			work = wait_for_work(ctx, id);
+		if (work == NULL)
 			break;
 
-		case FTS_NS:
-		case FTS_ERR:
+		scan_directory(thread_data, work);
+		finish_work(ctx, work);
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues source ${src} that is given on the command line. Source directories
+ * are pushed to the deques of the traversal threads in a round robin manner and
+ * source files are added to the queue directly.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+queue_source(struct traverse_thread_data *thread_data, uint8_t id, char *src,
+             char *dst_path)
+{
+	int ret;
+	char *err;
+	struct traverse_ctx *ctx = thread_data->ctx;
+	struct arena *A = &thread_data->arena;
+
+	struct stat statbuf;
+	ret = fstatat(AT_FDCWD, src, &statbuf, AT_SYMLINK_NOFOLLOW);
+	if (ret != 0) {
+		err = "Failure during traversing for %s";
+		print_error_and_reset_errno(errno, err, src);
+		return -1;
+	}
+
+	size_t dst_len = strlen(dst_path);
+
+	/* ${src} is a canonicalized absolute path, so the last component starts
+	   after the last '/' unless ${src} is "/" itself. */
+	char *name = strrchr(src, '/') + 1;
+	size_t name_len = strlen(name);
+	size_t parent_len = name - src > 1 ? (size_t) (name - src - 1) : 1;
+
+	if (!S_ISDIR(statbuf.st_mode) && !S_ISREG(statbuf.st_mode) &&
+	    !S_ISLNK(statbuf.st_mode)) {
+		print_message("Skipping %s. Unknown file type", src);
+		return 0;
+	}
+
+	/* For source path '/', we don't need to create '/' in destination, so
+	   it is scanned as the destination directory itself. */
+	if (name_len == 0) {
+		struct dir_node *work = dir_node_new(A, src, 1, dst_path, dst_len, true);
+		if (work == NULL || push_work(ctx, id, work) != 0) {
+			err = "Skipping sync of directory %s";
+			print_error_and_reset_errno(errno, err, src);
+			if (work != NULL)
+				dir_node_unref(work);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* The parent of the source is opened here so that the source can be
+	   opened relative to it just like every other directory or file. */
+	struct dir_node *parent = dir_node_new(A, src, parent_len, dst_path, dst_len,
+	                                       true);
+	if (parent == NULL ||
+	    (ctx->V != NULL ? open_directory(parent) : sync_directory(parent)) != 0) {
+		err = "Skipping sync of %s";
+		print_error_and_reset_errno(errno, err, src);
+		if (parent != NULL)
+			dir_node_unref(parent);
+		return -1;
+	}
+	add_filesystem(thread_data, parent);
+	/* The parent is not read, so it is recorded without its entries. */
+	if (ctx->M != NULL) {
+		manifest_check_dir(ctx->M, parent);
+		manifest_add_dir(ctx->M, parent, 0);
+	}
+
+	if (S_ISDIR(statbuf.st_mode)) {
+		struct dir_node *work = dir_node_new_child(A, parent, name, name_len);
+		if (work == NULL || push_work(ctx, id, work) != 0) {
+			err = "Skipping sync of directory %s";
+			print_error_and_reset_errno(errno, err, src);
+			if (work != NULL)
+				dir_node_unref(work);
+			dir_node_unref(parent);
+			return -1;
+		}
+	} else {
+		if (queue_file(thread_data, parent, name, name_len, &statbuf) != 0) {
+			err = "Skipping sync of file %s";
+			print_error_and_reset_errno(errno, err, src);
+			dir_node_unref(parent);
+			return -1;
+		}
+	}
+	dir_node_unref(parent);
+
+	return 0;
+}
+
+/*
+ * Traverses the ${src_paths} and syncs sources to ${dst_path} using
+ * ${thread_cnt} traversal threads (the calling thread is one of them). The
+ * traversal threads handle the work of syncing directories themselves. Files
+ * are added to the queue of the one of the ${pool_cnt} ${pools} of sync threads
+ * that syncs their device for syncing, or to its heap if it has one and they
+ * are large, which will be picked up by the pool's sync threads. If ${M}
+ * is not NULL, the synced directories are checked against and recorded in it
+ * and the directories it prunes are not read. If ${D} is not NULL, the
+ * filesystems of the destination directories are added to it. If ${V} is not
+ * NULL, the destination directories are only opened, not synced, for the
+ * queued files to be verified and the missing ones are reported to ${V}.
+ * Extra entries in the destination directories that are read are deleted
+ * according to ${delete_mode}.
+ *
+ * Every directory is a unit of work. A traversal thread scans a directory,
+ * pushing the subdirectories to its own deque, and idle traversal threads steal
+ * directories from the other threads' deques so that large trees get scanned
+ * in parallel.
+ *
+ * ${src_paths} must be a NULL terminated array and ${src_paths} and ${dst_path}
+ * must be canonicalized absolute paths.
+ *
+ * Returns 0 on success, -1 on any kind of failure during traversal.
+ */
+int
+traverse_and_queue(char *src_paths[], char *dst_path, struct sync_thread_data *pools,
+                   uint8_t pool_cnt, struct manifest *M, struct durable *D,
+                   struct verify *V, enum delete_mode delete_mode, uint8_t thread_cnt)
+{
+	int rc = 0;
+	int ret;
+
+	struct traverse_ctx ctx;
+	ctx.pools = pools;
+	ctx.pool_cnt = pool_cnt;
+	ctx.M = M;
+	ctx.D = D;
+	ctx.V = V;
+	ctx.delete_mode = delete_mode;
+	ctx.thread_cnt = thread_cnt;
+	ctx.pending = 0;
+	ctx.idle_cnt = 0;
+	ctx.failed = 0;
+
+	ctx.deques = calloc(thread_cnt, sizeof(struct dir_deque));
+	if (ctx.deques == NULL) {
+		print_error_and_reset_errno(errno, "Failed to initialize traversal");
+		rc = -1;
+		goto err0;
+	}
+
+	uint8_t deque_cnt = 0;
+	for (; deque_cnt < thread_cnt; ++deque_cnt) {
+		if (dir_deque_init(&ctx.deques[deque_cnt]) != 0) {
+			print_error_and_reset_errno(errno, "Failed to initialize traversal");
 			rc = -1;
-			err = "Failure during traversing for %s";
-			print_error_and_reset_errno(ftsent->fts_errno, err, ftsent->fts_path);
-			break;
+			goto err1;
+		}
+	}
 
-		case FTS_DP:
-		case FTS_DOT:
-		default:
+	ret = pthread_mutex_init(&ctx.idle_lock, NULL);
+	if (ret != 0) {
+		print_error_and_reset_errno(ret, "Failed to initialize traversal");
+		rc = -1;
+		goto err1;
+	}
+	ret = pthread_cond_init(&ctx.idle_cond, NULL);
+	if (ret != 0) {
+		print_error_and_reset_errno(ret, "Failed to initialize traversal");
+		rc = -1;
+		goto err2;
+	}
+
+	/* Every thread's batch of files takes about 10KB, too much for the stack
+	   with up to 256 threads. */
+	struct traverse_thread_data *thread_data =
+		malloc(thread_cnt * sizeof(struct traverse_thread_data));
+	if (thread_data == NULL) {
+		print_error_and_reset_errno(errno, "Failed to initialize traversal");
+		rc = -1;
+		goto err3;
+	}
+
+	pthread_t threads[UINT8_MAX + 1];
+	uint8_t started = 1;
+	for (uint8_t i = 0; i < thread_cnt; ++i) {
+		thread_data[i].ctx = &ctx;
+		thread_data[i].id = i;
+		thread_data[i].dst_dev_added = false;
+		arena_init(&thread_data[i].arena);
+		thread_data[i].batch_pool = NULL;
+		thread_data[i].batch_cnt = 0;
+	}
+
+	metrics_bind_traverse_thread(0);
+	log_sink_bind_traverse_thread(0);
+	for (size_t i = 0; src_paths[i] != NULL; ++i) {
+		if (queue_source(&thread_data[0], i % thread_cnt, src_paths[i], dst_path) != 0)
+			rc = -1;
+	}
+	flush_files(&thread_data[0]);
+	for (; started < thread_cnt; ++started) {
+		ret = pthread_create(&threads[started], NULL, traverse_thread_func,
+		                     &thread_data[started]);
+		if (ret != 0) {
+			/* The threads that have been started (including this one) can
+			   still finish the traversal as they steal from every deque. */
+			rc = -1;
+			print_error_and_reset_errno(ret, "Failed to create all traversal threads");
 			break;
 		}
 	}
 
-	if (errno) {
-		rc = -1;
-		print_error_and_reset_errno(errno, "Failure during traversing sources");
+	traverse_thread_func(&thread_data[0]);
+
+	for (uint8_t i = 1; i < started; ++i) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret != 0) {
+			rc = -1;
+			print_error_and_reset_errno(ret, "Failed to wait for traversal thread %d",
+			                            i);
+		}
 	}
 
-	/* Ignore return value from fts_close. */
-	fts_close(fts);
-	free(dst_dir_buf);
+	if (__atomic_load_n(&ctx.failed, __ATOMIC_RELAXED))
+		rc = -1;
 
- done:
+	/* The arena chunks still in use by the queued files are freed by the sync
+	   threads. */
+	for (uint8_t i = 0; i < thread_cnt; ++i)
+		arena_destroy(&thread_data[i].arena);
+	free(thread_data);
+
+ err3:
+	pthread_cond_destroy(&ctx.idle_cond);
+ err2:
+	pthread_mutex_destroy(&ctx.idle_lock);
+ err1:
+	for (uint8_t i = 0; i < deque_cnt; ++i)
+		dir_deque_destroy(&ctx.deques[i]);
+	free(ctx.deques);
+ err0:
 	return rc;
 }
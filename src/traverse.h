@@ -6,7 +6,18 @@
 #ifndef TRAVERSE_H
 #define TRAVERSE_H
 
+#include <stdint.h>
+
+#include "delete_extras.h"
+
+struct durable;
+struct manifest;
+struct sync_thread_data;
+struct verify;
+
 int traverse_and_queue(char *src_paths[], char *dst_path,
-                       struct sync_data_mpmc_queue *Q);
+                       struct sync_thread_data *pools, uint8_t pool_cnt,
+                       struct manifest *M, struct durable *D, struct verify *V,
+                       enum delete_mode delete_mode, uint8_t thread_cnt);
 
 #endif /* TRAVERSE_H */
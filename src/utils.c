@@ -5,31 +5,44 @@
 
 #include <errno.h>
 #include <stdarg.h>
-#include <stdio.h>
-#include <string.h>
 
+#include "log_sink.h"
+#include "metrics.h"
 #include "utils.h"
 
 /*
  * Prints ${format} to stderr with a string describing the ${err} error code
- * and resets errno.
+ * and resets errno. The error is counted in the calling thread's metrics.
  */
 void
 print_error_and_reset_errno(int err, const char *format, ...)
 {
+	metrics_add(METRICS_ERRORS, 1);
+
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	log_sink_vwrite(LOG_ERROR, err, format, args);
 	va_end(args);
 
-	if (err != 0) {
-		char err_buf[1024];
-		strerror_r(err, err_buf, 1024);
-		fprintf(stderr, " : %s", err_buf);
-	}
-
-	fprintf(stderr, "\n");
 	errno = 0;
 
 	return;
 }
+
+/*
+ * Prints ${format} to stderr as information rather than an error. errno is
+ * left as it is.
+ */
+void
+print_message(const char *format, ...)
+{
+	int err = errno;
+
+	va_list args;
+	va_start(args, format);
+	log_sink_vwrite(LOG_INFO, 0, format, args);
+	va_end(args);
+
+	errno = err;
+	return;
+}
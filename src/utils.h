@@ -6,6 +6,44 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
 void print_error_and_reset_errno(int err, const char *format, ...);
+void print_message(const char *format, ...);
+
+/*
+ * Returns the length of "${dir}/${name}" without the terminating null byte.
+ * If ${dir} already ends with a '/' (i.e., it is "/"), no extra '/' is added.
+ */
+static inline size_t
+joined_path_len(const char *dir, size_t dir_len, size_t name_len)
+{
+	bool needs_slash = dir_len == 0 || dir[dir_len - 1] != '/';
+	return dir_len + (needs_slash ? 1 : 0) + name_len;
+}
+
+/*
+ * Writes "${dir}/${name}" with a terminating null byte to ${buf} which must
+ * be able to hold joined_path_len() + 1 bytes.
+ *
+ * Returns the length of the written path without the terminating null byte.
+ */
+static inline size_t
+join_path(char *buf, const char *dir, size_t dir_len, const char *name,
+          size_t name_len)
+{
+	size_t len = 0;
+	memcpy(buf, dir, dir_len);
+	len += dir_len;
+	if (dir_len == 0 || dir[dir_len - 1] != '/')
+		buf[len++] = '/';
+	memcpy(buf + len, name, name_len);
+	len += name_len;
+	buf[len] = '\0';
+
+	return len;
+}
 
 #endif /* UTILS_H */
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dir_node.h"
+#include "file_job.h"
+#include "sync_options.h"
+#include "utils.h"
+#include "verify.h"
+
+/*
+ * Result of comparing the sources with the destination. Mismatches are
+ * reported on stdout and the source files' hashes are written to ${hash_file}
+ * (if not NULL) as they are computed, both under ${lock} so that the lines of
+ * different sync threads don't mix.
+ */
+struct verify {
+	pthread_mutex_t lock;
+	FILE *hash_file;
+	size_t mismatch_cnt;
+};
+
+/*
+ * Initialize verification. If ${hash_path} is not NULL, the hashes of the
+ * source files are written to it.
+ *
+ * Returns the verification on success, NULL on failure. Sets errno on failure.
+ */
+struct verify *
+verify_init(const char *hash_path)
+{
+	int ret;
+
+	struct verify *V = malloc(sizeof(struct verify));
+	if (V == NULL)
+		goto err0;
+	ret = pthread_mutex_init(&V->lock, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto err1;
+	}
+	V->hash_file = NULL;
+	if (hash_path != NULL) {
+		V->hash_file = fopen(hash_path, "w");
+		if (V->hash_file == NULL)
+			goto err2;
+	}
+	V->mismatch_cnt = 0;
+	return V;
+
+ err2:
+	pthread_mutex_destroy(&V->lock);
+ err1:
+	free(V);
+ err0:
+	return NULL;
+}
+
+/*
+ * Free verification, closing the hash file if verify_finish hasn't.
+ */
+void
+verify_free(struct verify *V)
+{
+	if (V == NULL)
+		return;
+
+	if (V->hash_file != NULL)
+		fclose(V->hash_file);
+	pthread_mutex_destroy(&V->lock);
+	free(V);
+	return;
+}
+
+/*
+ * Reports that "${dst}/${name}" (or ${dst} if ${name} is NULL) doesn't match
+ * its source because of ${reason}.
+ */
+void
+verify_mismatch(struct verify *V, const char *dst, const char *name,
+                const char *reason)
+{
+	pthread_mutex_lock(&V->lock);
+	++V->mismatch_cnt;
+	if (name != NULL)
+		printf("%s%s%s: %s\n", dst, strcmp(dst, "/") == 0 ? "" : "/", name, reason);
+	else
+		printf("%s: %s\n", dst, reason);
+	pthread_mutex_unlock(&V->lock);
+	return;
+}
+
+/*
+ * Writes ${hash} of source ${name} of ${dir} to the hash file, if there is one,
+ * in the format of xxhsum.
+ */
+static void
+write_hash(struct verify *V, struct dir_node *dir, const char *name,
+           uint64_t hash)
+{
+	if (V->hash_file == NULL)
+		return;
+
+	pthread_mutex_lock(&V->lock);
+	fprintf(V->hash_file, "%016" PRIx64 "  %s%s%s\n", hash, dir->src,
+	        strcmp(dir->src, "/") == 0 ? "" : "/", name);
+	pthread_mutex_unlock(&V->lock);
+	return;
+}
+
+/*
+ * Reads the contents of symbolic link ${name} of size ${size} relative to
+ * ${dir_fd}.
+ *
+ * Returns the contents on success, NULL on failure. Sets errno on failure.
+ */
+static char *
+read_symlink(int dir_fd, const char *name, uintmax_t size)
+{
+	if (size > (uintmax_t) (SSIZE_MAX - 1)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	char *buf = malloc(size + 1);
+	if (buf == NULL)
+		return NULL;
+	ssize_t len = readlinkat(dir_fd, name, buf, size + 1);
+	if (len == -1 || (uintmax_t) len != size) {
+		/* The link changed after it was stat-ed. */
+		if (len != -1)
+			errno = EAGAIN;
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+/*
+ * Compares symbolic link ${name} of ${dir} with its destination ${dst_statbuf}.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+verify_symlink(struct verify *V, struct dir_node *dir, char *name,
+               const struct stat *src_statbuf, const struct stat *dst_statbuf)
+{
+	char *err;
+
+	if (!S_ISLNK(dst_statbuf->st_mode)) {
+		verify_mismatch(V, dir->dst, name, "not a symbolic link");
+		return 0;
+	}
+	if (src_statbuf->st_size != dst_statbuf->st_size) {
+		verify_mismatch(V, dir->dst, name, "target differs");
+		return 0;
+	}
+
+	uintmax_t size = (uintmax_t) src_statbuf->st_size;
+	char *src_target = read_symlink(dir->src_fd, name, size);
+	if (src_target == NULL) {
+		err = "Failed to read symbolic link %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		return -1;
+	}
+	char *dst_target = read_symlink(dir->dst_fd, name, size);
+	if (dst_target == NULL) {
+		err = "Failed to read symbolic link %s/%s";
+		print_error_and_reset_errno(errno, err, dir->dst, name);
+		free(src_target);
+		return -1;
+	}
+
+	if (strcmp(src_target, dst_target) != 0)
+		verify_mismatch(V, dir->dst, name, "target differs");
+	free(dst_target);
+	free(src_target);
+	return 0;
+}
+
+/*
+ * Compares regular file ${name} of ${dir} with its destination, whose stat is
+ * ${dst_statbuf} if ${dst_err} is 0. The contents are only hashed if the sizes
+ * match, the destination's not at all if they don't (or it is missing) unless
+ * the source's hash is to be written to the hash file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+verify_regular_file(struct verify *V, const struct sync_options *opts,
+                    struct dir_node *dir, char *name,
+                    const struct stat *src_statbuf,
+                    const struct stat *dst_statbuf, int dst_err)
+{
+	int rc = 0;
+	char *err;
+	const char *reason = NULL;
+
+	if (dst_err != 0)
+		reason = "missing";
+	else if (!S_ISREG(dst_statbuf->st_mode))
+		reason = "not a regular file";
+	else if (src_statbuf->st_size != dst_statbuf->st_size)
+		reason = "size differs";
+	if (reason != NULL) {
+		verify_mismatch(V, dir->dst, name, reason);
+		if (V->hash_file == NULL)
+			return 0;
+	}
+
+	int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd == -1) {
+		err = "Failed to open source %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		return -1;
+	}
+	int dst_fd = -1;
+	if (reason == NULL) {
+		dst_fd = openat(dir->dst_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (dst_fd == -1) {
+			err = "Failed to open destination %s/%s";
+			print_error_and_reset_errno(errno, err, dir->dst, name);
+			rc = -1;
+			goto out;
+		}
+	}
+
+	uint64_t src_hash;
+	uint64_t dst_hash;
+	uintmax_t size = (uintmax_t) src_statbuf->st_size;
+	if (file_job_hash(opts, src_fd, dst_fd, size, &src_hash, &dst_hash) != 0) {
+		err = "Failed to hash %s/%s";
+		print_error_and_reset_errno(errno, err, dir->src, name);
+		rc = -1;
+		goto out;
+	}
+
+	write_hash(V, dir, name, src_hash);
+	if (dst_fd != -1 && src_hash != dst_hash)
+		verify_mismatch(V, dir->dst, name, "contents differ");
+
+ out:
+	/* Ignore return values from close as the files are opened for reading
+	   only. */
+	if (dst_fd != -1)
+		close(dst_fd);
+	close(src_fd);
+	errno = 0;
+	return rc;
+}
+
+/*
+ * Compares ${name} file in ${dir}'s source directory, whose stat is
+ * ${src_statbuf}, with ${name} in ${dir}'s destination directory. Regular
+ * files are compared by their size and hash, symbolic links by their target.
+ * Mismatches are reported with verify_mismatch and don't count as failures.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+verify_file(struct verify *V, const struct sync_options *opts,
+            struct dir_node *dir, char *name, const struct stat *src_statbuf)
+{
+	struct stat dst_statbuf;
+	int dst_err = 0;
+	if (fstatat(dir->dst_fd, name, &dst_statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+		dst_err = errno;
+		errno = 0;
+		if (dst_err != ENOENT) {
+			char *err = "Failed to stat destination %s/%s";
+			print_error_and_reset_errno(dst_err, err, dir->dst, name);
+			return -1;
+		}
+	}
+
+	if (S_ISLNK(src_statbuf->st_mode)) {
+		if (dst_err != 0) {
+			verify_mismatch(V, dir->dst, name, "missing");
+			return 0;
+		}
+		return verify_symlink(V, dir, name, src_statbuf, &dst_statbuf);
+	}
+
+	return verify_regular_file(V, opts, dir, name, src_statbuf, &dst_statbuf,
+	                           dst_err);
+}
+
+/*
+ * Returns the number of mismatches reported so far.
+ */
+size_t
+verify_mismatch_cnt(struct verify *V)
+{
+	pthread_mutex_lock(&V->lock);
+	size_t cnt = V->mismatch_cnt;
+	pthread_mutex_unlock(&V->lock);
+	return cnt;
+}
+
+/*
+ * Closes the hash file, if there is one, once all the files have been
+ * verified.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+int
+verify_finish(struct verify *V)
+{
+	if (V->hash_file == NULL)
+		return 0;
+
+	int ret = ferror(V->hash_file);
+	if (fclose(V->hash_file) != 0)
+		ret = -1;
+	else if (ret != 0)
+		errno = EIO;
+	V->hash_file = NULL;
+	return ret != 0 ? -1 : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+
+#include "dir_node.h"
+#include "sync_options.h"
+
+/* Opaque type */
+struct verify;
+
+struct verify *verify_init(const char *hash_path);
+void verify_free(struct verify *V);
+void verify_mismatch(struct verify *V, const char *dst, const char *name,
+                     const char *reason);
+int verify_file(struct verify *V, const struct sync_options *opts,
+                struct dir_node *dir, char *name, const struct stat *src_statbuf);
+size_t verify_mismatch_cnt(struct verify *V);
+int verify_finish(struct verify *V);
+
+#endif /* VERIFY_H */
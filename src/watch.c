@@ -0,0 +1,1061 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE /* for open_by_handle_at */
+
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "delete_extras.h"
+#include "link_table.h"
+#include "traverse.h"
+#include "utils.h"
+#include "watch.h"
+
+/* Changes are synced once no event has come for DEBOUNCE_MS or MAX_DELAY_MS
+   after the first pending event, whichever is earlier. */
+#define DEBOUNCE_MS 200
+#define MAX_DELAY_MS 2000
+
+/* More pending paths than this are collapsed into their directories. */
+#define MAX_DIRTY_CNT (1 << 16)
+
+#define EVENT_BUF_SIZE (64 * 1024)
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_EXCL_UNLINK | \
+                      IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#ifdef FAN_REPORT_DFID_NAME
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | \
+                       FAN_CLOSE_WRITE | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR)
+/* An event with a directory's file handle and a name fits in this. */
+#define FANOTIFY_EVENT_MAX_SIZE 1024
+#endif
+
+/*
+ * A source being watched. With fanotify, ${fd} is a file descriptor in its
+ * filesystem, which has id ${fsid}, to open the directories of events by
+ * their handles. ${lost} is set if events in the source have been lost, which
+ * makes the next sync rescan it as a whole.
+ */
+struct watch_source {
+	char *path;
+	size_t len;
+	int fd;
+	fsid_t fsid;
+	bool lost;
+};
+
+/*
+ * A fanotify group ${fd} marking filesystem ${fsid}. Every filesystem of the
+ * sources gets a group of its own, so that an overflow of a group's queue
+ * tells which sources have lost events.
+ */
+struct watch_group {
+	int fd;
+	fsid_t fsid;
+};
+
+/*
+ * Watches the sources with fanotify (a group per filesystem in ${groups}) or
+ * inotify (${fd} is the notification group) and gathers the paths of changed
+ * files and directories in ${dirty} until they are synced. ${overflow} is set
+ * if the inotify queue overflowed, which doesn't tell where events have been
+ * lost. With inotify, ${wd_paths} are the paths of the watched directories
+ * indexed by watch descriptor. SIGINT and SIGTERM are blocked and read from
+ * ${sig_fd}, which is polled along with the groups in ${pfds}.
+ */
+struct watch {
+	enum watch_backend backend;
+	int fd;
+	int sig_fd;
+	sigset_t old_mask;
+	struct watch_source *sources;
+	size_t source_cnt;
+	struct watch_group *groups;
+	size_t group_cnt;
+	struct pollfd *pfds;
+	size_t pfd_cnt;
+	char **wd_paths;
+	size_t wd_cap;
+	char **dirty;
+	size_t dirty_cnt;
+	size_t dirty_cap;
+	bool overflow;
+	uint64_t buf[EVENT_BUF_SIZE / sizeof(uint64_t)];
+};
+
+/*
+ * Returns the source which ${path} is or is inside of, NULL if there is none.
+ */
+static struct watch_source *
+find_source(struct watch *W, const char *path, size_t len)
+{
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		struct watch_source *src = &W->sources[i];
+		if (src->len == 1 ||
+		    (len >= src->len && memcmp(path, src->path, src->len) == 0 &&
+		     (len == src->len || path[src->len] == '/')))
+			return src;
+	}
+	return NULL;
+}
+
+/*
+ * Marks the sources that ${path} is inside of, or that are inside ${path}, as
+ * having lost events, e.g., when its events couldn't be recorded.
+ */
+static void
+lose_events(struct watch *W, const char *path, size_t len)
+{
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		struct watch_source *src = &W->sources[i];
+		bool inside = len >= src->len && memcmp(path, src->path, src->len) == 0 &&
+			(len == src->len || path[src->len] == '/');
+		bool around = len < src->len && memcmp(path, src->path, len) == 0 &&
+			src->path[len] == '/';
+		if (len == 1 || src->len == 1 || inside || around)
+			src->lost = true;
+	}
+	return;
+}
+
+/*
+ * Returns whether there are changes to sync.
+ */
+static bool
+changes_pending(struct watch *W)
+{
+	if (W->dirty_cnt > 0 || W->overflow)
+		return true;
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		if (W->sources[i].lost)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns the length of the parent directory of canonicalized absolute
+ * ${path}, 0 for the paths in "/".
+ */
+static inline size_t
+parent_len(const char *path)
+{
+	return (size_t) (strrchr(path, '/') - path);
+}
+
+/*
+ * Makes room for more paths to sync by replacing the paths inside the sources
+ * with their parent directories, which are synced with everything in them,
+ * and dropping the repeated ones. Events tend to come in bursts in the same
+ * directory, so this usually leaves a few directories to rescan.
+ */
+static void
+collapse_dirty(struct watch *W)
+{
+	size_t cnt = 0;
+	for (size_t i = 0; i < W->dirty_cnt; ++i) {
+		char *path = W->dirty[i];
+		size_t len = strlen(path);
+		struct watch_source *src = find_source(W, path, len);
+		if (len > src->len) {
+			size_t dir_len = parent_len(path);
+			path[dir_len > 0 ? dir_len : 1] = '\0';
+		}
+		if (cnt > 0 && strcmp(W->dirty[cnt - 1], path) == 0)
+			free(path);
+		else
+			W->dirty[cnt++] = path;
+	}
+	W->dirty_cnt = cnt;
+	return;
+}
+
+/*
+ * Adds "${dir}/${name}" (or ${dir} if ${name} is empty) to the paths to sync
+ * if it is inside a source that is not rescanned as a whole anyway. Paths are
+ * only deduplicated when synced, except for repeated events of the same path.
+ * If the path can't be added, its source is marked as having lost events.
+ */
+static void
+add_dirty(struct watch *W, const char *dir, size_t dir_len, const char *name,
+          size_t name_len)
+{
+	size_t len = name_len > 0 ? joined_path_len(dir, dir_len, name_len) : dir_len;
+	char *path = malloc(len + 1);
+	if (path == NULL) {
+		lose_events(W, dir, dir_len);
+		errno = 0;
+		return;
+	}
+	if (name_len > 0) {
+		join_path(path, dir, dir_len, name, name_len);
+	} else {
+		memcpy(path, dir, dir_len);
+		path[len] = '\0';
+	}
+
+	struct watch_source *src = find_source(W, path, len);
+	if (src == NULL || src->lost ||
+	    (W->dirty_cnt > 0 && strcmp(W->dirty[W->dirty_cnt - 1], path) == 0)) {
+		free(path);
+		return;
+	}
+
+	if (W->dirty_cnt == MAX_DIRTY_CNT) {
+		collapse_dirty(W);
+		if (W->dirty_cnt > MAX_DIRTY_CNT / 2) {
+			free(path);
+			src->lost = true;
+			return;
+		}
+	}
+	if (W->dirty_cnt == W->dirty_cap) {
+		size_t cap = W->dirty_cap > 0 ? W->dirty_cap * 2 : 64;
+		char **dirty = realloc(W->dirty, cap * sizeof(char *));
+		if (dirty == NULL) {
+			free(path);
+			src->lost = true;
+			errno = 0;
+			return;
+		}
+		W->dirty = dirty;
+		W->dirty_cap = cap;
+	}
+	W->dirty[W->dirty_cnt++] = path;
+	return;
+}
+
+/*
+ * Watches directory ${path} with inotify, replacing the path of its watch if
+ * it is already watched (e.g., it has been moved).
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+add_watch(struct watch *W, const char *path)
+{
+	int wd = inotify_add_watch(W->fd, path, INOTIFY_MASK);
+	if (wd == -1)
+		return -1;
+
+	if ((size_t) wd >= W->wd_cap) {
+		size_t cap = W->wd_cap > 0 ? W->wd_cap : 64;
+		while (cap <= (size_t) wd)
+			cap *= 2;
+		char **wd_paths = realloc(W->wd_paths, cap * sizeof(char *));
+		if (wd_paths == NULL)
+			goto err0;
+		memset(wd_paths + W->wd_cap, 0, (cap - W->wd_cap) * sizeof(char *));
+		W->wd_paths = wd_paths;
+		W->wd_cap = cap;
+	}
+
+	char *copy = strdup(path);
+	if (copy == NULL)
+		goto err0;
+	free(W->wd_paths[wd]);
+	W->wd_paths[wd] = copy;
+	return 0;
+
+ err0:
+	inotify_rm_watch(W->fd, wd);
+	return -1;
+}
+
+/*
+ * Watches directory ${path} and all the directories under it with inotify.
+ * Directories that disappear while being added are skipped.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+add_tree(struct watch *W, const char *path)
+{
+	if (add_watch(W, path) != 0)
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		if (fd != -1)
+			close(fd);
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+
+	int rc = 0;
+	size_t len = strlen(path);
+	struct dirent *dent;
+	while ((dent = readdir(dir)) != NULL) {
+		char *name = dent->d_name;
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		struct stat statbuf;
+		if (dent->d_type != DT_DIR &&
+		    (dent->d_type != DT_UNKNOWN ||
+		     fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+		     !S_ISDIR(statbuf.st_mode)))
+			continue;
+
+		size_t name_len = strlen(name);
+		char *child = malloc(joined_path_len(path, len, name_len) + 1);
+		if (child == NULL) {
+			rc = -1;
+			break;
+		}
+		join_path(child, path, len, name, name_len);
+		rc = add_tree(W, child);
+		free(child);
+		if (rc != 0)
+			break;
+	}
+
+	int ret = errno;
+	closedir(dir);
+	errno = ret;
+	return rc;
+}
+
+/*
+ * Stops watching directory ${path} and the directories under it with inotify
+ * as they are no longer there.
+ */
+static void
+remove_tree(struct watch *W, const char *path, size_t len)
+{
+	for (size_t wd = 0; wd < W->wd_cap; ++wd) {
+		char *wd_path = W->wd_paths[wd];
+		if (wd_path != NULL && strncmp(wd_path, path, len) == 0 &&
+		    (wd_path[len] == '\0' || wd_path[len] == '/')) {
+			inotify_rm_watch(W->fd, (int) wd);
+			free(wd_path);
+			W->wd_paths[wd] = NULL;
+		}
+	}
+	return;
+}
+
+/*
+ * Watches the sources with inotify. Source directories are watched with all
+ * the directories under them and source files through their parent
+ * directories, so that files replaced by a rename are still watched.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+inotify_setup(struct watch *W)
+{
+	W->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (W->fd == -1)
+		return -1;
+
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		struct watch_source *src = &W->sources[i];
+		struct stat statbuf;
+		if (lstat(src->path, &statbuf) != 0)
+			return -1;
+		if (S_ISDIR(statbuf.st_mode)) {
+			if (add_tree(W, src->path) != 0)
+				return -1;
+			continue;
+		}
+
+		char *name = strrchr(src->path, '/');
+		size_t parent_len = name - src->path > 0 ? (size_t) (name - src->path) : 1;
+		char *parent = strndup(src->path, parent_len);
+		if (parent == NULL)
+			return -1;
+		int ret = add_watch(W, parent);
+		free(parent);
+		if (ret != 0)
+			return -1;
+	}
+
+	W->backend = WATCH_INOTIFY;
+	return 0;
+}
+
+/*
+ * Reads a buffer of pending inotify events. Only one buffer is read at a time
+ * so that the signals are not held up by a steady stream of events.
+ *
+ * Returns the number of bytes read (0 if no event was pending) on success, -1
+ * on failure. Sets errno on failure.
+ */
+static ssize_t
+read_inotify_events(struct watch *W)
+{
+	ssize_t len = read(W->fd, W->buf, sizeof(W->buf));
+	if (len == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			errno = 0;
+			return 0;
+		}
+		return -1;
+	}
+
+	char *p = (char *) W->buf;
+	while (p < (char *) W->buf + len) {
+		struct inotify_event *event = (struct inotify_event *) p;
+		p += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			W->overflow = true;
+			continue;
+		}
+		if (event->wd < 0 || (size_t) event->wd >= W->wd_cap ||
+		    W->wd_paths[event->wd] == NULL)
+			continue;
+		if (event->mask & IN_IGNORED) {
+			free(W->wd_paths[event->wd]);
+			W->wd_paths[event->wd] = NULL;
+			continue;
+		}
+
+		char *dir = W->wd_paths[event->wd];
+		size_t dir_len = strlen(dir);
+		size_t name_len = event->len > 0 ? strlen(event->name) : 0;
+		add_dirty(W, dir, dir_len, event->name, name_len);
+		if (!(event->mask & IN_ISDIR) || name_len == 0)
+			continue;
+
+		/* Directories moved away lose their watches and directories
+		   created or moved in are watched with their contents. */
+		char *path = malloc(joined_path_len(dir, dir_len, name_len) + 1);
+		if (path == NULL) {
+			lose_events(W, dir, dir_len);
+			errno = 0;
+			continue;
+		}
+		size_t path_len = join_path(path, dir, dir_len, event->name, name_len);
+		if (event->mask & (IN_MOVED_FROM | IN_DELETE))
+			remove_tree(W, path, path_len);
+		if ((event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		    find_source(W, path, path_len) != NULL &&
+		    add_tree(W, path) != 0) {
+			char *err = "Failed to watch directory %s";
+			print_error_and_reset_errno(errno, err, path);
+		}
+		free(path);
+	}
+
+	return len;
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+/*
+ * Watches the filesystems of the sources with fanotify, with a group per
+ * filesystem. Events of the whole filesystems are reported, so the events
+ * outside the sources are dropped.
+ *
+ * Returns 0 on success, -1 on failure. Sets errno on failure.
+ */
+static int
+fanotify_setup(struct watch *W)
+{
+	W->groups = calloc(W->source_cnt, sizeof(struct watch_group));
+	if (W->groups == NULL)
+		return -1;
+
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		struct watch_source *src = &W->sources[i];
+		src->fd = open(src->path, O_RDONLY | O_CLOEXEC);
+		if (src->fd == -1)
+			return -1;
+		struct statfs statfsbuf;
+		if (fstatfs(src->fd, &statfsbuf) != 0)
+			return -1;
+		src->fsid = statfsbuf.f_fsid;
+
+		size_t g = 0;
+		while (g < W->group_cnt &&
+		       memcmp(&W->groups[g].fsid, &src->fsid, sizeof(fsid_t)) != 0)
+			++g;
+		if (g < W->group_cnt)
+			continue;
+
+		struct watch_group *G = &W->groups[W->group_cnt];
+		G->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+		                      FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+		if (G->fd == -1)
+			return -1;
+		G->fsid = src->fsid;
+		++W->group_cnt;
+		if (fanotify_mark(G->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK,
+		                  AT_FDCWD, src->path) != 0)
+			return -1;
+	}
+
+	W->backend = WATCH_FANOTIFY;
+	return 0;
+}
+
+/*
+ * Adds the path of the fanotify event with file identifier ${fid} of type
+ * ${info_type} to the paths to sync. The directory of the event is opened by
+ * its handle to find its path, which fails if it has been removed since.
+ */
+static void
+add_fanotify_event(struct watch *W, struct fanotify_event_info_fid *fid,
+                   uint8_t info_type)
+{
+	struct watch_source *src = NULL;
+	for (size_t i = 0; i < W->source_cnt && src == NULL; ++i) {
+		if (memcmp(&W->sources[i].fsid, &fid->fsid, sizeof(fsid_t)) == 0)
+			src = &W->sources[i];
+	}
+	if (src == NULL)
+		return;
+
+	struct file_handle *handle = (struct file_handle *) fid->handle;
+	char *name = "";
+	if (info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+		name = (char *) handle->f_handle + handle->handle_bytes;
+	if (name[0] == '.' && name[1] == '\0')
+		name = "";
+
+	int fd = open_by_handle_at(src->fd, handle, O_PATH | O_CLOEXEC);
+	if (fd == -1) {
+		errno = 0;
+		return;
+	}
+	char proc_path[64];
+	char dir[PATH_MAX];
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(proc_path, dir, sizeof(dir));
+	close(fd);
+	if (len <= 0 || (size_t) len >= sizeof(dir) || dir[0] != '/') {
+		errno = 0;
+		return;
+	}
+
+	add_dirty(W, dir, (size_t) len, name, strlen(name));
+	return;
+}
+
+/*
+ * Reads a buffer of pending fanotify events of group ${G} like
+ * read_inotify_events. If the group's queue overflowed, the sources on its
+ * filesystem are marked as having lost events.
+ *
+ * Returns the number of bytes read (0 if no event was pending) on success, -1
+ * on failure. Sets errno on failure.
+ */
+static ssize_t
+read_fanotify_events(struct watch *W, struct watch_group *G)
+{
+	ssize_t len = read(G->fd, W->buf, sizeof(W->buf));
+	if (len == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			errno = 0;
+			return 0;
+		}
+		return -1;
+	}
+
+	/* Events are only 4 byte aligned in the buffer, so each event is copied
+	   before it is looked at. */
+	uint64_t event[FANOTIFY_EVENT_MAX_SIZE / sizeof(uint64_t)];
+	struct fanotify_event_metadata meta;
+	char *p = (char *) W->buf;
+	char *end = p + len;
+	for (; p + sizeof(meta) <= end; p += meta.event_len) {
+		memcpy(&meta, p, sizeof(meta));
+		if (meta.event_len < sizeof(meta) || meta.event_len > (size_t) (end - p))
+			break;
+		if (meta.vers != FANOTIFY_METADATA_VERSION) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (meta.mask & FAN_Q_OVERFLOW) {
+			for (size_t i = 0; i < W->source_cnt; ++i) {
+				if (memcmp(&W->sources[i].fsid, &G->fsid, sizeof(fsid_t)) == 0)
+					W->sources[i].lost = true;
+			}
+			continue;
+		}
+		if (meta.event_len > sizeof(event))
+			continue;
+
+		memcpy(event, p, meta.event_len);
+		char *info = (char *) event + meta.metadata_len;
+		char *event_end = (char *) event + meta.event_len;
+		while (info + sizeof(struct fanotify_event_info_header) <= event_end) {
+			struct fanotify_event_info_fid *fid = (void *) info;
+			if (fid->hdr.len == 0 || fid->hdr.len > (size_t) (event_end - info))
+				break;
+			if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+			    fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+				add_fanotify_event(W, fid, fid->hdr.info_type);
+			info += fid->hdr.len;
+		}
+	}
+
+	return len;
+}
+#endif
+
+/*
+ * Initialize the watching of the canonicalized absolute ${src_paths} (a NULL
+ * terminated array) with ${backend}. Events are queued from now on, so changes
+ * made while the sources are synced the first time are not missed. SIGINT and
+ * SIGTERM are blocked in the calling thread and the threads it creates from
+ * now on, watch_run returns once one of them comes.
+ *
+ * Returns the watch on success, NULL on failure. Sets errno on failure.
+ */
+struct watch *
+watch_init(char *src_paths[], enum watch_backend backend)
+{
+	int ret;
+
+	struct watch *W = calloc(1, sizeof(struct watch));
+	if (W == NULL)
+		goto err0;
+	W->fd = -1;
+
+	for (; src_paths[W->source_cnt] != NULL; ++W->source_cnt)
+		;
+	W->sources = calloc(W->source_cnt, sizeof(struct watch_source));
+	if (W->sources == NULL)
+		goto err1;
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		W->sources[i].path = src_paths[i];
+		W->sources[i].len = strlen(src_paths[i]);
+		W->sources[i].fd = -1;
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	ret = pthread_sigmask(SIG_BLOCK, &mask, &W->old_mask);
+	if (ret != 0) {
+		errno = ret;
+		goto err2;
+	}
+	W->sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (W->sig_fd == -1)
+		goto err3;
+
+	ret = -1;
+#ifdef FAN_REPORT_DFID_NAME
+	if (backend != WATCH_INOTIFY) {
+		ret = fanotify_setup(W);
+		if (ret != 0) {
+			int err = errno;
+			for (size_t i = 0; i < W->source_cnt; ++i) {
+				if (W->sources[i].fd != -1)
+					close(W->sources[i].fd);
+				W->sources[i].fd = -1;
+			}
+			for (size_t i = 0; i < W->group_cnt; ++i)
+				close(W->groups[i].fd);
+			free(W->groups);
+			W->groups = NULL;
+			W->group_cnt = 0;
+			errno = err;
+		}
+	}
+#else
+	if (backend == WATCH_FANOTIFY)
+		errno = ENOTSUP;
+#endif
+	if (ret != 0 && backend != WATCH_FANOTIFY)
+		ret = inotify_setup(W);
+	if (ret != 0)
+		goto err4;
+
+	/* The signals are polled first, then the groups. */
+	W->pfd_cnt = 1 + (W->backend == WATCH_FANOTIFY ? W->group_cnt : 1);
+	W->pfds = calloc(W->pfd_cnt, sizeof(struct pollfd));
+	if (W->pfds == NULL)
+		goto err4;
+	W->pfds[0].fd = W->sig_fd;
+	for (size_t i = 1; i < W->pfd_cnt; ++i)
+		W->pfds[i].fd = W->backend == WATCH_FANOTIFY ? W->groups[i - 1].fd : W->fd;
+	for (size_t i = 0; i < W->pfd_cnt; ++i)
+		W->pfds[i].events = POLLIN;
+
+	return W;
+
+ err4:
+	ret = errno;
+	watch_free(W);
+	errno = ret;
+	return NULL;
+ err3:
+	ret = errno;
+	pthread_sigmask(SIG_SETMASK, &W->old_mask, NULL);
+	errno = ret;
+ err2:
+	free(W->sources);
+ err1:
+	free(W);
+ err0:
+	return NULL;
+}
+
+/*
+ * Compares paths so that every path is followed by the paths inside it, i.e.,
+ * '/' comes before any other character.
+ */
+static int
+compare_paths(const void *a, const void *b)
+{
+	const unsigned char *pa = *(const unsigned char **) a;
+	const unsigned char *pb = *(const unsigned char **) b;
+	for (; *pa != '\0' && *pa == *pb; ++pa, ++pb)
+		;
+	int ca = *pa == '/' ? 1 : *pa;
+	int cb = *pb == '/' ? 1 : *pb;
+	return ca - cb;
+}
+
+/*
+ * Builds the path of the destination directory in ${dst_path} that ${path},
+ * which is inside ${src}, is synced to, like traverse_and_queue does for the
+ * sources.
+ *
+ * Returns the path on success, NULL on failure. Sets errno on failure.
+ */
+static char *
+dst_dir_of(const char *dst_path, const struct watch_source *src, const char *path)
+{
+	/* Paths are relative to the parent of the source, or to "/" if the
+	   source is "/" which is synced as ${dst_path} itself. */
+	size_t base_len = src->len == 1 ? 0 : parent_len(src->path);
+	const char *rel = path + base_len;
+	size_t rel_len = rel[0] == '/' && rel[1] != '\0' ? parent_len(rel) : 0;
+	size_t dst_len = strlen(dst_path);
+	if (dst_len == 1)
+		dst_len = 0;
+
+	char *dir = malloc(dst_len + rel_len + 2);
+	if (dir == NULL)
+		return NULL;
+	memcpy(dir, dst_path, dst_len);
+	memcpy(dir + dst_len, rel, rel_len);
+	dir[dst_len + rel_len] = '\0';
+	if (dst_len + rel_len == 0)
+		strcpy(dir, "/");
+	return dir;
+}
+
+/*
+ * Syncs the changed paths gathered since the last sync, and the sources that
+ * have lost events as a whole, by traversing them like the sources are
+ * traversed the first time. If the inotify queue overflowed, which doesn't
+ * tell where, the parent directories of the changed paths are rescanned in
+ * their place, as events tend to come in bursts in the same directories, or
+ * all the sources if there are no changed paths. Paths inside other changed
+ * directories are left to their traversal and paths that no longer exist are
+ * skipped, or deleted from the destination too unless ${delete_mode} is
+ * DELETE_NONE. The files of the previous sync are synced completely before any
+ * of this one are queued.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+sync_dirty(struct watch *W, char *dst_path, struct sync_thread_data *pools,
+           uint8_t pool_cnt, struct durable *D, enum delete_mode delete_mode,
+           uint8_t thread_cnt)
+{
+	int rc = 0;
+	char *err;
+
+	/* The previous pass must be done before this one starts, otherwise an
+	   older version of a file queued by both could be synced last. */
+	for (uint8_t i = 0; i < pool_cnt; ++i)
+		sync_thread_wait_idle(&pools[i]);
+
+	/* The hard links seen by the previous passes may have changed since, so
+	   every pass tracks them from scratch. The table is shared by the pools. */
+	if (pools[0].opts.links != NULL)
+		link_table_clear(pools[0].opts.links);
+
+	bool all_lost = false;
+	if (W->overflow) {
+		W->overflow = false;
+		if (W->dirty_cnt == 0) {
+			print_message("Events have been lost, rescanning all the sources");
+			for (size_t i = 0; i < W->source_cnt; ++i)
+				W->sources[i].lost = true;
+			all_lost = true;
+		} else {
+			print_message("Events have been lost, rescanning the directories "
+			              "of the changes");
+			collapse_dirty(W);
+			qsort(W->dirty, W->dirty_cnt, sizeof(char *), compare_paths);
+			/* Directories created meanwhile need to be watched too. */
+			size_t kept = SIZE_MAX;
+			for (size_t i = 0; i < W->dirty_cnt; ++i) {
+				char *path = W->dirty[i];
+				if (kept != SIZE_MAX) {
+					size_t kept_len = strlen(W->dirty[kept]);
+					if (strncmp(path, W->dirty[kept], kept_len) == 0 &&
+					    (path[kept_len] == '\0' || path[kept_len] == '/'))
+						continue;
+				}
+				kept = i;
+				if (add_tree(W, path) != 0) {
+					err = "Failed to watch directory %s";
+					print_error_and_reset_errno(errno, err, path);
+					rc = -1;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		struct watch_source *src = &W->sources[i];
+		if (!src->lost)
+			continue;
+		if (!all_lost)
+			print_message("Events have been lost, rescanning %s", src->path);
+		src->lost = false;
+		if (W->backend == WATCH_INOTIFY && add_tree(W, src->path) != 0) {
+			err = "Failed to watch directory %s";
+			print_error_and_reset_errno(errno, err, src->path);
+			rc = -1;
+		}
+		add_dirty(W, src->path, src->len, "", 0);
+	}
+
+	qsort(W->dirty, W->dirty_cnt, sizeof(char *), compare_paths);
+
+	/* The changed paths are kept to be synced by the next try. */
+	char **srcs = malloc((W->dirty_cnt + 1) * sizeof(char *));
+	if (srcs == NULL) {
+		print_error_and_reset_errno(errno, "Failed to sync changes");
+		return -1;
+	}
+
+	size_t i = 0;
+	size_t kept = SIZE_MAX;
+	while (i < W->dirty_cnt) {
+		/* Paths with the same parent are synced to the same directory. */
+		size_t cnt = 0;
+		size_t len = parent_len(W->dirty[i]);
+		char *first = W->dirty[i];
+		struct watch_source *src = find_source(W, first, strlen(first));
+		char *dst_dir = dst_dir_of(dst_path, src, first);
+		if (dst_dir == NULL) {
+			print_error_and_reset_errno(errno, "Failed to sync changes");
+			rc = -1;
+		}
+		for (; i < W->dirty_cnt; ++i) {
+			char *path = W->dirty[i];
+			if (parent_len(path) != len || memcmp(path, first, len) != 0)
+				break;
+			if (kept != SIZE_MAX) {
+				size_t kept_len = strlen(W->dirty[kept]);
+				if (strncmp(path, W->dirty[kept], kept_len) == 0 &&
+				    (path[kept_len] == '\0' || path[kept_len] == '/'))
+					continue;
+			}
+			kept = i;
+			struct stat statbuf;
+			if (lstat(path, &statbuf) == 0) {
+				srcs[cnt++] = path;
+				continue;
+			}
+			/* A source that is gone itself is not deleted from the
+			   destination. */
+			if (errno == ENOENT && delete_mode != DELETE_NONE &&
+			    dst_dir != NULL && strlen(path) > src->len &&
+			    delete_entry(dst_dir, path + len + 1) != 0)
+				rc = -1;
+			errno = 0;
+		}
+		srcs[cnt] = NULL;
+
+		if (cnt > 0 && dst_dir != NULL &&
+		    traverse_and_queue(srcs, dst_dir, pools, pool_cnt, NULL, D, NULL,
+		                       delete_mode, thread_cnt) != 0)
+			rc = -1;
+		free(dst_dir);
+	}
+
+	free(srcs);
+	for (i = 0; i < W->dirty_cnt; ++i)
+		free(W->dirty[i]);
+	W->dirty_cnt = 0;
+	return rc;
+}
+
+/*
+ * Returns the time of CLOCK_MONOTONIC in milliseconds.
+ */
+static inline int64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Reads a buffer of pending events of the backend of ${W}, one per group.
+ *
+ * Returns the number of bytes read on success, -1 on failure. Sets errno on
+ * failure.
+ */
+static inline ssize_t
+read_events(struct watch *W)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	if (W->backend == WATCH_FANOTIFY) {
+		ssize_t total = 0;
+		for (size_t i = 0; i < W->group_cnt; ++i) {
+			ssize_t len = read_fanotify_events(W, &W->groups[i]);
+			if (len == -1)
+				return -1;
+			total += len;
+		}
+		return total;
+	}
+#endif
+	return read_inotify_events(W);
+}
+
+/*
+ * Syncs the changes in the sources to ${dst_path} as they happen until SIGINT
+ * or SIGTERM comes. Events are coalesced and debounced, and the changed paths
+ * are traversed with traverse_and_queue and ${thread_cnt} traversal threads,
+ * so the files go to the ${pool_cnt} ${pools} of sync threads like the first
+ * time. If events are lost (a notification queue overflowed), the sources
+ * that lost them are traversed again, see sync_dirty. Paths removed from the
+ * sources are deleted from the destination and extra entries are deleted from
+ * the traversed directories unless ${delete_mode} is DELETE_NONE. The
+ * filesystems of the synced destination directories are added to ${D} if it
+ * is not NULL. The changes made before the signal came are synced before
+ * returning.
+ *
+ * Returns 0 on success, -1 if watching failed or any change failed to sync.
+ */
+int
+watch_run(struct watch *W, char *dst_path, struct sync_thread_data *pools,
+          uint8_t pool_cnt, struct durable *D, enum delete_mode delete_mode,
+          uint8_t thread_cnt)
+{
+	int rc = 0;
+	int ret;
+	ssize_t len;
+	int64_t first = 0;
+	int64_t last = 0;
+
+	for (;;) {
+		bool pending = changes_pending(W);
+		int timeout = -1;
+		if (pending) {
+			int64_t deadline = last + DEBOUNCE_MS;
+			if (first + MAX_DELAY_MS < deadline)
+				deadline = first + MAX_DELAY_MS;
+			int64_t now = now_ms();
+			timeout = deadline > now ? (int) (deadline - now) : 0;
+		}
+
+		ret = poll(W->pfds, W->pfd_cnt, timeout);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			print_error_and_reset_errno(errno, "Failed to wait for changes");
+			return -1;
+		}
+
+		if (W->pfds[0].revents & POLLIN) {
+			/* Consume the signal, it would be delivered once unblocked. */
+			struct signalfd_siginfo info;
+			if (read(W->sig_fd, &info, sizeof(info)) == -1)
+				errno = 0;
+			while ((len = read_events(W)) > 0)
+				;
+			if (len == -1) {
+				print_error_and_reset_errno(errno, "Failed to read changes");
+				rc = -1;
+			}
+			if (changes_pending(W) &&
+			    sync_dirty(W, dst_path, pools, pool_cnt, D, delete_mode,
+			               thread_cnt) != 0)
+				rc = -1;
+			break;
+		}
+
+		if (ret == 0) {
+			if (sync_dirty(W, dst_path, pools, pool_cnt, D, delete_mode,
+			               thread_cnt) != 0)
+				rc = -1;
+			continue;
+		}
+
+		if (read_events(W) == -1) {
+			print_error_and_reset_errno(errno, "Failed to read changes");
+			return -1;
+		}
+		if (changes_pending(W)) {
+			last = now_ms();
+			if (!pending)
+				first = last;
+		}
+	}
+
+	return rc;
+}
+
+/*
+ * Stops watching, unblocking SIGINT and SIGTERM, and frees ${W}.
+ */
+void
+watch_free(struct watch *W)
+{
+	if (W == NULL)
+		return;
+
+	for (size_t i = 0; i < W->dirty_cnt; ++i)
+		free(W->dirty[i]);
+	free(W->dirty);
+	for (size_t i = 0; i < W->wd_cap; ++i)
+		free(W->wd_paths[i]);
+	free(W->wd_paths);
+	for (size_t i = 0; i < W->source_cnt; ++i) {
+		if (W->sources[i].fd != -1)
+			close(W->sources[i].fd);
+	}
+	free(W->sources);
+	for (size_t i = 0; i < W->group_cnt; ++i)
+		close(W->groups[i].fd);
+	free(W->groups);
+	free(W->pfds);
+	if (W->fd != -1)
+		close(W->fd);
+	close(W->sig_fd);
+	pthread_sigmask(SIG_SETMASK, &W->old_mask, NULL);
+	free(W);
+	return;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2024 Dorjoy Chowdhury
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+
+#include "delete_extras.h"
+#include "durable.h"
+#include "sync_thread.h"
+
+/*
+ * How changes in the sources are watched. WATCH_AUTO uses fanotify if it can
+ * be used for all the sources (it needs CAP_SYS_ADMIN) and inotify otherwise.
+ */
+enum watch_backend {
+	WATCH_AUTO,
+	WATCH_FANOTIFY,
+	WATCH_INOTIFY
+};
+
+/* Opaque type */
+struct watch;
+
+struct watch *watch_init(char *src_paths[], enum watch_backend backend);
+int watch_run(struct watch *W, char *dst_path, struct sync_thread_data *pools,
+              uint8_t pool_cnt, struct durable *D, enum delete_mode delete_mode,
+              uint8_t thread_cnt);
+void watch_free(struct watch *W);
+
+#endif /* WATCH_H */
@@ -196,6 +196,850 @@ test_random_tree() {
     pass "random tree"
 }
 
+test_parallel_traversal() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    for d in $(seq 1 10); do
+        for s in $(seq 1 5); do
+            mkdir -p "$src/dir$d/sub$s/leaf"
+            echo "$d $s" > "$src/dir$d/sub$s/file.txt"
+            echo "$s $d" > "$src/dir$d/sub$s/leaf/file.txt"
+        done
+    done
+    echo "single" > "$work/single.txt"
+
+    "$DSYNC" -t 4 -j 4 "$src" "$work/single.txt" "$dst"
+
+    verify_trees_equal "$src" "$dst/src"
+    cmp "$work/single.txt" "$dst/single.txt" || fail "source file not synced"
+
+    rm -rf "$work"
+    pass "parallel traversal"
+}
+
+test_long_paths() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    # 20 levels of 250 byte names make paths longer than PATH_MAX (4096).
+    local name
+    name=$(printf 'd%.0s' $(seq 1 250))
+    (
+        cd "$src"
+        for _ in $(seq 1 20); do
+            mkdir "$name"
+            cd "$name"
+        done
+        echo "deep" > file.txt
+    )
+
+    "$DSYNC" "$src" "$dst"
+
+    (
+        cd "$dst/src"
+        for _ in $(seq 1 20); do
+            cd "$name"
+        done
+        [ "$(cat file.txt)" = "deep" ]
+    ) || fail "file in long path not synced"
+
+    rm -rf "$work"
+    pass "long paths"
+}
+
+test_io_uring() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    for d in $(seq 1 5); do
+        mkdir -p "$src/dir$d"
+        for f in $(seq 1 100); do
+            echo "$d $f" > "$src/dir$d/file$f.txt"
+        done
+        ln -s "file1.txt" "$src/dir$d/link"
+    done
+
+    "$DSYNC" -u -j 2 "$src" "$dst"
+
+    echo "changed" > "$src/dir3/file7.txt"
+    touch -d "2001-01-01" "$src/dir1/file1.txt"
+
+    "$DSYNC" -u -j 2 "$src" "$dst"
+
+    verify_trees_equal "$src" "$dst/src"
+    [ "$(stat -c %Y "$src/dir1/file1.txt")" = "$(stat -c %Y "$dst/src/dir1/file1.txt")" ] \
+        || fail "timestamp not synced with io_uring"
+
+    rm -rf "$work"
+    pass "io_uring"
+}
+
+test_blocking_queue() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/empty"
+
+    # Workers that never get any work must still be woken up to exit.
+    timeout 60 "$DSYNC" -j 64 "$src/empty" "$dst" \
+        || fail "idle workers did not exit"
+
+    # More files than the queue can hold make traversal wait for space.
+    mkdir -p "$src/many"
+    for f in $(seq 1 2000); do
+        echo "$f" > "$src/many/file$f.txt"
+    done
+
+    timeout 60 "$DSYNC" -j 3 "$src/many" "$dst" \
+        || fail "sync with a full queue did not finish"
+
+    verify_trees_equal "$src/many" "$dst/many"
+
+    rm -rf "$work"
+    pass "blocking queue"
+}
+
+test_hard_links() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a" "$src/b"
+
+    for f in $(seq 1 50); do
+        echo "$f" > "$src/a/file$f.txt"
+        ln "$src/a/file$f.txt" "$src/b/file$f.txt"
+        ln "$src/a/file$f.txt" "$src/file$f.txt"
+    done
+    # A hard link outside of the source must not matter.
+    ln "$src/a/file1.txt" "$work/outside.txt"
+
+    "$DSYNC" -j 4 "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src"
+
+    for f in $(seq 1 50); do
+        local inode
+        inode=$(stat -c %i "$dst/src/a/file$f.txt")
+        [ "$(stat -c %i "$dst/src/b/file$f.txt")" = "$inode" ] \
+            || fail "hard link not preserved"
+        [ "$(stat -c %i "$dst/src/file$f.txt")" = "$inode" ] \
+            || fail "hard link not preserved"
+    done
+
+    # Separate copies in the destination are replaced with hard links.
+    rm -rf "$dst/src/b"
+    cp -a "$src/b" "$dst/src/b"
+    "$DSYNC" -u -j 2 "$src" "$dst"
+    [ "$(stat -c %h "$dst/src/a/file7.txt")" = "3" ] \
+        || fail "hard link not restored"
+
+    # Hard links that are already in place are skipped, not copied again.
+    "$DSYNC" -u --stats -j 2 "$src" "$dst" | grep -q '"files_copied":0,"files_skipped":150,' \
+        || fail "existing hard links not skipped"
+
+    rm -rf "$work"
+    pass "hard links"
+}
+
+test_reflink() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst/auto" "$dst/never" "$dst/always"
+    mkdir -p "$src"
+
+    for f in $(seq 1 20); do
+        head -c $((f * 1000)) /dev/urandom > "$src/file$f.bin"
+    done
+    : > "$src/empty"
+
+    "$DSYNC" --reflink=auto -j 2 "$src" "$dst/auto"
+    verify_trees_equal "$src" "$dst/auto/src"
+
+    "$DSYNC" --reflink=never "$src" "$dst/never"
+    verify_trees_equal "$src" "$dst/never/src"
+
+    # Cloning works or every non empty file fails with an error.
+    local errors
+    errors=$("$DSYNC" --reflink=always "$src" "$dst/always" 2>&1 >/dev/null \
+                 | grep -c "Failed to copy" || true)
+    if [ "$errors" = "0" ]; then
+        verify_trees_equal "$src" "$dst/always/src"
+    else
+        [ "$errors" = "20" ] || fail "unexpected --reflink=always failures"
+    fi
+
+    if "$DSYNC" --reflink=sometimes "$src" "$dst/auto" 2>/dev/null; then
+        fail "invalid --reflink value accepted"
+    fi
+
+    rm -rf "$work"
+    pass "reflink"
+}
+
+test_sparse_file() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    # Data between holes and a hole at the end.
+    truncate -s 32M "$src/sparse.img"
+    printf 'head' | dd of="$src/sparse.img" bs=1 conv=notrunc 2>/dev/null
+    head -c 100000 /dev/urandom \
+        | dd of="$src/sparse.img" bs=4096 seek=1000 conv=notrunc 2>/dev/null
+
+    "$DSYNC" "$src" "$dst"
+
+    cmp "$src/sparse.img" "$dst/src/sparse.img" || fail "sparse file content differs"
+    local src_blocks dst_blocks
+    src_blocks=$(stat -c %b "$src/sparse.img")
+    dst_blocks=$(stat -c %b "$dst/src/sparse.img")
+    [ "$dst_blocks" -le $((src_blocks * 2)) ] || fail "holes not preserved"
+
+    rm -rf "$work"
+    pass "sparse file"
+}
+
+test_parallel_large_file() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+    local dst_uring="$work/dst_uring"
+
+    mkdir -p "$dst" "$dst_uring"
+    mkdir -p "$src"
+
+    # Above the size copied in ranges, not a multiple of the range size.
+    head -c $((70 * 1024 * 1024 + 123)) /dev/urandom > "$src/big.bin"
+    for i in $(seq 1 20); do
+        echo "small $i" > "$src/small_$i.txt"
+    done
+
+    "$DSYNC" -j 4 "$src" "$dst"
+    "$DSYNC" -j 4 -u "$src" "$dst_uring"
+
+    verify_trees_equal "$src" "$dst/src"
+    verify_trees_equal "$src" "$dst_uring/src"
+    cmp "$src/big.bin" "$dst/src/big.bin" || fail "large file content differs"
+    [ "$(stat -c %Y "$src/big.bin")" = "$(stat -c %Y "$dst/src/big.bin")" ] \
+        || fail "large file mtime not preserved"
+
+    rm -rf "$work"
+    pass "parallel large file"
+}
+
+test_size_lanes() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+    local dst_uring="$work/dst_uring"
+
+    mkdir -p "$dst" "$dst_uring"
+    mkdir -p "$src/a/b"
+
+    # Large files of different sizes among many small ones.
+    for i in 1 2 3; do
+        head -c $((i * 9 * 1024 * 1024)) /dev/urandom > "$src/a/large_$i.bin"
+    done
+    head -c $((10 * 1024 * 1024)) /dev/urandom > "$src/a/b/large.bin"
+    for i in $(seq 1 200); do
+        echo "small $i" > "$src/a/small_$i.txt"
+        echo "small $i" > "$src/a/b/small_$i.txt"
+    done
+    ln -s small_1.txt "$src/a/link"
+
+    "$DSYNC" -j 4 "$src" "$dst"
+    "$DSYNC" -j 2 -u "$src" "$dst_uring"
+
+    verify_trees_equal "$src" "$dst/src"
+    verify_trees_equal "$src" "$dst_uring/src"
+
+    rm -rf "$work"
+    pass "size lanes"
+}
+
+test_manifest() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a/b"
+    for i in 1 2 3; do
+        echo "file $i" > "$src/a/f$i"
+        echo "file $i" > "$src/a/b/g$i"
+    done
+    ln -s f1 "$src/a/link"
+
+    # The first run copies, the second records the settled directories.
+    "$DSYNC" --manifest "$src" "$dst"
+    "$DSYNC" --manifest "$src" "$dst"
+    [ -f "$dst/.dsync/manifest" ] || fail "manifest not written"
+    verify_trees_equal "$src" "$dst/src"
+
+    # Unchanged files are not looked at in the destination.
+    chmod 600 "$dst/src/a/f1"
+    "$DSYNC" --manifest "$src" "$dst"
+    [ "$(stat -c %a "$dst/src/a/f1")" = "600" ] || fail "unchanged file was checked"
+
+    # Changed sources and removed destinations are synced.
+    echo "changed" > "$src/a/f2"
+    rm "$dst/src/a/b/g2"
+    "$DSYNC" --manifest -j 2 -u "$src" "$dst"
+    cmp "$src/a/f2" "$dst/src/a/f2" || fail "changed file not synced"
+    cmp "$src/a/b/g2" "$dst/src/a/b/g2" || fail "removed file not synced"
+
+    # A damaged manifest is ignored and rewritten.
+    head -c 20 "$dst/.dsync/manifest" > "$work/manifest"
+    mv "$work/manifest" "$dst/.dsync/manifest"
+    "$DSYNC" --manifest "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src"
+    [ "$(stat -c %s "$dst/.dsync/manifest")" -gt 20 ] || fail "manifest not rewritten"
+
+    rm -rf "$work"
+    pass "manifest"
+}
+
+test_prune() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a/b"
+    for i in 1 2 3; do
+        echo "file $i" > "$src/a/f$i"
+        echo "file $i" > "$src/a/b/g$i"
+    done
+    ln -s f1 "$src/a/link"
+
+    # The first run copies, the second records the settled directories.
+    "$DSYNC" --prune "$src" "$dst"
+    "$DSYNC" --prune "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src"
+
+    # Files edited in place in unchanged directories are not looked at...
+    echo "appended" >> "$src/a/b/g1"
+    "$DSYNC" --prune -j 2 "$src" "$dst"
+    cmp -s "$src/a/b/g1" "$dst/src/a/b/g1" && fail "unchanged directory was read"
+
+    # ...but they are with -f or without pruning.
+    "$DSYNC" -f --prune "$src" "$dst"
+    cmp "$src/a/b/g1" "$dst/src/a/b/g1" || fail "edited file not synced with -f"
+    "$DSYNC" --prune "$src" "$dst"
+    echo "appended again" >> "$src/a/b/g1"
+    "$DSYNC" --prune "$src" "$dst"
+    cmp -s "$src/a/b/g1" "$dst/src/a/b/g1" && fail "unchanged directory was read"
+    "$DSYNC" --manifest "$src" "$dst"
+    cmp "$src/a/b/g1" "$dst/src/a/b/g1" || fail "edited file not synced without pruning"
+
+    # Added, removed and renamed entries change the directory.
+    "$DSYNC" --prune "$src" "$dst"
+    echo "new" > "$src/a/b/g4"
+    mv "$src/a/f2" "$src/a/f5"
+    echo "appended" >> "$src/a/f3"
+    "$DSYNC" --prune -t 2 "$src" "$dst"
+    cmp "$src/a/b/g4" "$dst/src/a/b/g4" || fail "added file not synced"
+    cmp "$src/a/f5" "$dst/src/a/f5" || fail "renamed file not synced"
+    cmp "$src/a/f3" "$dst/src/a/f3" || fail "file in changed directory not synced"
+
+    echo "appended" >> "$src/a/b/g2"
+    "$DSYNC" --prune "$src" "$dst"
+    "$DSYNC" --prune -f "$src" "$dst"
+    cmp "$src/a/b/g2" "$dst/src/a/b/g2" || fail "-f did not disable pruning"
+
+    rm -rf "$work"
+    pass "prune"
+}
+
+test_watch() {
+    local backend
+    local backends="inotify"
+    # fanotify needs CAP_SYS_ADMIN
+    [ "$(id -u)" = "0" ] && backends="fanotify inotify"
+
+    for backend in $backends; do
+        local work
+        work=$(new_workdir)
+
+        local src="$work/src"
+        local dst="$work/dst"
+
+        mkdir -p "$dst"
+        mkdir -p "$src/a"
+        echo "first" > "$src/a/file"
+
+        "$DSYNC" --watch="$backend" -j 2 "$src" "$dst" &
+        local pid=$!
+
+        local i
+        for i in $(seq 50); do
+            [ -f "$dst/src/a/file" ] && break
+            sleep 0.1
+        done
+
+        # Edits, new trees, renames and mode changes are synced as they happen.
+        echo "second" >> "$src/a/file"
+        mkdir -p "$src/b/c"
+        echo "new" > "$src/b/c/file"
+        mv "$src/a" "$src/d"
+        chmod 600 "$src/d/file"
+        for i in $(seq 50); do
+            diff -r "$src/b" "$dst/src/b" > /dev/null 2>&1 &&
+                diff -r "$src/d" "$dst/src/d" > /dev/null 2>&1 &&
+                [ "$(stat -c %a "$dst/src/d/file")" = "600" ] && break
+            sleep 0.1
+        done
+        [ "$i" -lt 50 ] || fail "changes not synced by --watch=$backend"
+
+        # A file with another hard link is copied again on every edit.
+        mkdir -p "$src/h"
+        echo "v1" > "$src/h/f"
+        ln "$src/h/f" "$src/h/g"
+        local v
+        for v in v2 v33 v444; do
+            sleep 0.5
+            echo "$v" > "$src/h/f"
+            for i in $(seq 50); do
+                cmp -s "$src/h/f" "$dst/src/h/f" && break
+                sleep 0.1
+            done
+            [ "$i" -lt 50 ] || fail "hard linked file edit not synced by --watch=$backend"
+        done
+
+        # Changes pending when interrupted are synced before exiting.
+        echo "last" > "$src/b/last"
+        kill -TERM "$pid"
+        wait "$pid" || fail "--watch=$backend did not exit cleanly"
+        cmp "$src/b/last" "$dst/src/b/last" || fail "pending change not synced"
+
+        rm -rf "$work"
+    done
+    pass "watch"
+}
+
+test_delete() {
+    local mode
+    for mode in after before; do
+        local work
+        work=$(new_workdir)
+
+        local src="$work/src"
+        local dst="$work/dst"
+
+        mkdir -p "$dst"
+        mkdir -p "$src/a/b"
+        echo "kept" > "$src/a/file"
+        echo "kept" > "$src/a/b/file"
+        "$DSYNC" "$src" "$dst"
+
+        # Extra files, trees and symlinks in the destination...
+        echo "extra" > "$dst/src/a/extra"
+        mkdir -p "$dst/src/a/old/deep/er"
+        echo "extra" > "$dst/src/a/old/deep/er/file"
+        ln -s file "$dst/src/a/b/link"
+        echo "other" > "$dst/other"
+
+        # ...are left alone without --delete...
+        "$DSYNC" "$src" "$dst"
+        [ -f "$dst/src/a/extra" ] || fail "extra file deleted without --delete"
+
+        # ...and deleted with it, except outside of the sources.
+        rm "$src/a/b/file"
+        "$DSYNC" --delete="$mode" -j 2 -t 2 "$src" "$dst"
+        verify_trees_equal "$src" "$dst/src" || fail "--delete=$mode left extras"
+        [ -f "$dst/other" ] || fail "--delete=$mode deleted outside of sources"
+
+        rm -rf "$work"
+    done
+
+    # With --watch, removed paths are deleted as they are removed.
+    if [ "$(uname)" = "Linux" ]; then
+        local work
+        work=$(new_workdir)
+        mkdir -p "$work/src/a/b" "$work/dst"
+        echo "file" > "$work/src/a/file"
+        echo "file" > "$work/src/a/b/file"
+
+        "$DSYNC" --watch=inotify --delete "$work/src" "$work/dst" &
+        local pid=$!
+        local i
+        for i in $(seq 50); do
+            [ -f "$work/dst/src/a/b/file" ] && break
+            sleep 0.1
+        done
+        rm "$work/src/a/file"
+        rm -r "$work/src/a/b"
+        for i in $(seq 50); do
+            [ ! -e "$work/dst/src/a/file" ] && [ ! -e "$work/dst/src/a/b" ] && break
+            sleep 0.1
+        done
+        kill -TERM "$pid"
+        wait "$pid" || fail "--watch --delete did not exit cleanly"
+        verify_trees_equal "$work/src" "$work/dst/src" || fail "--watch did not delete"
+        rm -rf "$work"
+    fi
+    pass "delete"
+}
+
+test_durable() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a"
+    echo "small" > "$src/a/small"
+    # Larger than a write-behind window and than a range of a split file.
+    head -c $((70 * 1024 * 1024)) /dev/urandom > "$src/a/large"
+
+    "$DSYNC" --durable "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "--durable did not sync"
+
+    "$DSYNC" --durable=fsync -f -j 4 "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "--durable=fsync did not sync"
+
+    "$DSYNC" --durable=never "$src" "$dst" 2> /dev/null && fail "bad --durable level accepted"
+
+    rm -rf "$work"
+    pass "durable"
+}
+
+test_atomic() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a"
+    echo "first" > "$src/a/file"
+    echo "exec" > "$src/a/exec"
+    chmod 755 "$src/a/exec"
+    "$DSYNC" "$src" "$dst"
+
+    # Changed files are replaced by new inodes rather than rewritten, so an
+    # open file keeps its old contents.
+    local old_ino
+    old_ino=$(stat -c %i "$dst/src/a/file")
+    exec 3< "$dst/src/a/file"
+    echo "second version" > "$src/a/file"
+    (umask 077 && "$DSYNC" --atomic -j 2 "$src" "$dst")
+    [ "$(cat <&3)" = "first" ] || fail "file rewritten in place"
+    exec 3<&-
+    [ "$(stat -c %i "$dst/src/a/file")" != "$old_ino" ] || fail "file not replaced"
+    verify_trees_equal "$src" "$dst/src" || fail "--atomic did not sync"
+
+    # Modes and timestamps are set before the files are put in place.
+    rm -rf "$dst/src"
+    (umask 077 && "$DSYNC" --atomic "$src" "$dst")
+    [ "$(stat -c %a "$dst/src/a/exec")" = "755" ] || fail "mode not set"
+    [ "$(stat -c %Y "$src/a/file")" = "$(stat -c %Y "$dst/src/a/file")" ] ||
+        fail "timestamps not set"
+
+    echo "third" > "$src/a/file"
+    "$DSYNC" --atomic -u "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "--atomic -u did not sync"
+
+    # No temporary files are left behind.
+    [ -z "$(find "$dst" -name '.dsync-tmp*')" ] || fail "temporary file left"
+
+    rm -rf "$work"
+    pass "atomic"
+}
+
+test_verify() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a/b"
+    echo "one" > "$src/a/one"
+    echo "two" > "$src/a/b/two"
+    ln -s one "$src/a/link"
+    # Large enough to be hashed in ranges by multiple threads.
+    head -c $((80 * 1024 * 1024 + 5)) /dev/urandom > "$src/a/large"
+    "$DSYNC" -j 4 "$src" "$dst"
+
+    "$DSYNC" --verify="$work/hashes" -j 4 "$src" "$dst" > "$work/out" ||
+        fail "--verify failed on identical trees"
+    [ -s "$work/out" ] && fail "--verify reported identical trees"
+    [ "$(wc -l < "$work/hashes")" = "3" ] || fail "hash file not written"
+
+    # Serial and parallel hashing agree.
+    "$DSYNC" --verify="$work/hashes1" "$src" "$dst" > /dev/null ||
+        fail "--verify -j 1 failed on identical trees"
+    [ "$(sort "$work/hashes")" = "$(sort "$work/hashes1")" ] ||
+        fail "hashes differ between -j 1 and -j 4"
+
+    # Same size and modification time, so only the hashes differ.
+    printf 'X' | dd of="$dst/src/a/large" bs=1 seek=$((70 * 1024 * 1024)) \
+        conv=notrunc 2> /dev/null
+    touch -r "$src/a/large" "$dst/src/a/large"
+    echo "ONE" > "$dst/src/a/one"
+    touch -r "$src/a/one" "$dst/src/a/one"
+    rm -r "$dst/src/a/b"
+    ln -sf other "$dst/src/a/link"
+    "$DSYNC" --verify -j 4 "$src" "$dst" > "$work/out" 2> /dev/null &&
+        fail "--verify succeeded on different trees"
+    grep -q "a/large: contents differ" "$work/out" || fail "large file not reported"
+    grep -q "a/one: contents differ" "$work/out" || fail "file not reported"
+    grep -q "a/b: missing" "$work/out" || fail "directory not reported"
+    grep -q "a/link: target differs" "$work/out" || fail "symbolic link not reported"
+    [ "$(wc -l < "$work/out")" = "4" ] || fail "unexpected mismatches reported"
+
+    # Nothing was synced.
+    [ ! -e "$dst/src/a/b" ] || fail "--verify synced"
+
+    rm -rf "$work"
+    pass "verify"
+}
+
+test_compare() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    # A sparse source whose destination copy is fully allocated shows whether
+    # the copy has been rewritten (holes are preserved when copying).
+    truncate -s 1M "$src/same"
+    printf 'data' | dd of="$src/same" bs=1 conv=notrunc 2>/dev/null
+    head -c 200000 /dev/urandom > "$src/changed"
+    mkdir -p "$dst/src"
+    cp --sparse=never "$src/same" "$dst/src/same"
+    cp "$src/changed" "$dst/src/changed"
+    local full_blocks
+    full_blocks=$(stat -c %b "$dst/src/same")
+    # Same size, different contents.
+    printf 'XYZ' | dd of="$src/changed" bs=1 seek=150000 conv=notrunc 2>/dev/null
+    touch -d '2001-01-01' "$src/same" "$src/changed"
+
+    "$DSYNC" --compare "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "--compare did not sync"
+    [ "$(stat -c %b "$dst/src/same")" = "$full_blocks" ] ||
+        fail "identical file rewritten"
+    [ "$(stat -c %Y "$src/same")" = "$(stat -c %Y "$dst/src/same")" ] ||
+        fail "timestamps not set"
+
+    # Files below the size threshold are rewritten.
+    touch -d '2002-02-02' "$src/same"
+    "$DSYNC" --compare=2M -u "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "--compare=2M did not sync"
+    [ "$(stat -c %b "$dst/src/same")" -lt "$full_blocks" ] ||
+        fail "file below threshold not rewritten"
+
+    "$DSYNC" --compare=1X "$src" "$dst" 2>/dev/null && fail "invalid size accepted"
+
+    rm -rf "$work"
+    pass "compare"
+}
+
+test_metrics() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src/a"
+    echo "one" > "$src/a/one"
+    head -c 10000 /dev/urandom > "$src/a/two"
+
+    "$DSYNC" --stats="$work/stats" --progress -j 2 "$src" "$dst" 2> "$work/progress" ||
+        fail "--stats failed"
+    grep -q '"event":"summary"' "$work/stats" || fail "summary not written"
+    grep -q '"files_copied":2,' "$work/stats" || fail "copied files not counted"
+    grep -q '"bytes_copied":10004,' "$work/stats" || fail "copied bytes not counted"
+    grep -q '"latency_ns":{"stat":' "$work/stats" || fail "latencies not written"
+    grep -q "2 copied" "$work/progress" || fail "progress line not printed"
+
+    # Summary on stdout.
+    "$DSYNC" --stats "$src" "$dst" | grep -q '"files_skipped":2,' ||
+        fail "skipped files not counted"
+
+    # SIGUSR1 writes a snapshot without stopping dsync. It is handled once
+    # dsync has started syncing.
+    rm -rf "$dst/src"
+    "$DSYNC" --watch=inotify "$src" "$dst" 2> "$work/snapshot" &
+    local pid=$!
+    local i
+    for i in $(seq 50); do
+        [ -f "$dst/src/a/two" ] && break
+        sleep 0.1
+    done
+    for i in $(seq 50); do
+        kill -USR1 "$pid"
+        grep -q '"event":"snapshot"' "$work/snapshot" && break
+        sleep 0.1
+    done
+    kill -TERM "$pid"
+    wait "$pid" || fail "dsync failed after SIGUSR1"
+    [ "$i" -lt 50 ] || fail "snapshot not written on SIGUSR1"
+
+    rm -rf "$work"
+    pass "metrics"
+}
+
+test_log_format() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst/src"
+    mkdir -p "$src"
+
+    # Directories in the way of 50 different files fail them all the same
+    # way, and only the first 20 are reported before the rest are counted.
+    for i in $(seq 1 50); do
+        echo "$i" > "$src/f$i"
+        mkdir "$dst/src/f$i"
+    done
+
+    "$DSYNC" -j 4 "$src" "$dst" 2> "$work/log" || true
+    [ "$(grep -c "Failed to open destination" "$work/log")" = 21 ] ||
+        fail "similar errors not rate limited"
+    grep -q "Failed to open destination .*/src/f[0-9]* : .* (30 similar messages suppressed)$" \
+        "$work/log" || fail "suppressed errors not counted with a path"
+
+    "$DSYNC" -j 4 --log-format=json "$src" "$dst" 2> "$work/log" || true
+    [ "$(grep -c '^{"time":[0-9.]*,"level":"error",.*"errno":21,"error":"[^"]*"' \
+        "$work/log")" = 21 ] || fail "errors not logged as JSON"
+    grep -q '"suppressed":30}$' "$work/log" || fail "suppressed errors not counted"
+
+    "$DSYNC" --log-format=xml "$src" "$dst" 2>/dev/null && fail "invalid format accepted"
+
+    rm -rf "$work"
+    pass "log format"
+}
+
+test_auto_threads() {
+    local work
+    work=$(new_workdir)
+
+    local src="$work/src"
+    local dst="$work/dst"
+
+    mkdir -p "$dst"
+    mkdir -p "$src"
+
+    for d in $(seq 1 20); do
+        mkdir -p "$src/dir$d"
+        for f in $(seq 1 20); do
+            echo "$d $f" > "$src/dir$d/file$f"
+        done
+    done
+    head -c 3M /dev/urandom > "$src/dir1/large"
+
+    "$DSYNC" -j auto "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "-j auto did not sync"
+
+    rm -rf "$dst/src"
+    "$DSYNC" -j auto -u "$src" "$dst"
+    verify_trees_equal "$src" "$dst/src" || fail "-j auto -u did not sync"
+
+    "$DSYNC" -j automatic "$src" "$dst" 2>/dev/null && fail "invalid -j accepted"
+
+    rm -rf "$work"
+    pass "auto threads"
+}
+
+test_device_pools() {
+    local work
+    work=$(new_workdir)
+
+    local src1="$work/src1"
+    local dst="$work/dst"
+    # A second source on another filesystem, if there is one, gets a pool of
+    # its own.
+    local other="$work"
+    if [ -d /dev/shm ] && [ -w /dev/shm ]; then
+        other=$(mktemp -d -p /dev/shm)
+    fi
+    local src2="$other/src2"
+
+    mkdir -p "$dst"
+    for src in "$src1" "$src2"; do
+        for d in $(seq 1 10); do
+            mkdir -p "$src/dir$d"
+            for f in $(seq 1 20); do
+                echo "$d $f" > "$src/dir$d/file$f"
+            done
+        done
+        head -c 9M /dev/urandom > "$src/dir1/large"
+    done
+
+    for jobs in 1 4 auto; do
+        rm -rf "$dst/src1" "$dst/src2"
+        "$DSYNC" -j "$jobs" --stats="$work/stats.json" "$src1" "$src2" "$dst"
+        verify_trees_equal "$src1" "$dst/src1" || fail "-j $jobs did not sync src1"
+        verify_trees_equal "$src2" "$dst/src2" || fail "-j $jobs did not sync src2"
+        grep -q '"files_copied":402' "$work/stats.json" ||
+            fail "-j $jobs did not copy every file once"
+    done
+
+    if [ "$other" != "$work" ]; then
+        rm -rf "$other"
+    fi
+    rm -rf "$work"
+    pass "device pools"
+}
+
 echo "Running sync tests..."
 echo
 
@@ -206,6 +1050,27 @@ test_symlink_file
 test_broken_symlink
 test_large_file
 test_random_tree
+test_parallel_traversal
+test_long_paths
+test_io_uring
+test_blocking_queue
+test_hard_links
+test_reflink
+test_sparse_file
+test_parallel_large_file
+test_size_lanes
+test_manifest
+test_prune
+test_watch
+test_delete
+test_durable
+test_atomic
+test_verify
+test_compare
+test_metrics
+test_log_format
+test_auto_threads
+test_device_pools
 
 echo
 echo "$PASS_COUNT tests passed"